@@ -0,0 +1,154 @@
+// 响应头组装的微基准：比较原来经过 vsnprintf 的 add_response 与 header_templates.h 中的片段拼接
+// 用法：./bench_headers [responses]
+// 两种写法都按 http_conn 的方式写入同样大小的写缓冲，组装一个完整的静态文件 200 响应头
+// （状态行、Content-Length、Content-Type、Date、Accept-Ranges、ETag、Last-Modified、Cache-Control、Connection），
+// 先确认两者输出的字节相同，再各自组装 responses 次，输出每个响应头的平均耗时
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <libgen.h>
+#include <time.h>
+#include "header_templates.h"
+
+static const int WRITE_BUFFER_SIZE = 2048;
+// http_date::LEN
+static const int DATE_LEN = 29;
+
+// 与 http_conn 的写缓冲相同的部分，追加函数与 http_conn 共用 header_templates.h 中的实现
+struct header_writer
+{
+    char m_write_buf[WRITE_BUFFER_SIZE];
+    int m_write_idx;
+
+    // 原来的写法
+    bool add_response( const char* format, ... )
+    {
+        va_list arg_list;
+        va_start( arg_list, format );
+        bool ok = buffer_vprintf( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, format, arg_list );
+        va_end( arg_list );
+        return ok;
+    }
+
+    // 现在的写法
+    bool append( const header_fragment& f )
+    {
+        return buffer_append( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, f.data, f.len );
+    }
+
+    bool append( const char* data, size_t len )
+    {
+        return buffer_append( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, data, len );
+    }
+
+    bool append_decimal( unsigned long long value )
+    {
+        return buffer_append_decimal( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, value );
+    }
+
+    bool append_header( const header_fragment& name, const char* value )
+    {
+        return buffer_append_header( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, name, value );
+    }
+};
+
+// 一个响应的可变部分，每次请求不同的文件大小
+struct response_fields
+{
+    long content_len;
+    const char* content_type;
+    const char* date;
+    const char* etag;
+    const char* last_modified;
+    int max_age;
+    bool linger;
+};
+
+static bool build_printf( header_writer& w, const response_fields& r )
+{
+    w.m_write_idx = 0;
+    return w.add_response( "%s %d %s\r\n", "HTTP/1.1", 200, "OK" )
+        && w.add_response( "Content-Length: %ld\r\n", r.content_len )
+        && w.add_response( "Content-Type: %s\r\n", r.content_type )
+        && w.add_response( "Date: %s\r\n", r.date )
+        && w.add_response( "Accept-Ranges: bytes\r\n" )
+        && w.add_response( "ETag: %s\r\n", r.etag )
+        && w.add_response( "Last-Modified: %s\r\n", r.last_modified )
+        && w.add_response( "Cache-Control: public, max-age=%d\r\n", r.max_age )
+        && w.add_response( "Connection: %s\r\n", r.linger ? "keep-alive" : "close" )
+        && w.add_response( "%s", "\r\n" );
+}
+
+static bool build_fragments( header_writer& w, const response_fields& r )
+{
+    w.m_write_idx = 0;
+    return w.append( status_line( 200 ) )
+        && w.append( HDR_CONTENT_LENGTH ) && w.append_decimal( r.content_len ) && w.append( CRLF )
+        && w.append_header( HDR_CONTENT_TYPE, r.content_type )
+        && w.append( HDR_DATE ) && w.append( r.date, DATE_LEN ) && w.append( CRLF )
+        && w.append( HDR_ACCEPT_RANGES )
+        && w.append_header( HDR_ETAG, r.etag )
+        && w.append_header( HDR_LAST_MODIFIED, r.last_modified )
+        && w.append( HDR_MAX_AGE ) && w.append_decimal( r.max_age ) && w.append( CRLF )
+        && w.append( r.linger ? HDR_KEEP_ALIVE : HDR_CLOSE )
+        && w.append( CRLF );
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// 组装 n 个响应头，返回每个的平均纳秒数；累加输出长度，避免编译器把循环优化掉
+static double run( bool (*build)( header_writer&, const response_fields& ), long n, unsigned long& total )
+{
+    header_writer w;
+    response_fields r = { 0, "application/javascript", "Mon, 19 Oct 2026 12:53:35 GMT",
+                          "\"5f3a1c-7d00\"", "Sun, 18 Oct 2026 08:00:00 GMT", 3600, true };
+    double start = now_ns();
+    for ( long i = 0; i < n; i++ )
+    {
+        r.content_len = 1000 + i % 5000000;
+        r.linger = ( i & 7 ) != 0;
+        build( w, r );
+        total += w.m_write_idx;
+    }
+    return ( now_ns() - start ) / n;
+}
+
+int main( int argc, char** argv )
+{
+    long n = argc > 1 ? atol( argv[1] ) : 5000000;
+    if ( argc > 2 || n <= 0 )
+    {
+        fprintf( stderr, "Usage.. ./%s [responses(default 5000000)]\n", basename( argv[0] ) );
+        return 1;
+    }
+
+    // 两种写法的输出必须相同
+    header_writer a, b;
+    response_fields r = { 1234567, "text/css", "Mon, 19 Oct 2026 12:53:35 GMT",
+                          "\"1-2\"", "Sun, 18 Oct 2026 08:00:00 GMT", 60, false };
+    if ( !build_printf( a, r ) || !build_fragments( b, r ) || a.m_write_idx != b.m_write_idx
+         || memcmp( a.m_write_buf, b.m_write_buf, a.m_write_idx ) != 0 )
+    {
+        fprintf( stderr, "outputs differ\n" );
+        return 1;
+    }
+
+    unsigned long total = 0;
+    // 先各跑一轮预热缓存与分支预测
+    run( build_printf, n / 10 + 1, total );
+    run( build_fragments, n / 10 + 1, total );
+    double printf_ns = run( build_printf, n, total );
+    double fragment_ns = run( build_fragments, n, total );
+
+    printf( "%ld responses, %d header bytes each\n", n, a.m_write_idx );
+    printf( "add_response (vsnprintf)  %8.1f ns/response\n", printf_ns );
+    printf( "append fragments          %8.1f ns/response\n", fragment_ns );
+    printf( "speedup                   %8.2fx\n", printf_ns / fragment_ns );
+    return total == 0;
+}
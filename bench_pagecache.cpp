@@ -0,0 +1,411 @@
+// 页缓存基准：大文件下载与小文件请求混合，比较 -D（发送后从页缓存丢弃大文件）对小文件命中率的影响
+// 用法：./bench_pagecache [options] server [server_args...]
+// 在网站根目录下的 bench/ 中生成小文件与大文件，依次以不带 -D 与带 -D 的参数启动服务器（可以放入限制内存的
+// cgroup，模拟页缓存放不下全部内容），先请求一遍小文件，之后每一轮下载一个大文件再请求全部小文件，
+// 请求前用 mincore 检查小文件是否仍在页缓存中，输出命中率、小文件的平均延迟与结束时大文件留在页缓存中的大小
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static const char *doc_root = "/home/de4tsh/Desktop";
+static int port = 9180;
+static int large_mb = 256;
+static int large_count = 4;
+static int small_count = 200;
+static int small_kb = 32;
+static int rounds = 8;
+static int memcg_mb = 0;
+static const char *drop_bytes = "1048576";
+
+static const char *MEMCG = "/sys/fs/cgroup/memory/bench_pagecache";
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static std::string bench_file(const char *kind,int i)
+{
+    char name[64];
+    snprintf(name,sizeof(name),"/bench/%s%03d%s",kind,i,kind[0] == 's' ? ".css" : ".bin");
+    return name;
+}
+
+// 文件不存在或大小不对时重新生成，内容是可压缩的文本，避免稀疏文件
+static bool make_file(const std::string &path,size_t size)
+{
+    struct stat st;
+    if (stat(path.c_str(),&st) == 0 && (size_t)st.st_size == size)
+    {
+        return true;
+    }
+    int fd = open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if (fd < 0)
+    {
+        perror(path.c_str());
+        return false;
+    }
+    char block[65536];
+    for (size_t i = 0; i < sizeof(block); i++)
+    {
+        block[i] = 'a' + i % 26;
+    }
+    for (size_t done = 0; done < size; )
+    {
+        size_t n = size - done < sizeof(block) ? size - done : sizeof(block);
+        if (write(fd,block,n) != (ssize_t)n)
+        {
+            perror(path.c_str());
+            close(fd);
+            return false;
+        }
+        done += n;
+    }
+    fsync(fd);
+    close(fd);
+    return true;
+}
+
+// 文件在页缓存中的字节数（按页计）
+static size_t resident_bytes(const std::string &path)
+{
+    int fd = open(path.c_str(),O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat st;
+    fstat(fd,&st);
+    size_t resident = 0;
+    if (st.st_size > 0)
+    {
+        static const long page = sysconf(_SC_PAGESIZE);
+        void *p = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+        if (p != MAP_FAILED)
+        {
+            size_t pages = (st.st_size + page - 1) / page;
+            std::vector<unsigned char> vec(pages);
+            if (mincore(p,st.st_size,&vec[0]) == 0)
+            {
+                for (size_t i = 0; i < pages; i++)
+                {
+                    resident += (vec[i] & 1) ? page : 0;
+                }
+            }
+            munmap(p,st.st_size);
+        }
+    }
+    close(fd);
+    return resident < (size_t)st.st_size ? resident : st.st_size;
+}
+
+static void drop_cache(const std::string &path)
+{
+    int fd = open(path.c_str(),O_RDONLY);
+    if (fd >= 0)
+    {
+        posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static int connect_server()
+{
+    int fd = socket(AF_INET,SOCK_STREAM,0);
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    return fd;
+}
+
+// 在保持的连接上 GET path，读完响应体并丢弃，返回响应体的长度，出错时返回 -1
+static long http_get(int fd,const std::string &path)
+{
+    char buf[65536];
+    int n = snprintf(buf,sizeof(buf),"GET %s HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n",path.c_str());
+    if (write(fd,buf,n) != n)
+    {
+        return -1;
+    }
+
+    // 响应头
+    std::string head;
+    size_t end;
+    while ((end = head.find("\r\n\r\n")) == std::string::npos)
+    {
+        ssize_t r = read(fd,buf,sizeof(buf));
+        if (r <= 0)
+        {
+            return -1;
+        }
+        head.append(buf,r);
+    }
+    if (head.compare(0,12,"HTTP/1.1 200") != 0)
+    {
+        return -1;
+    }
+    size_t cl = head.find("Content-Length: ");
+    if (cl == std::string::npos || cl > end)
+    {
+        return -1;
+    }
+    long length = atol(head.c_str() + cl + 16);
+    long left = length - (long)(head.size() - end - 4);
+    while (left > 0)
+    {
+        ssize_t r = read(fd,buf,left < (long)sizeof(buf) ? left : sizeof(buf));
+        if (r <= 0)
+        {
+            return -1;
+        }
+        left -= r;
+    }
+    return length;
+}
+
+static bool setup_memcg()
+{
+    if (mkdir(MEMCG,0755) < 0 && errno != EEXIST)
+    {
+        perror(MEMCG);
+        return false;
+    }
+    std::string limit = std::string(MEMCG) + "/memory.limit_in_bytes";
+    FILE *f = fopen(limit.c_str(),"w");
+    if (!f)
+    {
+        perror(limit.c_str());
+        return false;
+    }
+    fprintf(f,"%lld\n",(long long)memcg_mb << 20);
+    fclose(f);
+    return true;
+}
+
+static pid_t start_server(char **server_argv,int server_argc,bool drop)
+{
+    std::vector<const char *> args;
+    for (int i = 0; i < server_argc; i++)
+    {
+        args.push_back(server_argv[i]);
+    }
+    if (drop)
+    {
+        args.push_back("-D");
+        args.push_back(drop_bytes);
+    }
+    char port_arg[16];
+    snprintf(port_arg,sizeof(port_arg),"%d",port);
+    args.push_back(port_arg);
+    args.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (memcg_mb > 0)
+        {
+            // 子进程先加入 cgroup，服务器读入的页缓存都记在这个 cgroup 上
+            std::string procs = std::string(MEMCG) + "/cgroup.procs";
+            FILE *f = fopen(procs.c_str(),"w");
+            if (f)
+            {
+                fprintf(f,"%d\n",getpid());
+                fclose(f);
+            }
+        }
+        int null = open("/dev/null",O_WRONLY);
+        dup2(null,1);
+        dup2(null,2);
+        execv(args[0],(char **)&args[0]);
+        _exit(127);
+    }
+
+    // 等待端口可以连接
+    for (int i = 0; i < 100; i++)
+    {
+        int fd = connect_server();
+        if (fd >= 0)
+        {
+            close(fd);
+            return pid;
+        }
+        usleep(50000);
+    }
+    kill(pid,SIGKILL);
+    waitpid(pid,NULL,0);
+    return -1;
+}
+
+// 一种配置的一次运行
+static bool run(char **server_argv,int server_argc,bool drop)
+{
+    std::string root(doc_root);
+    for (int i = 0; i < small_count; i++)
+    {
+        drop_cache(root + bench_file("s",i));
+    }
+    for (int i = 0; i < large_count; i++)
+    {
+        drop_cache(root + bench_file("large",i));
+    }
+
+    pid_t pid = start_server(server_argv,server_argc,drop);
+    if (pid < 0)
+    {
+        fprintf(stderr,"server did not start on port %d\n",port);
+        return false;
+    }
+
+    bool ok = true;
+    int conn = connect_server();
+    // 先请求一遍小文件，让它们进入页缓存
+    for (int i = 0; ok && i < small_count; i++)
+    {
+        ok = http_get(conn,bench_file("s",i)) == small_kb * 1024L;
+    }
+
+    long hits = 0;
+    long requests = 0;
+    double small_us = 0;
+    double large_us = 0;
+    for (int r = 0; ok && r < rounds; r++)
+    {
+        int big = connect_server();
+        double t = now_us();
+        ok = http_get(big,bench_file("large",r % large_count)) == (long)large_mb << 20;
+        large_us += now_us() - t;
+        close(big);
+
+        for (int i = 0; ok && i < small_count; i++)
+        {
+            std::string path = bench_file("s",i);
+            hits += resident_bytes(root + path) == (size_t)small_kb * 1024;
+            requests++;
+            t = now_us();
+            ok = http_get(conn,path) == small_kb * 1024L;
+            small_us += now_us() - t;
+        }
+    }
+    close(conn);
+
+    size_t large_resident = 0;
+    for (int i = 0; i < large_count; i++)
+    {
+        large_resident += resident_bytes(root + bench_file("large",i));
+    }
+
+    kill(pid,SIGTERM);
+    waitpid(pid,NULL,0);
+    if (!ok)
+    {
+        fprintf(stderr,"request failed (-D %s)\n",drop ? drop_bytes : "off");
+        return false;
+    }
+
+    printf("%-12s small hit rate %6.2f%% (%ld/%ld)  small latency %8.1f us  large %7.1f MB/s  large resident %6.1f MB\n",
+           drop ? "-D" : "baseline",100.0 * hits / requests,hits,requests,small_us / requests,
+           (double)rounds * large_mb / (large_us / 1e6),large_resident / 1048576.0);
+    return true;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,"Usage.. ./%s [options] server [server_args...]\n",basename((char *)prog));
+    fprintf(stderr,"  -r dir      服务器的网站根目录，基准文件生成在其下的 bench/ 中（默认 %s）\n",doc_root);
+    fprintf(stderr,"  -p port     服务器的端口（默认 %d）\n",port);
+    fprintf(stderr,"  -L mb       每个大文件的大小（默认 %d）\n",large_mb);
+    fprintf(stderr,"  -N count    大文件的个数，轮流下载（默认 %d）\n",large_count);
+    fprintf(stderr,"  -n count    小文件的个数（默认 %d）\n",small_count);
+    fprintf(stderr,"  -k kb       每个小文件的大小（默认 %d）\n",small_kb);
+    fprintf(stderr,"  -R rounds   轮数，每轮下载一个大文件再请求全部小文件（默认 %d）\n",rounds);
+    fprintf(stderr,"  -m mb       把服务器放入内存限制为 mb 的 cgroup（v1，需要 root），0 表示不限制（默认 0）\n");
+    fprintf(stderr,"  -D bytes    第二次运行传给服务器的 -D（默认 %s）\n",drop_bytes);
+    fprintf(stderr,"  服务器参数中应关闭响应缓存（-H 0），否则小文件从堆内存发送，与页缓存无关\n");
+}
+
+int main(int argc,char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc,argv,"+r:p:L:N:n:k:R:m:D:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': doc_root = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'L': large_mb = atoi(optarg); break;
+            case 'N': large_count = atoi(optarg); break;
+            case 'n': small_count = atoi(optarg); break;
+            case 'k': small_kb = atoi(optarg); break;
+            case 'R': rounds = atoi(optarg); break;
+            case 'm': memcg_mb = atoi(optarg); break;
+            case 'D': drop_bytes = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || large_mb <= 0 || large_count <= 0 || small_count <= 0 || small_kb <= 0 || rounds <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE,SIG_IGN);
+
+    std::string dir = std::string(doc_root) + "/bench";
+    mkdir(dir.c_str(),0755);
+    for (int i = 0; i < small_count; i++)
+    {
+        if (!make_file(doc_root + bench_file("s",i),(size_t)small_kb * 1024))
+        {
+            return 1;
+        }
+    }
+    for (int i = 0; i < large_count; i++)
+    {
+        if (!make_file(doc_root + bench_file("large",i),(size_t)large_mb << 20))
+        {
+            return 1;
+        }
+    }
+    if (memcg_mb > 0 && !setup_memcg())
+    {
+        return 1;
+    }
+
+    printf("%d x %d KB small, %d x %d MB large, %d rounds, memcg %d MB\n",small_count,small_kb,large_count,large_mb,
+           rounds,memcg_mb);
+    bool ok = run(argv + optind,argc - optind,false) && run(argv + optind,argc - optind,true);
+
+    if (memcg_mb > 0)
+    {
+        rmdir(MEMCG);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#include "cache_policy.h"
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+
+bool cache_policy::add_rule(const char *spec)
+{
+    const char *eq = strrchr(spec,'=');
+    if (!eq || eq == spec || spec[0] != '/')
+    {
+        return false;
+    }
+
+    char *end = NULL;
+    long max_age = strtol(eq + 1,&end,10);
+    if (end == eq + 1 || *end != '\0' || max_age < 0)
+    {
+        return false;
+    }
+
+    rule r;
+    r.prefix.assign(spec,eq - spec);
+    r.max_age = max_age;
+
+    std::vector<rule>::iterator it = m_rules.begin();
+    while (it != m_rules.end() && it->prefix.size() >= r.prefix.size())
+    {
+        ++it;
+    }
+    m_rules.insert(it,r);
+    return true;
+}
+
+
+void cache_policy::lookup(const char *path,long &max_age,bool &immutable) const
+{
+    if (fingerprinted(path))
+    {
+        max_age = FINGERPRINT_MAX_AGE;
+        immutable = true;
+        return;
+    }
+
+    immutable = false;
+    max_age = -1;
+    for (size_t i = 0; i < m_rules.size(); i++)
+    {
+        if (strncmp(path,m_rules[i].prefix.data(),m_rules[i].prefix.size()) == 0)
+        {
+            max_age = m_rules[i].max_age;
+            return;
+        }
+    }
+}
+
+
+bool cache_policy::fingerprinted(const char *path)
+{
+    const char *name = strrchr(path,'/');
+    name = name ? name + 1 : path;
+    const char *ext = strrchr(name,'.');
+    if (!ext || ext == name)
+    {
+        return false;
+    }
+
+    // 从扩展名向前找到上一个 . 或 -，检查两者之间的一段
+    const char *end = ext;
+    const char *start = end;
+    bool digit = false;
+    while (start > name && isalnum((unsigned char)start[-1]))
+    {
+        --start;
+        digit = digit || isdigit((unsigned char)*start);
+    }
+    if (start == name || (start[-1] != '.' && start[-1] != '-') || start - 1 == name)
+    {
+        return false;
+    }
+
+    return end - start >= 8 && digit;
+}
@@ -0,0 +1,42 @@
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#include <string>
+#include <vector>
+
+// 按请求路径决定 Cache-Control / Expires
+//   文件名中带内容指纹（如 app.3f9a1c2e.js、index-Bq7x2k9d.css）的资源内容永不改变，
+//   缓存一年并标记 immutable，浏览器刷新页面时也不再重新校验
+//   其余路径按最长前缀匹配启动时配置的规则，没有匹配的规则时不发送这两个头部
+class cache_policy
+{
+
+    public:
+
+        // 带内容指纹的资源的 max-age（一年）
+        static const long FINGERPRINT_MAX_AGE = 365L * 24 * 3600;
+
+        // 解析 "前缀=秒数" 形式的规则，秒数为 0 表示每次都要重新校验（no-cache）
+        // 格式错误时返回 false
+        bool add_rule(const char *spec);
+
+        // 查找 path 的策略，max_age 小于 0 表示不发送缓存相关的头部
+        void lookup(const char *path,long &max_age,bool &immutable) const;
+
+        // 文件名中是否有内容指纹：扩展名前以 . 或 - 分隔的一段由 8 个以上字母、数字组成且含有数字
+        static bool fingerprinted(const char *path);
+
+    private:
+
+        struct rule
+        {
+            std::string prefix;
+            long max_age;
+        };
+
+        // 按前缀长度从长到短排列，第一个匹配的即为最长前缀
+        std::vector<rule> m_rules;
+
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include "content_pack.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+
+locker content_pack::s_lock;
+content_pack *content_pack::s_current = NULL;
+
+
+content_pack *content_pack::open(const char *path)
+{
+    int fd = ::open(path,O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("open(pack)");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd,&st) < 0 || (size_t)st.st_size < sizeof(pack_header))
+    {
+        fprintf(stderr,"%s: not a content pack\n",path);
+        ::close(fd);
+        return NULL;
+    }
+
+    char *base = (char *)mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap(pack)");
+        return NULL;
+    }
+
+    const pack_header *header = (const pack_header *)base;
+    uint64_t index_end = header->index_offset + (uint64_t)header->count * sizeof(pack_entry);
+    if (memcmp(header->magic,PACK_MAGIC,8) != 0 || header->version != PACK_VERSION
+        || header->file_size != (uint64_t)st.st_size || index_end > header->file_size
+        || header->strings_offset + header->strings_size > header->file_size)
+    {
+        fprintf(stderr,"%s: not a content pack or truncated\n",path);
+        munmap(base,st.st_size);
+        return NULL;
+    }
+
+    // ETag 发送时原样使用，压缩版本去掉结尾的引号后拼接编码名，必须是 \0 结尾的 "..."
+    const pack_entry *entries = (const pack_entry *)(base + header->index_offset);
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        const char *etag = entries[i].etag;
+        size_t len = strnlen(etag,sizeof(entries[i].etag));
+        if (len < 2 || len == sizeof(entries[i].etag) || etag[0] != '"' || etag[len - 1] != '"')
+        {
+            fprintf(stderr,"%s: entry %u has an invalid etag\n",path,i);
+            munmap(base,st.st_size);
+            return NULL;
+        }
+    }
+
+    content_pack *pack = new (std::nothrow) content_pack;
+    if (!pack)
+    {
+        munmap(base,st.st_size);
+        return NULL;
+    }
+
+    pack->m_base = base;
+    pack->m_size = st.st_size;
+    pack->m_header = header;
+    pack->m_index = (const pack_entry *)(base + header->index_offset);
+    pack->m_strings = base + header->strings_offset;
+
+    // 索引常驻内存，避免第一次查找时缺页
+    madvise(base,index_end,MADV_WILLNEED);
+
+    return pack;
+}
+
+
+content_pack::~content_pack()
+{
+    if (m_base)
+    {
+        munmap(m_base,m_size);
+    }
+}
+
+
+content_pack *content_pack::acquire()
+{
+    s_lock.lock();
+    content_pack *pack = s_current;
+    if (pack)
+    {
+        __sync_add_and_fetch(&pack->m_refs,1);
+    }
+    s_lock.unlock();
+    return pack;
+}
+
+
+void content_pack::install(content_pack *pack)
+{
+    s_lock.lock();
+    content_pack *old = s_current;
+    s_current = pack;
+    s_lock.unlock();
+
+    if (old)
+    {
+        release(old);
+    }
+}
+
+
+void content_pack::release(content_pack *pack)
+{
+    if (__sync_sub_and_fetch(&pack->m_refs,1) == 0)
+    {
+        delete pack;
+    }
+}
+
+
+const pack_entry *content_pack::lookup(const char *path,size_t len) const
+{
+    // 索引按路径的字节序排序，二分查找
+    uint32_t lo = 0;
+    uint32_t hi = m_header->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const pack_entry *e = m_index + mid;
+
+        size_t n = (e->path_len < len) ? e->path_len : len;
+        int cmp = memcmp(m_strings + e->path_offset,path,n);
+        if (cmp == 0)
+        {
+            cmp = (e->path_len < len) ? -1 : (e->path_len > len ? 1 : 0);
+        }
+
+        if (cmp == 0)
+        {
+            return e;
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,111 @@
+#ifndef CONTENT_PACK_H
+#define CONTENT_PACK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "locker.h"
+
+// 内容包：把整个站点打包成一个文件，服务器启动时只 mmap 一次，
+// 每个请求只需在排好序的路径索引中二分查找，再从映射区直接发送
+//
+// 文件布局：
+//   pack_header
+//   pack_entry[count]      按路径排序的索引
+//   字符串表               路径与 MIME 类型
+//   文件内容               每个内容（含压缩版本）都按页对齐
+//
+// 部署时用 pack 工具生成新包并 rename 覆盖旧包，再向服务器发送 SIGHUP 即可原子切换
+
+#define PACK_MAGIC      "WSPACK\0\1"
+#define PACK_VERSION    1
+#define PACK_ALIGN      4096
+
+// 每个文件的版本：原文件与两种预压缩版本
+enum PACK_VARIANT
+{
+    PACK_IDENTITY = 0,
+    PACK_GZIP,
+    PACK_BR,
+    PACK_VARIANTS
+};
+
+struct pack_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t index_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t file_size;
+};
+
+struct pack_entry
+{
+    // 路径（以 / 开头）与 MIME 类型在字符串表中的位置，均以 \0 结尾
+    uint32_t path_offset;
+    uint32_t path_len;
+    uint32_t mime_offset;
+    uint32_t mime_len;
+
+    // 原文件的修改时间
+    int64_t mtime;
+
+    // 预先计算好的 ETag（含引号，以 \0 结尾）
+    char etag[40];
+
+    // 各版本在包内的位置，offset 为 0 表示该版本不存在（文件内容不会位于偏移 0）
+    struct
+    {
+        uint64_t offset;
+        uint64_t size;
+    } variants[PACK_VARIANTS];
+};
+
+class content_pack
+{
+
+    public:
+
+        // 打开并映射内容包，格式错误时返回 NULL
+        static content_pack *open(const char *path);
+
+        // 获取当前正在使用的内容包并增加引用计数，没有时返回 NULL
+        static content_pack *acquire();
+
+        // 用新的内容包替换当前的，旧包在最后一个引用释放后解除映射
+        static void install(content_pack *pack);
+
+        static void release(content_pack *pack);
+
+        // 在索引中查找路径，找不到时返回 NULL
+        const pack_entry *lookup(const char *path,size_t len) const;
+
+        const char *data(uint64_t offset) const { return m_base + offset; }
+        const char *string(uint32_t offset) const { return m_strings + offset; }
+
+        uint32_t count() const { return m_header->count; }
+
+    private:
+
+        content_pack() : m_base(NULL),m_size(0),m_refs(1) {}
+        ~content_pack();
+
+    private:
+
+        char *m_base;
+        size_t m_size;
+
+        const pack_header *m_header;
+        const pack_entry *m_index;
+        const char *m_strings;
+
+        int m_refs;
+
+        // 保护当前内容包指针的切换
+        static locker s_lock;
+        static content_pack *s_current;
+
+};
+
+#endif
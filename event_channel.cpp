@@ -0,0 +1,412 @@
+#include "event_channel.h"
+#include "http_conn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+std::vector<event_channel *> event_channel::s_channels;
+
+// 时间轮：订阅者按开始停放的时间放入 HEARTBEAT 个槽之一，每秒只检查当前的一个槽
+static std::list<event_subscriber *> s_wheel[event_channel::HEARTBEAT];
+static time_t s_last_tick = 0;
+
+static int s_wakefd = -1;
+
+
+static void notify()
+{
+    uint64_t one = 1;
+    ssize_t ret = ::write(s_wakefd,&one,sizeof(one));
+    (void)ret;
+}
+
+
+static void append_line(std::string &out,const char *field,const char *value,size_t len)
+{
+    out.append(field);
+    out.append(value,len);
+    out.push_back('\n');
+}
+
+
+event_message *event_message::create(unsigned long long id,const char *event,const char *data,size_t len)
+{
+    std::string text;
+    text.reserve(len + 64);
+
+    char number[24];
+    snprintf(number,sizeof(number),"%llu",id);
+    append_line(text,"id: ",number,strlen(number));
+    if (event)
+    {
+        // 事件名中的换行会让客户端把之后的内容当作新的字段
+        append_line(text,"event: ",event,strcspn(event,"\r\n"));
+    }
+    // data 中的每一行（\r\n、\r 或 \n 结尾）成为一个 data 行，客户端再用 \n 连接起来
+    size_t pos = 0;
+    while (true)
+    {
+        size_t end = pos;
+        while (end < len && data[end] != '\r' && data[end] != '\n')
+        {
+            end++;
+        }
+        append_line(text,"data: ",data + pos,end - pos);
+        if (end + 1 < len && data[end] == '\r' && data[end + 1] == '\n')
+        {
+            end++;
+        }
+        pos = end + 1;
+        // 结尾的换行不再产生一个空的 data 行
+        if (pos >= len)
+        {
+            break;
+        }
+    }
+    text.push_back('\n');
+
+    event_message *m = (event_message *)malloc(sizeof(event_message) + text.size());
+    if (!m)
+    {
+        return NULL;
+    }
+    m->id = id;
+    m->refs = 1;
+    m->len = text.size();
+    m->data = (char *)(m + 1);
+    memcpy(m->data,text.data(),text.size());
+    return m;
+}
+
+
+void event_message::release(void *p)
+{
+    event_message *m = (event_message *)p;
+    if (__sync_sub_and_fetch(&m->refs,1) == 0)
+    {
+        free(m);
+    }
+}
+
+
+event_channel::event_channel(const std::string &path) :
+    m_path(path),m_last_id(0),m_published(0),m_streams(0),m_polls(0)
+{
+}
+
+
+event_channel *event_channel::add(const char *path)
+{
+    if (path[0] != '/' || find(path))
+    {
+        return NULL;
+    }
+    std::string poll(path);
+    poll += (poll[poll.size() - 1] == '/') ? "poll" : "/poll";
+
+    event_channel *c = new event_channel(path);
+    if (!router::add(path,new event_endpoint(c,true)) || !router::add(poll.c_str(),new event_endpoint(c,false)))
+    {
+        // 路由格式错误或已被占用，启动会失败，不必回收
+        return NULL;
+    }
+    s_channels.push_back(c);
+    return c;
+}
+
+
+event_channel *event_channel::find(const char *path)
+{
+    for (size_t i = 0; i < s_channels.size(); i++)
+    {
+        if (s_channels[i]->m_path == path)
+        {
+            return s_channels[i];
+        }
+    }
+    return NULL;
+}
+
+
+unsigned long long event_channel::publish(const char *event,const char *data,size_t len)
+{
+    m_lock.lock();
+    unsigned long long id = ++m_last_id;
+    event_message *m = event_message::create(id,event,data,len);
+    if (!m)
+    {
+        m_last_id--;
+        m_lock.unlock();
+        return 0;
+    }
+    // 历史持有创建时的引用，待发列表再取一个
+    m_history.push_back(m);
+    if (m_history.size() > HISTORY)
+    {
+        event_message::release(m_history.front());
+        m_history.pop_front();
+    }
+    event_message::acquire(m);
+    bool idle = m_pending.empty();
+    m_pending.push_back(m);
+    m_published++;
+    m_lock.unlock();
+
+    // 待发列表原来不空时主线程已经被唤醒过，还没有处理
+    if (idle)
+    {
+        notify();
+    }
+    return id;
+}
+
+
+int event_channel::init()
+{
+    s_wakefd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+    s_last_tick = http_date::time();
+    return s_wakefd;
+}
+
+
+// 取出 batch 中 since 之后的消息
+static size_t newer(const std::vector<event_message *> &batch,unsigned long long since,std::vector<event_message *> &out)
+{
+    out.clear();
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        if (batch[i]->id > since)
+        {
+            out.push_back(batch[i]);
+        }
+    }
+    return out.size();
+}
+
+
+void event_channel::wake()
+{
+    uint64_t n;
+    while (::read(s_wakefd,&n,sizeof(n)) > 0)
+    {
+    }
+
+    std::vector<event_message *> batch;
+    std::vector<event_message *> send;
+    for (size_t i = 0; i < s_channels.size(); i++)
+    {
+        event_channel *c = s_channels[i];
+        c->m_lock.lock();
+        batch.swap(c->m_pending);
+        c->m_lock.unlock();
+        if (batch.empty())
+        {
+            continue;
+        }
+
+        // 所有订阅者的输出队列引用同一批消息，不为每个连接拷贝
+        std::list<event_subscriber *>::iterator it = c->m_subscribers.begin();
+        while (it != c->m_subscribers.end())
+        {
+            // 回复长轮询或关闭连接时 s 离开频道并被释放，先取下一个
+            event_subscriber *s = *it++;
+            http_conn *conn = s->conn;
+            if (newer(batch,s->since,send) > 0 && !conn->event_send(&send[0],send.size()))
+            {
+                conn->close_conn();
+            }
+        }
+
+        for (size_t j = 0; j < batch.size(); j++)
+        {
+            event_message::release(batch[j]);
+        }
+        batch.clear();
+    }
+}
+
+
+void event_channel::tick(time_t now)
+{
+    // 时钟跳过的秒也要转过，最多转一圈
+    time_t from = s_last_tick + 1;
+    if (now - from >= HEARTBEAT)
+    {
+        from = now - HEARTBEAT + 1;
+    }
+    s_last_tick = now;
+
+    for (time_t t = from; t <= now; t++)
+    {
+        std::list<event_subscriber *> &slot = s_wheel[t % HEARTBEAT];
+        std::list<event_subscriber *>::iterator it = slot.begin();
+        while (it != slot.end())
+        {
+            event_subscriber *s = *it++;
+            http_conn *conn = s->conn;
+            bool due = s->stream ? now - s->last_sent >= HEARTBEAT : now >= s->deadline;
+            // 没有消息时 SSE 发送心跳，长轮询回复 204
+            if (due && !conn->event_send(NULL,0))
+            {
+                conn->close_conn();
+            }
+        }
+    }
+}
+
+
+void event_channel::attach(event_subscriber *s,std::vector<event_message *> &backlog)
+{
+    event_channel *c = s->channel;
+
+    c->m_lock.lock();
+    if (s->since < c->m_last_id)
+    {
+        for (size_t i = 0; i < c->m_history.size(); i++)
+        {
+            event_message *m = c->m_history[i];
+            if (m->id > s->since)
+            {
+                event_message::acquire(m);
+                backlog.push_back(m);
+            }
+        }
+    }
+    // 不补发（LATEST 或者比最新的还新，例如服务器重启过）时从现在开始；
+    // 补发之后，已经发布但还在待发列表中的消息按 since 跳过，不会重复
+    s->since = c->m_last_id;
+    c->m_lock.unlock();
+
+    time_t now = http_date::time();
+    s->attached = true;
+    s->last_sent = now;
+    s->deadline = now + POLL_TIMEOUT;
+    s->channel_pos = c->m_subscribers.insert(c->m_subscribers.end(),s);
+    s->wheel_slot = now % HEARTBEAT;
+    s->wheel_pos = s_wheel[s->wheel_slot].insert(s_wheel[s->wheel_slot].end(),s);
+    if (s->stream)
+    {
+        c->m_streams++;
+    }
+    else
+    {
+        c->m_polls++;
+    }
+}
+
+
+void event_channel::detach(event_subscriber *s)
+{
+    if (!s->attached)
+    {
+        return;
+    }
+    event_channel *c = s->channel;
+    c->m_subscribers.erase(s->channel_pos);
+    s_wheel[s->wheel_slot].erase(s->wheel_pos);
+    s->attached = false;
+    if (s->stream)
+    {
+        c->m_streams--;
+    }
+    else
+    {
+        c->m_polls--;
+    }
+}
+
+
+void event_channel::print_stats()
+{
+    for (size_t i = 0; i < s_channels.size(); i++)
+    {
+        event_channel *c = s_channels[i];
+        printf("events %s: streams %lu polls %lu published %lu\n",c->m_path.c_str(),(unsigned long)c->m_streams,
+               (unsigned long)c->m_polls,c->m_published);
+    }
+}
+
+
+void event_channel::metrics(std::string &out)
+{
+    char line[256];
+    for (size_t i = 0; i < s_channels.size(); i++)
+    {
+        event_channel *c = s_channels[i];
+        snprintf(line,sizeof(line),"event_subscribers{channel=\"%s\",mode=\"stream\"} %lu\n",c->m_path.c_str(),
+                 (unsigned long)c->m_streams);
+        out += line;
+        snprintf(line,sizeof(line),"event_subscribers{channel=\"%s\",mode=\"poll\"} %lu\n",c->m_path.c_str(),
+                 (unsigned long)c->m_polls);
+        out += line;
+        snprintf(line,sizeof(line),"event_messages_total{channel=\"%s\"} %lu\n",c->m_path.c_str(),c->m_published);
+        out += line;
+    }
+}
+
+
+// 解析十进制的消息 id，格式不对时返回 LATEST
+static unsigned long long parse_id(const char *s,size_t len)
+{
+    if (len == 0 || len > 20)
+    {
+        return event_channel::LATEST;
+    }
+    unsigned long long id = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (s[i] < '0' || s[i] > '9')
+        {
+            return event_channel::LATEST;
+        }
+        id = id * 10 + (s[i] - '0');
+    }
+    return id;
+}
+
+
+ROUTE_RESULT event_endpoint::handle(route_request &req,route_response &resp)
+{
+    if (!req.get_or_head(resp))
+    {
+        return ROUTE_DONE;
+    }
+    if (!req.async_allowed)
+    {
+        // HTTP/2 的流不能停放
+        resp.status = 400;
+        resp.body = "event streams require HTTP/1.1\n";
+        return ROUTE_DONE;
+    }
+
+    // 补发的起点：SSE 是 EventSource 重连时带上的 Last-Event-ID，长轮询是上一次收到的最后一个 id
+    const char *id = NULL;
+    size_t id_len = 0;
+    if (m_stream)
+    {
+        id = req.last_event_id;
+        id_len = id ? strlen(id) : 0;
+    }
+    else
+    {
+        for (const char *q = req.query; q && *q; )
+        {
+            size_t n = strcspn(q,"&");
+            if (n > 6 && strncmp(q,"since=",6) == 0)
+            {
+                id = q + 6;
+                id_len = n - 6;
+            }
+            q += n;
+            if (*q == '&')
+            {
+                q++;
+            }
+        }
+    }
+    unsigned long long since = id ? parse_id(id,id_len) : event_channel::LATEST;
+    return req.park(m_channel,m_stream,since);
+}
@@ -0,0 +1,145 @@
+#ifndef EVENT_CHANNEL_H
+#define EVENT_CHANNEL_H
+
+#include <stddef.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include "locker.h"
+#include "router.h"
+
+class http_conn;
+class event_channel;
+
+// 发布的一条消息：发布时按 SSE 格式（id、event、data 行与结尾的空行）编码一次，
+// 频道的历史与所有订阅者的输出队列共享这块内存，引用计数归零时释放
+struct event_message
+{
+    unsigned long long id;
+    int refs;
+    size_t len;
+    // 紧跟在结构之后
+    char *data;
+
+    // 编码 data（其中的换行拆成多个 data 行），返回的消息持有一个引用
+    static event_message *create(unsigned long long id,const char *event,const char *data,size_t len);
+    static void acquire(event_message *m) { __sync_fetch_and_add(&m->refs,1); }
+    // 输出队列的 release 回调，归还一个引用
+    static void release(void *m);
+};
+
+// 停放在频道上的连接：SSE 订阅者一直留在频道上，长轮询收到一批消息或超时后离开
+// 停放期间连接只在 epoll 中等待断开（有积压时等待可写），不占用工作线程，待发的消息都是共享片段
+// 除了创建（工作线程中的 do_route）以外只在主线程中访问
+struct event_subscriber
+{
+    event_subscriber(http_conn *c,event_channel *ch,bool s,unsigned long long id) :
+        conn(c),channel(ch),stream(s),since(id),attached(false),writing(false),last_sent(0),deadline(0),wheel_slot(0) {}
+
+    http_conn *conn;
+    event_channel *channel;
+    bool stream;
+    // 已经发给这个连接的最后一条消息
+    unsigned long long since;
+    // 已经加入频道与时间轮
+    bool attached;
+    // 输出队列没有发完，注册了 EPOLLOUT
+    bool writing;
+    // 最近一次发送（SSE 的心跳按它计算）与长轮询的截止时间
+    time_t last_sent;
+    time_t deadline;
+    // 在频道的订阅者列表与时间轮中的位置
+    int wheel_slot;
+    std::list<event_subscriber *>::iterator channel_pos;
+    std::list<event_subscriber *>::iterator wheel_pos;
+};
+
+// 一个事件频道：path 上是 SSE（text/event-stream）的订阅，path/poll 上是长轮询
+// 任意线程都可以 publish()，消息放入待发列表后通过 eventfd 唤醒主线程，由主线程一次扇出给所有订阅者
+// 最近的 HISTORY 条消息留在频道上，断线重连的 SSE 订阅者（Last-Event-ID）与长轮询（?since=id）从中补发
+class event_channel
+{
+
+    public:
+
+        // since 取这个值时只等待新发布的消息
+        static const unsigned long long LATEST = ~0ULL;
+        // SSE 没有消息时发送心跳注释的间隔（秒），也是时间轮的槽数
+        static const int HEARTBEAT = 15;
+        // 长轮询最长的等待时间（秒），超时回复 204
+        static const int POLL_TIMEOUT = 30;
+        // 每个频道保留的历史消息条数
+        static const size_t HISTORY = 64;
+        // 订阅者输出队列中最多积压的字节数，超过时认为对方太慢，关闭连接
+        static const size_t MAX_PENDING = 1 << 20;
+
+        // 在启动时添加频道并注册 path 与 path/poll 两条路由，path 重复或格式错误时返回 NULL
+        static event_channel *add(const char *path);
+        // 按路径查找频道，没有时返回 NULL
+        static event_channel *find(const char *path);
+
+        // 可以在任意线程中调用：发布一条消息，event 为 NULL 时不带事件名，返回消息的 id
+        unsigned long long publish(const char *event,const char *data,size_t len);
+
+        // 创建唤醒主线程用的 eventfd，返回它以便加入 epoll，失败时返回 -1
+        static int init();
+        // 以下只在主线程中调用
+        // 把各频道新发布的消息发给订阅者
+        static void wake();
+        // 每秒调用一次：转动时间轮，向空闲的 SSE 订阅者发送心跳，让超时的长轮询回复 204
+        static void tick(time_t now);
+        // 连接开始停放：加入频道与时间轮，backlog 填入 since 之后仍在历史中的消息（各持有一个引用）
+        static void attach(event_subscriber *s,std::vector<event_message *> &backlog);
+        // 连接离开频道（回复、关闭）
+        static void detach(event_subscriber *s);
+
+        // 输出各频道的订阅者数与发布的消息数
+        static void print_stats();
+        // 以 Prometheus 文本格式追加各频道的订阅者数与发布的消息数
+        static void metrics(std::string &out);
+
+        const std::string &path() const { return m_path; }
+
+    private:
+
+        explicit event_channel(const std::string &path);
+
+        std::string m_path;
+
+        // 保护历史、待发列表与消息 id
+        locker m_lock;
+        unsigned long long m_last_id;
+        unsigned long m_published;
+        std::deque<event_message *> m_history;
+        // 已经发布、还没有扇出的消息，各持有一个引用
+        std::vector<event_message *> m_pending;
+
+        // 以下只在主线程中访问
+        std::list<event_subscriber *> m_subscribers;
+        size_t m_streams;
+        size_t m_polls;
+
+        static std::vector<event_channel *> s_channels;
+
+};
+
+// 频道的两个端点：SSE 订阅（Last-Event-ID 指定补发的起点）与长轮询（?since=id）
+class event_endpoint : public route_handler
+{
+
+    public:
+
+        event_endpoint(event_channel *channel,bool stream) : m_channel(channel),m_stream(stream) {}
+
+        ROUTE_RESULT handle(route_request &req,route_response &resp);
+
+    private:
+
+        event_channel *m_channel;
+        bool m_stream;
+
+};
+
+#endif
@@ -0,0 +1,1137 @@
+#include "fastcgi.h"
+#include "http_conn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+
+extern void addfd(int epollfd,int fd,bool one_shot);
+extern void removefd(int epollfd,int fd);
+extern void modfd(int epollfd,int fd,int ev);
+
+std::vector<fcgi_backend *> fcgi_backend::s_routes;
+
+// 所有 FastCGI 连接按 fd 索引，主线程据此把事件分派给连接
+static std::vector<fcgi_conn *> s_conns;
+static int s_epollfd = -1;
+
+// FastCGI 记录类型
+enum
+{
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7
+};
+
+static const int FCGI_RESPONDER = 1;
+static const int FCGI_KEEP_CONN = 1;
+static const int FCGI_REQUEST_COMPLETE = 0;
+// 一个记录的最大内容长度
+static const size_t FCGI_MAX_CONTENT = 0xffff;
+
+static void record_header(char *h,int type,unsigned short id,size_t len)
+{
+    h[0] = 1;
+    h[1] = type;
+    h[2] = id >> 8;
+    h[3] = id & 0xff;
+    h[4] = len >> 8;
+    h[5] = len & 0xff;
+    h[6] = 0;
+    h[7] = 0;
+}
+
+// 需要推进的客户端连接，同一个只推进一次
+static void add_ready(std::vector<http_conn *> &ready,http_conn *client)
+{
+    if (std::find(ready.begin(),ready.end(),client) == ready.end())
+    {
+        ready.push_back(client);
+    }
+}
+
+static void pump(std::vector<http_conn *> &ready)
+{
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        if (!ready[i]->proxy_pump())
+        {
+            ready[i]->close_conn();
+        }
+    }
+}
+
+
+fcgi_block *fcgi_block::create()
+{
+    fcgi_block *b = new fcgi_block;
+    b->refs = 1;
+    b->len = 0;
+    return b;
+}
+
+
+void fcgi_block::release(void *block)
+{
+    fcgi_block *b = (fcgi_block *)block;
+    if (--b->refs == 0)
+    {
+        delete b;
+    }
+}
+
+
+fcgi_exchange::fcgi_exchange(fcgi_backend *backend,http_conn *client,output_queue *out) :
+    backend(backend),conn(NULL),client(client),out(out),state(FCGI_START),id(0),tries(0),
+    records(fcgi_block::create()),params_start(0),overflow(false),body_left(0),stdin_block(NULL),
+    streamed(false),stdin_pending(false),head_request(false),keep_alive(false),
+    head_done(false),status(200),chunked(false),remaining(0),truncated(false),active(http_date::time())
+{
+    clock_gettime(CLOCK_MONOTONIC,&started);
+
+    // BEGIN_REQUEST：响应者角色，响应结束后保持连接
+    char *b = records->data;
+    record_header(b,FCGI_BEGIN_REQUEST,0,8);
+    memset(b + 8,0,8);
+    b[9] = FCGI_RESPONDER;
+    b[10] = FCGI_KEEP_CONN;
+    records->len = 16;
+}
+
+
+fcgi_exchange::~fcgi_exchange()
+{
+    fcgi_block::release(records);
+    if (stdin_block)
+    {
+        fcgi_block::release(stdin_block);
+    }
+}
+
+
+void fcgi_exchange::param(const char *name,size_t name_len,const char *value,size_t value_len)
+{
+    if (records->len + 8 + name_len + value_len > fcgi_block::SIZE)
+    {
+        overflow = true;
+        return;
+    }
+
+    // 长度小于 128 时用 1 字节，否则用最高位置 1 的 4 字节
+    unsigned char *p = (unsigned char *)records->data + records->len;
+    size_t lens[2] = { name_len,value_len };
+    for (int i = 0; i < 2; i++)
+    {
+        if (lens[i] < 128)
+        {
+            *p++ = lens[i];
+        }
+        else
+        {
+            *p++ = (lens[i] >> 24) | 0x80;
+            *p++ = lens[i] >> 16;
+            *p++ = lens[i] >> 8;
+            *p++ = lens[i];
+        }
+    }
+    memcpy(p,name,name_len);
+    memcpy(p + name_len,value,value_len);
+    records->len = (char *)p + name_len + value_len - records->data;
+}
+
+
+void fcgi_exchange::param(const char *name,const char *value)
+{
+    param(name,strlen(name),value,strlen(value));
+}
+
+
+void fcgi_exchange::begin_params()
+{
+    // 先留出记录头的位置，参数编码完后再填入长度
+    params_start = records->len;
+    records->len += 8;
+}
+
+
+void fcgi_exchange::end_params()
+{
+    size_t content = records->len - params_start - 8;
+    if (content > FCGI_MAX_CONTENT || records->len + 8 > fcgi_block::SIZE)
+    {
+        overflow = true;
+        return;
+    }
+    record_header(records->data + params_start,FCGI_PARAMS,0,content);
+    // 空的 PARAMS 记录结束参数流
+    record_header(records->data + records->len,FCGI_PARAMS,0,0);
+    records->len += 8;
+}
+
+
+void fcgi_exchange::stdin_record(const char *data,size_t len)
+{
+    if (len > FCGI_MAX_CONTENT || records->len + 8 + len > fcgi_block::SIZE)
+    {
+        overflow = true;
+        return;
+    }
+    record_header(records->data + records->len,FCGI_STDIN,0,len);
+    memcpy(records->data + records->len + 8,data,len);
+    records->len += 8 + len;
+}
+
+
+void fcgi_exchange::set_id(unsigned short id)
+{
+    unsigned char *b = (unsigned char *)records->data;
+    size_t pos = 0;
+    while (pos + 8 <= records->len)
+    {
+        b[pos + 2] = id >> 8;
+        b[pos + 3] = id & 0xff;
+        pos += 8 + ((b[pos + 4] << 8) | b[pos + 5]) + b[pos + 6];
+    }
+}
+
+
+// Status: 404 Not Found
+// Content-Type: text/html
+//
+bool fcgi_exchange::parse_head(size_t head_len)
+{
+    std::string fields;
+    std::string status_line;
+    bool location = false;
+    bool has_length = false;
+
+    const char *p = head.data();
+    const char *end = p + head_len;
+    while (p < end)
+    {
+        const char *next = (const char *)memchr(p,'\n',end - p);
+        if (!next)
+        {
+            next = end;
+        }
+        const char *line_end = next;
+        if (line_end > p && line_end[-1] == '\r')
+        {
+            line_end--;
+        }
+
+        const char *colon = (const char *)memchr(p,':',line_end - p);
+        if (!colon || colon == p)
+        {
+            return false;
+        }
+        size_t name_len = colon - p;
+        const char *value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t'))
+        {
+            value++;
+        }
+
+        if (name_len == 6 && strncasecmp(p,"Status",6) == 0)
+        {
+            status = atoi(value);
+            if (status < 200 || status > 999)
+            {
+                return false;
+            }
+            status_line.assign(value,line_end - value);
+        }
+        else if (proxy_exchange::hop_by_hop(p,name_len)
+                 || (name_len == 17 && strncasecmp(p,"Transfer-Encoding",17) == 0))
+        {
+            // 响应体的编码与连接由本端决定
+        }
+        else
+        {
+            if (name_len == 14 && strncasecmp(p,"Content-Length",14) == 0)
+            {
+                has_length = true;
+                remaining = strtoull(value,NULL,10);
+            }
+            else if (name_len == 8 && strncasecmp(p,"Location",8) == 0)
+            {
+                location = true;
+            }
+            fields.append(p,line_end - p).append("\r\n");
+        }
+        p = next + 1;
+    }
+
+    if (status_line.empty())
+    {
+        // 没有 Status 时按 CGI 的约定：有 Location 为重定向，否则为 200
+        status = location ? 302 : 200;
+        status_line = location ? "302 Found" : "200 OK";
+    }
+    else if (status_line.find(' ') == std::string::npos)
+    {
+        // 只有状态码，原因短语可以为空
+        status_line.append(" ");
+    }
+
+    response.assign("HTTP/1.1 ").append(status_line).append("\r\n").append(fields);
+    if (head_request || status == 204 || status == 304)
+    {
+        // 没有响应体，应用输出的内容被丢弃
+        remaining = 0;
+    }
+    else if (!has_length)
+    {
+        chunked = true;
+        response.append("Transfer-Encoding: chunked\r\n");
+    }
+    response.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+
+    head.clear();
+    head_done = true;
+    return true;
+}
+
+
+void fcgi_exchange::body(const char *data,size_t len,fcgi_block *block)
+{
+    if (chunked)
+    {
+        char line[24];
+        int n = snprintf(line,sizeof(line),"%lx\r\n",(unsigned long)len);
+        out->push_copy(line,n);
+        fcgi_block::ref(block);
+        out->push_shared(data,len,fcgi_block::release,block);
+        out->push("\r\n",2);
+        return;
+    }
+
+    size_t n = (remaining < len) ? remaining : len;
+    if (n > 0)
+    {
+        fcgi_block::ref(block);
+        out->push_shared(data,n,fcgi_block::release,block);
+        remaining -= n;
+    }
+}
+
+
+void fcgi_exchange::finish()
+{
+    if (chunked)
+    {
+        out->push("0\r\n\r\n",5);
+    }
+    else if (remaining > 0)
+    {
+        truncated = true;
+    }
+    state = FCGI_DONE;
+}
+
+
+fcgi_conn::fcgi_conn(fcgi_backend *backend,int fd) :
+    active(http_date::time()),m_backend(backend),m_fd(fd),m_connecting(true),m_paused(false),m_served(0),
+    m_requests(backend->max_requests() + 1,(fcgi_exchange *)NULL),m_count(0),
+    m_block(NULL),m_header_len(0),m_content_left(0),m_padding_left(0),m_end_len(0)
+{
+}
+
+
+fcgi_conn::~fcgi_conn()
+{
+    s_conns[m_fd] = NULL;
+    removefd(s_epollfd,m_fd);
+    m_out.clear();
+    if (m_block)
+    {
+        fcgi_block::release(m_block);
+    }
+}
+
+
+bool fcgi_conn::has_slot() const
+{
+    return m_count < m_backend->max_requests();
+}
+
+
+void fcgi_conn::begin(fcgi_exchange *x)
+{
+    unsigned short id = 1;
+    while (m_requests[id])
+    {
+        id++;
+    }
+    m_requests[id] = x;
+    m_count++;
+    m_backend->active++;
+    m_backend->requests++;
+
+    x->id = id;
+    x->conn = this;
+    x->state = fcgi_exchange::FCGI_ACTIVE;
+    x->active = http_date::time();
+    x->set_id(id);
+
+    // 记录直接从请求的缓冲块发送，不再拷贝
+    fcgi_block::ref(x->records);
+    m_out.push_shared(x->records->data,x->records->len,fcgi_block::release,x->records);
+    rearm();
+}
+
+
+void fcgi_conn::send_stdin(fcgi_exchange *x,fcgi_block *block,const char *data,size_t len)
+{
+    char h[8];
+    while (len > 0)
+    {
+        size_t n = (len < FCGI_MAX_CONTENT) ? len : FCGI_MAX_CONTENT;
+        record_header(h,FCGI_STDIN,x->id,n);
+        m_out.push_copy(h,8);
+        fcgi_block::ref(block);
+        m_out.push_shared(data,n,fcgi_block::release,block);
+        data += n;
+        len -= n;
+        x->body_left -= n;
+    }
+    if (x->body_left <= 0)
+    {
+        record_header(h,FCGI_STDIN,x->id,0);
+        m_out.push_copy(h,8);
+    }
+    x->streamed = true;
+    x->stdin_pending = true;
+    x->active = http_date::time();
+    rearm();
+}
+
+
+void fcgi_conn::abort(fcgi_exchange *x)
+{
+    x->client = NULL;
+    x->out = NULL;
+    x->active = http_date::time();
+
+    char h[8];
+    record_header(h,FCGI_ABORT_REQUEST,x->id,0);
+    m_out.push_copy(h,8);
+    // 它积压的输出已经随客户端丢弃
+    resume();
+    rearm();
+}
+
+
+void fcgi_conn::resume()
+{
+    if (!m_paused)
+    {
+        return;
+    }
+    for (size_t i = 1; i < m_requests.size(); i++)
+    {
+        fcgi_exchange *x = m_requests[i];
+        if (x && x->out && x->out->bytes() >= fcgi_backend::HIGH_WATER)
+        {
+            return;
+        }
+    }
+    m_paused = false;
+    rearm();
+}
+
+
+void fcgi_conn::rearm()
+{
+    int ev = 0;
+    if (!m_paused)
+    {
+        ev |= EPOLLIN;
+    }
+    if (m_connecting || !m_out.empty())
+    {
+        ev |= EPOLLOUT;
+    }
+    // 暂停且没有要发送的记录时不注册，应用关闭连接等恢复读取后再发现
+    if (ev)
+    {
+        modfd(s_epollfd,m_fd,ev);
+    }
+}
+
+
+void fcgi_conn::detach(fcgi_exchange *x)
+{
+    m_requests[x->id] = NULL;
+    m_count--;
+    m_backend->active--;
+    x->conn = NULL;
+}
+
+
+void fcgi_conn::on_event(int events)
+{
+    std::vector<http_conn *> ready;
+    bool ok = true;
+
+    if (m_connecting)
+    {
+        // 非阻塞连接完成
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(m_fd,SOL_SOCKET,SO_ERROR,&err,&len) < 0 || err != 0)
+        {
+            ok = false;
+        }
+        m_connecting = false;
+    }
+
+    if (ok)
+    {
+        ok = flush() && receive(ready);
+    }
+
+    if (!ok)
+    {
+        fail(ready);
+        pump(ready);
+        return;
+    }
+
+    // 请求体的上一块已经发送完，客户端连接可以继续读取
+    for (size_t i = 1; i < m_requests.size(); i++)
+    {
+        fcgi_exchange *x = m_requests[i];
+        if (x && x->client && x->stdin_pending && x->want_stdin())
+        {
+            x->stdin_pending = false;
+            add_ready(ready,x->client);
+        }
+    }
+    rearm();
+    pump(ready);
+}
+
+
+bool fcgi_conn::flush()
+{
+    while (!m_out.empty())
+    {
+        struct iovec iov[64];
+        struct msghdr msg;
+        memset(&msg,0,sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = m_out.gather(iov,64);
+
+        ssize_t n = sendmsg(m_fd,&msg,MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            return errno == EAGAIN;
+        }
+        m_out.consume(n);
+        m_backend->bytes_sent += n;
+        active = http_date::time();
+    }
+    return true;
+}
+
+
+bool fcgi_conn::receive(std::vector<http_conn *> &ready)
+{
+    while (!m_paused)
+    {
+        if (m_block && m_block->refs == 1)
+        {
+            // 缓冲块中的数据都已解析完，也没有被输出队列引用，从头重新使用
+            m_block->len = 0;
+        }
+        else if (!m_block || m_block->len == fcgi_block::SIZE)
+        {
+            if (m_block)
+            {
+                fcgi_block::release(m_block);
+            }
+            m_block = fcgi_block::create();
+        }
+
+        char *data = m_block->data + m_block->len;
+        ssize_t n = recv(m_fd,data,fcgi_block::SIZE - m_block->len,0);
+        if (n < 0)
+        {
+            return errno == EAGAIN;
+        }
+        if (n == 0)
+        {
+            // 应用关闭了连接
+            return false;
+        }
+        m_block->len += n;
+        m_backend->bytes_received += n;
+        active = http_date::time();
+
+        if (!parse(data,n,ready))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+fcgi_exchange *fcgi_conn::current() const
+{
+    unsigned short id = (m_header[2] << 8) | m_header[3];
+    return (id < m_requests.size()) ? m_requests[id] : NULL;
+}
+
+
+bool fcgi_conn::parse(const char *data,size_t len,std::vector<http_conn *> &ready)
+{
+    const char *p = data;
+    const char *end = data + len;
+
+    while (p < end)
+    {
+        if (m_header_len < 8)
+        {
+            size_t n = std::min((size_t)(end - p),8 - m_header_len);
+            memcpy(m_header + m_header_len,p,n);
+            m_header_len += n;
+            p += n;
+            if (m_header_len < 8)
+            {
+                break;
+            }
+            if (m_header[0] != 1)
+            {
+                // 协议版本错误，连接上的数据已经不可信
+                return false;
+            }
+            m_content_left = (m_header[4] << 8) | m_header[5];
+            m_padding_left = m_header[6];
+            m_end_len = 0;
+            if (m_content_left == 0 && !finish_record(ready))
+            {
+                return false;
+            }
+        }
+        else if (m_content_left > 0)
+        {
+            size_t n = std::min((size_t)(end - p),m_content_left);
+            fcgi_exchange *x = current();
+            switch (m_header[1])
+            {
+                case FCGI_STDOUT:
+                    if (x)
+                    {
+                        on_stdout(x,p,n,ready);
+                    }
+                    break;
+                case FCGI_STDERR:
+                    fprintf(stderr,"fastcgi %s: %.*s",m_backend->name().c_str(),(int)n,p);
+                    break;
+                case FCGI_END_REQUEST:
+                {
+                    size_t copy = std::min(n,sizeof(m_end) - m_end_len);
+                    memcpy(m_end + m_end_len,p,copy);
+                    m_end_len += copy;
+                    break;
+                }
+                default:
+                    // GET_VALUES_RESULT、UNKNOWN_TYPE 等，忽略
+                    break;
+            }
+            p += n;
+            m_content_left -= n;
+            if (m_content_left == 0 && !finish_record(ready))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            size_t n = std::min((size_t)(end - p),m_padding_left);
+            p += n;
+            m_padding_left -= n;
+        }
+
+        if (m_header_len == 8 && m_content_left == 0 && m_padding_left == 0)
+        {
+            m_header_len = 0;
+        }
+    }
+    return true;
+}
+
+
+// 一个记录的内容全部到达
+bool fcgi_conn::finish_record(std::vector<http_conn *> &ready)
+{
+    if (m_header[1] != FCGI_END_REQUEST)
+    {
+        return true;
+    }
+    if (m_end_len < sizeof(m_end))
+    {
+        return false;
+    }
+    fcgi_exchange *x = current();
+    if (x)
+    {
+        end_request(x,ready);
+    }
+    return true;
+}
+
+
+void fcgi_conn::on_stdout(fcgi_exchange *x,const char *data,size_t len,std::vector<http_conn *> &ready)
+{
+    x->active = http_date::time();
+    if (!x->client || x->state != fcgi_exchange::FCGI_ACTIVE)
+    {
+        // 客户端已经放弃或响应已经无效，丢弃输出
+        return;
+    }
+
+    if (!x->head_done)
+    {
+        // CGI 响应头可能分几个记录到达，以空行结束
+        size_t old = x->head.size();
+        x->head.append(data,len);
+        const std::string &h = x->head;
+        size_t head_len = 0;
+        size_t body_start = 0;
+        for (size_t i = (old >= 2) ? old - 2 : 0; i < h.size(); i++)
+        {
+            if (h[i] != '\n')
+            {
+                continue;
+            }
+            if (i + 1 < h.size() && h[i + 1] == '\n')
+            {
+                head_len = i + 1;
+                body_start = i + 2;
+                break;
+            }
+            if (i + 2 < h.size() && h[i + 1] == '\r' && h[i + 2] == '\n')
+            {
+                head_len = i + 1;
+                body_start = i + 3;
+                break;
+            }
+        }
+
+        if (!body_start)
+        {
+            if (h.size() > fcgi_exchange::MAX_HEAD)
+            {
+                x->state = fcgi_exchange::FCGI_FAILED;
+                add_ready(ready,x->client);
+            }
+            return;
+        }
+        if (!x->parse_head(head_len))
+        {
+            x->state = fcgi_exchange::FCGI_FAILED;
+            add_ready(ready,x->client);
+            return;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        m_backend->responses++;
+        m_backend->latency_us += (now.tv_sec - x->started.tv_sec) * 1000000
+                               + (now.tv_nsec - x->started.tv_nsec) / 1000;
+
+        x->out->push(x->response.data(),x->response.size());
+        // 这个片段中响应头之后的部分是响应体
+        size_t skip = len - (old + len - body_start);
+        data += skip;
+        len -= skip;
+    }
+
+    if (len > 0)
+    {
+        x->body(data,len,m_block);
+    }
+    if (x->out->bytes() >= fcgi_backend::HIGH_WATER)
+    {
+        // 客户端跟不上，等它的输出队列发送完再继续读取（多路复用时同一连接上的其他请求也随之等待）
+        m_paused = true;
+    }
+    add_ready(ready,x->client);
+}
+
+
+void fcgi_conn::end_request(fcgi_exchange *x,std::vector<http_conn *> &ready)
+{
+    detach(x);
+    m_served++;
+
+    if (!x->client)
+    {
+        delete x;
+    }
+    else
+    {
+        if (x->state == fcgi_exchange::FCGI_ACTIVE)
+        {
+            if (x->head_done && m_end[4] == FCGI_REQUEST_COMPLETE)
+            {
+                x->finish();
+            }
+            else
+            {
+                // 没有输出响应头，或应用拒绝了请求（过载、不支持多路复用）
+                x->state = fcgi_exchange::FCGI_FAILED;
+                m_backend->failures++;
+            }
+        }
+        add_ready(ready,x->client);
+    }
+
+    resume();
+    m_backend->dispatch(ready);
+}
+
+
+void fcgi_conn::fail(std::vector<http_conn *> &ready)
+{
+    fcgi_backend *b = m_backend;
+    b->remove(this);
+    m_out.clear();
+
+    for (size_t i = 1; i < m_requests.size(); i++)
+    {
+        fcgi_exchange *x = m_requests[i];
+        if (!x)
+        {
+            continue;
+        }
+        detach(x);
+        if (!x->client)
+        {
+            delete x;
+            continue;
+        }
+        if (x->state == fcgi_exchange::FCGI_ACTIVE)
+        {
+            if (m_served > 0 && !x->streamed && !x->head_done && x->head.empty() && ++x->tries < 2)
+            {
+                // 复用的连接可能已被应用关闭（进程回收等），请求还没有任何回应时换一条连接重发
+                x->state = fcgi_exchange::FCGI_START;
+            }
+            else
+            {
+                x->state = fcgi_exchange::FCGI_FAILED;
+                b->failures++;
+            }
+        }
+        add_ready(ready,x->client);
+    }
+
+    delete this;
+    b->dispatch(ready);
+}
+
+
+void fcgi_conn::shutdown()
+{
+    std::vector<http_conn *> ready;
+    fail(ready);
+    pump(ready);
+}
+
+
+// [mpx:]/php/=/run/php-fpm.sock 或 [mpx:]/app/=127.0.0.1:9000
+bool fcgi_backend::add_route(const char *spec)
+{
+    bool mpx = false;
+    if (strncmp(spec,"mpx:",4) == 0)
+    {
+        mpx = true;
+        spec += 4;
+    }
+
+    const char *eq = strchr(spec,'=');
+    if (!eq || eq == spec || spec[0] != '/' || !eq[1])
+    {
+        return false;
+    }
+
+    fcgi_backend *b = new fcgi_backend;
+    b->m_prefix.assign(spec,eq - spec);
+    b->m_name.assign(eq + 1);
+    b->m_mpx = mpx;
+    b->active = 0;
+    b->requests = b->failures = b->bytes_sent = b->bytes_received = b->responses = b->latency_us = 0;
+    memset(&b->m_addr,0,sizeof(b->m_addr));
+
+    const std::string &target = b->m_name;
+    if (target[0] == '/')
+    {
+        sockaddr_un *addr = (sockaddr_un *)&b->m_addr;
+        if (target.size() >= sizeof(addr->sun_path))
+        {
+            delete b;
+            return false;
+        }
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path,target.c_str(),target.size() + 1);
+        b->m_addr_len = sizeof(sockaddr_un);
+    }
+    else
+    {
+        size_t colon = target.rfind(':');
+        if (colon == std::string::npos || colon == 0)
+        {
+            delete b;
+            return false;
+        }
+        std::string host = target.substr(0,colon);
+        std::string port = target.substr(colon + 1);
+
+        // 只在启动时解析一次，之后不再查询 DNS
+        struct addrinfo hints;
+        struct addrinfo *res = NULL;
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(),port.c_str(),&hints,&res) != 0 || !res)
+        {
+            fprintf(stderr,"cannot resolve fastcgi %s\n",target.c_str());
+            delete b;
+            return false;
+        }
+        memcpy(&b->m_addr,res->ai_addr,res->ai_addrlen);
+        b->m_addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+
+    s_routes.push_back(b);
+    return true;
+}
+
+
+fcgi_backend *fcgi_backend::match(const char *url)
+{
+    fcgi_backend *best = NULL;
+    for (size_t i = 0; i < s_routes.size(); i++)
+    {
+        const std::string &prefix = s_routes[i]->m_prefix;
+        if (strncmp(url,prefix.data(),prefix.size()) == 0 && (!best || prefix.size() > best->m_prefix.size()))
+        {
+            best = s_routes[i];
+        }
+    }
+    return best;
+}
+
+
+void fcgi_backend::start(int epollfd)
+{
+    s_epollfd = epollfd;
+}
+
+
+fcgi_conn *fcgi_backend::find(int fd)
+{
+    if (fd < 0 || (size_t)fd >= s_conns.size())
+    {
+        return NULL;
+    }
+    return s_conns[fd];
+}
+
+
+fcgi_conn *fcgi_backend::open()
+{
+    int fd = socket(m_addr.ss_family,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (connect(fd,(struct sockaddr *)&m_addr,m_addr_len) < 0 && errno != EINPROGRESS)
+    {
+        // Unix 域套接字不存在、应用没有监听或其监听队列已满
+        ::close(fd);
+        return NULL;
+    }
+
+    if (m_addr.ss_family == AF_INET)
+    {
+        int one = 1;
+        setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    }
+
+    fcgi_conn *c = new fcgi_conn(this,fd);
+    if ((size_t)fd >= s_conns.size())
+    {
+        s_conns.resize(fd + 1,NULL);
+    }
+    s_conns[fd] = c;
+    addfd(s_epollfd,fd,true);
+    m_conns.push_back(c);
+    return c;
+}
+
+
+void fcgi_backend::remove(fcgi_conn *c)
+{
+    m_conns.erase(std::find(m_conns.begin(),m_conns.end(),c));
+}
+
+
+fcgi_conn *fcgi_backend::acquire()
+{
+    for (size_t i = 0; i < m_conns.size(); i++)
+    {
+        if (m_conns[i]->has_slot())
+        {
+            return m_conns[i];
+        }
+    }
+    return NULL;
+}
+
+
+bool fcgi_backend::submit(fcgi_exchange *x)
+{
+    fcgi_conn *c = acquire();
+    if (!c && m_conns.size() < MAX_CONNS)
+    {
+        c = open();
+        if (!c)
+        {
+            failures++;
+            return false;
+        }
+    }
+    if (!c)
+    {
+        x->state = fcgi_exchange::FCGI_QUEUED;
+        x->active = http_date::time();
+        m_waiting.push_back(x);
+        return true;
+    }
+    c->begin(x);
+    return true;
+}
+
+
+void fcgi_backend::dispatch(std::vector<http_conn *> &ready)
+{
+    while (!m_waiting.empty())
+    {
+        fcgi_conn *c = acquire();
+        if (!c && (m_conns.size() >= MAX_CONNS || !(c = open())))
+        {
+            // 等待中的请求留到下一次有请求槽空出，或者超时
+            break;
+        }
+        fcgi_exchange *x = m_waiting.front();
+        m_waiting.pop_front();
+        c->begin(x);
+        add_ready(ready,x->client);
+    }
+}
+
+
+void fcgi_backend::detach(fcgi_exchange *x)
+{
+    if (x->state == fcgi_exchange::FCGI_QUEUED)
+    {
+        std::deque<fcgi_exchange *> &w = x->backend->m_waiting;
+        w.erase(std::find(w.begin(),w.end(),x));
+    }
+    else if (x->conn)
+    {
+        // 请求由连接继续持有，END_REQUEST 到达后释放
+        x->conn->abort(x);
+        return;
+    }
+    delete x;
+}
+
+
+void fcgi_backend::tick(time_t now)
+{
+    // 空闲过久的连接，以及客户端放弃后应用长时间不结束的请求所在的连接，直接关闭
+    std::vector<fcgi_conn *> stale;
+    for (size_t r = 0; r < s_routes.size(); r++)
+    {
+        std::vector<fcgi_conn *> &conns = s_routes[r]->m_conns;
+        for (size_t i = 0; i < conns.size(); i++)
+        {
+            fcgi_conn *c = conns[i];
+            bool close = (c->count() == 0 && now - c->active >= IDLE_TIMEOUT);
+            for (size_t id = 1; id < c->m_requests.size() && !close; id++)
+            {
+                fcgi_exchange *x = c->m_requests[id];
+                close = (x && !x->client && now - x->active >= TIMEOUT);
+            }
+            if (close)
+            {
+                stale.push_back(c);
+            }
+        }
+    }
+    for (size_t i = 0; i < stale.size(); i++)
+    {
+        stale[i]->shutdown();
+    }
+
+    // 长时间没有进展的请求以 504 结束，处理时会摘下请求，先收集再处理
+    std::vector<http_conn *> expired;
+    for (size_t r = 0; r < s_routes.size(); r++)
+    {
+        fcgi_backend *b = s_routes[r];
+        for (size_t i = 0; i < b->m_conns.size(); i++)
+        {
+            fcgi_conn *c = b->m_conns[i];
+            for (size_t id = 1; id < c->m_requests.size(); id++)
+            {
+                fcgi_exchange *x = c->m_requests[id];
+                if (x && x->client && now - x->active >= TIMEOUT)
+                {
+                    expired.push_back(x->client);
+                }
+            }
+        }
+        for (size_t i = 0; i < b->m_waiting.size(); i++)
+        {
+            if (now - b->m_waiting[i]->active >= TIMEOUT)
+            {
+                expired.push_back(b->m_waiting[i]->client);
+            }
+        }
+    }
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+        expired[i]->upstream_timeout();
+    }
+}
+
+
+void fcgi_backend::print_stats()
+{
+    for (size_t r = 0; r < s_routes.size(); r++)
+    {
+        fcgi_backend *b = s_routes[r];
+        printf("fastcgi %s (%s%s): conns %lu active %d queued %lu requests %lu failures %lu sent %lu received %lu latency %.2f ms\n",
+               b->m_prefix.c_str(),b->m_name.c_str(),b->m_mpx ? ", mpx" : "",(unsigned long)b->m_conns.size(),b->active,
+               (unsigned long)b->m_waiting.size(),b->requests,b->failures,b->bytes_sent,b->bytes_received,
+               b->responses ? b->latency_us / 1000.0 / b->responses : 0.0);
+    }
+}
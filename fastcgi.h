@@ -0,0 +1,269 @@
+#ifndef FASTCGI_H
+#define FASTCGI_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "output_queue.h"
+
+class http_conn;
+class fcgi_conn;
+class fcgi_backend;
+
+// 从 FastCGI 连接读入数据的缓冲块，带引用计数
+// STDOUT 记录的内容直接以共享片段放入客户端的输出队列，客户端的请求体也读入缓冲块后直接作为 STDIN 记录发送，
+// 所有引用都归还后才释放；只在主线程中使用
+struct fcgi_block
+{
+    static const size_t SIZE = 64 * 1024;
+
+    // 创建一个引用计数为 1 的空缓冲块
+    static fcgi_block *create();
+    static void ref(fcgi_block *b) { b->refs++; }
+    // 归还一个引用，也是 output_queue 共享片段的 release 回调
+    static void release(void *block);
+
+    int refs;
+    size_t len;
+    char data[SIZE];
+};
+
+// 一次 FastCGI 请求（对应一个客户端请求）的状态，由主线程驱动：
+// 记录在工作线程中编码好，主线程交给连接池中的一条连接发送；响应的 STDOUT 由连接解析后
+// 直接放入客户端的输出队列，客户端的输出队列积压过多时连接暂停读取（背压）
+struct fcgi_exchange
+{
+    // CGI 响应头的最大长度
+    static const size_t MAX_HEAD = 64 * 1024;
+
+    enum STATE
+    {
+        FCGI_START = 0,                     // 等待交给连接池
+        FCGI_QUEUED,                        // 连接数已满，等待空出的请求槽
+        FCGI_ACTIVE,                        // 已经分配请求 id，正在收发记录
+        FCGI_DONE,                          // 收到 END_REQUEST，响应已经全部放入输出队列
+        FCGI_FAILED                         // 连接出错或响应无效
+    };
+
+    fcgi_exchange(fcgi_backend *backend,http_conn *client,output_queue *out);
+    ~fcgi_exchange();
+
+    // 编码 PARAMS 中的一对名字与值
+    void param(const char *name,size_t name_len,const char *value,size_t value_len);
+    void param(const char *name,const char *value);
+    // 开始 / 结束 PARAMS 流：参数直接编码在记录缓冲块中，结束时补上记录头并追加空的 PARAMS 记录
+    void begin_params();
+    void end_params();
+    // 追加一个 STDIN 记录，len 为 0 时表示请求体结束
+    void stdin_record(const char *data,size_t len);
+    // 分配到请求 id 后填入所有已编码记录的记录头
+    void set_id(unsigned short id);
+
+    // 解析 head 中的 CGI 响应头（前 head_len 字节）并生成发给客户端的 HTTP 响应头 response，格式错误时返回 false
+    bool parse_head(size_t head_len);
+
+    // 响应体的一段到达，按响应的边界放入输出队列（data 属于缓冲块 block）
+    void body(const char *data,size_t len,fcgi_block *block);
+    // END_REQUEST 到达：结束分块编码的响应体
+    void finish();
+
+    // 请求体还有数据要发送，且上一块已经发送完
+    bool want_stdin() const { return body_left > 0 && ( !stdin_block || stdin_block->refs == 1 ); }
+
+    fcgi_backend *backend;
+    fcgi_conn *conn;
+    // 客户端连接及其输出队列；客户端提前关闭后请求由连接继续持有到 END_REQUEST（孤儿请求），此时为 NULL
+    http_conn *client;
+    output_queue *out;
+    STATE state;
+    unsigned short id;
+    // 已经尝试过的连接次数
+    int tries;
+
+    // 编码好的 BEGIN_REQUEST / PARAMS / STDIN 记录，发送队列另外持有引用，换连接重试时重新发送
+    fcgi_block *records;
+    size_t params_start;
+    // 记录超出了缓冲块（请求头受读缓冲区限制，实际不会发生）
+    bool overflow;
+    // 还要从客户端读入并发送的请求体字节数，以及最近一块请求体所在的缓冲块
+    long body_left;
+    fcgi_block *stdin_block;
+    // 请求体已经开始从客户端流式读入，请求不能再完整重发
+    bool streamed;
+    // 最近一块请求体还在连接的发送队列中，发送完后通知客户端连接继续读取
+    bool stdin_pending;
+    bool head_request;
+    bool keep_alive;
+
+    // 尚未结束的 CGI 响应头，以及生成的 HTTP 响应头
+    std::string head;
+    bool head_done;
+    std::string response;
+    int status;
+    // 响应体以分块编码发送，否则按 Content-Length 发送剩余的 remaining 字节
+    bool chunked;
+    unsigned long long remaining;
+    // 响应体比 Content-Length 短，客户端连接不能保持
+    bool truncated;
+
+    // 最近一次有进展的时间与开始的时间
+    time_t active;
+    struct timespec started;
+};
+
+// 到 FastCGI 应用的一条持久连接（FCGI_KEEP_CONN），与客户端连接一样注册在主线程的 epoll 中
+// 应用支持多路复用时一条连接上同时进行多个请求，以请求 id 区分
+class fcgi_conn
+{
+
+    public:
+
+        fcgi_conn(fcgi_backend *backend,int fd);
+        ~fcgi_conn();
+
+        int fd() const { return m_fd; }
+        // 正在进行的请求数（包括客户端已经放弃、等待 END_REQUEST 的请求）
+        int count() const { return m_count; }
+        bool has_slot() const;
+        bool paused() const { return m_paused; }
+
+        // 分配请求 id 并把 x 的记录放入发送队列，在下一次可写时发送
+        void begin(fcgi_exchange *x);
+        // 把 x 读入缓冲块的一段请求体作为 STDIN 记录发送，请求体结束时追加空的 STDIN 记录
+        void send_stdin(fcgi_exchange *x,fcgi_block *block,const char *data,size_t len);
+        // 客户端放弃请求：发送 ABORT_REQUEST，请求留到 END_REQUEST 到达后释放
+        void abort(fcgi_exchange *x);
+        // 客户端的输出队列发送完，积压都已消除时恢复读取
+        void resume();
+
+        // 连接上的事件：发送排队的记录、读取并分派记录，然后推进有了进展的客户端连接
+        void on_event(int events);
+        // 关闭连接，其上所有请求以失败结束
+        void shutdown();
+
+        // 最近一次有进展的时间
+        time_t active;
+
+    private:
+
+        friend class fcgi_backend;
+
+        // 发送排队的记录，发送缓冲区满时返回 true 等待下一次可写
+        bool flush();
+        bool receive(std::vector<http_conn *> &ready);
+        bool parse(const char *data,size_t len,std::vector<http_conn *> &ready);
+        bool finish_record(std::vector<http_conn *> &ready);
+        fcgi_exchange *current() const;
+        void on_stdout(fcgi_exchange *x,const char *data,size_t len,std::vector<http_conn *> &ready);
+        void end_request(fcgi_exchange *x,std::vector<http_conn *> &ready);
+        // 连接出错：请求全部失败，客户端加入 ready，连接被删除
+        void fail(std::vector<http_conn *> &ready);
+        void rearm();
+        // 释放 x 占用的请求槽
+        void detach(fcgi_exchange *x);
+
+    private:
+
+        fcgi_backend *m_backend;
+        int m_fd;
+        // 非阻塞连接尚未确认
+        bool m_connecting;
+        // 有客户端连接积压了过多的输出，暂停读取
+        bool m_paused;
+        // 已经完成的请求数，大于 0 时应用可能已经关闭了这条连接
+        unsigned long m_served;
+
+        // 按请求 id 索引的请求，0 不使用
+        std::vector<fcgi_exchange *> m_requests;
+        int m_count;
+
+        output_queue m_out;
+
+        // 当前读入的缓冲块及记录的解析状态（记录头与 END_REQUEST 的内容可能分几次读入）
+        fcgi_block *m_block;
+        unsigned char m_header[8];
+        size_t m_header_len;
+        size_t m_content_left;
+        size_t m_padding_left;
+        unsigned char m_end[8];
+        size_t m_end_len;
+
+};
+
+// 一条 FastCGI 路由：URL 前缀匹配的请求发给同一个应用（Unix 域套接字或 TCP 地址），带连接池
+// 除了启动时的配置，所有操作都在主线程中进行，不需要加锁
+class fcgi_backend
+{
+
+    public:
+
+        // 支持多路复用时每条连接上最多同时进行的请求数
+        static const int MAX_MPX = 16;
+        // 每个应用最多的连接数，全部占满时请求排队
+        static const size_t MAX_CONNS = 64;
+        // 客户端的输出队列超过该值时暂停读取连接（背压）
+        static const size_t HIGH_WATER = 256 * 1024;
+        // 空闲连接保留的时间（秒）
+        static const int IDLE_TIMEOUT = 60;
+        // 请求没有任何进展的最长时间（秒）
+        static const int TIMEOUT = 60;
+
+        // 在启动时添加路由 [mpx:]前缀=/path/to/socket 或 [mpx:]前缀=主机:端口，格式错误或无法解析主机时返回 false
+        static bool add_route(const char *spec);
+        // 查找 URL 匹配的路由（最长前缀），没有时返回 NULL，可以在工作线程中调用
+        static fcgi_backend *match(const char *url);
+        static bool enabled() { return !s_routes.empty(); }
+
+        // 以下只在主线程中调用
+        static void start(int epollfd);
+        // 每秒调用一次：回收空闲连接、让长时间没有进展的请求超时
+        static void tick(time_t now);
+        // fd 属于 FastCGI 连接时返回它
+        static fcgi_conn *find(int fd);
+        static void print_stats();
+        // 客户端不再等待 x（出错、超时或关闭）：从连接或等待队列中摘下，需要时释放
+        static void detach(fcgi_exchange *x);
+
+        // 把 x 交给一条有空闲请求槽的连接，连接都占满时排队；无法建立连接时返回 false
+        bool submit(fcgi_exchange *x);
+
+        const std::string &name() const { return m_name; }
+        int max_requests() const { return m_mpx ? MAX_MPX : 1; }
+
+        // 统计
+        int active;
+        unsigned long requests;
+        unsigned long failures;
+        unsigned long bytes_sent;
+        unsigned long bytes_received;
+        unsigned long responses;
+        unsigned long latency_us;
+
+    private:
+
+        friend class fcgi_conn;
+
+        // 有空闲请求槽的连接，没有时返回 NULL
+        fcgi_conn *acquire();
+        fcgi_conn *open();
+        // 连接关闭前调用
+        void remove(fcgi_conn *c);
+        // 有请求槽空出或连接关闭：把等待中的请求交给连接，客户端加入 ready
+        void dispatch(std::vector<http_conn *> &ready);
+
+        std::string m_prefix;
+        std::string m_name;
+        bool m_mpx;
+        sockaddr_storage m_addr;
+        socklen_t m_addr_len;
+        std::vector<fcgi_conn *> m_conns;
+        std::deque<fcgi_exchange *> m_waiting;
+
+        static std::vector<fcgi_backend *> s_routes;
+
+};
+
+#endif
@@ -0,0 +1,232 @@
+#include "file_watcher.h"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+
+// 需要关注的事件：内容变化、属性变化（权限影响 403）、创建（否定缓存）、删除与移动
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE
+                                 | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+                                 | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+
+file_watcher::file_watcher(change_callback on_change,lost_callback on_lost) :
+    m_inotify_fd(-1),m_on_change(on_change),m_on_lost(on_lost),m_lost(false)
+{
+}
+
+
+file_watcher::~file_watcher()
+{
+    if (m_inotify_fd != -1)
+    {
+        // 监视线程阻塞在 read 上，read 是取消点
+        pthread_cancel(m_thread);
+        pthread_join(m_thread,NULL);
+        close(m_inotify_fd);
+    }
+}
+
+
+bool file_watcher::start(const char *root)
+{
+    m_root = root;
+
+    m_inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (m_inotify_fd < 0)
+    {
+        perror("inotify_init1()");
+        return false;
+    }
+
+    if (!add_watches(m_root) || pthread_create(&m_thread,NULL,worker,this) != 0)
+    {
+        close(m_inotify_fd);
+        m_inotify_fd = -1;
+        m_dirs.clear();
+        return false;
+    }
+
+    return true;
+}
+
+
+void* file_watcher::worker(void* arg)
+{
+    file_watcher *watcher = (file_watcher *)arg;
+    watcher->run();
+    return watcher;
+}
+
+
+void file_watcher::run()
+{
+    // 按 inotify_event 的对齐方式分配缓冲区
+    char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (true)
+    {
+        ssize_t len = read(m_inotify_fd,buf,sizeof(buf));
+        if (len < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("read(inotify)");
+            break;
+        }
+
+        for (char *p = buf; p < buf + len; )
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            handle(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    if (!m_lost)
+    {
+        m_lost = true;
+        m_on_lost();
+    }
+}
+
+
+void file_watcher::handle(const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        // 事件队列溢出，丢失了哪些事件无从得知，整个缓存全部失效
+        m_on_change(m_root,true);
+        return;
+    }
+
+    std::unordered_map<int,std::string>::iterator it = m_dirs.find(ev->wd);
+    if (it == m_dirs.end())
+    {
+        return;
+    }
+
+    if (ev->mask & IN_IGNORED)
+    {
+        // 目录被删除或监视被移除
+        m_dirs.erase(it);
+        return;
+    }
+
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        // 根目录本身被删除或移走
+        if (it->second == m_root)
+        {
+            m_on_change(m_root,true);
+        }
+        return;
+    }
+
+    if (ev->len == 0)
+    {
+        return;
+    }
+
+    std::string path = it->second + "/" + ev->name;
+
+    if (!(ev->mask & IN_ISDIR))
+    {
+        m_on_change(path,false);
+        return;
+    }
+
+    if (ev->mask & IN_MOVED_FROM)
+    {
+        // 目录被移走后原有的监视仍然有效，但路径已经不对了
+        remove_watches(path);
+    }
+    else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+    {
+        if (!add_watches(path) && !m_lost)
+        {
+            m_lost = true;
+            m_on_lost();
+        }
+    }
+
+    // 在添加监视之后失效，覆盖监视建立之前新目录中已经出现的文件
+    m_on_change(path,true);
+}
+
+
+bool file_watcher::add_watches(const std::string &dir)
+{
+    int wd = inotify_add_watch(m_inotify_fd,dir.c_str(),WATCH_MASK);
+    if (wd < 0)
+    {
+        if (errno == ENOENT || errno == ENOTDIR)
+        {
+            // 目录在监视之前已经消失
+            return true;
+        }
+        fprintf(stderr,"inotify_add_watch(%s): %s\n",dir.c_str(),strerror(errno));
+        return false;
+    }
+    m_dirs[wd] = dir;
+
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        return true;
+    }
+
+    bool ok = true;
+    struct dirent *de;
+    while (ok && (de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name,".") == 0 || strcmp(de->d_name,"..") == 0)
+        {
+            continue;
+        }
+
+        std::string sub = dir + "/" + de->d_name;
+        bool is_dir = (de->d_type == DT_DIR);
+        if (de->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = (lstat(sub.c_str(),&st) == 0 && S_ISDIR(st.st_mode));
+        }
+
+        if (is_dir)
+        {
+            ok = add_watches(sub);
+        }
+    }
+    closedir(d);
+
+    return ok;
+}
+
+
+void file_watcher::remove_watches(const std::string &dir)
+{
+    std::unordered_map<int,std::string>::iterator it = m_dirs.begin();
+    while (it != m_dirs.end())
+    {
+        const std::string &path = it->second;
+        if (path.compare(0,dir.size(),dir) == 0
+            && (path.size() == dir.size() || path[dir.size()] == '/'))
+        {
+            // 对应的 IN_IGNORED 到达时已找不到该描述符，直接忽略
+            inotify_rm_watch(m_inotify_fd,it->first);
+            it = m_dirs.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+
+// 用 inotify 监视网站根目录（递归），文件被修改、移动或删除时立即通知各缓存失效
+// 有了它，缓存条目可以一直信任下去，不必每个请求 stat 或按 ttl 重新校验
+//
+// 监视工作在独立的线程中进行，回调也在该线程中调用
+class file_watcher
+{
+
+    public:
+
+        // path 发生变化，subtree 为 true 表示 path 是目录，其下所有路径都要失效
+        typedef void (*change_callback)(const std::string &path,bool subtree);
+
+        // 监视失效（例如超出 inotify 监视数量上限），缓存需要回到按 ttl 校验的方式
+        typedef void (*lost_callback)();
+
+        file_watcher(change_callback on_change,lost_callback on_lost);
+        ~file_watcher();
+
+        // 递归监视 root 并启动监视线程，失败时返回 false
+        bool start(const char *root);
+
+    private:
+
+        static void* worker(void* arg);
+
+        void run();
+
+        // 递归为 dir 及其子目录添加监视，失败时返回 false
+        bool add_watches(const std::string &dir);
+
+        // 移除 dir 及其子目录的监视（目录被移走时使用）
+        void remove_watches(const std::string &dir);
+
+        // 处理一个 inotify 事件
+        void handle(const struct inotify_event *ev);
+
+    private:
+
+        int m_inotify_fd;
+
+        pthread_t m_thread;
+
+        std::string m_root;
+
+        // 监视描述符 -> 目录路径，只在监视线程中访问（启动前由 start 填充）
+        std::unordered_map<int,std::string> m_dirs;
+
+        change_callback m_on_change;
+        lost_callback m_on_lost;
+
+        // 是否已经通知过监视失效
+        bool m_lost;
+
+};
+
+#endif
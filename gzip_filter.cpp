@@ -0,0 +1,132 @@
+#include "gzip_filter.h"
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+
+gzip_stream::gzip_stream() : m_inited(false)
+{
+    memset(&m_zs,0,sizeof(m_zs));
+}
+
+
+gzip_stream::~gzip_stream()
+{
+    if (m_inited)
+    {
+        deflateEnd(&m_zs);
+    }
+}
+
+
+bool gzip_stream::init(int level,FORMAT format)
+{
+    if (m_inited)
+    {
+        deflateEnd(&m_zs);
+        m_inited = false;
+    }
+
+    memset(&m_zs,0,sizeof(m_zs));
+
+    // windowBits 加 16 输出 gzip 头尾，否则为 zlib 格式
+    int window_bits = (format == GZIP) ? 15 + 16 : 15;
+    if (deflateInit2(&m_zs,level,Z_DEFLATED,window_bits,8,Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+
+    m_inited = true;
+    return true;
+}
+
+
+bool gzip_stream::write(const char *in,size_t len,std::string &out,bool finish)
+{
+    if (!m_inited)
+    {
+        return false;
+    }
+
+    char buf[16 * 1024];
+
+    m_zs.next_in = (Bytef *)in;
+    m_zs.avail_in = len;
+
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+    int ret;
+    do
+    {
+        m_zs.next_out = (Bytef *)buf;
+        m_zs.avail_out = sizeof(buf);
+
+        ret = deflate(&m_zs,flush);
+        if (ret == Z_STREAM_ERROR)
+        {
+            return false;
+        }
+
+        out.append(buf,sizeof(buf) - m_zs.avail_out);
+    } while (m_zs.avail_out == 0 || (finish && ret != Z_STREAM_END));
+
+    return true;
+}
+
+
+bool gzip_compressible(const char *path)
+{
+    static const char *exts[] = {
+        ".html", ".htm", ".css", ".js", ".mjs", ".json", ".map", ".txt",
+        ".xml", ".svg", ".csv", ".md", ".wasm", ".ico", ".ttf", ".otf"
+    };
+
+    const char *dot = strrchr(path,'.');
+    if (!dot || strchr(dot,'/'))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++)
+    {
+        if (strcasecmp(dot,exts[i]) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+int gzip_adaptive_level(int max_level)
+{
+    // 负载每秒最多读取一次
+    static time_t last = 0;
+    static double load_per_cpu = 0;
+
+    time_t now = time(NULL);
+    if (now != last)
+    {
+        double load[1];
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (getloadavg(load,1) == 1 && cpus > 0)
+        {
+            load_per_cpu = load[0] / cpus;
+        }
+        last = now;
+    }
+
+    int level = max_level;
+    if (load_per_cpu >= 1.0)
+    {
+        level = 1;
+    }
+    else if (load_per_cpu >= 0.5)
+    {
+        level = max_level / 2;
+    }
+
+    return level < 1 ? 1 : level;
+}
@@ -0,0 +1,44 @@
+#ifndef GZIP_FILTER_H
+#define GZIP_FILTER_H
+
+#include <zlib.h>
+#include <cstddef>
+#include <string>
+
+// 响应体的流式压缩
+// 静态文件在工作线程中压缩一次后放入压缩结果缓存，动态内容可以分块调用 write 边生成边压缩
+class gzip_stream
+{
+
+    public:
+
+        // Content-Encoding: gzip 为 gzip 格式，deflate 为 zlib 格式
+        enum FORMAT
+        {
+            GZIP = 0,
+            DEFLATE
+        };
+
+        gzip_stream();
+        ~gzip_stream();
+
+        // level 为 zlib 压缩级别 1 ~ 9
+        bool init(int level,FORMAT format);
+
+        // 压缩 len 字节的输入并把输出追加到 out，finish 为 true 时写出压缩流的结尾
+        bool write(const char *in,size_t len,std::string &out,bool finish);
+
+    private:
+
+        z_stream m_zs;
+        bool m_inited;
+
+};
+
+// 根据扩展名判断文件是否属于值得压缩的文本类型（图片、视频、压缩包等已经压缩过）
+bool gzip_compressible(const char *path);
+
+// 根据当前 CPU 负载选择压缩级别：空闲时使用 max_level，负载越高级别越低，最低为 1
+int gzip_adaptive_level(int max_level);
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef HEADER_TEMPLATES_H
+#define HEADER_TEMPLATES_H
+
+#include <cstddef>
+#include <cstring>
+#include <cstdarg>
+#include <cstdio>
+
+// 编译期生成的响应头片段
+// 状态行与固定的头部名在编译期拼接好并算出长度，组装响应头时只需 memcpy，
+// 不再为每个头部经过 vsnprintf 解析一遍格式串
+
+struct header_fragment
+{
+    const char *data;
+    size_t len;
+};
+
+template<size_t N>
+constexpr header_fragment fragment(const char (&s)[N])
+{
+    return header_fragment{ s, N - 1 };
+}
+
+// 每个状态码完整的状态行
+struct status_template
+{
+    int status;
+    header_fragment line;
+};
+
+constexpr status_template STATUS_LINES[] = {
+    { 101, fragment("HTTP/1.1 101 Switching Protocols\r\n") },
+    { 200, fragment("HTTP/1.1 200 OK\r\n") },
+    { 206, fragment("HTTP/1.1 206 Partial Content\r\n") },
+    { 400, fragment("HTTP/1.1 400 Bad Request\r\n") },
+    { 403, fragment("HTTP/1.1 403 Forbidden\r\n") },
+    { 404, fragment("HTTP/1.1 404 Not Found\r\n") },
+    { 405, fragment("HTTP/1.1 405 Method Not Allowed\r\n") },
+    { 416, fragment("HTTP/1.1 416 Range Not Satisfiable\r\n") },
+    { 500, fragment("HTTP/1.1 500 Internal Error\r\n") },
+    { 502, fragment("HTTP/1.1 502 Bad Gateway\r\n") },
+    { 504, fragment("HTTP/1.1 504 Gateway Timeout\r\n") },
+};
+
+// 查找状态行，表中没有的状态码返回长度为 0 的片段
+constexpr header_fragment status_line(int status)
+{
+    for (const status_template &t : STATUS_LINES)
+    {
+        if (t.status == status)
+        {
+            return t.line;
+        }
+    }
+    return header_fragment{ nullptr, 0 };
+}
+
+static_assert(status_line(404).len == 24,"status line length must be computed at compile time");
+
+// 头部名（含冒号与空格）与整行固定的头部
+constexpr header_fragment HDR_CONTENT_LENGTH = fragment("Content-Length: ");
+constexpr header_fragment HDR_CONTENT_TYPE = fragment("Content-Type: ");
+constexpr header_fragment HDR_CONTENT_ENCODING = fragment("Content-Encoding: ");
+constexpr header_fragment HDR_CONTENT_RANGE = fragment("Content-Range: bytes ");
+constexpr header_fragment HDR_ETAG = fragment("ETag: ");
+constexpr header_fragment HDR_WEAK_ETAG = fragment("ETag: W/");
+constexpr header_fragment HDR_LAST_MODIFIED = fragment("Last-Modified: ");
+constexpr header_fragment HDR_VARY_ENCODING = fragment("Vary: Accept-Encoding\r\n");
+constexpr header_fragment HDR_ALLOW = fragment("Allow: GET, HEAD\r\n");
+constexpr header_fragment HDR_ACCEPT_RANGES = fragment("Accept-Ranges: bytes\r\n");
+constexpr header_fragment HDR_DATE = fragment("Date: ");
+constexpr header_fragment HDR_EXPIRES = fragment("Expires: ");
+constexpr header_fragment HDR_MAX_AGE = fragment("Cache-Control: public, max-age=");
+constexpr header_fragment HDR_IMMUTABLE = fragment(", immutable\r\n");
+constexpr header_fragment HDR_NO_CACHE = fragment("Cache-Control: no-cache\r\n");
+constexpr header_fragment HDR_KEEP_ALIVE = fragment("Connection: keep-alive\r\n");
+constexpr header_fragment HDR_CLOSE = fragment("Connection: close\r\n");
+// Connection 头连同结束响应头的空行，用于从缓存发送的响应
+constexpr header_fragment HDR_KEEP_ALIVE_END = fragment("Connection: keep-alive\r\n\r\n");
+constexpr header_fragment HDR_CLOSE_END = fragment("Connection: close\r\n\r\n");
+// WebSocket 握手响应
+constexpr header_fragment HDR_UPGRADE_WEBSOCKET = fragment("Upgrade: websocket\r\nConnection: Upgrade\r\n");
+constexpr header_fragment HDR_WEBSOCKET_ACCEPT = fragment("Sec-WebSocket-Accept: ");
+constexpr header_fragment CRLF = fragment("\r\n");
+
+// 十进制最长 20 位（2^64 - 1）
+const size_t DECIMAL_LEN = 20;
+
+// 无符号整数转十进制，每次查表输出两位，返回写入的字节数（不写结尾的 \0）
+// out 至少需要 DECIMAL_LEN 字节
+inline size_t format_decimal(char *out,unsigned long long value)
+{
+    static const char digits[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    char buf[DECIMAL_LEN];
+    char *p = buf + DECIMAL_LEN;
+    while (value >= 100)
+    {
+        unsigned int i = (unsigned int)(value % 100) * 2;
+        value /= 100;
+        *--p = digits[i + 1];
+        *--p = digits[i];
+    }
+    if (value >= 10)
+    {
+        unsigned int i = (unsigned int)value * 2;
+        *--p = digits[i + 1];
+        *--p = digits[i];
+    }
+    else
+    {
+        *--p = (char)('0' + value);
+    }
+
+    size_t len = buf + DECIMAL_LEN - p;
+    memcpy(out,p,len);
+    return len;
+}
+
+// 写缓冲区的追加函数，http_conn 的 add_response / append 系列与 bench_headers 共用
+// buf 共 size 字节，已写入 idx 字节；始终为结尾的 \0 留出一个字节，放不下时返回 false，idx 不变
+inline bool buffer_vprintf(char *buf,int size,int &idx,const char *format,va_list args)
+{
+    if (idx >= size)
+    {
+        return false;
+    }
+    int len = vsnprintf(buf + idx,size - 1 - idx,format,args);
+    if (len < 0 || len >= size - 1 - idx)
+    {
+        return false;
+    }
+    idx += len;
+    return true;
+}
+
+inline bool buffer_append(char *buf,int size,int &idx,const char *data,size_t len)
+{
+    if (len >= (size_t)(size - 1 - idx))
+    {
+        return false;
+    }
+    memcpy(buf + idx,data,len);
+    idx += len;
+    return true;
+}
+
+inline bool buffer_append_decimal(char *buf,int size,int &idx,unsigned long long value)
+{
+    char digits[DECIMAL_LEN];
+    return buffer_append(buf,size,idx,digits,format_decimal(digits,value));
+}
+
+// 头部名 + 字符串值 + \r\n
+inline bool buffer_append_header(char *buf,int size,int &idx,const header_fragment &name,const char *value)
+{
+    return buffer_append(buf,size,idx,name.data,name.len) && buffer_append(buf,size,idx,value,strlen(value))
+        && buffer_append(buf,size,idx,CRLF.data,CRLF.len);
+}
+
+#endif
@@ -0,0 +1,565 @@
+#include "hpack.h"
+
+// RFC 7541 附录 A
+static const hpack_header STATIC_TABLE[hpack_table::STATIC_COUNT] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// RFC 7541 附录 B，EOS（0x3fffffff，30 位）单独处理
+static const uint32_t HUFFMAN_CODES[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t HUFFMAN_LENGTHS[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+static const uint32_t HUFFMAN_EOS = 0x3fffffff;
+static const int HUFFMAN_EOS_LENGTH = 30;
+static const int HUFFMAN_EOS_SYMBOL = 256;
+
+
+// Huffman 解码用的二叉树，第一次使用时由码表生成
+struct huffman_tree
+{
+    // 257 个叶子（含 EOS）与 256 个内部节点
+    static const int NODES = 2 * 257 - 1;
+
+    // 每个节点的两个子节点，0 表示没有；叶子节点的 symbol 不小于 0
+    int16_t child[NODES][2];
+    int16_t symbol[NODES];
+    int count;
+
+    huffman_tree() : count(1)
+    {
+        child[0][0] = child[0][1] = 0;
+        symbol[0] = -1;
+        for (int i = 0; i < 256; i++)
+        {
+            insert(HUFFMAN_CODES[i],HUFFMAN_LENGTHS[i],i);
+        }
+        insert(HUFFMAN_EOS,HUFFMAN_EOS_LENGTH,HUFFMAN_EOS_SYMBOL);
+    }
+
+    void insert(uint32_t code,int length,int sym)
+    {
+        int node = 0;
+        for (int i = length - 1; i >= 0; i--)
+        {
+            int bit = (code >> i) & 1;
+            if (!child[node][bit])
+            {
+                child[count][0] = child[count][1] = 0;
+                symbol[count] = -1;
+                child[node][bit] = count++;
+            }
+            node = child[node][bit];
+        }
+        symbol[node] = sym;
+    }
+};
+
+
+static bool huffman_decode(const unsigned char *data,size_t len,std::string &out)
+{
+    static const huffman_tree tree;
+
+    int node = 0;
+    // 当前未完成的码字已经读入的位数，以及这些位是否全为 1（合法的填充是 EOS 的前缀）
+    int depth = 0;
+    bool ones = true;
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int b = 7; b >= 0; b--)
+        {
+            int bit = (data[i] >> b) & 1;
+            node = tree.child[node][bit];
+            if (!node)
+            {
+                return false;
+            }
+            depth++;
+            ones = ones && bit;
+
+            int sym = tree.symbol[node];
+            if (sym >= 0)
+            {
+                if (sym == HUFFMAN_EOS_SYMBOL)
+                {
+                    return false;
+                }
+                out += (char)sym;
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+
+    // 填充不超过 7 位且全为 1
+    return depth <= 7 && ones;
+}
+
+
+static size_t huffman_length(const std::string &s)
+{
+    size_t bits = 0;
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        bits += HUFFMAN_LENGTHS[(unsigned char)s[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+
+static void huffman_encode(const std::string &s,std::string &out)
+{
+    uint64_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        unsigned char c = s[i];
+        acc = (acc << HUFFMAN_LENGTHS[c]) | HUFFMAN_CODES[c];
+        bits += HUFFMAN_LENGTHS[c];
+        while (bits >= 8)
+        {
+            bits -= 8;
+            out += (char)(acc >> bits);
+        }
+    }
+    if (bits > 0)
+    {
+        // 用 EOS 的高位（全 1）填充
+        out += (char)((acc << (8 - bits)) | (0xff >> bits));
+    }
+}
+
+
+// 整数表示：前缀 prefix 位，first 为第一个字节中前缀之外的标志位
+static void encode_integer(std::string &out,unsigned char first,int prefix,size_t value)
+{
+    size_t max = (1u << prefix) - 1;
+    if (value < max)
+    {
+        out += (char)(first | value);
+        return;
+    }
+    out += (char)(first | max);
+    value -= max;
+    while (value >= 128)
+    {
+        out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+
+static bool decode_integer(const unsigned char *&p,const unsigned char *end,int prefix,size_t &value)
+{
+    if (p == end)
+    {
+        return false;
+    }
+    size_t max = (1u << prefix) - 1;
+    value = *p++ & max;
+    if (value < max)
+    {
+        return true;
+    }
+
+    for (int shift = 0; p != end; shift += 7)
+    {
+        // 头部块中的任何整数都不会超过 2^28
+        if (shift > 21)
+        {
+            return false;
+        }
+        unsigned char b = *p++;
+        value += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void encode_string(std::string &out,const std::string &s)
+{
+    size_t huffman = huffman_length(s);
+    if (huffman < s.size())
+    {
+        encode_integer(out,0x80,7,huffman);
+        huffman_encode(s,out);
+    }
+    else
+    {
+        encode_integer(out,0,7,s.size());
+        out += s;
+    }
+}
+
+
+static bool decode_string(const unsigned char *&p,const unsigned char *end,std::string &s)
+{
+    if (p == end)
+    {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    size_t len;
+    if (!decode_integer(p,end,7,len) || len > (size_t)(end - p))
+    {
+        return false;
+    }
+
+    s.clear();
+    bool ok = true;
+    if (huffman)
+    {
+        ok = huffman_decode(p,len,s);
+    }
+    else
+    {
+        s.assign((const char *)p,len);
+    }
+    p += len;
+    return ok;
+}
+
+
+const hpack_header *hpack_table::get(size_t index) const
+{
+    if (index == 0)
+    {
+        return NULL;
+    }
+    if (index <= STATIC_COUNT)
+    {
+        return &STATIC_TABLE[index - 1];
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= m_entries.size())
+    {
+        return NULL;
+    }
+    return &m_entries[index];
+}
+
+
+void hpack_table::add(const std::string &name,const std::string &value)
+{
+    size_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+    if (size > m_max_size)
+    {
+        evict(0);
+        return;
+    }
+
+    evict(m_max_size - size);
+    hpack_header h;
+    h.name = name;
+    h.value = value;
+    m_entries.push_front(h);
+    m_size += size;
+}
+
+
+void hpack_table::set_max_size(size_t size)
+{
+    m_max_size = size;
+    evict(size);
+}
+
+
+void hpack_table::evict(size_t limit)
+{
+    while (m_size > limit && !m_entries.empty())
+    {
+        const hpack_header &h = m_entries.back();
+        m_size -= h.name.size() + h.value.size() + ENTRY_OVERHEAD;
+        m_entries.pop_back();
+    }
+}
+
+
+size_t hpack_table::find(const std::string &name,const std::string &value,bool &exact) const
+{
+    size_t by_name = 0;
+    exact = false;
+    for (size_t i = 0; i < STATIC_COUNT; i++)
+    {
+        if (STATIC_TABLE[i].name == name)
+        {
+            if (STATIC_TABLE[i].value == value)
+            {
+                exact = true;
+                return i + 1;
+            }
+            if (!by_name)
+            {
+                by_name = i + 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        if (m_entries[i].name == name)
+        {
+            if (m_entries[i].value == value)
+            {
+                exact = true;
+                return STATIC_COUNT + 1 + i;
+            }
+            if (!by_name)
+            {
+                by_name = STATIC_COUNT + 1 + i;
+            }
+        }
+    }
+    return by_name;
+}
+
+
+bool hpack_decoder::decode(const unsigned char *data,size_t len,std::vector<hpack_header> &headers)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    size_t list_size = 0;
+    bool first = true;
+
+    while (p != end)
+    {
+        unsigned char b = *p;
+        size_t index;
+
+        if (b & 0x80)
+        {
+            // 索引表示
+            const hpack_header *h;
+            if (!decode_integer(p,end,7,index) || !(h = m_table.get(index)))
+            {
+                return false;
+            }
+            headers.push_back(*h);
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // 动态表大小更新，只能出现在头部块的开头
+            if (!first || !decode_integer(p,end,5,index) || index > m_limit)
+            {
+                return false;
+            }
+            m_table.set_max_size(index);
+            continue;
+        }
+        else
+        {
+            // 字面量：带增量索引（01）、不索引（0000）、永不索引（0001）
+            bool indexing = (b & 0xc0) == 0x40;
+            int prefix = indexing ? 6 : 4;
+            if (!decode_integer(p,end,prefix,index))
+            {
+                return false;
+            }
+
+            hpack_header h;
+            if (index)
+            {
+                const hpack_header *named = m_table.get(index);
+                if (!named)
+                {
+                    return false;
+                }
+                h.name = named->name;
+            }
+            else if (!decode_string(p,end,h.name))
+            {
+                return false;
+            }
+            if (!decode_string(p,end,h.value))
+            {
+                return false;
+            }
+
+            if (indexing)
+            {
+                m_table.add(h.name,h.value);
+            }
+            headers.push_back(h);
+        }
+
+        first = false;
+        const hpack_header &last = headers.back();
+        list_size += last.name.size() + last.value.size() + hpack_table::ENTRY_OVERHEAD;
+        if (list_size > m_max_list)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void hpack_encoder::set_max_size(size_t size)
+{
+    if (size > 4096)
+    {
+        size = 4096;
+    }
+    if (size != m_table.max_size())
+    {
+        m_table.set_max_size(size);
+        m_pending = true;
+    }
+}
+
+
+void hpack_encoder::begin(std::string &out)
+{
+    if (m_pending)
+    {
+        encode_integer(out,0x20,5,m_table.max_size());
+        m_pending = false;
+    }
+}
+
+
+void hpack_encoder::encode(std::string &out,const std::string &name,const std::string &value,bool index)
+{
+    bool exact;
+    size_t found = m_table.find(name,value,exact);
+    if (exact)
+    {
+        encode_integer(out,0x80,7,found);
+        return;
+    }
+
+    if (index)
+    {
+        encode_integer(out,0x40,6,found);
+    }
+    else
+    {
+        encode_integer(out,0x00,4,found);
+    }
+    if (!found)
+    {
+        encode_string(out,name);
+    }
+    encode_string(out,value);
+
+    if (index)
+    {
+        m_table.add(name,value);
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+// HPACK（RFC 7541）：HTTP/2 的头部压缩
+// 61 项的静态表加上每个方向各自维护的动态表，字符串可以用 Huffman 编码
+
+struct hpack_header
+{
+    std::string name;
+    std::string value;
+};
+
+// 头部表，索引从 1 开始：1 ~ 61 为静态表，之后为动态表（最新加入的在前）
+class hpack_table
+{
+
+    public:
+
+        static const size_t STATIC_COUNT = 61;
+
+        // 每个条目在名字与值之外额外计入的大小
+        static const size_t ENTRY_OVERHEAD = 32;
+
+        explicit hpack_table(size_t max_size = 4096) : m_size(0),m_max_size(max_size) {}
+
+        // 取得 index 处的条目，越界时返回 NULL
+        const hpack_header *get(size_t index) const;
+
+        // 加入动态表，超出大小时从最旧的条目开始淘汰（比整个表还大的条目只是清空表）
+        void add(const std::string &name,const std::string &value);
+
+        void set_max_size(size_t size);
+        size_t max_size() const { return m_max_size; }
+
+        // 名字与值都相同时返回其索引并把 exact 置为 true，只有名字相同时返回名字的索引，都没有返回 0
+        size_t find(const std::string &name,const std::string &value,bool &exact) const;
+
+    private:
+
+        void evict(size_t limit);
+
+    private:
+
+        std::deque<hpack_header> m_entries;
+        size_t m_size;
+        size_t m_max_size;
+
+};
+
+class hpack_decoder
+{
+
+    public:
+
+        // limit 为本端通告的 SETTINGS_HEADER_TABLE_SIZE，max_list 为解码后头部总大小的上限
+        explicit hpack_decoder(size_t limit = 4096,size_t max_list = 16384)
+            : m_table(limit),m_limit(limit),m_max_list(max_list) {}
+
+        // 解码一个完整的头部块，格式错误（COMPRESSION_ERROR）或头部过大时返回 false，
+        // 此后动态表的状态不可信，连接必须关闭
+        bool decode(const unsigned char *data,size_t len,std::vector<hpack_header> &headers);
+
+    private:
+
+        hpack_table m_table;
+        size_t m_limit;
+        size_t m_max_list;
+
+};
+
+class hpack_encoder
+{
+
+    public:
+
+        hpack_encoder() : m_table(4096),m_pending(false) {}
+
+        // 对端的 SETTINGS_HEADER_TABLE_SIZE，动态表不超过它与 4096 中的较小值
+        // 大小改变后在下一个头部块的开头发出动态表大小更新
+        void set_max_size(size_t size);
+
+        // 开始一个新的头部块
+        void begin(std::string &out);
+
+        // 编码一个头部，index 为 false 时不放入动态表（每个响应都不同的值，如 content-length、etag）
+        void encode(std::string &out,const std::string &name,const std::string &value,bool index);
+
+    private:
+
+        hpack_table m_table;
+        bool m_pending;
+
+};
+
+#endif
@@ -0,0 +1,924 @@
+#include "http2.h"
+#include "http_conn.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <new>
+
+const char http2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// 帧头的长度
+static const size_t FRAME_HEADER_LEN = 9;
+
+// 帧标志
+static const int FLAG_END_STREAM = 0x1;
+static const int FLAG_ACK = 0x1;
+static const int FLAG_END_HEADERS = 0x4;
+static const int FLAG_PADDED = 0x8;
+static const int FLAG_PRIORITY = 0x20;
+
+// 设置项
+static const int SETTINGS_HEADER_TABLE_SIZE = 1;
+static const int SETTINGS_ENABLE_PUSH = 2;
+static const int SETTINGS_MAX_CONCURRENT_STREAMS = 3;
+static const int SETTINGS_INITIAL_WINDOW_SIZE = 4;
+static const int SETTINGS_MAX_FRAME_SIZE = 5;
+static const int SETTINGS_MAX_HEADER_LIST_SIZE = 6;
+
+// 流量控制窗口的上限与初始值
+static const long MAX_WINDOW = 0x7fffffff;
+static const long DEFAULT_WINDOW = 65535;
+
+// 本端接受的解码后头部总大小
+static const size_t MAX_HEADER_LIST = 16384;
+
+
+static void put32(unsigned char *p,unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_frame_header(unsigned char *p,size_t len,int type,int flags,unsigned int id)
+{
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5,id & 0x7fffffff);
+}
+
+// HTTP2-Settings 使用不带填充的 base64url
+static bool base64url_decode(const char *in,std::string &out)
+{
+    unsigned int acc = 0;
+    int bits = 0;
+    for (; *in && *in != '='; in++)
+    {
+        char c = *in;
+        int v;
+        if (c >= 'A' && c <= 'Z')
+        {
+            v = c - 'A';
+        }
+        else if (c >= 'a' && c <= 'z')
+        {
+            v = c - 'a' + 26;
+        }
+        else if (c >= '0' && c <= '9')
+        {
+            v = c - '0' + 52;
+        }
+        else if (c == '-' || c == '+')
+        {
+            v = 62;
+        }
+        else if (c == '_' || c == '/')
+        {
+            v = 63;
+        }
+        else
+        {
+            return false;
+        }
+
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out += (char)((acc >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+// 每个响应都不同的值不放入动态表，避免把可复用的条目挤出去
+static bool volatile_header(const std::string &name)
+{
+    return name == "content-length" || name == "content-range" || name == "etag"
+        || name == "last-modified" || name == "date" || name == "expires";
+}
+
+
+http2_session::http2_session(http_conn *conn) :
+    m_conn(conn),m_decoder(4096,MAX_HEADER_LIST),m_preface(false),
+    m_peer_max_frame(MAX_FRAME_SIZE),m_peer_initial_window(DEFAULT_WINDOW),m_send_window(DEFAULT_WINDOW),
+    m_last_stream(0),m_continuation(0),m_goaway(false),m_peer_goaway(false)
+{
+    // 服务端连接前言：SETTINGS，其余设置使用默认值
+    unsigned char settings[12];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2,MAX_CONCURRENT_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(settings + 8,MAX_HEADER_LIST);
+    frame_header(sizeof(settings),FRAME_SETTINGS,0,0);
+    m_control.append((const char *)settings,sizeof(settings));
+}
+
+
+http2_session::~http2_session()
+{
+    for (size_t i = 0; i < m_retired.size(); i++)
+    {
+        release(m_retired[i]);
+    }
+    std::unordered_map<unsigned int,http2_stream *>::iterator it = m_streams.begin();
+    for (; it != m_streams.end(); ++it)
+    {
+        release(it->second);
+    }
+}
+
+
+bool http2_session::upgrade(const char *settings)
+{
+    std::string payload;
+    if (!base64url_decode(settings,payload))
+    {
+        return false;
+    }
+    // 101 响应即是对这些设置的确认，不需要再发送 SETTINGS ACK
+    return apply_settings((const unsigned char *)payload.data(),payload.size());
+}
+
+
+http2_stream *http2_session::open_stream(unsigned int id)
+{
+    http2_stream *s = new (std::nothrow) http2_stream;
+    if (!s)
+    {
+        return NULL;
+    }
+    s->id = id;
+    s->window = m_peer_initial_window;
+    s->data = NULL;
+    s->chunk = 0;
+    s->remaining = 0;
+    s->next_part = 0;
+    s->entry = NULL;
+    s->mapping = NULL;
+    s->cached = NULL;
+    s->pack = NULL;
+    s->slice = NULL;
+    s->slice_len = 0;
+    m_streams[id] = s;
+    if (id > m_last_stream)
+    {
+        m_last_stream = id;
+    }
+    return s;
+}
+
+
+void http2_session::on_input(const char *data,size_t len)
+{
+    if (m_goaway)
+    {
+        return;
+    }
+    m_input.append(data,len);
+
+    size_t pos = 0;
+    if (!m_preface)
+    {
+        size_t n = m_input.size() < PREFACE_LEN ? m_input.size() : PREFACE_LEN;
+        if (memcmp(m_input.data(),PREFACE,n) != 0)
+        {
+            connection_error(PROTOCOL_ERROR);
+            m_input.clear();
+            return;
+        }
+        if (n < PREFACE_LEN)
+        {
+            return;
+        }
+        m_preface = true;
+        pos = PREFACE_LEN;
+    }
+
+    while (!m_goaway && m_input.size() - pos >= FRAME_HEADER_LEN)
+    {
+        const unsigned char *p = (const unsigned char *)m_input.data() + pos;
+        size_t length = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (length > MAX_FRAME_SIZE)
+        {
+            connection_error(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (m_input.size() - pos - FRAME_HEADER_LEN < length)
+        {
+            // 帧还不完整
+            break;
+        }
+        on_frame(p[3],p[4],get32(p + 5) & 0x7fffffff,p + FRAME_HEADER_LEN,length);
+        pos += FRAME_HEADER_LEN + length;
+    }
+
+    if (m_goaway)
+    {
+        m_input.clear();
+    }
+    else
+    {
+        m_input.erase(0,pos);
+    }
+}
+
+
+void http2_session::on_frame(int type,int flags,unsigned int id,const unsigned char *payload,size_t len)
+{
+    // 头部块必须连续，中间不能插入其他帧
+    if (m_continuation && type != FRAME_CONTINUATION)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type)
+    {
+        case FRAME_DATA:
+            on_data(flags,id,len);
+            break;
+        case FRAME_HEADERS:
+            on_headers(flags,id,payload,len);
+            break;
+        case FRAME_PRIORITY:
+            // 不按优先级调度，各流轮流发送
+            if (len != 5)
+            {
+                reset_stream(id,FRAME_SIZE_ERROR);
+            }
+            break;
+        case FRAME_RST_STREAM:
+            if (id == 0)
+            {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            if (len != 4)
+            {
+                connection_error(FRAME_SIZE_ERROR);
+                return;
+            }
+            m_uploading.erase(id);
+            if (http2_stream *s = find(id))
+            {
+                retire(s);
+            }
+            break;
+        case FRAME_SETTINGS:
+            if (id != 0)
+            {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            if (flags & FLAG_ACK)
+            {
+                if (len != 0)
+                {
+                    connection_error(FRAME_SIZE_ERROR);
+                }
+                return;
+            }
+            if (apply_settings(payload,len))
+            {
+                frame_header(0,FRAME_SETTINGS,FLAG_ACK,0);
+            }
+            break;
+        case FRAME_PUSH_PROMISE:
+            // 客户端不能推送
+            connection_error(PROTOCOL_ERROR);
+            break;
+        case FRAME_PING:
+            if (id != 0)
+            {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            if (len != 8)
+            {
+                connection_error(FRAME_SIZE_ERROR);
+                return;
+            }
+            if (!(flags & FLAG_ACK))
+            {
+                frame_header(8,FRAME_PING,FLAG_ACK,0);
+                m_control.append((const char *)payload,8);
+            }
+            break;
+        case FRAME_GOAWAY:
+            if (id != 0)
+            {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            // 已经开始的流继续发送完
+            m_peer_goaway = true;
+            break;
+        case FRAME_WINDOW_UPDATE:
+            on_window_update(id,payload,len);
+            break;
+        case FRAME_CONTINUATION:
+            if (id == 0 || id != m_continuation)
+            {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            if (m_header_block.size() + len > MAX_HEADER_BLOCK)
+            {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            m_header_block.append((const char *)payload,len);
+            if (flags & FLAG_END_HEADERS)
+            {
+                m_continuation = 0;
+                on_header_block(id);
+            }
+            break;
+        default:
+            // 未知类型的帧必须忽略
+            break;
+    }
+}
+
+
+void http2_session::on_headers(int flags,unsigned int id,const unsigned char *payload,size_t len)
+{
+    // 客户端发起的流使用奇数 id
+    if (id == 0 || !(id & 1))
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+
+    size_t pad = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        pad = payload[0];
+        payload++;
+        len--;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        if (len < 5)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        payload += 5;
+        len -= 5;
+    }
+    if (pad > len)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    len -= pad;
+
+    // 新的流没有 END_STREAM 时之后还有请求体；已有流上带 END_STREAM 的 trailer 结束请求体
+    if (!(flags & FLAG_END_STREAM))
+    {
+        if (id > m_last_stream)
+        {
+            m_uploading[id] = false;
+        }
+    }
+    else
+    {
+        m_uploading.erase(id);
+    }
+
+    m_header_block.assign((const char *)payload,len);
+    if (flags & FLAG_END_HEADERS)
+    {
+        on_header_block(id);
+    }
+    else
+    {
+        m_continuation = id;
+    }
+}
+
+
+// 请求体被丢弃，只归还流量控制窗口，让客户端可以把它发完
+// 流的状态按 RFC 7540 5.1：idle 的流上不能有 DATA；客户端已经用 END_STREAM 结束发送的流
+// （half-closed (remote) 与 closed）上的 DATA 以 STREAM_CLOSED 拒绝
+void http2_session::on_data(int flags,unsigned int id,size_t len)
+{
+    if (id == 0 || id > m_last_stream)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    // 帧总是计入连接级的窗口，即使流已经结束
+    if (len > 0)
+    {
+        send_window_update(0,len);
+    }
+
+    std::unordered_map<unsigned int,bool>::iterator it = m_uploading.find(id);
+    if (it == m_uploading.end())
+    {
+        // 还在回复的流是 half-closed (remote)，只重置这个流；已经结束的流是 closed，按连接错误处理
+        if (find(id))
+        {
+            reset_stream(id,STREAM_CLOSED);
+        }
+        else
+        {
+            connection_error(STREAM_CLOSED);
+        }
+        return;
+    }
+
+    // 本端已经重置的流上，对端在收到 RST_STREAM 之前发出的帧直接忽略
+    bool reset = it->second;
+    if (flags & FLAG_END_STREAM)
+    {
+        m_uploading.erase(it);
+    }
+    else if (len > 0 && !reset)
+    {
+        send_window_update(id,len);
+    }
+}
+
+
+void http2_session::on_header_block(unsigned int id)
+{
+    // 即使请求随后被拒绝也必须解码，保持动态表与客户端一致
+    std::vector<hpack_header> headers;
+    bool ok = m_decoder.decode((const unsigned char *)m_header_block.data(),m_header_block.size(),headers);
+    m_header_block.clear();
+    if (!ok)
+    {
+        connection_error(COMPRESSION_ERROR);
+        return;
+    }
+
+    if (id <= m_last_stream)
+    {
+        // 已有流上的头部块只能是请求体之后的 trailer，忽略
+        return;
+    }
+    m_last_stream = id;
+
+    if (m_peer_goaway || m_streams.size() >= MAX_CONCURRENT_STREAMS)
+    {
+        reset_stream(id,REFUSED_STREAM);
+        return;
+    }
+
+    http2_request req;
+    bool valid = true;
+    for (size_t i = 0; i < headers.size(); i++)
+    {
+        const hpack_header &h = headers[i];
+        for (size_t j = 0; j < h.name.size(); j++)
+        {
+            // HTTP/2 的头部名必须是小写
+            if (h.name[j] >= 'A' && h.name[j] <= 'Z')
+            {
+                valid = false;
+            }
+        }
+
+        if (h.name == ":method")
+        {
+            req.method = h.value;
+        }
+        else if (h.name == ":path")
+        {
+            req.path = h.value;
+        }
+        else if (h.name == "accept-encoding")
+        {
+            if (!req.accept_encoding.empty())
+            {
+                req.accept_encoding += ", ";
+            }
+            req.accept_encoding += h.value;
+        }
+        else if (h.name == "range")
+        {
+            req.range = h.value;
+        }
+        else if (h.name == "if-range")
+        {
+            req.if_range = h.value;
+        }
+    }
+
+    if (!valid || req.method.empty() || req.path.empty())
+    {
+        reset_stream(id,PROTOCOL_ERROR);
+        return;
+    }
+
+    http2_stream *s = open_stream(id);
+    if (!s)
+    {
+        reset_stream(id,REFUSED_STREAM);
+        return;
+    }
+    m_conn->serve_h2(s,req);
+}
+
+
+bool http2_session::apply_settings(const unsigned char *payload,size_t len)
+{
+    if (len % 6 != 0)
+    {
+        connection_error(FRAME_SIZE_ERROR);
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i += 6)
+    {
+        int id = (payload[i] << 8) | payload[i + 1];
+        unsigned int value = get32(payload + i + 2);
+        switch (id)
+        {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                m_encoder.set_max_size(value);
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if (value > 1)
+                {
+                    connection_error(PROTOCOL_ERROR);
+                    return false;
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+            {
+                if (value > MAX_WINDOW)
+                {
+                    connection_error(FLOW_CONTROL_ERROR);
+                    return false;
+                }
+                // 新的初始窗口按差值作用于所有已经打开的流
+                long delta = (long)value - m_peer_initial_window;
+                std::unordered_map<unsigned int,http2_stream *>::iterator it = m_streams.begin();
+                for (; it != m_streams.end(); ++it)
+                {
+                    it->second->window += delta;
+                    if (it->second->window > MAX_WINDOW)
+                    {
+                        connection_error(FLOW_CONTROL_ERROR);
+                        return false;
+                    }
+                }
+                m_peer_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < 16384 || value > 16777215)
+                {
+                    connection_error(PROTOCOL_ERROR);
+                    return false;
+                }
+                m_peer_max_frame = value;
+                break;
+            default:
+                // 未知的设置项必须忽略
+                break;
+        }
+    }
+    return true;
+}
+
+
+void http2_session::on_window_update(unsigned int id,const unsigned char *payload,size_t len)
+{
+    if (len != 4)
+    {
+        connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+
+    long increment = get32(payload) & 0x7fffffff;
+    if (id == 0)
+    {
+        if (increment == 0)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        m_send_window += increment;
+        if (m_send_window > MAX_WINDOW)
+        {
+            connection_error(FLOW_CONTROL_ERROR);
+        }
+        return;
+    }
+
+    if (increment == 0)
+    {
+        reset_stream(id,PROTOCOL_ERROR);
+        return;
+    }
+
+    // 已经结束的流上的窗口更新直接忽略
+    http2_stream *s = find(id);
+    if (s)
+    {
+        s->window += increment;
+        if (s->window > MAX_WINDOW)
+        {
+            reset_stream(id,FLOW_CONTROL_ERROR);
+        }
+    }
+}
+
+
+void http2_session::respond(http2_stream *s,const std::vector<hpack_header> &headers)
+{
+    std::string block;
+    m_encoder.begin(block);
+    for (size_t i = 0; i < headers.size(); i++)
+    {
+        m_encoder.encode(block,headers[i].name,headers[i].value,!volatile_header(headers[i].name));
+    }
+
+    // 超过对端最大帧的头部块拆成 HEADERS + CONTINUATION
+    bool end = (s->remaining == 0);
+    size_t off = 0;
+    do
+    {
+        size_t n = block.size() - off;
+        if (n > m_peer_max_frame)
+        {
+            n = m_peer_max_frame;
+        }
+        int flags = (off + n == block.size()) ? FLAG_END_HEADERS : 0;
+        if (off == 0 && end)
+        {
+            flags |= FLAG_END_STREAM;
+        }
+        frame_header(n,off == 0 ? FRAME_HEADERS : FRAME_CONTINUATION,flags,s->id);
+        m_control.append(block,off,n);
+        off += n;
+    } while (off < block.size());
+
+    if (end)
+    {
+        retire(s);
+    }
+    else
+    {
+        m_active.push_back(s);
+    }
+}
+
+
+void http2_session::fill(output_queue &out)
+{
+    // 输出队列已经发送完，之前结束的流不再被引用
+    for (size_t i = 0; i < m_retired.size(); i++)
+    {
+        release(m_retired[i]);
+    }
+    m_retired.clear();
+
+    if (!m_control.empty())
+    {
+        out.push_copy(m_control.data(),m_control.size());
+        m_control.clear();
+    }
+
+    // 各流每轮发送一个 DATA 帧，直到窗口或本次的预算用完
+    // 升级的连接在收到客户端的连接前言之前只发送控制帧与响应头，有的客户端在 101 之后只能缓存有限的数据
+    size_t budget = FILL_BUDGET;
+    bool progress = m_preface;
+    while (progress && budget > 0 && m_send_window > 0)
+    {
+        progress = false;
+        std::list<http2_stream *>::iterator it = m_active.begin();
+        while (it != m_active.end() && budget > 0 && m_send_window > 0)
+        {
+            http2_stream *s = *it;
+            if (s->window <= 0)
+            {
+                ++it;
+                continue;
+            }
+
+            size_t n = s->remaining;
+            if (n > m_peer_max_frame)
+            {
+                n = m_peer_max_frame;
+            }
+            if ((long)n > s->window)
+            {
+                n = s->window;
+            }
+            if ((long)n > m_send_window)
+            {
+                n = m_send_window;
+            }
+            if (n > budget)
+            {
+                n = budget;
+            }
+
+            bool end = (n == s->remaining);
+            unsigned char head[FRAME_HEADER_LEN];
+            put_frame_header(head,n,FRAME_DATA,end ? FLAG_END_STREAM : 0,s->id);
+            out.push_copy((const char *)head,sizeof(head));
+            // 一个帧可以跨过多个段
+            for (size_t left = n; left > 0; )
+            {
+                if (s->chunk == 0)
+                {
+                    s->data = s->parts[s->next_part].data;
+                    s->chunk = s->parts[s->next_part].len;
+                    s->next_part++;
+                    continue;
+                }
+                size_t k = left < s->chunk ? left : s->chunk;
+                out.push(s->data,k);
+                s->data += k;
+                s->chunk -= k;
+                left -= k;
+            }
+
+            s->remaining -= n;
+            s->window -= n;
+            m_send_window -= n;
+            budget -= n;
+            progress = true;
+
+            if (end)
+            {
+                // 最后一个 DATA 帧还在输出队列中，下一次 fill() 时释放
+                it = m_active.erase(it);
+                m_streams.erase(s->id);
+                m_retired.push_back(s);
+                end_upload(s->id);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+}
+
+
+bool http2_session::want_write() const
+{
+    if (!m_control.empty())
+    {
+        return true;
+    }
+    if (!m_preface || m_send_window <= 0)
+    {
+        return false;
+    }
+    std::list<http2_stream *>::const_iterator it = m_active.begin();
+    for (; it != m_active.end(); ++it)
+    {
+        if ((*it)->window > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void http2_session::frame_header(size_t len,int type,int flags,unsigned int id)
+{
+    unsigned char head[FRAME_HEADER_LEN];
+    put_frame_header(head,len,type,flags,id);
+    m_control.append((const char *)head,sizeof(head));
+}
+
+
+void http2_session::send_window_update(unsigned int id,unsigned int increment)
+{
+    unsigned char payload[4];
+    put32(payload,increment);
+    frame_header(sizeof(payload),FRAME_WINDOW_UPDATE,0,id);
+    m_control.append((const char *)payload,sizeof(payload));
+}
+
+
+void http2_session::reset_stream(unsigned int id,int code)
+{
+    unsigned char payload[4];
+    put32(payload,code);
+    frame_header(sizeof(payload),FRAME_RST_STREAM,0,id);
+    m_control.append((const char *)payload,sizeof(payload));
+
+    std::unordered_map<unsigned int,bool>::iterator it = m_uploading.find(id);
+    if (it != m_uploading.end() && !it->second)
+    {
+        it->second = true;
+        m_reset_uploads.push_back(id);
+        if (m_reset_uploads.size() > MAX_CONCURRENT_STREAMS)
+        {
+            m_uploading.erase(m_reset_uploads.front());
+            m_reset_uploads.pop_front();
+        }
+    }
+
+    http2_stream *s = find(id);
+    if (s)
+    {
+        retire(s);
+    }
+}
+
+
+void http2_session::connection_error(int code)
+{
+    if (m_goaway)
+    {
+        return;
+    }
+
+    unsigned char payload[8];
+    put32(payload,m_last_stream);
+    put32(payload + 4,code);
+    frame_header(sizeof(payload),FRAME_GOAWAY,0,0);
+    m_control.append((const char *)payload,sizeof(payload));
+    m_goaway = true;
+
+    // 连接在 GOAWAY 发出后关闭，不再发送任何流的响应体
+    std::unordered_map<unsigned int,http2_stream *>::iterator it = m_streams.begin();
+    for (; it != m_streams.end(); ++it)
+    {
+        m_retired.push_back(it->second);
+    }
+    m_streams.clear();
+    m_active.clear();
+}
+
+
+http2_stream *http2_session::find(unsigned int id)
+{
+    std::unordered_map<unsigned int,http2_stream *>::iterator it = m_streams.find(id);
+    return (it == m_streams.end()) ? NULL : it->second;
+}
+
+
+void http2_session::retire(http2_stream *s)
+{
+    m_streams.erase(s->id);
+    m_active.remove(s);
+    m_retired.push_back(s);
+    end_upload(s->id);
+}
+
+
+void http2_session::end_upload(unsigned int id)
+{
+    std::unordered_map<unsigned int,bool>::iterator it = m_uploading.find(id);
+    if (it != m_uploading.end() && !it->second)
+    {
+        reset_stream(id,NO_ERROR);
+    }
+}
+
+
+void http2_session::release(http2_stream *s)
+{
+    if (s->pack)
+    {
+        content_pack::release(s->pack);
+    }
+    if (s->cached)
+    {
+        response_cache::release(s->cached);
+    }
+    if (s->mapping)
+    {
+        http_conn::m_mmap_cache->release(s->mapping);
+    }
+    if (s->slice)
+    {
+        munmap(s->slice,s->slice_len);
+    }
+    if (s->entry)
+    {
+        open_file_cache::release(s->entry);
+    }
+    delete s;
+}
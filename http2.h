@@ -0,0 +1,209 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+#include <string>
+#include <list>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include "hpack.h"
+#include "output_queue.h"
+#include "open_file_cache.h"
+#include "mmap_cache.h"
+#include "response_cache.h"
+#include "content_pack.h"
+
+class http_conn;
+
+// HTTP/2 流上的一个请求，只取文件服务需要的头部（请求体被丢弃）
+struct http2_request
+{
+    std::string method;
+    std::string path;
+    std::string accept_encoding;
+    std::string range;
+    std::string if_range;
+};
+
+// 响应体中的一段连续内存
+struct http2_segment
+{
+    const char *data;
+    size_t len;
+};
+
+// 正在发送响应的流
+// 响应体通常是一块连续内存（共享映射、只映射了请求区间的映射、内容包、响应缓存对象或错误页），
+// multipart/byteranges 的响应体是分段头与文件片段交替的多段，
+// 流持有这些内存所属资源的引用，流结束且输出队列中它的 DATA 帧都发送完之后才释放
+struct http2_stream
+{
+    unsigned int id;
+    // 发送窗口，对端调小 SETTINGS_INITIAL_WINDOW_SIZE 时可以为负
+    long window;
+    // 尚未放入 DATA 帧的响应体：当前段从 data 开始还剩 chunk 字节，之后是 parts 中 next_part 起的各段，
+    // remaining 是所有段剩余的字节数
+    const char *data;
+    size_t chunk;
+    size_t remaining;
+    std::vector<http2_segment> parts;
+    size_t next_part;
+    // 注册的处理器生成的响应体或 multipart 的分段头，data 与 parts 指向其中
+    std::string body;
+
+    open_file_cache::entry *entry;
+    mmap_cache::mapping *mapping;
+    response_cache::object *cached;
+    content_pack *pack;
+    // 只映射了请求区间所在页的大文件，流释放时 munmap
+    char *slice;
+    size_t slice_len;
+};
+
+// 一个 HTTP/2 连接（RFC 7540）
+// 工作线程中 on_input() 解析帧，每个完整的请求交给 http_conn 按原来的流程生成响应，
+// 响应头编码后与 SETTINGS / PING 等控制帧一起放入待发送的控制缓冲区；
+// 主线程在输出队列发送完时调用 fill()，把控制帧和各个流的 DATA 帧（按流轮转、受流量控制窗口约束）放入输出队列
+// EPOLLONESHOT 保证同一时刻只有一个线程访问会话
+class http2_session
+{
+
+    public:
+
+        // 客户端连接前言
+        static const char PREFACE[];
+        static const size_t PREFACE_LEN = 24;
+
+        // 本端通告的并发流上限
+        static const unsigned int MAX_CONCURRENT_STREAMS = 100;
+        // 本端接受的最大帧（SETTINGS_MAX_FRAME_SIZE 的默认值）
+        static const size_t MAX_FRAME_SIZE = 16384;
+        // 一个头部块（HEADERS + CONTINUATION）的最大大小
+        static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+        // 一次 fill() 最多放入输出队列的 DATA 字节数，避免一次排队过多
+        static const size_t FILL_BUDGET = 256 * 1024;
+
+        explicit http2_session(http_conn *conn);
+        ~http2_session();
+
+        // h2c 升级：应用 HTTP2-Settings 头中的对端设置（base64url），格式错误时返回 false
+        bool upgrade(const char *settings);
+
+        // 创建流 id，升级时用于已经按 HTTP/1.1 解析过的请求（流 1）
+        http2_stream *open_stream(unsigned int id);
+
+        // 在工作线程中处理收到的字节
+        void on_input(const char *data,size_t len);
+
+        // 发送流 s 的响应头，s->data / s->chunk / s->parts 为响应体，remaining 为 0 时流随响应头结束
+        void respond(http2_stream *s,const std::vector<hpack_header> &headers);
+
+        // 在主线程中调用，输出队列必须为空：先释放已经发送完的流，再放入待发送的帧
+        void fill(output_queue &out);
+
+        // 是否有控制帧或可以发送的 DATA 帧
+        bool want_write() const;
+
+        // 连接应当在输出发送完之后关闭（已发出 GOAWAY，或对端 GOAWAY 后所有流都已结束）
+        bool closed() const { return m_goaway || ( m_peer_goaway && m_streams.empty() ); }
+
+    private:
+
+        // 帧类型
+        enum FRAME_TYPE
+        {
+            FRAME_DATA = 0,
+            FRAME_HEADERS,
+            FRAME_PRIORITY,
+            FRAME_RST_STREAM,
+            FRAME_SETTINGS,
+            FRAME_PUSH_PROMISE,
+            FRAME_PING,
+            FRAME_GOAWAY,
+            FRAME_WINDOW_UPDATE,
+            FRAME_CONTINUATION
+        };
+
+        // 错误码
+        enum ERROR_CODE
+        {
+            NO_ERROR = 0,
+            PROTOCOL_ERROR,
+            INTERNAL_ERROR,
+            FLOW_CONTROL_ERROR,
+            SETTINGS_TIMEOUT,
+            STREAM_CLOSED,
+            FRAME_SIZE_ERROR,
+            REFUSED_STREAM,
+            CANCEL,
+            COMPRESSION_ERROR
+        };
+
+        void on_frame(int type,int flags,unsigned int id,const unsigned char *payload,size_t len);
+        void on_data(int flags,unsigned int id,size_t len);
+        void on_headers(int flags,unsigned int id,const unsigned char *payload,size_t len);
+        void on_header_block(unsigned int id);
+        bool apply_settings(const unsigned char *payload,size_t len);
+        void on_window_update(unsigned int id,const unsigned char *payload,size_t len);
+
+        // 在控制缓冲区中追加帧头
+        void frame_header(size_t len,int type,int flags,unsigned int id);
+        void send_window_update(unsigned int id,unsigned int increment);
+        // 以 code 重置流，流不存在时只发送 RST_STREAM
+        void reset_stream(unsigned int id,int code);
+        // 连接错误：发送 GOAWAY 后不再处理任何帧
+        void connection_error(int code);
+
+        http2_stream *find(unsigned int id);
+        // 流结束或被重置：移出活动表，等输出队列发送完后释放
+        void retire(http2_stream *s);
+        // 响应已经发完而请求体还没有收完：以 NO_ERROR 重置流，让客户端停止发送（RFC 7540 8.1）
+        void end_upload(unsigned int id);
+        void release(http2_stream *s);
+
+    private:
+
+        http_conn *m_conn;
+
+        hpack_decoder m_decoder;
+        hpack_encoder m_encoder;
+
+        // 尚未凑成完整帧的输入
+        std::string m_input;
+        bool m_preface;
+
+        // 对端的设置
+        size_t m_peer_max_frame;
+        long m_peer_initial_window;
+
+        // 连接级发送窗口
+        long m_send_window;
+
+        // 客户端发起的最大流 id
+        unsigned int m_last_stream;
+
+        // 正在接收 CONTINUATION 的流，0 表示没有
+        unsigned int m_continuation;
+        std::string m_header_block;
+
+        // 尚未放入输出队列的控制帧与响应头
+        std::string m_control;
+
+        std::unordered_map<unsigned int,http2_stream *> m_streams;
+        // 客户端还在发送请求体（没有收到 END_STREAM）的流，值为 true 表示本端已经重置了这个流
+        // 未重置的流都还在 m_streams 中，受并发流上限约束；重置过的流只为忽略在途的 DATA 而保留，
+        // 按重置的先后记在 m_reset_uploads 中，超过 MAX_CONCURRENT_STREAMS 个时丢弃最早的
+        std::unordered_map<unsigned int,bool> m_uploading;
+        std::deque<unsigned int> m_reset_uploads;
+        // 还有响应体要发送的流，按顺序轮转
+        std::list<http2_stream *> m_active;
+        // 已经结束、但 DATA 帧可能还在输出队列中的流
+        std::vector<http2_stream *> m_retired;
+
+        bool m_goaway;
+        bool m_peer_goaway;
+
+};
+
+#endif
@@ -1,15 +1,28 @@
 #include "http_conn.h"
 
 // 定义HTTP响应的一些状态信息
+const char* ok_101_title = "Switching Protocols";
 const char* ok_200_title = "OK";
+const char* ok_206_title = "Partial Content";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form = "The requested method is not allowed for this resource.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_416_title = "Range Not Satisfiable";
+const char* error_416_form = "The requested range is not satisfiable.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unavailable or sent an invalid response.\n";
+const char* error_504_title = "Gateway Timeout";
+const char* error_504_form = "The upstream server did not respond in time.\n";
+
+// 错误页的 Content-Type，文件按扩展名查 MIME 表，内容包中的文件使用打包时记录的类型
+const char* default_content_type = "text/html";
 
 
 // 初始化静态变量
@@ -17,6 +30,39 @@ int http_conn::m_epollfd = -1;
 
 int http_conn::m_user_count = 0;
 
+long http_conn::m_sendfile_threshold = 256 * 1024;
+
+open_file_cache *http_conn::m_file_cache = NULL;
+
+mmap_cache *http_conn::m_mmap_cache = NULL;
+
+response_cache *http_conn::m_response_cache = NULL;
+
+bool http_conn::m_precompressed = true;
+
+int http_conn::m_gzip_level = 6;
+long http_conn::m_gzip_min_length = 256;
+long http_conn::m_gzip_max_length = 8 * 1024 * 1024;
+response_cache *http_conn::m_compressed_cache = NULL;
+
+bool http_conn::m_pack_mode = false;
+
+threadpool<http_conn::prefetch_task> *http_conn::m_io_pool = NULL;
+
+long http_conn::m_populate_max = 64 * 1024;
+
+long http_conn::m_dropbehind_threshold = 0;
+
+long http_conn::m_zerocopy_threshold = 0;
+
+tls_context *http_conn::m_tls_context = NULL;
+
+bool http_conn::m_http2 = true;
+
+http_conn::error_response http_conn::m_error_responses[ERROR_PAGES];
+
+cache_policy http_conn::m_cache_policy;
+
 
 // 网站根目录
 // 要请求资源的目录
@@ -82,6 +128,15 @@ void addfd(int epollfd,int fd,bool one_shot)
 
 
 
+// 关闭 Nagle 算法：用户态 TLS 的每个记录与 HTTP/2 每一批帧的最后一段都是不满一个报文段的写，
+// 在 Nagle 算法下要等到前面的数据被确认才发出，遇到对方的延迟确认会停顿约 40ms
+// 前面的段已经带 MSG_MORE 或拼成了完整的记录，关闭后不会产生大量小报文
+static void set_nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+}
+
 // 从 epoll 中删除监听的文件描述符
 void removefd(int epollfd,int fd)
 {
@@ -104,15 +159,26 @@ void modfd(int epollfd,int fd,int ev)
 
 
 // 初始化新接收的连接
-void http_conn::init(int sockfd,const sockaddr_in & addr)
+void http_conn::init(int sockfd,const sock_address & addr,bool tls)
 {
     m_sockfd = sockfd;
     m_address = addr;
 
+    m_ssl = tls ? m_tls_context->new_session(sockfd) : 0;
+    m_handshaking = (m_ssl != 0);
+    m_tls_rx = m_tls_tx = false;
+
     // 设置端口复用
     int reuse = 1;
     setsockopt(m_sockfd,SOL_SOCKET,SO_REUSEPORT,&reuse,sizeof(reuse));
 
+    m_zc_state = ZEROCOPY_UNKNOWN;
+    m_zc_sent = 0;
+    m_zc_done = 0;
+    m_zc_retired = 0;
+    m_pipe[0] = m_pipe[1] = -1;
+    m_pipe_bytes = 0;
+
     // 添加到 epoll
     addfd(m_epollfd,m_sockfd,true);
     m_user_count++; // 总用户数 +1
@@ -121,12 +187,229 @@ void http_conn::init(int sockfd,const sockaddr_in & addr)
 }
 
 
+// 由 inotify 监视线程调用
+void http_conn::invalidate(const std::string &path,bool subtree)
+{
+    if (subtree)
+    {
+        m_file_cache->invalidate_prefix(path);
+        m_response_cache->invalidate_prefix(path);
+        m_compressed_cache->invalidate_prefix(path);
+        return;
+    }
+
+    m_file_cache->invalidate(path);
+    m_response_cache->invalidate(path);
+    m_compressed_cache->invalidate(path + "#gzip");
+    m_compressed_cache->invalidate(path + "#deflate");
+}
+
+void http_conn::on_watch_lost()
+{
+    fprintf(stderr,"file watcher lost, falling back to ttl revalidation\n");
+    m_file_cache->set_trusted(false);
+}
+
+
+bool http_conn::warm(const char *url)
+{
+    char url_buf[FILENAME_LEN];
+    char accept[] = "br, gzip, deflate";
+    char* encodings[2] = { NULL, accept };
+    bool ok = false;
+
+    // 连接对象带有读写缓冲区，放在堆上
+    http_conn* conn = new http_conn;
+    for (int i = 0; i < 2; i++)
+    {
+        conn->init();
+        snprintf(url_buf,sizeof(url_buf),"%s",url);
+        conn->m_url = url_buf;
+        conn->m_accept_encoding = encodings[i];
+
+        HTTP_CODE ret = conn->do_request();
+        if (ret != FILE_REQUEST)
+        {
+            break;
+        }
+        ok = true;
+
+        // 大文件只让内容进入页缓存
+        if (conn->m_file_fd != -1)
+        {
+            readahead(conn->m_file_fd,0,conn->m_file_stat.st_size);
+        }
+
+        // 小文件放入响应缓存，文本文件压缩后放入压缩结果缓存
+        conn->process_write(ret);
+        if (conn->m_file_address && !conn->m_cached)
+        {
+            madvise(conn->m_file_address,conn->m_file_stat.st_size,MADV_WILLNEED);
+        }
+        conn->m_out.clear();
+        conn->unmap();
+    }
+    conn->reset_request();
+    delete conn;
+
+    return ok;
+}
+
+
+// 在主线程启动阶段调用，之后只读
+bool http_conn::build_error_responses(const char *dir)
+{
+    static const struct
+    {
+        int status;
+        const char *name;
+        const char **form;
+    } pages[ERROR_PAGES] = {
+        { 400, "400.html", &error_400_form },
+        { 403, "403.html", &error_403_form },
+        { 404, "404.html", &error_404_form },
+        { 405, "405.html", &error_405_form },
+        { 500, "500.html", &error_500_form },
+        { 502, "502.html", &error_502_form },
+        { 504, "504.html", &error_504_form },
+    };
+
+    for (int i = 0; i < ERROR_PAGES; i++)
+    {
+        std::string body = *pages[i].form;
+        const char *type = default_content_type;
+
+        if (dir)
+        {
+            std::string path = std::string(dir) + "/" + pages[i].name;
+            int fd = open(path.c_str(),O_RDONLY | O_CLOEXEC);
+            if (fd >= 0)
+            {
+                // 页面按 fstat 的大小整体读入，超过上限的页面在启动时报错，不截断发送
+                struct stat st;
+                if (fstat(fd,&st) != 0 || !S_ISREG(st.st_mode) || st.st_size > ERROR_PAGE_MAX)
+                {
+                    fprintf(stderr,"%s: not a regular file of at most %ld bytes\n",path.c_str(),ERROR_PAGE_MAX);
+                    close(fd);
+                    return false;
+                }
+                std::string page(st.st_size,'\0');
+                size_t got = 0;
+                while (got < page.size())
+                {
+                    ssize_t n = ::read(fd,&page[got],page.size() - got);
+                    if (n < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (n <= 0)
+                    {
+                        break;
+                    }
+                    got += n;
+                }
+                close(fd);
+                if (got != page.size())
+                {
+                    fprintf(stderr,"%s: short read\n",path.c_str());
+                    return false;
+                }
+                body.swap(page);
+                type = "text/html; charset=utf-8";
+            }
+        }
+
+        char length[DECIMAL_LEN];
+        size_t length_len = format_decimal(length,body.size());
+        header_fragment line = status_line(pages[i].status);
+
+        std::string &r = m_error_responses[i].head;
+        r.assign(line.data,line.len);
+        r.append(HDR_CONTENT_LENGTH.data,HDR_CONTENT_LENGTH.len);
+        r.append(length,length_len);
+        r.append(CRLF.data,CRLF.len);
+        r.append(HDR_CONTENT_TYPE.data,HDR_CONTENT_TYPE.len);
+        r.append(type);
+        r.append(CRLF.data,CRLF.len);
+        if (pages[i].status == 405)
+        {
+            r.append(HDR_ALLOW.data,HDR_ALLOW.len);
+        }
+        m_error_responses[i].body = body;
+        m_error_responses[i].type = type;
+    }
+    return true;
+}
+
+
 // 关闭连接
 void http_conn::close_conn()
 {
 
     if (m_sockfd != -1)
     {
+        // 连接可能在发送途中被关闭，释放映射区或打开的文件
+        // HTTP/2 的输出队列指向各个流持有的内存，先清空队列再释放会话
+        m_out.clear();
+        delete m_h2;
+        m_h2 = 0;
+        if (m_proxy)
+        {
+            // 转发途中关闭：上游连接上还有未读完的响应，不能放回连接池
+            if (m_proxy->conn)
+            {
+                upstream_group::release(m_proxy->conn,false);
+            }
+            delete m_proxy;
+            m_proxy = 0;
+        }
+        if (m_fcgi)
+        {
+            // 请求已经交给应用时由连接继续持有到 END_REQUEST
+            fcgi_backend::detach(m_fcgi);
+            m_fcgi = 0;
+        }
+        if (m_async)
+        {
+            // 处理器还没有完成时由它在 finish() 中释放
+            router::cancel(m_async);
+            m_async = 0;
+        }
+        if (m_events)
+        {
+            event_channel::detach(m_events);
+            delete m_events;
+            m_events = 0;
+        }
+        if (m_ws)
+        {
+            m_ws->handler()->on_close(m_ws);
+            delete m_ws;
+            m_ws = 0;
+        }
+        unmap();
+        if (m_zc_retired)
+        {
+            // 仍在发送的页面由内核持有引用，释放只读映射不影响这些页面
+            m_mmap_cache->release(m_zc_retired);
+            m_zc_retired = 0;
+        }
+        if (m_pipe[0] != -1)
+        {
+            close(m_pipe[0]);
+            close(m_pipe[1]);
+            m_pipe[0] = m_pipe[1] = -1;
+        }
+        if (m_ssl)
+        {
+            // 尽力发送 close_notify，不等待对方的回应
+            if (!m_handshaking)
+            {
+                SSL_shutdown(m_ssl);
+            }
+            SSL_free(m_ssl);
+            m_ssl = 0;
+        }
         removefd(m_epollfd,m_sockfd);
         m_sockfd = -1;
         m_user_count--;
@@ -144,6 +427,17 @@ void http_conn::init()
     m_start_line = 0;
     // 初始接收数据也是从 0 开始
     m_read_idx = 0;
+
+    reset_request();
+    m_out.clear();
+
+    bzero(m_read_buf,READ_BUFFER_SIZE);
+    bzero(m_write_buf,WRITE_BUFFER_SIZE);
+    bzero(m_real_file,FILENAME_LEN);
+}
+
+void http_conn::reset_request()
+{
     // 默认不保持链接  Connection : keep-alive保持连接
     m_linger = false;       
 
@@ -153,18 +447,46 @@ void http_conn::init()
     m_version = 0;
     m_linger = false;
     m_content_length = 0;
+    m_content_length_seen = false;
+    m_body_bytes = 0;
     m_host = 0;
-    m_start_line = 0;
-    m_checked_index = 0;
-    m_read_idx = 0;
+    m_range = 0;
+    m_if_range = 0;
+    m_upgrade_h2c = false;
+    m_http2_settings = 0;
+    m_upgrade_websocket = false;
+    m_websocket_key = 0;
+    m_websocket_version = 0;
+    m_last_event_id = 0;
+    m_method_name = 0;
+    m_proxy_route = 0;
+    m_fcgi_route = 0;
+    delete m_route;
+    m_route = 0;
+    m_proxy_head.clear();
+    m_proxy_continue = false;
+    m_accept_encoding = 0;
+    m_content_encoding = 0;
+    m_compress = 0;
+    m_content_type = default_content_type;
+    m_max_age = -1;
+    m_immutable = false;
+    m_range_count = 0;
+    m_file_address = 0;
+    m_mapping = 0;
+    m_file_entry = 0;
+    m_cached = 0;
+    m_pack = 0;
+    m_file_fd = -1;
+    m_file_offset = 0;
+    m_transmit = TRANSMIT_SENDFILE;
+    m_resident_until = 0;
+    m_advised_until = 0;
+    m_dropped_until = 0;
     m_write_idx = 0;
 
     bytes_to_send = 0;
     bytes_have_send = 0;
-
-    bzero(m_read_buf,READ_BUFFER_SIZE);
-    bzero(m_write_buf,WRITE_BUFFER_SIZE);
-    bzero(m_real_file,FILENAME_LEN);
 }
 
 
@@ -179,9 +501,36 @@ bool http_conn::read()
         return false;
     }
 
+    if (m_ws)
+    {
+        m_ws->unpark();
+    }
+
     // 读取到的字节
     int bytes_read = 0;
 
+    while (m_tls_rx)
+    {
+        // 接收方向没有交给内核，由 OpenSSL 解密
+        bytes_read = SSL_read(m_ssl,m_read_buf + m_read_idx,READ_BUFFER_SIZE - m_read_idx);
+        if (bytes_read <= 0)
+        {
+            int err = SSL_get_error(m_ssl,bytes_read);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            {
+                return true;
+            }
+            // 对端关闭或出错
+            return false;
+        }
+
+        m_read_idx += bytes_read;
+        if (m_read_idx >= READ_BUFFER_SIZE)
+        {
+            return true;
+        }
+    }
+
     while (true)
     {
         bytes_read = recv(m_sockfd,m_read_buf + m_read_idx,READ_BUFFER_SIZE - m_read_idx,0);
@@ -202,9 +551,17 @@ bool http_conn::read()
         }
 
         m_read_idx += bytes_read;
+        if (m_read_idx >= READ_BUFFER_SIZE)
+        {
+            // 读缓冲区满了，其余的数据在处理完这些之后再读
+            break;
+        }
     }
 
-    printf("读取到的数据为：%s\n",m_read_buf);
+    if (!m_h2 && !m_ws && !m_proxy && !m_fcgi)
+    {
+        printf("读取到的数据为：%s\n",m_read_buf);
+    }
     return true;
 }
 
@@ -255,6 +612,10 @@ http_conn::HTTP_CODE http_conn::process_read()                   // 解析 HTTP
                     // 进一步解析具体的请求信息
                     return do_request();
                 }
+                else if (ret == PROXY_REQUEST)
+                {
+                    return PROXY_REQUEST;
+                }
                 break;
             }
 
@@ -298,14 +659,20 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)   // 解析 HTTP
     *m_url++ = '\0';
 
     char *method = text;
+    m_method_name = method;
     // 忽略大小写的比较
     if ( strcasecmp(method,"GET") == 0)
     {
         m_method = GET;
     }
+    else if ( strcasecmp(method,"HEAD") == 0)
+    {
+        m_method = HEAD;
+    }
     else
     {
-        return BAD_REQUEST;
+        // 其余方法（POST / PUT / PATCH 等）只在代理时接受，原文在 m_method_name 中
+        m_method = POST;
     }
     
     // /index.html HTTP/1.1
@@ -334,6 +701,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)   // 解析 HTTP
         return BAD_REQUEST;
     }
 
+    // 代理路由上的请求转发给上游，FastCGI 路由上的请求交给应用；
+    // 其余请求不论方法都交给注册的处理器，由处理器（静态文件为 do_request）决定是否返回 405
+    m_proxy_route = upstream_group::match(m_url);
+    if (!m_proxy_route)
+    {
+        m_fcgi_route = fcgi_backend::match(m_url);
+    }
+
     // 至此 http 包的请求首行解析完毕
     // 将状态机推至检查请求头
     m_check_state = CHECK_STATE_HEADER;
@@ -345,6 +720,12 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)   // 解析 HTTP
 http_conn::HTTP_CODE http_conn::parse_headers(char *text)        // 解析 HTTP 头
 {
 
+    if (m_proxy_route || m_fcgi_route)
+    {
+        // 代理与 FastCGI 的请求：请求头结束后立即开始转发，请求体边读边发送
+        return text[0] == '\0' ? PROXY_REQUEST : proxy_header(text);
+    }
+
     if (text[0] == '\0')
     {
         // 若请求首行后的第一个字符为 \0 就说明没有请求头
@@ -378,8 +759,10 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)        // 解析 HTTP
     {
         // 处理 Content-Length 头部字段
         text += 15;
-        text += strspn(text," \t");
-        m_content_length = atol(text);
+        if (!set_content_length(text))
+        {
+            return BAD_REQUEST;
+        }
     }   
     else if (strncasecmp(text,"Host:",5) == 0)
     {
@@ -388,6 +771,67 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)        // 解析 HTTP
         text += strspn(text," \t");
         m_host = text;
     }
+    else if (strncasecmp(text,"Range:",6) == 0)
+    {
+        // 处理 Range 头部字段
+        // Range: bytes=0-499
+        text += 6;
+        text += strspn(text," \t");
+        m_range = text;
+    }
+    else if (strncasecmp(text,"Accept-Encoding:",16) == 0)
+    {
+        // 处理 Accept-Encoding 头部字段
+        // Accept-Encoding: gzip, deflate, br;q=0.9
+        text += 16;
+        text += strspn(text," \t");
+        m_accept_encoding = text;
+    }
+    else if (strncasecmp(text,"If-Range:",9) == 0)
+    {
+        // 处理 If-Range 头部字段
+        // If-Range: "5f3a-1c2b" 或 If-Range: Wed, 21 Oct 2015 07:28:00 GMT
+        text += 9;
+        text += strspn(text," \t");
+        m_if_range = text;
+    }
+    else if (strncasecmp(text,"Upgrade:",8) == 0)
+    {
+        // 处理 Upgrade 头部字段
+        // Upgrade: h2c 或 Upgrade: websocket
+        text += 8;
+        text += strspn(text," \t");
+        m_upgrade_h2c = (strcasecmp(text,"h2c") == 0);
+        m_upgrade_websocket = (strcasecmp(text,"websocket") == 0);
+    }
+    else if (strncasecmp(text,"Sec-WebSocket-Key:",18) == 0)
+    {
+        // 处理 Sec-WebSocket-Key 头部字段，16 字节随机数的 base64
+        text += 18;
+        text += strspn(text," \t");
+        m_websocket_key = text;
+    }
+    else if (strncasecmp(text,"Sec-WebSocket-Version:",22) == 0)
+    {
+        // 处理 Sec-WebSocket-Version 头部字段，RFC 6455 为 13
+        text += 22;
+        text += strspn(text," \t");
+        m_websocket_version = atoi(text);
+    }
+    else if (strncasecmp(text,"Last-Event-ID:",14) == 0)
+    {
+        // 处理 Last-Event-ID 头部字段，EventSource 重连时带上收到的最后一个事件的 id
+        text += 14;
+        text += strspn(text," \t");
+        m_last_event_id = text;
+    }
+    else if (strncasecmp(text,"HTTP2-Settings:",15) == 0)
+    {
+        // 处理 HTTP2-Settings 头部字段，值为 base64url 编码的 SETTINGS 帧载荷
+        text += 15;
+        text += strspn(text," \t");
+        m_http2_settings = text;
+    }
     else
     {
         printf("unkonwn headers %s\n",text);
@@ -462,253 +906,3267 @@ http_conn::LINE_STATUS http_conn::parse_line()
 // 映射到内存地址m_file_address处，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
+    // HTTP/2 的流不经过 parse_request_line，代理与 FastCGI 路由只能以 HTTP/1.1 转发
+    if ( m_h2 && ( upstream_group::match( m_url ) || fcgi_backend::match( m_url ) ) )
+    {
+        return BAD_GATEWAY;
+    }
 
-    // /Desktop
-    strcpy( m_real_file, doc_root );
+    // WebSocket 端点只接受握手请求（HTTP/2 上不支持 WebSocket）
+    if ( websocket_session::endpoint( m_url ) )
+    {
+        if ( m_method == GET && m_upgrade_websocket && m_websocket_key && strlen( m_websocket_key ) == 24
+             && m_websocket_version == 13 && !m_h2 )
+        {
+            return WEBSOCKET_REQUEST;
+        }
+        return BAD_REQUEST;
+    }
+
+    // 注册的处理器：健康检查、统计等端点，其余请求由静态文件的处理器交回下面的流程
+    route_request req;
+    const char* query = strchr( m_url, '?' );
+    size_t path_len = query ? query - m_url : strlen( m_url );
+    route_handler* handler = router::match( m_url, path_len, req );
+    if ( !handler )
+    {
+        return NO_RESOURCE;
+    }
+    req.path = m_url;
+    req.path_len = path_len;
+    req.query = query ? query + 1 : 0;
+    HTTP_CODE routed = do_route( handler, req );
+    if ( routed != FILE_REQUEST )
+    {
+        return routed;
+    }
+    if ( m_method != GET && m_method != HEAD )
+    {
+        return METHOD_NOT_ALLOWED;
+    }
+
+    // /Desktop，文件路径不含查询串（/app.js?v=3 发送 /app.js）
     int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) 
+    if ( len + path_len >= FILENAME_LEN )
+    {
+        return NO_RESOURCE;
+    }
+    strcpy( m_real_file, doc_root );
+    memcpy( m_real_file + len, m_url, path_len );
+    m_real_file[ len + path_len ] = '\0';
+    const char* path = m_real_file + len;
+
+    if ( m_pack_mode )
+    {
+        content_pack* pack = content_pack::acquire();
+        if ( !pack )
+        {
+            return INTERNAL_ERROR;
+        }
+        return do_pack_request( pack, path, path_len );
+    }
+
+    // 按请求的路径（而不是选中的预压缩文件）决定类型与缓存策略
+    m_content_type = mime_type( path );
+    m_cache_policy.lookup( path, m_max_age, m_immutable );
+
+    // 从打开文件缓存中获取文件的 fd 与状态信息，热点文件不再需要 stat / open / close
+    m_file_entry = m_file_cache->acquire( m_real_file );
+    if ( !m_file_entry )
+    {
+        return INTERNAL_ERROR;
+    }
+
+    // stat 失败
+    if ( m_file_entry->err != 0 )
     {
+        unmap();
         return NO_RESOURCE;
     }
+    m_file_stat = m_file_entry->st;
 
     // 判断访问权限
     if ( ! ( m_file_stat.st_mode & S_IROTH ) ) 
     {
+        unmap();
         return FORBIDDEN_REQUEST;
     }
 
     // 判断是否是目录
     if ( S_ISDIR( m_file_stat.st_mode ) ) 
     {
+        unmap();
         return BAD_REQUEST;
     }
 
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
-    // 创建内存映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
-    return FILE_REQUEST;
-
-}
-
-
-// 对内存映射区执行munmap操作
-void http_conn::unmap() 
-{
-    if( m_file_address )
+    // 文件无法以只读方式打开
+    if ( m_file_entry->fd < 0 )
     {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+        unmap();
+        return FORBIDDEN_REQUEST;
     }
-}
 
-// 写HTTP响应
-bool http_conn::write()
-{
-    int temp = 0;
-    
-    if ( bytes_to_send == 0 ) 
+    // 客户端接受压缩时换成预压缩的版本，之后的流程与原文件完全相同
+    if ( m_precompressed && m_accept_encoding )
     {
-        // 将要发送的字节为0，这一次响应结束。
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
-        init();
-        return true;
+        select_precompressed();
     }
 
-    while(1) 
+    // 没有预压缩版本的文本文件即时压缩，压缩结果按 (路径, 修改时间, 编码) 缓存，每个文件只压缩一次
+    if ( select_compression() )
     {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
-        if ( temp <= -1 ) {
-            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
-            // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
-            if( errno == EAGAIN ) 
-            {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
-            }
-            unmap();
-            return false;
-        }
-
-        bytes_have_send += temp;
-        bytes_to_send -= temp;
-
-        if (bytes_have_send >= m_iv[0].iov_len)
+        m_cached = m_compressed_cache->lookup( m_file_entry->path + '#' + m_compress, m_file_stat );
+        if ( m_cached )
         {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
+            open_file_cache::release( m_file_entry );
+            m_file_entry = 0;
+            return FILE_REQUEST;
         }
 
-        if (bytes_to_send <= 0)
+        // 压缩在 process_write 中进行，需要映射完整的文件内容
+        make_validators();
+        m_file_address = map_file();
+        if ( !m_file_address )
         {
-            // 没有数据要发送了
             unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
-
-            if (m_linger)
-            {
-                init();
-                return true;
-            }
-            else
-            {
-                return false;
-            }
+            return INTERNAL_ERROR;
         }
+        return FILE_REQUEST;
+    }
 
+    // 没有 Range 的小文件先查响应缓存，命中后不必再生成响应头与映射文件
+    // 以实际发送的文件路径为键，原文件与各压缩版本分别缓存
+    if ( !m_range && m_response_cache->cacheable( m_file_stat.st_size ) )
+    {
+        m_cached = m_response_cache->lookup( m_file_entry->path, m_file_stat );
+        if ( m_cached )
+        {
+            open_file_cache::release( m_file_entry );
+            m_file_entry = 0;
+            return FILE_REQUEST;
+        }
     }
 
-    
-}
+    make_validators();
 
-// 往写缓冲中写入待发送的数据
-bool http_conn::add_response( const char* format, ... ) 
-{
-    if( m_write_idx >= WRITE_BUFFER_SIZE ) 
+    // 解析 Range，所有区间都无法满足时不必再映射文件
+    if ( parse_range() == RANGE_NOT_SATISFIABLE )
     {
-        return false;
+        unmap();
+        return RANGE_NOT_SATISFIABLE;
     }
-    va_list arg_list;
-    va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ) 
+
+    // 大文件直接使用缓存中的 fd，由 write() 用 sendfile 按偏移发送（不改变共享 fd 的文件位置）
+    // multipart 的各个区间作为文件段与分段头交替放入输出队列
+    // 发送方向没有交给内核的 TLS 连接只能从内存加密发送
+    // HTTP/2 的 DATA 帧与其他流的帧交错发送，响应体总是从映射区发送
+    if ( m_sendfile_threshold >= 0 && m_file_stat.st_size >= m_sendfile_threshold && !m_tls_tx && !m_h2 )
     {
-        return false;
+        m_file_fd = m_file_entry->fd;
+        // 大文件按顺序读取，加大内核预读窗口（作用于缓存中共享的打开文件）
+        posix_fadvise( m_file_fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+        // kTLS 不支持 MSG_ZEROCOPY，加密连接保持 sendfile
+        if ( m_zerocopy_threshold > 0 && m_file_stat.st_size >= m_zerocopy_threshold && !m_ssl )
+        {
+            select_transmit();
+        }
+        return FILE_REQUEST;
     }
-    m_write_idx += len;
-    va_end( arg_list );
-    return true;
+
+    // HTTP/2 上大文件的单个区间由 respond_h2 只映射区间所在的页
+    if ( m_h2 && m_range_count == 1 && m_file_stat.st_size > PREFETCH_WINDOW )
+    {
+        return FILE_REQUEST;
+    }
+
+    // 创建内存映射（空文件不需要映射）
+    m_file_address = map_file();
+    if ( !m_file_address && m_file_stat.st_size > 0 )
+    {
+        unmap();
+        return INTERNAL_ERROR;
+    }
+    return FILE_REQUEST;
+
 }
 
-bool http_conn::add_status_line( int status, const char* title ) 
+
+char* http_conn::map_file()
 {
-    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+    if ( m_file_stat.st_size == 0 )
+    {
+        return 0;
+    }
+
+    // 同一个文件的并发请求共用一个映射；小文件新建映射时预先建立全部页表，writev 时不再逐页缺页
+    m_mapping = m_mmap_cache->acquire( m_file_entry->fd, m_file_stat, m_file_stat.st_size <= m_populate_max );
+    if ( !m_mapping )
+    {
+        return 0;
+    }
+
+    if ( m_file_stat.st_size > PREFETCH_WINDOW )
+    {
+        // 走 mmap 的大文件（多区间请求）同样按顺序预读
+        madvise( m_mapping->addr, m_file_stat.st_size, MADV_SEQUENTIAL );
+    }
+    return m_mapping->addr;
 }
 
-bool http_conn::add_headers(int content_len) 
+
+// 返回 Accept-Encoding 中 coding 的权重（0 ~ 1000），未列出时取 "*" 的权重，都没有则为 0
+static int encoding_quality( const char* header, const char* coding )
 {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    int star = 0;
+    size_t coding_len = strlen( coding );
+    const char* p = header;
+
+    while ( *p )
+    {
+        p += strspn( p, " \t," );
+        const char* name = p;
+        size_t name_len = strcspn( p, " \t,;" );
+        p += name_len;
+
+        // 默认权重为 1
+        int q = 1000;
+        p += strspn( p, " \t" );
+        while ( *p == ';' )
+        {
+            ++p;
+            p += strspn( p, " \t" );
+            if ( ( p[0] == 'q' || p[0] == 'Q' ) && p[1] == '=' )
+            {
+                q = (int)( atof( p + 2 ) * 1000 );
+            }
+            p += strcspn( p, ",;" );
+        }
+
+        if ( name_len == coding_len && strncasecmp( name, coding, name_len ) == 0 )
+        {
+            return q;
+        }
+        if ( name_len == 1 && name[0] == '*' )
+        {
+            star = q;
+        }
+
+        p += strcspn( p, "," );
+    }
+
+    return star;
 }
 
-bool http_conn::add_content_length(int content_len) 
+// 构建流程会在每个资源旁生成 .br 与 .gz，根据客户端的权重选择其中存在的一个
+// 权重相同时 br 优先，因为它通常更小
+void http_conn::select_precompressed()
 {
-    return add_response( "Content-Length: %d\r\n", content_len );
+    struct variant
+    {
+        const char* coding;
+        const char* suffix;
+        int q;
+    } variants[2] = {
+        { "br", ".br", encoding_quality( m_accept_encoding, "br" ) },
+        { "gzip", ".gz", encoding_quality( m_accept_encoding, "gzip" ) },
+    };
+
+    if ( variants[1].q > variants[0].q )
+    {
+        variant tmp = variants[0];
+        variants[0] = variants[1];
+        variants[1] = tmp;
+    }
+
+    char path[FILENAME_LEN + 4];
+    for ( int i = 0; i < 2; ++i )
+    {
+        if ( variants[i].q <= 0 )
+        {
+            continue;
+        }
+
+        snprintf( path, sizeof( path ), "%s%s", m_real_file, variants[i].suffix );
+        open_file_cache::entry* e = m_file_cache->acquire( path );
+        if ( !e )
+        {
+            continue;
+        }
+
+        if ( e->err == 0 && e->fd >= 0 )
+        {
+            open_file_cache::release( m_file_entry );
+            m_file_entry = e;
+            m_file_stat = e->st;
+            m_content_encoding = variants[i].coding;
+            return;
+        }
+
+        open_file_cache::release( e );
+    }
 }
 
-bool http_conn::add_linger()
+// 内容包模式：一次二分查找定位文件，按 Accept-Encoding 选择包内的压缩版本，
+// 之后与普通文件一样走 200 / 206 / multipart 的发送流程，内容直接从包的映射区发送
+http_conn::HTTP_CODE http_conn::do_pack_request( content_pack* pack, const char* path, size_t path_len )
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    m_pack = pack;
+
+    const pack_entry* e = pack->lookup( path, path_len );
+    if ( !e )
+    {
+        unmap();
+        return NO_RESOURCE;
+    }
+
+    int variant = PACK_IDENTITY;
+    if ( m_precompressed && m_accept_encoding )
+    {
+        int q_br = e->variants[PACK_BR].offset ? encoding_quality( m_accept_encoding, "br" ) : 0;
+        int q_gzip = e->variants[PACK_GZIP].offset ? encoding_quality( m_accept_encoding, "gzip" ) : 0;
+        if ( q_br > 0 && q_br >= q_gzip )
+        {
+            variant = PACK_BR;
+            m_content_encoding = "br";
+        }
+        else if ( q_gzip > 0 )
+        {
+            variant = PACK_GZIP;
+            m_content_encoding = "gzip";
+        }
+    }
+
+    memset( &m_file_stat, 0, sizeof( m_file_stat ) );
+    m_file_stat.st_size = e->variants[variant].size;
+    m_file_stat.st_mtime = e->mtime;
+    m_content_type = pack->string( e->mime_offset );
+    m_cache_policy.lookup( path, m_max_age, m_immutable );
+
+    // Last-Modified 由修改时间生成，ETag 使用打包时计算好的，压缩版本在其后加上编码名
+    make_validators();
+    if ( m_content_encoding )
+    {
+        snprintf( m_etag, ETAG_LEN, "%.*s-%s\"", (int)strlen( e->etag ) - 1, e->etag, m_content_encoding );
+    }
+    else
+    {
+        snprintf( m_etag, ETAG_LEN, "%s", e->etag );
+    }
+
+    if ( parse_range() == RANGE_NOT_SATISFIABLE )
+    {
+        unmap();
+        return RANGE_NOT_SATISFIABLE;
+    }
+
+    m_file_address = (char*)pack->data( e->variants[variant].offset );
+    return FILE_REQUEST;
 }
 
-bool http_conn::add_blank_line()
+// 文本类文件在没有预压缩版本、没有 Range 且大小合适时即时压缩
+// 客户端同时接受 gzip 与 deflate 时选择权重更高的一个，相同时选择 gzip
+bool http_conn::select_compression()
 {
-    return add_response( "%s", "\r\n" );
+    if ( m_gzip_level <= 0 || m_content_encoding || m_range || !m_accept_encoding
+         || m_file_stat.st_size < m_gzip_min_length || m_file_stat.st_size > m_gzip_max_length
+         || !gzip_compressible( m_real_file ) )
+    {
+        return false;
+    }
+
+    int q_gzip = encoding_quality( m_accept_encoding, "gzip" );
+    int q_deflate = encoding_quality( m_accept_encoding, "deflate" );
+    if ( q_gzip <= 0 && q_deflate <= 0 )
+    {
+        return false;
+    }
+
+    m_compress = ( q_gzip >= q_deflate ) ? "gzip" : "deflate";
+    return true;
 }
 
-bool http_conn::add_content( const char* content )
+// 生成 ETag 与 Last-Modified，供响应头与 If-Range 比较使用
+// ETag 的格式与 nginx 相同："修改时间-文件大小"
+void http_conn::make_validators()
 {
-    return add_response( "%s", content );
-}
+    snprintf( m_etag, ETAG_LEN, "\"%lx-%lx\"",
+              (unsigned long)m_file_stat.st_mtime, (unsigned long)m_file_stat.st_size );
 
-bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    http_date::format( m_file_stat.st_mtime, m_last_modified );
 }
 
-// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
-bool http_conn::process_write(HTTP_CODE ret) 
+// 解析 Range: bytes=first-last, first-, -suffix
+// 语法错误、区间过多或请求的总字节数超过文件大小时忽略 Range 返回完整文件（RFC 7233 允许服务器忽略 Range）
+// 其余的区间排序并合并重叠与相邻的部分，所有区间都超出文件范围时返回 RANGE_NOT_SATISFIABLE
+http_conn::HTTP_CODE http_conn::parse_range()
 {
-    switch (ret)
+    m_range_count = 0;
+
+    if ( !m_range )
     {
-        case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) 
+        return FILE_REQUEST;
+    }
+
+    // If-Range 与当前文件不匹配，说明客户端手里的片段已经过期，需要返回完整文件
+    if ( m_if_range )
+    {
+        const char* validator = ( m_if_range[0] == '"' ) ? m_etag : m_last_modified;
+        if ( strcmp( m_if_range, validator ) != 0 )
+        {
+            return FILE_REQUEST;
+        }
+    }
+
+    if ( strncasecmp( m_range, "bytes=", 6 ) != 0 )
+    {
+        return FILE_REQUEST;
+    }
+
+    off_t size = m_file_stat.st_size;
+    char* p = m_range + 6;
+    int count = 0;
+    bool any = false;   // 是否出现过至少一个语法正确的区间
+
+    while ( *p )
+    {
+        p += strspn( p, " \t" );
+
+        off_t start = -1;
+        off_t end = -1;
+        char* next = 0;
+
+        if ( *p == '-' )
+        {
+            // -suffix 表示最后 suffix 个字节
+            off_t suffix = strtoll( p + 1, &next, 10 );
+            if ( next == p + 1 || suffix < 0 )
             {
-                return false;
+                m_range_count = 0;
+                return FILE_REQUEST;
             }
-            break;
-        case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) 
+            if ( suffix > 0 && size > 0 )
             {
-                return false;
+                start = ( suffix >= size ) ? 0 : size - suffix;
+                end = size - 1;
             }
-            break;
-        case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) 
+        }
+        else
+        {
+            start = strtoll( p, &next, 10 );
+            if ( next == p || *next != '-' || start < 0 )
             {
-                return false;
+                m_range_count = 0;
+                return FILE_REQUEST;
             }
-            break;
-        case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) 
+            p = next + 1;
+
+            if ( *p >= '0' && *p <= '9' )
             {
-                return false;
+                end = strtoll( p, &next, 10 );
+                if ( end < start )
+                {
+                    m_range_count = 0;
+                    return FILE_REQUEST;
+                }
             }
-            break;
-        case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_idx;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
+            else
+            {
+                next = p;
+                end = size - 1;
+            }
+
+            if ( start >= size )
+            {
+                // 该区间无法满足，跳过
+                start = -1;
+            }
+            else if ( end >= size )
+            {
+                end = size - 1;
+            }
+        }
 
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
+        any = true;
+        if ( start >= 0 )
+        {
+            if ( count == MAX_RANGES )
+            {
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            m_range_start[count] = start;
+            m_range_end[count] = end;
+            ++count;
+        }
 
-            return true;
-        default:
-            return false;
+        p = next;
+        p += strspn( p, " \t" );
+        if ( *p == ',' )
+        {
+            ++p;
+        }
+        else if ( *p != '\0' )
+        {
+            m_range_count = 0;
+            return FILE_REQUEST;
+        }
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
-    return true;
-}
+    if ( !any )
+    {
+        return FILE_REQUEST;
+    }
 
+    if ( count == 0 )
+    {
+        return RANGE_NOT_SATISFIABLE;
+    }
 
+    // 请求的字节总数超过文件大小说明区间大量重叠（如 bytes=0-,0-,0-），按多个区间回复会放大流量，返回完整文件
+    off_t total = 0;
+    for ( int i = 0; i < count; i++ )
+    {
+        total += m_range_end[i] - m_range_start[i] + 1;
+    }
+    if ( total > size )
+    {
+        return FILE_REQUEST;
+    }
 
-// 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
-// 任务放入队列中由线程池到队列中取任务，取到了以后由工作线程调用 process 解析 HTTP 请求
-void http_conn::process()
+    // 按起点排序（最多 MAX_RANGES 个，插入排序即可），合并重叠或相邻的区间（RFC 7233 允许合并）
+    for ( int i = 1; i < count; i++ )
+    {
+        off_t start = m_range_start[i];
+        off_t end = m_range_end[i];
+        int j = i;
+        while ( j > 0 && m_range_start[j - 1] > start )
+        {
+            m_range_start[j] = m_range_start[j - 1];
+            m_range_end[j] = m_range_end[j - 1];
+            --j;
+        }
+        m_range_start[j] = start;
+        m_range_end[j] = end;
+    }
+    int merged = 0;
+    for ( int i = 1; i < count; i++ )
+    {
+        if ( m_range_start[i] <= m_range_end[merged] + 1 )
+        {
+            if ( m_range_end[i] > m_range_end[merged] )
+            {
+                m_range_end[merged] = m_range_end[i];
+            }
+        }
+        else
+        {
+            ++merged;
+            m_range_start[merged] = m_range_start[i];
+            m_range_end[merged] = m_range_end[i];
+        }
+    }
+    count = merged + 1;
+
+    // 合并后覆盖整个文件，与完整响应没有区别
+    if ( count == 1 && m_range_start[0] == 0 && m_range_end[0] == size - 1 )
+    {
+        return FILE_REQUEST;
+    }
+
+    m_range_count = count;
+    return FILE_REQUEST;
+}
+
+
+bool http_conn::body_window( off_t& off, off_t& len )
 {
+    // 响应缓存中的内容与错误页都在内存中
+    if ( m_file_fd == -1 && ( !m_file_address || m_cached ) )
+    {
+        return false;
+    }
 
-    // 解析 HTTP 请求
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST)
+    // 找到下一个文件段或指向映射区的内存段
+    size_t i = 0;
+    for ( ; i < m_out.size(); ++i )
     {
-        // 请求不完整，需要继续读取客户数据
-        modfd(m_epollfd,m_sockfd,EPOLLIN);
-        return;
+        const output_queue::segment& s = m_out.at( i );
+        if ( s.kind == output_queue::FILE )
+        {
+            off = s.offset;
+            break;
+        }
+        if ( m_file_address && s.data >= m_file_address && s.data < m_file_address + m_file_stat.st_size )
+        {
+            off = s.data - m_file_address;
+            break;
+        }
+    }
+    if ( i == m_out.size() )
+    {
+        return false;
     }
 
-    // 生成响应
-    bool write_ret = process_write( read_ret );
-    if ( !write_ret ) 
+    if ( off >= m_file_stat.st_size )
     {
-        close_conn();
+        return false;
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+
+    len = m_file_stat.st_size - off;
+    if ( len > PREFETCH_WINDOW )
+    {
+        len = PREFETCH_WINDOW;
+    }
+    return true;
+}
+
+// 从 start 开始连续在页缓存中的字节数（mincore 逐页检查，窗口之内）
+static size_t resident_prefix( const char* start, size_t len )
+{
+    static const long page = sysconf( _SC_PAGESIZE );
+    unsigned char vec[http_conn::PREFETCH_WINDOW / 4096 + 2];
+    const char* aligned = (const char*)( (unsigned long)start & ~( page - 1 ) );
+    size_t span = start + len - aligned;
+    size_t pages = ( span + page - 1 ) / page;
+    if ( pages > sizeof( vec ) || mincore( (void*)aligned, span, vec ) != 0 )
+    {
+        return 0;
+    }
+    size_t i = 0;
+    while ( i < pages && ( vec[i] & 1 ) )
+    {
+        ++i;
+    }
+    size_t bytes = i * page - ( start - aligned );
+    return bytes < len ? bytes : len;
 }
 
+// 窗口中的每一页都在页缓存中才返回 true；已经确认过的前缀不再检查，只有逐页确认过的部分记入 m_resident_until
+// 只在主线程中调用，不为检查而映射文件：sendfile 路径上没有映射区，未确认的窗口一律交给 I/O 线程池，
+// 由 prefetch() 的 readahead 读入（已在页缓存中时很快返回）后确认
+bool http_conn::body_resident()
+{
+    off_t off, len;
+    if ( !body_window( off, len ) )
+    {
+        return true;
+    }
+    off_t from = off > m_resident_until ? off : m_resident_until;
+    off_t end = off + len;
+    if ( from >= end )
+    {
+        return true;
+    }
+
+    if ( m_file_fd != -1 )
+    {
+        return false;
+    }
+
+    size_t resident = resident_prefix( m_file_address + from, end - from );
+    m_resident_until = from + resident;
+    return from + (off_t)resident == end;
+}
+
+void http_conn::select_transmit()
+{
+    // 预热时没有连接
+    if ( m_sockfd == -1 )
+    {
+        return;
+    }
+
+    if ( m_zc_state == ZEROCOPY_UNKNOWN )
+    {
+        int one = 1;
+        m_zc_state = ( setsockopt( m_sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof( one ) ) == 0 )
+                   ? ZEROCOPY_ENABLED : ZEROCOPY_UNAVAILABLE;
+    }
+
+    if ( m_zc_state == ZEROCOPY_ENABLED )
+    {
+        // 上一个响应的页面仍被内核引用时只保留一个映射区，本次仍用 sendfile
+        reap_zerocopy();
+        if ( m_zc_retired )
+        {
+            return;
+        }
+        m_file_address = map_file();
+        if ( m_file_address )
+        {
+            m_transmit = TRANSMIT_ZEROCOPY;
+        }
+    }
+    else if ( m_zc_state == ZEROCOPY_UNAVAILABLE )
+    {
+        if ( m_pipe[0] != -1 || pipe2( m_pipe, O_NONBLOCK | O_CLOEXEC ) == 0 )
+        {
+            m_transmit = TRANSMIT_SPLICE;
+        }
+        else
+        {
+            m_pipe[0] = m_pipe[1] = -1;
+        }
+    }
+}
+
+ssize_t http_conn::send_body( const output_queue::segment& s )
+{
+    // 文件段的偏移由输出队列按发送到 socket 的字节数推进，这里只使用它的副本
+    off_t offset = s.offset;
+    // 有 I/O 线程池时一次最多发到确认在页缓存中的位置，之后的内容先由 body_resident() 检查，
+    // 否则 socket 缓冲区较大时一次 sendfile 会越过检查过的窗口，在主线程中等待磁盘
+    size_t count = s.len;
+    if ( m_io_pool && m_resident_until > offset && (off_t)count > m_resident_until - offset )
+    {
+        count = m_resident_until - offset;
+    }
+
+    if ( m_transmit == TRANSMIT_ZEROCOPY )
+    {
+        // 只有文件内容用 MSG_ZEROCOPY 发送，响应头所在的写缓冲区会被下一个请求复用，不能被内核引用
+        int more = ( count < m_out.bytes() ) ? MSG_MORE : 0;
+        ssize_t n = send( m_sockfd, m_file_address + offset, count, MSG_ZEROCOPY | more );
+        if ( n < 0 && errno == ENOBUFS )
+        {
+            // 完成通知占满了 optmem，先回收，这一段按普通方式拷贝发送
+            reap_zerocopy();
+            n = send( m_sockfd, m_file_address + offset, count, more );
+        }
+        else if ( n > 0 )
+        {
+            m_zc_sent++;
+        }
+        return n;
+    }
+
+    if ( m_transmit == TRANSMIT_SPLICE )
+    {
+        // 管道为空时先从文件填充，再把管道中的内容送入 socket
+        // 管道只在一个文件段之内使用，段结束时其中的内容恰好全部送出
+        if ( m_pipe_bytes == 0 )
+        {
+            ssize_t n = splice( s.fd, &offset, m_pipe[1], NULL, count,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+            if ( n <= 0 )
+            {
+                return n;
+            }
+            m_pipe_bytes = n;
+        }
+        int more = ( m_pipe_bytes < m_out.bytes() ) ? SPLICE_F_MORE : 0;
+        ssize_t n = splice( m_pipe[0], NULL, m_sockfd, NULL, m_pipe_bytes,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more );
+        if ( n > 0 )
+        {
+            m_pipe_bytes -= n;
+        }
+        return n;
+    }
+
+    return sendfile( m_sockfd, s.fd, &offset, count );
+}
+
+void http_conn::reap_zerocopy()
+{
+    char control[128];
+    while ( m_zc_done != m_zc_sent )
+    {
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof( control );
+        if ( recvmsg( m_sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 )
+        {
+            break;
+        }
+
+        for ( struct cmsghdr* cm = CMSG_FIRSTHDR( &msg ); cm; cm = CMSG_NXTHDR( &msg, cm ) )
+        {
+            if ( !( cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR )
+                 && !( cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR ) )
+            {
+                continue;
+            }
+            struct sock_extended_err* serr = ( struct sock_extended_err* )CMSG_DATA( cm );
+            if ( serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+            {
+                continue;
+            }
+            // 一条通知覆盖 [ee_info, ee_data] 范围内的所有调用
+            m_zc_done += serr->ee_data - serr->ee_info + 1;
+            if ( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+            {
+                // 内核退回了拷贝，零拷贝只多了通知的开销，之后改用 sendfile
+                m_zc_state = ZEROCOPY_COPIED;
+            }
+        }
+    }
+
+    if ( m_zc_retired && m_zc_done == m_zc_sent )
+    {
+        m_mmap_cache->release( m_zc_retired );
+        m_zc_retired = 0;
+    }
+}
+
+bool http_conn::zerocopy_event()
+{
+    if ( m_zc_sent == m_zc_done )
+    {
+        return false;
+    }
+    reap_zerocopy();
+
+    // 错误队列之外还有真正的 socket 错误时按原来的方式关闭连接
+    int err = 0;
+    socklen_t len = sizeof( err );
+    if ( getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 || err != 0 )
+    {
+        return false;
+    }
+
+    // EPOLLONESHOT 已经解除了注册，按连接当前所处的阶段重新注册
+    modfd( m_epollfd, m_sockfd, bytes_to_send > 0 ? EPOLLOUT : EPOLLIN );
+    return true;
+}
+
+void http_conn::advise_body()
+{
+    // 一次性下载：丢弃已经发送完毕的部分，每满一个窗口或发送结束时丢弃一次
+    // sendfile 返回后页面仍被发送队列中的报文引用，此时 DONTNEED 不起作用，
+    // 所以只丢弃发送队列（SIOCOUTQ）之前的部分，发送途中再多隔一个窗口
+    if ( m_file_fd != -1 && m_dropbehind_threshold > 0 && m_file_stat.st_size >= m_dropbehind_threshold )
+    {
+        int queued = 0;
+        ioctl( m_sockfd, SIOCOUTQ, &queued );
+        off_t end = m_file_offset - queued;
+        if ( bytes_to_send > 0 )
+        {
+            end = ( end - PREFETCH_WINDOW ) & ~( PREFETCH_WINDOW - 1 );
+        }
+        if ( end - m_dropped_until >= PREFETCH_WINDOW || ( bytes_to_send <= 0 && end > m_dropped_until ) )
+        {
+            posix_fadvise( m_file_fd, m_dropped_until, end - m_dropped_until, POSIX_FADV_DONTNEED );
+            m_dropped_until = end;
+        }
+    }
+
+    off_t off, len;
+    if ( !body_window( off, len ) || m_file_stat.st_size <= PREFETCH_WINDOW )
+    {
+        return;
+    }
+
+    // 发送位置进入最后一个已提示的窗口时，再提示后面两个窗口，磁盘读取与网络发送并行进行
+    if ( off + PREFETCH_WINDOW > m_advised_until )
+    {
+        off_t end = off + 2 * PREFETCH_WINDOW;
+        if ( end > m_file_stat.st_size )
+        {
+            end = m_file_stat.st_size;
+        }
+
+        if ( m_file_fd != -1 )
+        {
+            posix_fadvise( m_file_fd, off, end - off, POSIX_FADV_WILLNEED );
+        }
+        else if ( !m_pack )
+        {
+            // 内容包的映射由所有连接共享，不对其中的片段做提示，避免拆分映射区
+            static const long page = sysconf( _SC_PAGESIZE );
+            off_t start = off & ~( page - 1 );
+            madvise( m_file_address + start, end - start, MADV_WILLNEED );
+        }
+        m_advised_until = end;
+    }
+}
+
+void http_conn::prefetch_task::process()
+{
+    conn->prefetch();
+}
+
+void http_conn::prefetch()
+{
+    off_t off, len;
+    if ( body_window( off, len ) )
+    {
+        if ( m_file_fd != -1 )
+        {
+            // readahead 会等待读取完成，之后的 sendfile 直接命中页缓存
+            readahead( m_file_fd, off, len );
+        }
+        else
+        {
+            // 逐页读取映射区，缺页在这里发生而不是在主线程的 writev 中
+            static const long page = sysconf( _SC_PAGESIZE );
+            volatile char sink = 0;
+            for ( off_t p = 0; p < len; p += page )
+            {
+                sink += m_file_address[off + p];
+            }
+            sink += m_file_address[off + len - 1];
+        }
+        m_resident_until = off + len;
+    }
+
+    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+}
+
+
+// 释放对共享映射、打开文件缓存条目与响应缓存对象的引用
+void http_conn::unmap() 
+{
+    // 队列中的段可能指向下面释放的内存
+    // HTTP/2 连接的队列中是其他流的帧，由 close_conn() 清空
+    if ( !m_h2 )
+    {
+        m_out.clear();
+    }
+    if ( m_pack )
+    {
+        // 指向内容包内部，不需要 munmap
+        m_file_address = 0;
+        content_pack::release( m_pack );
+        m_pack = 0;
+    }
+    if ( m_cached )
+    {
+        response_cache::release( m_cached );
+        m_cached = 0;
+    }
+    if( m_mapping )
+    {
+        if ( m_transmit == TRANSMIT_ZEROCOPY && m_zc_done != m_zc_sent )
+        {
+            // 页面仍被内核引用，等完成通知到达后再释放映射
+            m_zc_retired = m_mapping;
+        }
+        else
+        {
+            m_mmap_cache->release( m_mapping );
+        }
+        m_mapping = 0;
+    }
+    m_file_address = 0;
+    if ( m_pipe_bytes > 0 )
+    {
+        // 中途放弃的响应在管道中留下了数据，丢弃整个管道，下次需要时重新创建
+        close( m_pipe[0] );
+        close( m_pipe[1] );
+        m_pipe[0] = m_pipe[1] = -1;
+        m_pipe_bytes = 0;
+    }
+    if ( m_file_entry )
+    {
+        open_file_cache::release( m_file_entry );
+        m_file_entry = 0;
+    }
+    m_file_fd = -1;
+}
+
+ssize_t http_conn::send_queue()
+{
+    // 主线程独占使用，连接之间不需要各自保留一份
+    static struct iovec iv[output_queue::MAX_IOV];
+
+    ssize_t temp;
+    bool body = (m_out.front().kind == output_queue::FILE);
+    if (body)
+    {
+        // 队首是文件段，由内核直接从页缓存发送
+        temp = send_body(m_out.front());
+    }
+    else
+    {
+        // 队首连续的内存段一次发出
+        int count = m_out.gather(iv, output_queue::MAX_IOV);
+        if (m_tls_tx)
+        {
+            temp = tls_writev(iv, count);
+        }
+        else if ((size_t)count < m_out.size())
+        {
+            // 后面还有文件段或更多内存段，带 MSG_MORE 发送，让内核把它们合并成满的报文段
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iv;
+            msg.msg_iovlen = count;
+            temp = sendmsg(m_sockfd, &msg, MSG_MORE);
+        }
+        else
+        {
+            // 分散写
+            temp = writev(m_sockfd, iv, count);
+        }
+    }
+
+    if (temp > 0)
+    {
+        if (body)
+        {
+            m_file_offset = m_out.front().offset + temp;
+        }
+        // 移除已经完整发送的段，并调整第一个未发送完的段
+        m_out.consume(temp);
+    }
+    return temp;
+}
+
+// 写HTTP响应
+bool http_conn::write()
+{
+    int temp = 0;
+
+    if ( m_h2 )
+    {
+        return write_h2();
+    }
+
+    if ( m_ws )
+    {
+        m_ws->unpark();
+        return write_ws();
+    }
+    
+    if ( bytes_to_send == 0 ) 
+    {
+        // 将要发送的字节为0，这一次响应结束。
+        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
+        init();
+        return true;
+    }
+
+    if (m_zc_sent != m_zc_done)
+    {
+        reap_zerocopy();
+    }
+
+    while(1) 
+    {
+        // 即将发送的文件内容不在页缓存中时交给 I/O 线程池读取，由它在完成后重新注册 EPOLLOUT，
+        // 主线程不会因为缺页等待磁盘
+        if (m_io_pool && !body_resident() && m_io_pool->append(&m_prefetch))
+        {
+            return true;
+        }
+        advise_body();
+
+        temp = send_queue();
+        if (temp == 0)
+        {
+            // 文件在发送途中被截断
+            unmap();
+            return false;
+        }
+
+        if ( temp <= -1 ) {
+            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
+            // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
+            if( errno == EAGAIN ) 
+            {
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                return true;
+            }
+            unmap();
+            return false;
+        }
+
+        bytes_have_send += temp;
+        bytes_to_send -= temp;
+
+        if (bytes_to_send <= 0)
+        {
+            // 没有数据要发送了
+            advise_body();
+            unmap();
+            modfd(m_epollfd, m_sockfd, EPOLLIN);
+
+            if (m_linger)
+            {
+                init();
+                return true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+    }
+
+    
+}
+
+// 往写缓冲中写入待发送的数据
+bool http_conn::add_response( const char* format, ... ) 
+{
+    va_list arg_list;
+    va_start( arg_list, format );
+    bool ok = buffer_vprintf( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, format, arg_list );
+    va_end( arg_list );
+    return ok;
+}
+
+bool http_conn::append( const char* data, size_t len )
+{
+    return buffer_append( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, data, len );
+}
+
+bool http_conn::append_decimal( unsigned long long value )
+{
+    return buffer_append_decimal( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, value );
+}
+
+bool http_conn::append_header( const header_fragment& name, const char* value )
+{
+    return buffer_append_header( m_write_buf, WRITE_BUFFER_SIZE, m_write_idx, name, value );
+}
+
+bool http_conn::add_status_line( int status, const char* title ) 
+{
+    header_fragment line = status_line( status );
+    if ( line.len > 0 )
+    {
+        return append( line );
+    }
+    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+}
+
+bool http_conn::add_headers(long content_len) 
+{
+    return add_content_length(content_len)
+        && add_content_type()
+        && add_date_headers()
+        && add_linger()
+        && add_blank_line();
+}
+
+bool http_conn::add_date_headers()
+{
+    if ( !append( HDR_DATE ) || !append( http_date::now(), http_date::LEN ) || !append( CRLF ) )
+    {
+        return false;
+    }
+    if ( m_max_age < 0 )
+    {
+        return true;
+    }
+
+    // 给只认 Expires 的 HTTP/1.0 缓存
+    char expires[http_date::LEN + 1];
+    http_date::format( http_date::time() + m_max_age, expires );
+    return append( HDR_EXPIRES ) && append( expires, http_date::LEN ) && append( CRLF );
+}
+
+// Cache-Control 只取决于路径，可以放入响应缓存
+bool http_conn::add_cache_control()
+{
+    if ( m_max_age < 0 )
+    {
+        return true;
+    }
+    if ( m_max_age == 0 )
+    {
+        return append( HDR_NO_CACHE );
+    }
+    return append( HDR_MAX_AGE ) && append_decimal( m_max_age )
+        && append( m_immutable ? HDR_IMMUTABLE : CRLF );
+}
+
+bool http_conn::add_content_length(long content_len) 
+{
+    m_body_bytes = content_len;
+    return append( HDR_CONTENT_LENGTH ) && append_decimal( content_len ) && append( CRLF );
+}
+
+bool http_conn::add_linger()
+{
+    return append( m_linger ? HDR_KEEP_ALIVE : HDR_CLOSE );
+}
+
+bool http_conn::add_blank_line()
+{
+    return append( CRLF );
+}
+
+bool http_conn::add_content( const char* content )
+{
+    return append( content, strlen( content ) );
+}
+
+bool http_conn::add_content_type() {
+    return append_header( HDR_CONTENT_TYPE, m_content_type );
+}
+
+// 同一个 URL 是否可能按 Accept-Encoding 返回不同的内容：启用预压缩时任何文件都可能有压缩版本，
+// 启用即时压缩时文本类文件可能被压缩（客户端不接受压缩或大小不合适时发送的原文件也一样）
+bool http_conn::vary_encoding() const
+{
+    return m_precompressed || ( m_gzip_level > 0 && gzip_compressible( m_real_file ) );
+}
+
+// 文件响应的附加头部：支持 Range，并给出 If-Range 所需的校验值
+// 可能协商压缩的响应都带上 Vary，共享缓存才不会把原文件交给接受压缩的客户端（或者相反）
+bool http_conn::add_file_headers()
+{
+    if ( m_content_encoding && !append_header( HDR_CONTENT_ENCODING, m_content_encoding ) )
+    {
+        return false;
+    }
+    if ( vary_encoding() && !append( HDR_VARY_ENCODING ) )
+    {
+        return false;
+    }
+    return append( HDR_ACCEPT_RANGES )
+        && append_header( HDR_ETAG, m_etag )
+        && append_header( HDR_LAST_MODIFIED, m_last_modified )
+        && add_cache_control();
+}
+
+bool http_conn::add_content_range( off_t start, off_t end )
+{
+    return append( HDR_CONTENT_RANGE )
+        && append_decimal( start ) && append( "-", 1 )
+        && append_decimal( end ) && append( "/", 1 )
+        && append_decimal( m_file_stat.st_size ) && append( CRLF );
+}
+
+// multipart/byteranges 中第 i 个区间之前的分段头
+int http_conn::format_range_part( char* buf, int i )
+{
+    int len = snprintf( buf, RANGE_PART_SIZE,
+                        "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                        m_boundary, m_content_type,
+                        (long long)m_range_start[i], (long long)m_range_end[i],
+                        (long long)m_file_stat.st_size );
+    return ( len < RANGE_PART_SIZE ) ? len : -1;
+}
+
+void http_conn::make_boundary()
+{
+    static unsigned long boundary_seq = 0;
+    snprintf( m_boundary, sizeof( m_boundary ), "%08lx%08lx",
+              (unsigned long)time( NULL ), __sync_fetch_and_add( &boundary_seq, 1 ) );
+}
+
+// 生成 multipart/byteranges 响应：
+// 每个区间的分段头拷贝进输出队列，与文件片段（映射区片段或文件段）交替排列
+bool http_conn::add_multipart_ranges()
+{
+    make_boundary();
+
+    // 响应头中的 Content-Length 需要先算出整个消息体的长度
+    char part[RANGE_PART_SIZE];
+    long body_len = 0;
+    for ( int i = 0; i < m_range_count; ++i )
+    {
+        int len = format_range_part( part, i );
+        if ( len < 0 )
+        {
+            return false;
+        }
+        body_len += len + m_range_end[i] - m_range_start[i] + 1;
+    }
+    int tail_len = snprintf( part, sizeof( part ), "\r\n--%s--\r\n", m_boundary );
+    body_len += tail_len;
+
+    add_status_line( 206, ok_206_title );
+    add_file_headers();
+    add_content_length( body_len );
+    add_response( "Content-Type: multipart/byteranges; boundary=%s\r\n", m_boundary );
+    add_date_headers();
+    add_linger();
+    add_blank_line();
+    m_out.push( m_write_buf, m_write_idx );
+
+    for ( int i = 0; i < m_range_count; ++i )
+    {
+        int len = format_range_part( part, i );
+        m_out.push_copy( part, len );
+
+        off_t slice = m_range_end[i] - m_range_start[i] + 1;
+        if ( m_file_fd != -1 )
+        {
+            m_out.push_file( m_file_fd, m_range_start[i], slice );
+        }
+        else
+        {
+            m_out.push( m_file_address + m_range_start[i], slice );
+        }
+    }
+    snprintf( part, sizeof( part ), "\r\n--%s--\r\n", m_boundary );
+    m_out.push_copy( part, tail_len );
+
+    if ( m_file_fd != -1 )
+    {
+        m_file_offset = m_range_start[0];
+        m_dropped_until = m_range_start[0];
+    }
+    bytes_to_send = m_out.bytes();
+    return true;
+}
+
+static void release_cached( void* o )
+{
+    response_cache::release( (response_cache::object*)o );
+}
+
+// 从响应缓存发送：缓存的响应头 + 写缓冲区中的 Date / Connection 头与空行 + 文件内容，一次 writev 完成
+// 指向缓存对象的两段各自持有一个引用，对象被淘汰后仍可以安全发送
+bool http_conn::add_cached_response()
+{
+    m_write_idx = 0;
+    add_date_headers();
+    append( m_linger ? HDR_KEEP_ALIVE_END : HDR_CLOSE_END );
+    m_body_bytes = m_cached->body_len;
+
+    response_cache::retain( m_cached );
+    m_out.push_shared( m_cached->head(), m_cached->head_len, release_cached, m_cached );
+    m_out.push( m_write_buf, m_write_idx );
+    response_cache::retain( m_cached );
+    m_out.push_shared( m_cached->body(), m_cached->body_len, release_cached, m_cached );
+
+    bytes_to_send = m_out.bytes();
+    return true;
+}
+
+// 错误响应的头部与页面在启动时已经生成，直接指向共享的只读内存发送，写缓冲区中只有 Date 与 Connection 头
+bool http_conn::add_error_response( ERROR_PAGE page )
+{
+    const error_response& r = m_error_responses[page];
+    if ( r.head.empty() )
+    {
+        return false;
+    }
+
+    add_date_headers();
+    append( m_linger ? HDR_KEEP_ALIVE_END : HDR_CLOSE_END );
+    m_out.push( r.head.data(), r.head.size() );
+    m_out.push( m_write_buf, m_write_idx );
+    m_out.push( r.body.data(), r.body.size() );
+    m_body_bytes = r.body.size();
+    bytes_to_send = m_out.bytes();
+    return true;
+}
+
+// 在工作线程中分块压缩已映射的文件，连同响应头放入压缩结果缓存后从缓存发送
+// 压缩失败或结果无法放入缓存时返回 false，由调用者按原文件发送
+bool http_conn::add_compressed_response()
+{
+    return compress_response() && add_cached_response();
+}
+
+bool http_conn::compress_response()
+{
+    gzip_stream gz;
+    gzip_stream::FORMAT format = ( strcmp( m_compress, "gzip" ) == 0 ) ? gzip_stream::GZIP : gzip_stream::DEFLATE;
+    if ( !gz.init( gzip_adaptive_level( m_gzip_level ), format ) )
+    {
+        return false;
+    }
+
+    const off_t CHUNK = 64 * 1024;
+    std::string body;
+    body.reserve( m_file_stat.st_size / 3 );
+    for ( off_t off = 0; off < m_file_stat.st_size; off += CHUNK )
+    {
+        off_t len = m_file_stat.st_size - off;
+        bool last = ( len <= CHUNK );
+        if ( !gz.write( m_file_address + off, last ? len : CHUNK, body, last ) )
+        {
+            return false;
+        }
+    }
+
+    // 压缩结果与原文件字节不同，使用弱 ETag，也不支持 Range
+    add_status_line( 200, ok_200_title );
+    append_header( HDR_CONTENT_ENCODING, m_compress );
+    append( HDR_VARY_ENCODING );
+    append_header( HDR_WEAK_ETAG, m_etag );
+    append_header( HDR_LAST_MODIFIED, m_last_modified );
+    add_cache_control();
+    add_content_length( body.size() );
+    add_content_type();
+
+    m_cached = m_compressed_cache->insert( m_file_entry->path + '#' + m_compress, m_file_stat,
+                                           m_write_buf, m_write_idx, body.data(), body.size() );
+    m_write_idx = 0;
+    return m_cached != 0;
+}
+
+// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+bool http_conn::process_write(HTTP_CODE ret) 
+{
+    if ( ret == WEBSOCKET_REQUEST )
+    {
+        return upgrade_ws();
+    }
+
+    if ( ret == PROXY_REQUEST )
+    {
+        return m_fcgi_route ? fcgi_begin() : proxy_request();
+    }
+
+    if ( ret == ROUTE_REQUEST )
+    {
+        return add_route_response();
+    }
+
+    if ( ret == ROUTE_PENDING )
+    {
+        // 由主线程在 proxy_pump() 中等待处理器完成
+        return true;
+    }
+
+    if ( ret == EVENT_REQUEST )
+    {
+        // 长轮询等到有消息或超时时才生成响应，由主线程在 proxy_pump() 中加入频道
+        return !m_events->stream || add_event_stream();
+    }
+
+    // HEAD 与 GET 的响应头相同（包括 Content-Length），只是不发送响应体
+    m_body_bytes = 0;
+    if ( !add_static_response( ret ) )
+    {
+        return false;
+    }
+    if ( m_method == HEAD )
+    {
+        m_out.truncate( m_body_bytes );
+        bytes_to_send = m_out.bytes();
+    }
+    return true;
+}
+
+bool http_conn::add_static_response(HTTP_CODE ret)
+{
+    if ( ret != FILE_REQUEST )
+    {
+        // 错误页是 HTML，也不应被长期缓存
+        m_content_type = default_content_type;
+        m_max_age = -1;
+    }
+
+    switch (ret)
+    {
+        case INTERNAL_ERROR:
+            if ( add_error_response( ERROR_500 ) )
+            {
+                return true;
+            }
+            add_status_line( 500, error_500_title );
+            add_headers( strlen( error_500_form ) );
+            if ( ! add_content( error_500_form ) ) 
+            {
+                return false;
+            }
+            break;
+        case BAD_REQUEST:
+            if ( add_error_response( ERROR_400 ) )
+            {
+                return true;
+            }
+            add_status_line( 400, error_400_title );
+            add_headers( strlen( error_400_form ) );
+            if ( ! add_content( error_400_form ) ) 
+            {
+                return false;
+            }
+            break;
+        case NO_RESOURCE:
+            if ( add_error_response( ERROR_404 ) )
+            {
+                return true;
+            }
+            add_status_line( 404, error_404_title );
+            add_headers( strlen( error_404_form ) );
+            if ( ! add_content( error_404_form ) ) 
+            {
+                return false;
+            }
+            break;
+        case BAD_GATEWAY:
+            if ( add_error_response( ERROR_502 ) )
+            {
+                return true;
+            }
+            add_status_line( 502, error_502_title );
+            add_headers( strlen( error_502_form ) );
+            if ( ! add_content( error_502_form ) ) 
+            {
+                return false;
+            }
+            break;
+        case METHOD_NOT_ALLOWED:
+            if ( add_error_response( ERROR_405 ) )
+            {
+                return true;
+            }
+            add_status_line( 405, error_405_title );
+            append( HDR_ALLOW );
+            add_headers( strlen( error_405_form ) );
+            if ( ! add_content( error_405_form ) ) 
+            {
+                return false;
+            }
+            break;
+        case GATEWAY_TIMEOUT:
+            if ( add_error_response( ERROR_504 ) )
+            {
+                return true;
+            }
+            add_status_line( 504, error_504_title );
+            add_headers( strlen( error_504_form ) );
+            if ( ! add_content( error_504_form ) ) 
+            {
+                return false;
+            }
+            break;
+        case FORBIDDEN_REQUEST:
+            if ( add_error_response( ERROR_403 ) )
+            {
+                return true;
+            }
+            add_status_line( 403, error_403_title );
+            add_headers(strlen( error_403_form));
+            if ( ! add_content( error_403_form ) ) 
+            {
+                return false;
+            }
+            break;
+        case RANGE_NOT_SATISFIABLE:
+            add_status_line( 416, error_416_title );
+            append( HDR_CONTENT_RANGE );
+            append( "*/", 2 );
+            append_decimal( m_file_stat.st_size );
+            append( CRLF );
+            add_headers( strlen( error_416_form ) );
+            if ( ! add_content( error_416_form ) ) 
+            {
+                return false;
+            }
+            break;
+        case FILE_REQUEST:
+            if ( m_cached )
+            {
+                return add_cached_response();
+            }
+
+            if ( m_compress && add_compressed_response() )
+            {
+                return true;
+            }
+
+            if ( m_range_count > 1 )
+            {
+                return add_multipart_ranges();
+            }
+
+            if ( m_range_count == 1 )
+            {
+                // 单个区间：206 + Content-Range，只发送请求的文件片段
+                off_t start = m_range_start[0];
+                off_t len = m_range_end[0] - start + 1;
+                add_status_line( 206, ok_206_title );
+                add_file_headers();
+                add_content_range( start, m_range_end[0] );
+                add_headers( len );
+                m_out.push( m_write_buf, m_write_idx );
+                if ( m_file_fd != -1 )
+                {
+                    m_file_offset = start;
+                    m_dropped_until = start;
+                    m_out.push_file( m_file_fd, start, len );
+                }
+                else
+                {
+                    m_out.push( m_file_address + start, len );
+                }
+
+                bytes_to_send = m_out.bytes();
+
+                return true;
+            }
+
+            add_status_line(200, ok_200_title );
+            add_file_headers();
+            add_content_length( m_file_stat.st_size );
+            add_content_type();
+
+            // 已映射的小文件连同生成好的响应头一起放入响应缓存，之后的请求直接从缓存发送
+            // Date 等随时间变化的头部不放入缓存
+            if ( m_file_entry && m_file_address && !m_range && m_response_cache->cacheable( m_file_stat.st_size ) )
+            {
+                m_cached = m_response_cache->insert( m_file_entry->path, m_file_stat, m_write_buf, m_write_idx,
+                                                     m_file_address, m_file_stat.st_size );
+                if ( m_cached )
+                {
+                    return add_cached_response();
+                }
+            }
+
+            add_date_headers();
+            add_linger();
+            add_blank_line();
+            m_out.push( m_write_buf, m_write_idx );
+            if ( m_file_fd != -1 )
+            {
+                m_file_offset = 0;
+                m_out.push_file( m_file_fd, 0, m_file_stat.st_size );
+            }
+            else
+            {
+                m_out.push( m_file_address, m_file_stat.st_size );
+            }
+
+            bytes_to_send = m_out.bytes();
+
+            return true;
+        default:
+            return false;
+    }
+
+    m_out.push( m_write_buf, m_write_idx );
+    bytes_to_send = m_out.bytes();
+    return true;
+}
+
+
+
+void http_conn::handshake()
+{
+    int ret = SSL_do_handshake( m_ssl );
+    if ( ret == 1 )
+    {
+        // OpenSSL 在握手完成时尝试开启 kTLS，没有开启的方向走用户态
+        m_handshaking = false;
+        m_tls_rx = !tls_context::ktls_recv( m_ssl );
+        m_tls_tx = !tls_context::ktls_send( m_ssl );
+        if ( m_http2 && tls_context::alpn_h2( m_ssl ) )
+        {
+            // ALPN 选择了 h2，连接从第一个字节起就是 HTTP/2
+            m_h2 = new http2_session( this );
+        }
+        if ( m_tls_tx || m_h2 )
+        {
+            set_nodelay( m_sockfd );
+        }
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return;
+    }
+
+    switch ( SSL_get_error( m_ssl, ret ) )
+    {
+        case SSL_ERROR_WANT_READ:
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            break;
+        default:
+            close_conn();
+            break;
+    }
+}
+
+ssize_t http_conn::tls_writev( const struct iovec* iov, int count )
+{
+    int i = 0;
+    while ( i < count - 1 && iov[i].iov_len == 0 )
+    {
+        i++;
+    }
+
+    // 小的内存块（响应头、HTTP/2 帧头）与其后的内容拼成一个完整的记录，
+    // 单独发出的小记录会在 Nagle 算法下等待对方的延迟确认
+    // 只在主线程中使用；重试时队首的内容不变，拼出的记录以相同的字节开头
+    static char record[TLS_RECORD_SIZE];
+    const void* data = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+    if ( len < (size_t)TLS_RECORD_SIZE && i < count - 1 )
+    {
+        len = 0;
+        for ( ; i < count && len < (size_t)TLS_RECORD_SIZE; i++ )
+        {
+            size_t n = iov[i].iov_len;
+            if ( n > TLS_RECORD_SIZE - len )
+            {
+                n = TLS_RECORD_SIZE - len;
+            }
+            memcpy( record + len, iov[i].iov_base, n );
+            len += n;
+        }
+        data = record;
+    }
+
+    // 每次调用最多生成一个 TLS 记录，剩余的内存块由 write() 的循环继续发送
+    int n = SSL_write( m_ssl, data, len );
+    if ( n > 0 )
+    {
+        return n;
+    }
+
+    int err = SSL_get_error( m_ssl, n );
+    errno = ( err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ) ? EAGAIN : EPIPE;
+    return -1;
+}
+
+// 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
+// 任务放入队列中由线程池到队列中取任务，取到了以后由工作线程调用 process 解析 HTTP 请求
+void http_conn::process()
+{
+    if ( m_ssl && m_handshaking )
+    {
+        // TLS 握手在工作线程中进行，不占用主线程
+        handshake();
+        return;
+    }
+
+    if ( m_h2 )
+    {
+        process_h2();
+        return;
+    }
+
+    if ( m_ws )
+    {
+        process_ws();
+        return;
+    }
+
+    // 明文连接以 HTTP/2 连接前言开头：客户端事先知道服务器支持 HTTP/2（prior knowledge）
+    size_t n = ( m_read_idx < (int)http2_session::PREFACE_LEN ) ? m_read_idx : http2_session::PREFACE_LEN;
+    if ( m_http2 && !m_ssl && m_checked_index == 0 && n > 0 && memcmp( m_read_buf, http2_session::PREFACE, n ) == 0 )
+    {
+        if ( n < http2_session::PREFACE_LEN )
+        {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return;
+        }
+        m_h2 = new http2_session( this );
+        set_nodelay( m_sockfd );
+        process_h2();
+        return;
+    }
+
+    // 解析 HTTP 请求
+    HTTP_CODE read_ret = process_read();
+    if (read_ret == NO_REQUEST)
+    {
+        // 请求不完整，需要继续读取客户数据
+        modfd(m_epollfd,m_sockfd,EPOLLIN);
+        return;
+    }
+
+    // 明文连接上的 Upgrade: h2c，这个请求作为流 1 用 HTTP/2 响应
+    if ( m_http2 && !m_ssl && m_upgrade_h2c && m_http2_settings && upgrade_h2( read_ret ) )
+    {
+        return;
+    }
+
+    // 生成响应
+    bool write_ret = process_write( read_ret );
+    if ( !write_ret ) 
+    {
+        close_conn();
+    }
+
+    // 冷文件先交给 I/O 线程池读入页缓存，由它注册 EPOLLOUT；热文件直接注册
+    if ( write_ret && m_io_pool && !body_resident() && m_io_pool->append( &m_prefetch ) )
+    {
+        return;
+    }
+    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+}
+
+
+// 工作线程中处理 HTTP/2 连接上读入的数据，有帧要发送时同时注册 EPOLLOUT
+void http_conn::process_h2()
+{
+    m_h2->on_input( m_read_buf, m_read_idx );
+    m_read_idx = 0;
+
+    while ( read_tls_pending() )
+    {
+        m_h2->on_input( m_read_buf, m_read_idx );
+        m_read_idx = 0;
+    }
+
+    bool pending = !m_out.empty() || m_h2->want_write();
+    if ( m_h2->closed() && !pending )
+    {
+        close_conn();
+        return;
+    }
+    modfd( m_epollfd, m_sockfd, pending ? ( EPOLLIN | EPOLLOUT ) : EPOLLIN );
+}
+
+// Upgrade: h2c（RFC 7540 3.2）：发送 101 后切换到 HTTP/2，已经处理过的请求成为流 1
+// HTTP2-Settings 无效时返回 false，按 HTTP/1.1 响应
+bool http_conn::upgrade_h2( HTTP_CODE ret )
+{
+    http2_session* h2 = new http2_session( this );
+    if ( !h2->upgrade( m_http2_settings ) )
+    {
+        delete h2;
+        return false;
+    }
+
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    m_out.push( switching, sizeof( switching ) - 1 );
+    m_h2 = h2;
+    set_nodelay( m_sockfd );
+
+    http2_stream* s = m_h2->open_stream( 1 );
+    if ( !s )
+    {
+        close_conn();
+        return true;
+    }
+    respond_h2( s, ret );
+
+    // 请求之后已经读入的字节是客户端的连接前言
+    m_h2->on_input( m_read_buf + m_checked_index, m_read_idx - m_checked_index );
+    m_read_idx = 0;
+    modfd( m_epollfd, m_sockfd, EPOLLIN | EPOLLOUT );
+    return true;
+}
+
+// 流上的一个请求：与 HTTP/1.1 共用 do_request 的整个流程（打开文件缓存、响应缓存、预压缩与即时压缩、Range）
+void http_conn::serve_h2( http2_stream* s, http2_request& req )
+{
+    reset_request();
+    if ( req.method.empty() || req.path[0] != '/' )
+    {
+        respond_h2( s, BAD_REQUEST );
+        return;
+    }
+
+    // 与 HTTP/1.1 一样交给处理器决定是否接受这个方法，静态文件只接受 GET 与 HEAD
+    m_method_name = &req.method[0];
+    if ( req.method == "GET" )
+    {
+        m_method = GET;
+    }
+    else if ( req.method == "HEAD" )
+    {
+        m_method = HEAD;
+    }
+    else
+    {
+        m_method = POST;
+    }
+    m_url = &req.path[0];
+    if ( !req.accept_encoding.empty() )
+    {
+        m_accept_encoding = &req.accept_encoding[0];
+    }
+    if ( !req.range.empty() )
+    {
+        m_range = &req.range[0];
+    }
+    if ( !req.if_range.empty() )
+    {
+        m_if_range = &req.if_range[0];
+    }
+    respond_h2( s, do_request() );
+}
+
+static void add_h2_header( std::vector<hpack_header>& headers, const char* name, const char* value, size_t len )
+{
+    headers.push_back( hpack_header() );
+    headers.back().name = name;
+    headers.back().value.assign( value, len );
+}
+
+static void add_h2_header( std::vector<hpack_header>& headers, const char* name, const char* value )
+{
+    add_h2_header( headers, name, value, strlen( value ) );
+}
+
+static void add_h2_header( std::vector<hpack_header>& headers, const char* name, unsigned long long value )
+{
+    char number[DECIMAL_LEN];
+    add_h2_header( headers, name, number, format_decimal( number, value ) );
+}
+
+// multipart/byteranges 的响应体：分段头写入流持有的 body，各区间直接引用整个文件的映射区，
+// 按顺序放入 s->parts，返回消息体的总长度，分段头放不下时返回 -1
+long http_conn::multipart_h2( http2_stream* s )
+{
+    make_boundary();
+
+    char part[RANGE_PART_SIZE];
+    size_t heads[MAX_RANGES + 1];
+    for ( int i = 0; i < m_range_count; ++i )
+    {
+        int n = format_range_part( part, i );
+        if ( n < 0 )
+        {
+            return -1;
+        }
+        heads[i] = s->body.size();
+        s->body.append( part, n );
+    }
+    heads[m_range_count] = s->body.size();
+    int n = snprintf( part, sizeof( part ), "\r\n--%s--\r\n", m_boundary );
+    s->body.append( part, n );
+
+    // body 不再改变，之后才能取其中的地址
+    long total = 0;
+    for ( int i = 0; i <= m_range_count; ++i )
+    {
+        size_t end = ( i < m_range_count ) ? heads[i + 1] : s->body.size();
+        http2_segment head = { s->body.data() + heads[i], end - heads[i] };
+        s->parts.push_back( head );
+        total += head.len;
+        if ( i < m_range_count )
+        {
+            http2_segment slice = { m_file_address + m_range_start[i],
+                                    (size_t)( m_range_end[i] - m_range_start[i] + 1 ) };
+            s->parts.push_back( slice );
+            total += slice.len;
+        }
+    }
+    return total;
+}
+
+// 把 do_request 的结果作为流 s 的响应：响应头交给会话编码，
+// 响应体所在的内存连同它所属资源（打开文件、共享映射、区间映射、缓存对象、内容包）的引用一起交给流
+void http_conn::respond_h2( http2_stream* s, HTTP_CODE ret )
+{
+    if ( ret == FILE_REQUEST && m_compress && !m_cached && !compress_response() )
+    {
+        // 压缩失败，按原文件发送
+        m_compress = 0;
+    }
+
+    char* slice = 0;
+    size_t slice_len = 0;
+    off_t slice_off = 0;
+    if ( ret == FILE_REQUEST && !m_cached && !m_file_address && m_file_stat.st_size > 0 )
+    {
+        if ( m_range_count == 1 && m_file_stat.st_size > PREFETCH_WINDOW )
+        {
+            // 大文件的单个区间只映射区间所在的页，不为一小段内容映射整个文件
+            static const long page = sysconf( _SC_PAGESIZE );
+            slice_off = m_range_start[0] & ~( (off_t)page - 1 );
+            slice_len = m_range_end[0] + 1 - slice_off;
+            slice = (char*)mmap( 0, slice_len, PROT_READ, MAP_SHARED, m_file_entry->fd, slice_off );
+            if ( slice == MAP_FAILED )
+            {
+                slice = 0;
+                unmap();
+                ret = INTERNAL_ERROR;
+            }
+        }
+        else
+        {
+            // 升级前按 HTTP/1.1 选择了 sendfile 路径
+            m_file_address = map_file();
+            if ( !m_file_address )
+            {
+                unmap();
+                ret = INTERNAL_ERROR;
+            }
+        }
+    }
+
+    long multipart_len = 0;
+    if ( ret == FILE_REQUEST && !m_cached && m_range_count > 1 )
+    {
+        multipart_len = multipart_h2( s );
+        if ( multipart_len < 0 )
+        {
+            s->parts.clear();
+            s->body.clear();
+            unmap();
+            ret = INTERNAL_ERROR;
+        }
+    }
+
+    std::vector<hpack_header> headers;
+    const char* body = 0;
+    size_t len = 0;
+
+    if ( ret == FILE_REQUEST )
+    {
+        int status = 200;
+        if ( m_cached )
+        {
+            // 缓存中只有 HTTP/1.1 的响应头，校验值按文件状态重新生成
+            make_validators();
+            body = m_cached->body();
+            len = m_cached->body_len;
+        }
+        else if ( m_range_count > 1 )
+        {
+            status = 206;
+            len = multipart_len;
+        }
+        else
+        {
+            body = m_file_address;
+            len = m_file_stat.st_size;
+            if ( m_range_count == 1 )
+            {
+                status = 206;
+                body = slice ? slice + ( m_range_start[0] - slice_off ) : body + m_range_start[0];
+                len = m_range_end[0] - m_range_start[0] + 1;
+            }
+        }
+
+        add_h2_header( headers, ":status", status );
+        if ( m_range_count > 1 )
+        {
+            std::string type = std::string( "multipart/byteranges; boundary=" ) + m_boundary;
+            add_h2_header( headers, "content-type", type.data(), type.size() );
+        }
+        else
+        {
+            add_h2_header( headers, "content-type", m_content_type );
+        }
+        add_h2_header( headers, "content-length", len );
+        if ( status == 206 && m_range_count == 1 )
+        {
+            char range[3 * DECIMAL_LEN + 16];
+            int n = snprintf( range, sizeof( range ), "bytes %lld-%lld/%lld", (long long)m_range_start[0],
+                              (long long)m_range_end[0], (long long)m_file_stat.st_size );
+            add_h2_header( headers, "content-range", range, n );
+        }
+
+        const char* encoding = m_content_encoding ? m_content_encoding : m_compress;
+        if ( encoding )
+        {
+            add_h2_header( headers, "content-encoding", encoding );
+        }
+        if ( m_compress || vary_encoding() )
+        {
+            add_h2_header( headers, "vary", "Accept-Encoding" );
+        }
+        if ( m_compress )
+        {
+            // 压缩结果与原文件字节不同，使用弱 ETag，也不支持 Range
+            std::string etag = std::string( "W/" ) + m_etag;
+            add_h2_header( headers, "etag", etag.data(), etag.size() );
+        }
+        else
+        {
+            add_h2_header( headers, "accept-ranges", "bytes" );
+            add_h2_header( headers, "etag", m_etag );
+        }
+        add_h2_header( headers, "last-modified", m_last_modified );
+
+        if ( m_max_age == 0 )
+        {
+            add_h2_header( headers, "cache-control", "no-cache" );
+        }
+        else if ( m_max_age > 0 )
+        {
+            char control[DECIMAL_LEN + 32];
+            int n = snprintf( control, sizeof( control ), "public, max-age=%ld%s", m_max_age,
+                              m_immutable ? ", immutable" : "" );
+            add_h2_header( headers, "cache-control", control, n );
+        }
+    }
+    else if ( ret == ROUTE_REQUEST )
+    {
+        // 处理器生成的响应体交给流持有，头部名按 HTTP/2 的要求转为小写
+        route_response* r = m_route;
+        m_route = 0;
+        bool no_body = r->status < 200 || r->status == 204 || r->status == 304;
+        add_h2_header( headers, ":status", r->status );
+        if ( !no_body )
+        {
+            if ( r->content_type )
+            {
+                add_h2_header( headers, "content-type", r->content_type );
+            }
+            add_h2_header( headers, "content-length", r->body.size() );
+            s->body.swap( r->body );
+            body = s->body.data();
+            len = s->body.size();
+        }
+        for ( size_t i = 0; i < r->headers.size(); i++ )
+        {
+            std::string name = r->headers[i].first;
+            for ( size_t j = 0; j < name.size(); j++ )
+            {
+                name[j] = tolower( (unsigned char)name[j] );
+            }
+            add_h2_header( headers, name.c_str(), r->headers[i].second.data(), r->headers[i].second.size() );
+        }
+        delete r;
+    }
+    else
+    {
+        // 错误页是 HTML，也不应被长期缓存
+        m_max_age = -1;
+
+        int status;
+        const char* type = default_content_type;
+        if ( ret == RANGE_NOT_SATISFIABLE )
+        {
+            status = 416;
+            body = error_416_form;
+            len = strlen( error_416_form );
+        }
+        else
+        {
+            ERROR_PAGE page;
+            switch ( ret )
+            {
+                case BAD_REQUEST:       page = ERROR_400; status = 400; break;
+                case FORBIDDEN_REQUEST: page = ERROR_403; status = 403; break;
+                case NO_RESOURCE:       page = ERROR_404; status = 404; break;
+                case METHOD_NOT_ALLOWED: page = ERROR_405; status = 405; break;
+                case BAD_GATEWAY:       page = ERROR_502; status = 502; break;
+                case GATEWAY_TIMEOUT:   page = ERROR_504; status = 504; break;
+                default:                page = ERROR_500; status = 500; break;
+            }
+            const error_response& r = m_error_responses[page];
+            body = r.body.data();
+            len = r.body.size();
+            type = r.type.c_str();
+        }
+
+        add_h2_header( headers, ":status", status );
+        add_h2_header( headers, "content-type", type );
+        add_h2_header( headers, "content-length", len );
+        if ( status == 405 )
+        {
+            add_h2_header( headers, "allow", "GET, HEAD" );
+        }
+        if ( status == 416 )
+        {
+            char range[DECIMAL_LEN + 16];
+            int n = snprintf( range, sizeof( range ), "bytes */%lld", (long long)m_file_stat.st_size );
+            add_h2_header( headers, "content-range", range, n );
+        }
+    }
+
+    add_h2_header( headers, "date", http_date::now(), http_date::LEN );
+    if ( m_max_age >= 0 )
+    {
+        char expires[http_date::LEN + 1];
+        http_date::format( http_date::time() + m_max_age, expires );
+        add_h2_header( headers, "expires", expires, http_date::LEN );
+    }
+
+    if ( s->parts.empty() )
+    {
+        s->data = body;
+        s->chunk = len;
+    }
+    // HEAD 的响应头带着 GET 时的 content-length，随 END_STREAM 一起发出，不发送 DATA
+    s->remaining = ( m_method == HEAD ) ? 0 : len;
+    s->entry = m_file_entry;
+    s->mapping = m_mapping;
+    s->cached = m_cached;
+    s->pack = m_pack;
+    s->slice = slice;
+    s->slice_len = slice_len;
+
+    // 资源的引用已经交给流，由会话在流的数据发送完后释放
+    m_file_entry = 0;
+    m_mapping = 0;
+    m_cached = 0;
+    m_pack = 0;
+    m_file_address = 0;
+    m_file_fd = -1;
+    m_transmit = TRANSMIT_SENDFILE;
+
+    m_h2->respond( s, headers );
+}
+
+// 主线程中发送 HTTP/2 连接的输出：输出队列发送完后向会话取下一批帧，直到没有可发送的帧或 socket 写满
+bool http_conn::write_h2()
+{
+    if ( !flush_h2() )
+    {
+        return false;
+    }
+    if ( !m_out.empty() )
+    {
+        // 等待可写的同时继续接收请求与窗口更新
+        modfd( m_epollfd, m_sockfd, EPOLLIN | EPOLLOUT );
+        return true;
+    }
+
+    if ( m_h2->closed() )
+    {
+        return false;
+    }
+    modfd( m_epollfd, m_sockfd, EPOLLIN );
+    return true;
+}
+
+bool http_conn::flush_h2()
+{
+    if ( !m_h2 )
+    {
+        return true;
+    }
+    while ( true )
+    {
+        if ( m_out.empty() )
+        {
+            m_h2->fill( m_out );
+            if ( m_out.empty() )
+            {
+                return true;
+            }
+        }
+
+        if ( send_queue() < 0 )
+        {
+            return errno == EAGAIN;
+        }
+    }
+}
+
+bool http_conn::read_tls_pending()
+{
+    if ( !m_tls_rx || SSL_pending( m_ssl ) <= 0 )
+    {
+        return false;
+    }
+    int n = SSL_read( m_ssl, m_read_buf, READ_BUFFER_SIZE );
+    if ( n <= 0 )
+    {
+        return false;
+    }
+    m_read_idx = n;
+    return true;
+}
+
+// WebSocket 握手（RFC 6455 4.2.2）：发送 101 后连接交给 WebSocket 会话，
+// 请求之后已经读入的字节是客户端的第一批帧
+bool http_conn::upgrade_ws()
+{
+    char accept[websocket_session::ACCEPT_LEN + 1];
+    websocket_session::accept_key( m_websocket_key, accept );
+
+    add_status_line( 101, ok_101_title );
+    append( HDR_UPGRADE_WEBSOCKET );
+    append_header( HDR_WEBSOCKET_ACCEPT, accept );
+    if ( !add_blank_line() )
+    {
+        return false;
+    }
+    m_out.push( m_write_buf, m_write_idx );
+    bytes_to_send = m_out.bytes();
+
+    websocket_handler* handler = websocket_session::endpoint( m_url );
+    m_ws = new websocket_session( handler, m_sockfd );
+    handler->on_open( m_ws );
+
+    int used = m_checked_index;
+    m_ws->on_input( m_read_buf + used, m_read_idx - used );
+    m_read_idx = 0;
+    return true;
+}
+
+// 工作线程中处理 WebSocket 连接上读入的帧，处理完后连接回到 epoll 中空闲等待，不占用工作线程
+void http_conn::process_ws()
+{
+    m_ws->on_input( m_read_buf, m_read_idx );
+    m_read_idx = 0;
+
+    while ( read_tls_pending() )
+    {
+        m_ws->on_input( m_read_buf, m_read_idx );
+        m_read_idx = 0;
+    }
+
+    if ( m_ws->expired() || ( m_ws->closing() && m_out.empty() && !m_ws->pending() ) )
+    {
+        close_conn();
+        return;
+    }
+    m_ws->park( m_epollfd, m_out.bytes() );
+}
+
+// 主线程中发送 WebSocket 连接的输出：输出队列发送完后取出会话中排队的帧，直到没有可发送的帧或 socket 写满
+bool http_conn::write_ws()
+{
+    if ( m_ws->expired() )
+    {
+        return false;
+    }
+
+    while ( true )
+    {
+        if ( m_out.empty() )
+        {
+            m_ws->take( m_out );
+            if ( m_out.empty() )
+            {
+                break;
+            }
+        }
+
+        if ( send_queue() < 0 )
+        {
+            if ( errno == EAGAIN )
+            {
+                m_ws->park( m_epollfd, m_out.bytes() );
+                return true;
+            }
+            return false;
+        }
+    }
+
+    // 关闭帧发送完后关闭连接
+    if ( m_ws->closing() && !m_ws->pending() )
+    {
+        return false;
+    }
+    m_ws->park( m_epollfd, 0 );
+    return true;
+}
+
+// 代理请求的一个头部：逐跳头部不转发，其余原样转发给上游
+// Content-Length 只能是一个十进制数（前后可以有空白），"5abc"、"+5"、"5, 7" 都不接受
+// 请求中出现第二个 Content-Length 时即使值相同也拒绝，避免与上游对请求体在哪里结束理解不同（请求走私）
+bool http_conn::set_content_length( const char* value )
+{
+    value += strspn( value, " \t" );
+    size_t digits = strspn( value, "0123456789" );
+    if ( m_content_length_seen || digits == 0 || value[digits + strspn( value + digits, " \t" )] != '\0' )
+    {
+        return false;
+    }
+    errno = 0;
+    long long length = strtoll( value, NULL, 10 );
+    if ( errno == ERANGE || length > LONG_MAX )
+    {
+        return false;
+    }
+    m_content_length = length;
+    m_content_length_seen = true;
+    return true;
+}
+
+http_conn::HTTP_CODE http_conn::proxy_header( char* text )
+{
+    char* colon = strchr( text, ':' );
+    if ( !colon )
+    {
+        return BAD_REQUEST;
+    }
+    size_t name_len = colon - text;
+    char* value = colon + 1;
+    value += strspn( value, " \t" );
+
+    if ( name_len == 14 && strncasecmp( text, "Content-Length", 14 ) == 0 )
+    {
+        if ( !set_content_length( value ) )
+        {
+            return BAD_REQUEST;
+        }
+        // 转发规范化之后的值
+        char length[DECIMAL_LEN];
+        m_proxy_head.append( "Content-Length: " ).append( length, format_decimal( length, m_content_length ) );
+        m_proxy_head.append( "\r\n" );
+        return NO_REQUEST;
+    }
+    else if ( name_len == 17 && strncasecmp( text, "Transfer-Encoding", 17 ) == 0 )
+    {
+        // 请求体只支持 Content-Length
+        return BAD_REQUEST;
+    }
+    else if ( name_len == 10 && strncasecmp( text, "Connection", 10 ) == 0 )
+    {
+        m_linger = ( strcasecmp( value, "keep-alive" ) == 0 );
+        return NO_REQUEST;
+    }
+    else if ( name_len == 6 && strncasecmp( text, "Expect", 6 ) == 0 )
+    {
+        // 由本端回复 100 Continue，上游直接收到请求体
+        m_proxy_continue = ( strcasecmp( value, "100-continue" ) == 0 );
+        return NO_REQUEST;
+    }
+    else if ( proxy_exchange::hop_by_hop( text, name_len )
+              || ( name_len == 14 && strncasecmp( text, "HTTP2-Settings", 14 ) == 0 ) )
+    {
+        return NO_REQUEST;
+    }
+
+    m_proxy_head.append( text ).append( "\r\n" );
+    return NO_REQUEST;
+}
+
+// 工作线程中生成发往上游的请求（请求行、转发的头部、与请求头一起读入的请求体），之后的转发由主线程进行
+bool http_conn::proxy_request()
+{
+    proxy_exchange* p = new proxy_exchange( m_proxy_route );
+
+    std::string& r = p->request;
+    r.append( m_method_name ).append( " " ).append( m_url ).append( " HTTP/1.1\r\n" );
+    r.append( m_proxy_head );
+
+    char ip[ADDRESS_LEN];
+    format_address( m_address, ip );
+    r.append( "X-Forwarded-For: " ).append( ip ).append( "\r\n" );
+    r.append( m_ssl ? "X-Forwarded-Proto: https\r\n" : "X-Forwarded-Proto: http\r\n" );
+    r.append( "Connection: keep-alive\r\n\r\n" );
+
+    long body = m_read_idx - m_checked_index;
+    if ( body > m_content_length )
+    {
+        body = m_content_length;
+    }
+    r.append( m_read_buf + m_checked_index, body );
+    p->body_left = m_content_length - body;
+    p->head_request = ( m_method == HEAD );
+
+    if ( m_proxy_continue && p->body_left > 0 )
+    {
+        static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        m_out.push( continue_100, sizeof( continue_100 ) - 1 );
+    }
+
+    m_read_idx = 0;
+    m_proxy = p;
+    return true;
+}
+
+// 按路由的均衡策略选择上游并取得连接
+bool http_conn::proxy_connect()
+{
+    proxy_exchange* p = m_proxy;
+    upstream* u = p->route->pick();
+    if ( !u )
+    {
+        return false;
+    }
+
+    p->conn = upstream_group::acquire( u, this );
+    if ( !p->conn )
+    {
+        u->failure();
+        return false;
+    }
+    p->sent = 0;
+    p->state = proxy_exchange::PROXY_SEND;
+    return true;
+}
+
+// 在主线程中推进代理转发：请求发往上游时等待上游可写或客户端可读，响应转发时等待上游可读或客户端可写，
+// 客户端的输出队列发送完之前不再读取上游（背压）
+bool http_conn::proxy_pump()
+{
+    if ( m_fcgi )
+    {
+        return fcgi_pump();
+    }
+    if ( m_async )
+    {
+        return route_pump();
+    }
+    if ( m_events )
+    {
+        return event_pump();
+    }
+
+    proxy_exchange* p = m_proxy;
+
+    while ( true )
+    {
+        if ( p->conn )
+        {
+            p->conn->active = http_date::time();
+        }
+
+        switch ( p->state )
+        {
+            case proxy_exchange::PROXY_START:
+            {
+                if ( !proxy_connect() )
+                {
+                    return proxy_error( BAD_GATEWAY );
+                }
+                break;
+            }
+            case proxy_exchange::PROXY_SEND:
+            {
+                if ( p->sent < p->request.size() )
+                {
+                    ssize_t n = send( p->conn->fd, p->request.data() + p->sent, p->request.size() - p->sent, MSG_NOSIGNAL );
+                    if ( n < 0 )
+                    {
+                        if ( errno == EAGAIN )
+                        {
+                            // 连接尚未建立或发送缓冲区已满
+                            modfd( m_epollfd, p->conn->fd, EPOLLOUT );
+                            return true;
+                        }
+                        return proxy_error( BAD_GATEWAY );
+                    }
+                    p->sent += n;
+                    p->conn->server->bytes_sent += n;
+                    break;
+                }
+
+                if ( p->body_left > 0 )
+                {
+                    if ( !m_out.empty() )
+                    {
+                        // 先发出 100 Continue，客户端收到后才发送请求体
+                        if ( send_queue() < 0 )
+                        {
+                            if ( errno == EAGAIN )
+                            {
+                                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                                return true;
+                            }
+                            return false;
+                        }
+                        break;
+                    }
+
+                    // 请求体的下一块：上一块发送完才读取，客户端的发送速度受上游限制
+                    m_read_idx = 0;
+                    if ( !read() )
+                    {
+                        return false;
+                    }
+                    if ( m_read_idx == 0 )
+                    {
+                        modfd( m_epollfd, m_sockfd, EPOLLIN );
+                        return true;
+                    }
+                    long n = ( m_read_idx < p->body_left ) ? m_read_idx : p->body_left;
+                    p->request.assign( m_read_buf, n );
+                    p->sent = 0;
+                    p->body_left -= n;
+                    p->streamed = true;
+                    m_read_idx = 0;
+                    break;
+                }
+
+                p->state = proxy_exchange::PROXY_HEAD;
+                break;
+            }
+            default:
+            {
+                if ( !m_out.empty() )
+                {
+                    if ( send_queue() < 0 )
+                    {
+                        if ( errno == EAGAIN )
+                        {
+                            modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                            return true;
+                        }
+                        return false;
+                    }
+                    break;
+                }
+
+                if ( p->state == proxy_exchange::PROXY_DONE )
+                {
+                    return proxy_finish();
+                }
+
+                // 输出队列已经发送完，缓冲区可以重新使用；响应头可能分几次读入
+                size_t off = ( p->state == proxy_exchange::PROXY_HEAD ) ? p->buf_len : 0;
+                ssize_t n = recv( p->conn->fd, p->buf + off, proxy_exchange::BUFFER_SIZE - off, 0 );
+                if ( n < 0 && errno == EAGAIN )
+                {
+                    modfd( m_epollfd, p->conn->fd, EPOLLIN );
+                    return true;
+                }
+                if ( n <= 0 )
+                {
+                    if ( p->state == proxy_exchange::PROXY_BODY && p->framing == proxy_exchange::BODY_CLOSE )
+                    {
+                        p->state = proxy_exchange::PROXY_DONE;
+                        break;
+                    }
+                    return proxy_error( BAD_GATEWAY );
+                }
+                p->conn->server->bytes_received += n;
+
+                const char* data = p->buf;
+                size_t len = n;
+                if ( p->state == proxy_exchange::PROXY_HEAD )
+                {
+                    p->buf_len += n;
+                    int head_len = p->parse_head( m_linger );
+                    if ( head_len < 0 )
+                    {
+                        return proxy_error( BAD_GATEWAY );
+                    }
+                    if ( head_len == 0 )
+                    {
+                        break;
+                    }
+
+                    struct timespec now;
+                    clock_gettime( CLOCK_MONOTONIC, &now );
+                    p->conn->server->responses++;
+                    p->conn->server->latency_us += ( now.tv_sec - p->started.tv_sec ) * 1000000
+                                                 + ( now.tv_nsec - p->started.tv_nsec ) / 1000;
+
+                    if ( p->framing == proxy_exchange::BODY_CLOSE )
+                    {
+                        m_linger = false;
+                    }
+                    m_out.push( p->head.data(), p->head.size() );
+                    data = p->buf + head_len;
+                    len = p->buf_len - head_len;
+                }
+
+                if ( len > 0 )
+                {
+                    size_t used = p->body( data, len );
+                    if ( used < len )
+                    {
+                        // 响应之后还有多余的数据，上游连接不能再复用
+                        p->reusable = false;
+                    }
+                    if ( used > 0 )
+                    {
+                        m_out.push( data, used );
+                    }
+                }
+                break;
+            }
+        }
+    }
+}
+
+// 上游出错或超时：请求还能完整重发时换一条连接重试（复用的空闲连接可能已被上游关闭，
+// 或连接没有建立），否则在客户端还没有收到响应头时回复 502 / 504，已经开始转发响应时只能关闭连接
+bool http_conn::proxy_error( HTTP_CODE code )
+{
+    proxy_exchange* p = m_proxy;
+
+    if ( p->conn )
+    {
+        upstream_conn* c = p->conn;
+        p->conn = 0;
+
+        bool nothing_received = ( p->state <= proxy_exchange::PROXY_HEAD && p->buf_len == 0 && code == BAD_GATEWAY );
+        bool stale = c->reused && nothing_received;
+        bool refused = !c->reused && p->state == proxy_exchange::PROXY_SEND && p->sent == 0;
+        if ( !stale )
+        {
+            c->server->failure();
+        }
+        upstream_group::release( c, false );
+
+        if ( !p->streamed && nothing_received && ( stale || ( refused && ++p->tries < p->route->size() ) ) )
+        {
+            p->state = proxy_exchange::PROXY_START;
+            return proxy_pump();
+        }
+    }
+
+    bool started = ( p->state >= proxy_exchange::PROXY_BODY );
+    if ( p->body_left > 0 )
+    {
+        // 请求体没有读完，之后的数据不能当作下一个请求解析
+        m_linger = false;
+    }
+    delete p;
+    m_proxy = 0;
+
+    if ( started )
+    {
+        return false;
+    }
+
+    m_out.clear();
+    m_write_idx = 0;
+    if ( !process_write( code ) )
+    {
+        return false;
+    }
+    return write();
+}
+
+// 响应已经全部发给客户端：上游连接放回连接池，客户端连接与普通响应一样保持或关闭
+bool http_conn::proxy_finish()
+{
+    proxy_exchange* p = m_proxy;
+    p->conn->server->success();
+    upstream_group::release( p->conn, p->reusable );
+    delete p;
+    m_proxy = 0;
+
+    modfd( m_epollfd, m_sockfd, EPOLLIN );
+    if ( m_linger )
+    {
+        init();
+        return true;
+    }
+    return false;
+}
+
+void http_conn::upstream_timeout()
+{
+    if ( m_proxy && !proxy_error( GATEWAY_TIMEOUT ) )
+    {
+        close_conn();
+    }
+    else if ( m_fcgi && !fcgi_error( GATEWAY_TIMEOUT ) )
+    {
+        close_conn();
+    }
+    else if ( m_async && !route_error( GATEWAY_TIMEOUT ) )
+    {
+        close_conn();
+    }
+}
+
+// 工作线程中编码 FastCGI 请求的记录：BEGIN_REQUEST、CGI 参数（请求头转为 HTTP_ 变量）、与请求头一起读入的请求体，
+// 之后由主线程交给连接池
+bool http_conn::fcgi_begin()
+{
+    fcgi_exchange* x = new fcgi_exchange( m_fcgi_route, this, &m_out );
+
+    char* query = strchr( m_url, '?' );
+    size_t path_len = query ? (size_t)( query - m_url ) : strlen( m_url );
+    std::string script( doc_root );
+    script.append( m_url, path_len );
+    char buf[64];
+
+    x->begin_params();
+    x->param( "GATEWAY_INTERFACE", "CGI/1.1" );
+    x->param( "SERVER_PROTOCOL", "HTTP/1.1" );
+    x->param( "REQUEST_METHOD", m_method_name );
+    x->param( "REQUEST_URI", m_url );
+    x->param( "SCRIPT_NAME", 11, m_url, path_len );
+    x->param( "SCRIPT_FILENAME", script.c_str() );
+    x->param( "DOCUMENT_ROOT", doc_root );
+    x->param( "QUERY_STRING", query ? query + 1 : "" );
+    if ( m_content_length > 0 )
+    {
+        snprintf( buf, sizeof( buf ), "%ld", m_content_length );
+        x->param( "CONTENT_LENGTH", buf );
+    }
+
+    char ip[ADDRESS_LEN];
+    int port = format_address( m_address, ip );
+    x->param( "REMOTE_ADDR", ip );
+    snprintf( buf, sizeof( buf ), "%d", port );
+    x->param( "REMOTE_PORT", buf );
+    // Unix 域监听上的连接没有本端的 IP 与端口
+    sock_address local;
+    socklen_t local_len = sizeof( local );
+    if ( m_address.sa.sa_family != AF_UNIX && getsockname( m_sockfd, &local.sa, &local_len ) == 0 )
+    {
+        port = format_address( local, ip );
+        x->param( "SERVER_ADDR", ip );
+        snprintf( buf, sizeof( buf ), "%d", port );
+        x->param( "SERVER_PORT", buf );
+    }
+    if ( m_ssl )
+    {
+        x->param( "HTTPS", "on" );
+    }
+
+    // 收集到的请求头：Content-Type 为 CONTENT_TYPE，Host 同时作为 SERVER_NAME，其余转为 HTTP_ 变量
+    const char* line = m_proxy_head.c_str();
+    while ( *line )
+    {
+        const char* next = strstr( line, "\r\n" );
+        const char* colon = (const char*)memchr( line, ':', next - line );
+        size_t name_len = colon - line;
+        const char* value = colon + 1 + strspn( colon + 1, " \t" );
+        size_t value_len = next - value;
+
+        if ( name_len == 12 && strncasecmp( line, "Content-Type", 12 ) == 0 )
+        {
+            x->param( "CONTENT_TYPE", 12, value, value_len );
+        }
+        else if ( ( name_len == 14 && strncasecmp( line, "Content-Length", 14 ) == 0 )
+                  || ( name_len == 5 && strncasecmp( line, "Proxy", 5 ) == 0 ) )
+        {
+            // 请求体长度已经给出；Proxy 头会被应用当作 HTTP_PROXY 环境变量（httpoxy），不传递
+        }
+        else if ( name_len < 64 )
+        {
+            if ( name_len == 4 && strncasecmp( line, "Host", 4 ) == 0 )
+            {
+                // IPv6 字面地址 [::1]:8080 的端口在 ] 之后
+                const char* host_end = ( value[0] == '[' ) ? (const char*)memchr( value, ']', value_len ) : value;
+                const char* port = host_end ? (const char*)memchr( host_end, ':', value + value_len - host_end ) : 0;
+                x->param( "SERVER_NAME", 11, value, port ? (size_t)( port - value ) : value_len );
+            }
+            char name[69] = "HTTP_";
+            for ( size_t i = 0; i < name_len; i++ )
+            {
+                char c = line[i];
+                name[5 + i] = ( c == '-' ) ? '_' : toupper( (unsigned char)c );
+            }
+            x->param( name, 5 + name_len, value, value_len );
+        }
+        line = next + 2;
+    }
+    x->end_params();
+
+    long body = m_read_idx - m_checked_index;
+    if ( body > m_content_length )
+    {
+        body = m_content_length;
+    }
+    if ( body > 0 )
+    {
+        x->stdin_record( m_read_buf + m_checked_index, body );
+    }
+    x->body_left = m_content_length - body;
+    if ( x->body_left == 0 )
+    {
+        x->stdin_record( NULL, 0 );
+    }
+    x->head_request = ( m_method == HEAD );
+    x->keep_alive = m_linger;
+
+    if ( x->overflow )
+    {
+        delete x;
+        m_fcgi_route = 0;
+        return process_write( INTERNAL_ERROR );
+    }
+
+    if ( m_proxy_continue && x->body_left > 0 )
+    {
+        static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        m_out.push( continue_100, sizeof( continue_100 ) - 1 );
+    }
+
+    m_read_idx = 0;
+    m_fcgi = x;
+    return true;
+}
+
+// 在主线程中推进 FastCGI 请求：交给连接池、发送连接放入输出队列的响应、把请求体读入缓冲块交给连接发送；
+// 输出队列发送完后恢复因背压暂停的连接
+bool http_conn::fcgi_pump()
+{
+    fcgi_exchange* x = m_fcgi;
+    x->active = http_date::time();
+
+    if ( x->state == fcgi_exchange::FCGI_START && !x->backend->submit( x ) )
+    {
+        return fcgi_error( BAD_GATEWAY );
+    }
+
+    while ( !m_out.empty() )
+    {
+        if ( send_queue() < 0 )
+        {
+            if ( errno == EAGAIN )
+            {
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                return true;
+            }
+            return false;
+        }
+    }
+    if ( x->conn && x->conn->paused() )
+    {
+        x->conn->resume();
+    }
+
+    switch ( x->state )
+    {
+        case fcgi_exchange::FCGI_FAILED:
+            return fcgi_error( BAD_GATEWAY );
+        case fcgi_exchange::FCGI_DONE:
+            return fcgi_finish();
+        case fcgi_exchange::FCGI_ACTIVE:
+        {
+            if ( !x->want_stdin() )
+            {
+                // 等待应用的响应，或上一块请求体发送完；期间只关注客户端断开，以便尽早放弃请求
+                modfd( m_epollfd, m_sockfd, 0 );
+                return true;
+            }
+
+            // 请求体直接读入缓冲块，由连接以 STDIN 记录发送；上一块发送完才读取下一块，客户端的发送速度受应用限制
+            fcgi_block* b = x->stdin_block;
+            if ( !b )
+            {
+                b = x->stdin_block = fcgi_block::create();
+            }
+            size_t want = ( x->body_left < (long)fcgi_block::SIZE ) ? x->body_left : fcgi_block::SIZE;
+            ssize_t n = read_body( b->data, want );
+            if ( n < 0 )
+            {
+                return false;
+            }
+            if ( n == 0 )
+            {
+                modfd( m_epollfd, m_sockfd, EPOLLIN );
+                return true;
+            }
+            b->len = n;
+            x->conn->send_stdin( x, b, b->data, n );
+            return true;
+        }
+        default:
+            // 等待连接池空出请求槽
+            modfd( m_epollfd, m_sockfd, 0 );
+            return true;
+    }
+}
+
+// 应用不可用、响应无效或超时：客户端还没有收到响应头时回复 502 / 504，已经开始发送响应时只能关闭连接
+bool http_conn::fcgi_error( HTTP_CODE code )
+{
+    fcgi_exchange* x = m_fcgi;
+    bool started = x->head_done;
+    if ( x->body_left > 0 )
+    {
+        // 请求体没有读完，之后的数据不能当作下一个请求解析
+        m_linger = false;
+    }
+    m_fcgi = 0;
+    fcgi_backend::detach( x );
+
+    if ( started )
+    {
+        return false;
+    }
+
+    m_out.clear();
+    m_write_idx = 0;
+    if ( !process_write( code ) )
+    {
+        return false;
+    }
+    return write();
+}
+
+// 响应已经全部发给客户端：连接已在 END_REQUEST 时空出请求槽，客户端连接与普通响应一样保持或关闭
+bool http_conn::fcgi_finish()
+{
+    fcgi_exchange* x = m_fcgi;
+    // 应用没有读完请求体就结束了请求，或响应体比 Content-Length 短，都不能继续在这个连接上解析请求
+    bool keep = m_linger && x->body_left == 0 && !x->truncated;
+    delete x;
+    m_fcgi = 0;
+
+    modfd( m_epollfd, m_sockfd, EPOLLIN );
+    if ( keep )
+    {
+        init();
+        return true;
+    }
+    return false;
+}
+
+ssize_t http_conn::read_body( char* buf, size_t len )
+{
+    size_t n = 0;
+    while ( n < len )
+    {
+        ssize_t r;
+        if ( m_tls_rx )
+        {
+            r = SSL_read( m_ssl, buf + n, len - n );
+            if ( r <= 0 )
+            {
+                int err = SSL_get_error( m_ssl, r );
+                if ( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE )
+                {
+                    break;
+                }
+                return n > 0 ? (ssize_t)n : -1;
+            }
+        }
+        else
+        {
+            r = recv( m_sockfd, buf + n, len - n, 0 );
+            if ( r < 0 && errno == EAGAIN )
+            {
+                break;
+            }
+            if ( r <= 0 )
+            {
+                return n > 0 ? (ssize_t)n : -1;
+            }
+        }
+        n += r;
+    }
+    return n;
+}
+
+// 工作线程中调用处理器；静态文件的处理器返回 FILE_REQUEST，由 do_request 继续按文件处理
+http_conn::HTTP_CODE http_conn::do_route( route_handler* handler, route_request& req )
+{
+    req.method = m_method_name ? m_method_name : "GET";
+    req.host = m_host;
+    req.last_event_id = m_last_event_id;
+    req.head = ( m_method == HEAD );
+    // HTTP/2 的流（包括 h2c 升级的第一个请求）与预热没有可以等待的连接
+    req.async_allowed = !m_h2 && !m_upgrade_h2c && m_sockfd != -1;
+    req.conn = this;
+    req.async = 0;
+    req.channel = 0;
+
+    route_response resp;
+    ROUTE_RESULT result = handler->handle( req, resp );
+    if ( result == ROUTE_STATIC )
+    {
+        return FILE_REQUEST;
+    }
+    if ( result == ROUTE_ASYNC )
+    {
+        if ( !req.async )
+        {
+            return INTERNAL_ERROR;
+        }
+        m_async = req.async;
+        return ROUTE_PENDING;
+    }
+    if ( req.async )
+    {
+        // 调用了 defer() 却同步回复：这个异步请求不会再完成
+        router::cancel( req.async );
+        req.async = 0;
+    }
+    if ( result == ROUTE_PARK )
+    {
+        if ( !req.async_allowed || !req.channel )
+        {
+            return INTERNAL_ERROR;
+        }
+        m_events = new event_subscriber( this, req.channel, req.stream, req.since );
+        return EVENT_REQUEST;
+    }
+    m_route = new route_response( std::move( resp ) );
+    return ROUTE_REQUEST;
+}
+
+// 处理器的响应：补上 Content-Length、Date 与 Connection，响应体连同响应对象交给输出队列，发送完后释放
+bool http_conn::add_route_response()
+{
+    route_response* r = m_route;
+    m_route = 0;
+
+    // 1xx、204 与 304 没有响应体
+    bool no_body = r->status < 200 || r->status == 204 || r->status == 304;
+    bool ok = add_status_line( r->status, route_response::reason( r->status ) );
+    if ( ok && !no_body )
+    {
+        ok = add_content_length( r->body.size() );
+    }
+    if ( ok && r->content_type && !no_body )
+    {
+        ok = append_header( HDR_CONTENT_TYPE, r->content_type );
+    }
+    for ( size_t i = 0; ok && i < r->headers.size(); i++ )
+    {
+        const std::pair<std::string,std::string>& h = r->headers[i];
+        ok = append( h.first.data(), h.first.size() ) && append( ": ", 2 )
+             && append( h.second.data(), h.second.size() ) && append( CRLF );
+    }
+    ok = ok && add_date_headers() && add_linger() && add_blank_line();
+    if ( !ok )
+    {
+        // 头部超出了写缓冲区
+        delete r;
+        return false;
+    }
+
+    m_out.push( m_write_buf, m_write_idx );
+    if ( no_body || m_method == HEAD || r->body.empty() )
+    {
+        delete r;
+    }
+    else
+    {
+        m_out.push_shared( r->body.data(), r->body.size(), route_response::release, r );
+    }
+    bytes_to_send = m_out.bytes();
+    return true;
+}
+
+// 主线程中等待异步处理器：已经完成时发送响应，否则只关注客户端断开，完成时由 router::wake() 再次调用
+bool http_conn::route_pump()
+{
+    if ( !router::take( m_async ) )
+    {
+        modfd( m_epollfd, m_sockfd, 0 );
+        return true;
+    }
+
+    route_async* a = m_async;
+    m_async = 0;
+    m_route = new route_response( std::move( a->response ) );
+    delete a;
+
+    m_out.clear();
+    m_write_idx = 0;
+    if ( !process_write( ROUTE_REQUEST ) )
+    {
+        return false;
+    }
+    return write();
+}
+
+// 异步处理器超时：放弃它，回复 504
+bool http_conn::route_error( HTTP_CODE code )
+{
+    router::cancel( m_async );
+    m_async = 0;
+
+    m_out.clear();
+    m_write_idx = 0;
+    if ( !process_write( code ) )
+    {
+        return false;
+    }
+    return write();
+}
+
+// SSE 的响应头：没有 Content-Length，响应体是之后推送的消息，以关闭连接结束
+bool http_conn::add_event_stream()
+{
+    m_linger = false;
+    if ( !add_status_line( 200, ok_200_title ) || !append_header( HDR_CONTENT_TYPE, "text/event-stream" )
+         || !append( HDR_NO_CACHE ) || !add_date_headers() || !add_linger() || !add_blank_line() )
+    {
+        return false;
+    }
+    m_out.push( m_write_buf, m_write_idx );
+    bytes_to_send = m_out.bytes();
+    return true;
+}
+
+// 主线程中推进停放的连接：第一次时加入频道并补发历史消息（长轮询有消息时直接回复），之后是等待可写的 SSE 订阅者
+bool http_conn::event_pump()
+{
+    event_subscriber* s = m_events;
+    if ( !s->attached )
+    {
+        std::vector<event_message*> backlog;
+        event_channel::attach( s, backlog );
+        bool ok = true;
+        if ( s->stream && !backlog.empty() )
+        {
+            event_queue( backlog.data(), backlog.size() );
+        }
+        else if ( !backlog.empty() )
+        {
+            ok = event_reply( backlog.data(), backlog.size() );
+        }
+        for ( size_t i = 0; i < backlog.size(); i++ )
+        {
+            event_message::release( backlog[i] );
+        }
+        if ( !ok || !m_events )
+        {
+            return ok;
+        }
+    }
+    // 事件已经触发过（EPOLLONESHOT），无论是否发完都要重新注册
+    return event_flush( true );
+}
+
+// 追加消息的共享片段，count 为 0 时追加一条心跳注释
+void http_conn::event_queue( event_message** msgs, size_t count )
+{
+    static const char heartbeat[] = ":\n\n";
+    if ( count == 0 )
+    {
+        m_out.push( heartbeat, sizeof( heartbeat ) - 1 );
+    }
+    for ( size_t i = 0; i < count; i++ )
+    {
+        event_message::acquire( msgs[i] );
+        m_out.push_shared( msgs[i]->data, msgs[i]->len, event_message::release, msgs[i] );
+        m_events->since = msgs[i]->id;
+    }
+    m_events->last_sent = http_date::time();
+}
+
+// 发送输出队列：发完后只关注客户端断开，没发完时等待 EPOLLOUT
+// 只在注册的事件变化时调用 epoll_ctl，rearm 为 true 时（事件刚刚触发过）总是重新注册
+bool http_conn::event_flush( bool rearm )
+{
+    event_subscriber* s = m_events;
+    while ( !m_out.empty() )
+    {
+        if ( send_queue() < 0 )
+        {
+            if ( errno != EAGAIN )
+            {
+                return false;
+            }
+            if ( rearm || !s->writing )
+            {
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+            }
+            s->writing = true;
+            return true;
+        }
+    }
+    if ( rearm || s->writing )
+    {
+        modfd( m_epollfd, m_sockfd, 0 );
+    }
+    s->writing = false;
+    return true;
+}
+
+bool http_conn::event_send( event_message** msgs, size_t count )
+{
+    if ( !m_events->stream )
+    {
+        return event_reply( msgs, count );
+    }
+    event_queue( msgs, count );
+    if ( m_out.bytes() > event_channel::MAX_PENDING )
+    {
+        // 客户端读得太慢，积压的消息不再增加
+        return false;
+    }
+    return event_flush( false );
+}
+
+// 长轮询的响应：这批消息按 SSE 的格式作为响应体（与订阅者共享），没有消息时回复 204，之后连接可以继续发送请求
+bool http_conn::event_reply( event_message** msgs, size_t count )
+{
+    event_channel::detach( m_events );
+    delete m_events;
+    m_events = 0;
+
+    m_out.clear();
+    m_write_idx = 0;
+    size_t len = 0;
+    for ( size_t i = 0; i < count; i++ )
+    {
+        len += msgs[i]->len;
+    }
+    bool ok;
+    if ( count == 0 )
+    {
+        ok = add_status_line( 204, route_response::reason( 204 ) );
+    }
+    else
+    {
+        ok = add_status_line( 200, ok_200_title ) && add_content_length( len )
+             && append_header( HDR_CONTENT_TYPE, "text/event-stream" ) && append( HDR_NO_CACHE );
+    }
+    if ( !ok || !add_date_headers() || !add_linger() || !add_blank_line() )
+    {
+        return false;
+    }
+    m_out.push( m_write_buf, m_write_idx );
+    for ( size_t i = 0; i < count; i++ )
+    {
+        event_message::acquire( msgs[i] );
+        m_out.push_shared( msgs[i]->data, msgs[i]->len, event_message::release, msgs[i] );
+    }
+    bytes_to_send = m_out.bytes();
+    return write();
+}
@@ -11,13 +11,39 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
 #include "locker.h"
+#include "open_file_cache.h"
+#include "mmap_cache.h"
+#include "response_cache.h"
+#include "gzip_filter.h"
+#include "content_pack.h"
+#include "threadpool.h"
+#include "tls_context.h"
+#include "header_templates.h"
+#include "output_queue.h"
+#include "http_date.h"
+#include "cache_policy.h"
+#include "mime_types.h"
+#include "http2.h"
+#include "websocket.h"
+#include "upstream.h"
+#include "fastcgi.h"
+#include "router.h"
+#include "event_channel.h"
+#include "listener.h"
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
 
 
 class http_conn
@@ -31,6 +57,61 @@ class http_conn
         // 当前在线用户数量
         static int m_user_count;
 
+        // 不小于该大小的文件走 sendfile 零拷贝发送，更小的文件走 mmap + writev
+        // 小于 0 表示始终使用 mmap
+        static long m_sendfile_threshold;
+
+        // 所有工作线程共享的打开文件缓存
+        static open_file_cache *m_file_cache;
+
+        // 所有连接共享的只读文件映射
+        static mmap_cache *m_mmap_cache;
+
+        // 所有工作线程共享的热点小文件响应缓存
+        static response_cache *m_response_cache;
+
+        // 是否优先发送预压缩的 .br / .gz 文件
+        static bool m_precompressed;
+
+        // 即时压缩的最高级别，0 表示不做即时压缩
+        static int m_gzip_level;
+        // 即时压缩的文件大小范围
+        static long m_gzip_min_length;
+        static long m_gzip_max_length;
+        // 即时压缩结果的缓存，键为 路径#编码，并按文件修改时间校验
+        static response_cache *m_compressed_cache;
+
+        // 内容包模式：所有请求都从内容包中发送，不再访问网站根目录
+        static bool m_pack_mode;
+
+        // 交给阻塞 I/O 线程池的任务：把即将发送的冷文件内容读入页缓存，完成后重新注册 EPOLLOUT
+        struct prefetch_task
+        {
+            http_conn *conn;
+            void process();
+        };
+
+        // 不大于该大小的文件映射时使用 MAP_POPULATE，一次系统调用建立全部页表，发送时不再缺页
+        static long m_populate_max;
+
+        // 不小于该大小的文件视为一次性下载：sendfile 发送过的部分用 POSIX_FADV_DONTNEED 从页缓存丢弃，
+        // 避免大文件下载把热点小文件挤出页缓存，0 表示不丢弃
+        static long m_dropbehind_threshold;
+
+        // sendfile 路径上不小于该大小的文件改用 MSG_ZEROCOPY 从映射区发送，
+        // 内核不支持 SO_ZEROCOPY 时改为经管道 splice 发送，0 表示不使用
+        static long m_zerocopy_threshold;
+
+        // HTTPS 监听端口接受的连接所使用的 TLS 上下文
+        static tls_context *m_tls_context;
+
+        // 是否接受 HTTP/2：明文连接的连接前言（prior knowledge）与 Upgrade: h2c，HTTPS 连接的 ALPN h2
+        static bool m_http2;
+
+        // 阻塞 I/O 线程池，冷文件的读取在这里进行，不占用工作线程也不阻塞主线程的发送
+        // 为 NULL 时不做驻留检查
+        static threadpool<prefetch_task> *m_io_pool;
+
         // 读缓冲区的大小
         static const int READ_BUFFER_SIZE = 2048;
 
@@ -40,8 +121,71 @@ class http_conn
         // 文件名程字符串空间
         static const int FILENAME_LEN = 200;
 
+        // 单个请求最多接受的 Range 区间数，超过则忽略 Range 返回完整文件
+        static const int MAX_RANGES = 16;
+
+        // multipart/byteranges 中单个分段头部的最大长度
+        static const int RANGE_PART_SIZE = 256;
+
+        // 发送前检查并预读的文件窗口大小
+        static const long PREFETCH_WINDOW = 1024 * 1024;
+
+        // 用户态 TLS 一个记录的最大明文长度
+        static const int TLS_RECORD_SIZE = 16384;
+
+        // ETag 与 HTTP 日期字符串空间
+        static const int ETAG_LEN = 48;
+        static const int HTTP_DATE_LEN = 32;
+
 
         
+        // 文件内容的发送方式（m_file_fd 路径）
+        enum TRANSMIT
+        {
+            TRANSMIT_SENDFILE = 0,          // sendfile
+            TRANSMIT_ZEROCOPY,              // 从映射区 send(MSG_ZEROCOPY)
+            TRANSMIT_SPLICE                 // 文件 -> 管道 -> socket
+        };
+
+        // 连接上 SO_ZEROCOPY 的状态
+        enum ZEROCOPY_STATE
+        {
+            ZEROCOPY_UNKNOWN = 0,           // 尚未尝试开启
+            ZEROCOPY_ENABLED,               // 已开启
+            ZEROCOPY_UNAVAILABLE,           // 内核不支持，改用 splice
+            ZEROCOPY_COPIED                 // 内核实际做了拷贝（如本机回环），改回 sendfile
+        };
+
+        // 预先生成响应的错误状态
+        enum ERROR_PAGE
+        {
+            ERROR_400 = 0,
+            ERROR_403,
+            ERROR_404,
+            ERROR_405,
+            ERROR_500,
+            ERROR_502,
+            ERROR_504,
+            ERROR_PAGES
+        };
+
+        // 自定义错误页的最大大小
+        static const long ERROR_PAGE_MAX = 64 * 1024;
+
+        // 预先生成的错误响应，所有连接只读共享，head 为空时按原来的方式生成
+        // 随时间变化的 Date 与 Connection 头在发送时放在 head 与 body 之间
+        struct error_response
+        {
+            std::string head;
+            std::string body;
+            // HTTP/2 响应中的 content-type
+            std::string type;
+        };
+        static error_response m_error_responses[ERROR_PAGES];
+
+        // 按路径决定的 Cache-Control / Expires 策略，启动时配置，之后只读
+        static cache_policy m_cache_policy;
+
         // HTTP 请求方法
         enum METHOD
         {
@@ -80,14 +224,28 @@ class http_conn
             GET_REQUEST,                    // 获得了一个完整的 GET 请求
             BAD_REQUEST,                    // 客户端请求语法错误
             NO_RESOURCE,                    // 请求资源服务器不存在
+            METHOD_NOT_ALLOWED,             // 静态文件只接受 GET 与 HEAD
             FORBIDDEN_REQUEST,              // 客户端对请求资源没有访问权限
             FILE_REQUEST,                   // 文件请求成功
             INTERNAL_ERROR,                 // 服务器内部错误
+            RANGE_NOT_SATISFIABLE,          // 请求的 Range 区间均无法满足
+            WEBSOCKET_REQUEST,              // 合法的 WebSocket 握手请求
+            PROXY_REQUEST,                  // 匹配代理路由的请求，转发给上游
+            BAD_GATEWAY,                    // 上游不可用或响应无效
+            GATEWAY_TIMEOUT,                // 上游长时间没有响应
+            ROUTE_REQUEST,                  // 注册的处理器已经生成了响应
+            ROUTE_PENDING,                  // 处理器将异步完成响应
+            EVENT_REQUEST,                  // 处理器把连接停放在事件频道上（SSE 或长轮询）
             CLOSED_CONNECTION               // 客户端关闭连接
         };
 
 
-        http_conn(){}
+        http_conn() : m_sockfd(-1),m_ssl(0),m_handshaking(false),m_tls_rx(false),m_tls_tx(false),m_zc_state(ZEROCOPY_UNKNOWN),m_zc_sent(0),m_zc_done(0),
+                      m_zc_retired(0),m_pipe_bytes(0),m_h2(0),m_ws(0),m_proxy(0),m_fcgi(0),m_route(0),m_async(0),m_events(0)
+        {
+            m_prefetch.conn = this;
+            m_pipe[0] = m_pipe[1] = -1;
+        }
         ~http_conn(){}
 
 
@@ -95,26 +253,71 @@ class http_conn
         // 解析 HTTP 请求报文
         void process();
 
-        // 初始化新接收的连接
-        void init(int sockfd,const sockaddr_in & addr);
+        // 初始化新接收的连接，tls 为 true 时先进行 TLS 握手
+        void init(int sockfd,const sock_address & addr,bool tls = false);
+
+        // TLS 握手尚未完成，读写事件都交给工作线程继续握手
+        bool handshaking() const { return m_ssl && m_handshaking; }
 
         // 关闭连接
         void close_conn();
 
+        // 网站根目录下的 path 发生变化，使各缓存中对应的条目失效
+        // subtree 为 true 时 path 为目录，其下所有条目都失效
+        static void invalidate(const std::string &path,bool subtree);
+
+        // inotify 监视失效，打开文件缓存回到按 ttl 校验
+        static void on_watch_lost();
+
+        // 启动预热：像处理一个 GET 请求一样走一遍 do_request / process_write（原文件与压缩版本各一次），
+        // 填充打开文件缓存、响应缓存与压缩结果缓存，并让文件内容进入页缓存
+        static bool warm(const char *url);
+
+        // 启动时生成 400 / 403 / 404 / 405 / 500 / 502 / 504 的完整响应（保持连接与关闭连接各一份），之后直接发送
+        // dir 不为 NULL 时，其中的 400.html 等文件作为对应状态的自定义错误页，页面不是普通文件或超过 ERROR_PAGE_MAX 时返回 false
+        static bool build_error_responses(const char *dir);
+
         // 非阻塞读
         bool read();
 
         // 非阻塞写
         bool write();
 
+        // HTTP/2 连接同时可读可写时，主线程先把会话中已有的帧发送到 socket 写满为止，再交给工作线程处理输入，
+        // 不重新注册事件；不是 HTTP/2 连接时什么也不做。出错时返回 false
+        bool flush_h2();
+
+        // 处理 EPOLLERR：若只是错误队列中的零拷贝完成通知，回收后重新注册事件并返回 true
+        bool zerocopy_event();
+
+        // 正在转发给上游或 FastCGI 应用，或者等待异步处理器完成、停放在事件频道上，客户端与后端连接上的事件都在主线程中交给 proxy_pump()
+        bool proxying() const { return m_proxy != 0 || m_fcgi != 0 || m_async != 0 || m_events != 0; }
+        // 推进代理转发、FastCGI 请求、异步处理器的响应或事件频道的推送，直到等待某一端的事件；返回 false 时关闭客户端连接
+        bool proxy_pump();
+        // 停放在事件频道上的连接收到消息（主线程中由 event_channel 调用）：SSE 追加到输出队列并尽量发送，count 为 0 时发送心跳；
+        // 长轮询以这些消息回复，count 为 0 时回复 204，之后回到普通的请求处理。返回 false 时关闭连接
+        bool event_send( event_message** msgs, size_t count );
+        // 上游、FastCGI 应用或异步处理器长时间没有进展，由 upstream_group::tick() / fcgi_backend::tick() / router::tick() 调用
+        void upstream_timeout();
+
 
     private:
 
+        // HTTP/2 会话把每个流上的请求交给 serve_h2()
+        friend class http2_session;
+
         // 当前 HTTP 连接的 socket
         int m_sockfd;
 
-        // 通信的socket地址
-        sockaddr_in m_address;
+        // 通信的socket地址（IPv4、IPv6，Unix 域只有地址族）
+        sock_address m_address;
+
+        // HTTPS 连接的 TLS 会话，明文连接为 NULL
+        SSL* m_ssl;
+        bool m_handshaking;
+        // 握手后该方向没有交给内核（kTLS），需要经过 SSL_read / SSL_write
+        bool m_tls_rx;
+        bool m_tls_tx;
 
         // 读缓冲区
         char m_read_buf[READ_BUFFER_SIZE];
@@ -142,8 +345,57 @@ class http_conn
         bool m_linger;
         // Content_length
         long m_content_length;
+        // 已组装的响应中响应体的字节数，HEAD 请求发送前从输出队列中去掉
+        long m_body_bytes;
+        // 已经收到过 Content-Length 头
+        bool m_content_length_seen;
         // 要访问资源路径名称
         char m_real_file[FILENAME_LEN];
+        // Range 请求头，例如 bytes=0-499,1000-
+        char *m_range;
+        // If-Range 请求头，值为 ETag 或 HTTP 日期
+        char *m_if_range;
+        // Upgrade: h2c 请求及其 HTTP2-Settings 头
+        bool m_upgrade_h2c;
+        char *m_http2_settings;
+        // 请求方法原文，代理时原样转发
+        char *m_method_name;
+        // 匹配的代理路由，NULL 表示由本机处理
+        upstream_group *m_proxy_route;
+        // 匹配的 FastCGI 路由，请求头与代理请求一样收集
+        fcgi_backend *m_fcgi_route;
+        // 代理请求中转发给上游的头部，以及客户端是否发送了 Expect: 100-continue
+        std::string m_proxy_head;
+        bool m_proxy_continue;
+        // Upgrade: websocket 请求及其 Sec-WebSocket-Key / Sec-WebSocket-Version 头
+        bool m_upgrade_websocket;
+        char *m_websocket_key;
+        int m_websocket_version;
+        // Last-Event-ID 请求头，SSE 重连时从它之后补发
+        char *m_last_event_id;
+        // Accept-Encoding 请求头
+        char *m_accept_encoding;
+        // 选中的预压缩版本的 Content-Encoding，NULL 表示发送原文件
+        const char *m_content_encoding;
+        // 需要即时压缩时使用的编码（gzip / deflate），NULL 表示不压缩
+        const char *m_compress;
+        // 响应的 Content-Type
+        const char *m_content_type;
+        // 响应的 Cache-Control max-age，小于 0 表示不发送缓存相关的头部
+        long m_max_age;
+        bool m_immutable;
+
+        // 解析后的区间，闭区间 [start, end]
+        off_t m_range_start[MAX_RANGES];
+        off_t m_range_end[MAX_RANGES];
+        // 有效区间的数量，0 表示返回完整文件
+        int m_range_count;
+        // multipart/byteranges 的分隔符
+        char m_boundary[24];
+
+        // 目标文件的 ETag 与 Last-Modified
+        char m_etag[ETAG_LEN];
+        char m_last_modified[HTTP_DATE_LEN];
 
 
 
@@ -153,28 +405,97 @@ class http_conn
         int m_write_idx;         
         // 客户请求的目标文件被mmap到内存中的起始位置              
         char* m_file_address;                   
+        // m_file_address 所在的共享映射，内容包模式下为 NULL
+        mmap_cache::mapping* m_mapping;
         // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
         struct stat m_file_stat;                
-        // 我们将采用writev来执行写操作，所以定义下面两个成员
-        struct iovec m_iv[2];                   
-        // m_iv_count表示被写内存块的数量
-        int m_iv_count;
+        // 从打开文件缓存中取得的目标文件，响应发送完毕后在 unmap() 中释放
+        open_file_cache::entry *m_file_entry;
+        // 内容包模式下正在使用的内容包，m_file_address 指向其映射区内部
+        content_pack *m_pack;
+        // 命中或刚放入响应缓存的完整响应，非 NULL 时直接从缓存内存发送
+        response_cache::object *m_cached;
+        // sendfile 路径下使用的目标文件（属于 m_file_entry），-1 表示使用 mmap 路径
+        int m_file_fd;
+        // m_file_fd 路径上已经发送到的文件偏移
+        off_t m_file_offset;
+        // 该文件偏移之前的内容已确认在页缓存中
+        off_t m_resident_until;
+        // 该文件偏移之前已经发出 WILLNEED 预读提示
+        off_t m_advised_until;
+        // 该文件偏移之前的内容已经从页缓存丢弃
+        off_t m_dropped_until;
+        // 交给 I/O 线程池的任务（不需要额外分配内存）
+        prefetch_task m_prefetch;
+        // 本次响应文件内容的发送方式
+        TRANSMIT m_transmit;
+        // 以下零拷贝与管道状态属于整个连接，不随每个请求重置
+        ZEROCOPY_STATE m_zc_state;
+        // 已发出的 MSG_ZEROCOPY 调用数与已收到完成通知的调用数
+        unsigned int m_zc_sent;
+        unsigned int m_zc_done;
+        // 响应已经发送完毕、但页面仍被内核引用的映射区，全部完成通知到达后再解除映射
+        mmap_cache::mapping* m_zc_retired;
+        // splice 使用的管道，以及管道中尚未送入 socket 的字节数
+        int m_pipe[2];
+        size_t m_pipe_bytes;
+        // 待发送的响应：响应头 + 文件内容（或每个区间的分段头与文件片段 + 结尾分隔符）
+        // HTTP/2 连接上为会话放入的帧
+        output_queue m_out;
+        // 切换到 HTTP/2 后的会话，属于整个连接，HTTP/1.1 连接为 NULL
+        http2_session* m_h2;
+        // 升级为 WebSocket 后的会话，连接关闭时释放
+        websocket_session* m_ws;
+        // 正在进行的代理转发
+        proxy_exchange* m_proxy;
+        // 正在进行的 FastCGI 请求
+        fcgi_exchange* m_fcgi;
+        // 处理器生成的响应，放入输出队列时交给队列释放
+        route_response* m_route;
+        // 正在等待完成的异步处理器
+        route_async* m_async;
+        // 停放在事件频道上时的订阅状态
+        event_subscriber* m_events;
 
         // 将要发送的数据的字节数
-        int bytes_to_send;            
+        long bytes_to_send;            
         // 已经发送的字节数
-        int bytes_have_send;            
+        long bytes_have_send;            
 
 	// 这一组函数被process_write调用以填充HTTP应答。
    	 void unmap();
    	 bool add_response( const char* format, ... );
+   	 // 把编译期生成的片段或已知长度的字符串直接拷贝进写缓冲区
+   	 bool append( const char* data, size_t len );
+   	 bool append( const header_fragment& f ) { return append( f.data, f.len ); }
+   	 bool append_decimal( unsigned long long value );
+   	 // 头部名 + 字符串值 + \r\n
+   	 bool append_header( const header_fragment& name, const char* value );
    	 bool add_content( const char* content );
    	 bool add_content_type();
    	 bool add_status_line( int status, const char* title );
-   	 bool add_headers( int content_length );
-   	 bool add_content_length( int content_length );
+   	 bool add_headers( long content_length );
+   	 // Date 与 Expires 随时间变化，不放入响应缓存，每次发送时重新生成
+   	 bool add_date_headers();
+   	 bool add_cache_control();
+   	 bool add_content_length( long content_length );
    	 bool add_linger();
    	 bool add_blank_line();
+   	 // 响应是否要带 Vary: Accept-Encoding
+   	 bool vary_encoding() const;
+   	 bool add_file_headers();
+   	 bool add_content_range( off_t start, off_t end );
+   	 // 为 multipart/byteranges 生成新的分隔符
+   	 void make_boundary();
+   	 bool add_multipart_ranges();
+   	 // 把第 i 个区间的 multipart 分段头写入 buf，返回长度，放不下时返回 -1
+   	 int format_range_part( char* buf, int i );
+   	 bool add_cached_response();
+   	 // 直接发送预先生成的错误响应，没有时返回 false
+   	 bool add_error_response( ERROR_PAGE page );
+   	 bool add_compressed_response();
+   	 // 压缩已映射的文件并放入压缩结果缓存，成功后 m_cached 指向结果
+   	 bool compress_response();
 
 
 
@@ -183,6 +504,8 @@ class http_conn
 
         // 初始化连接所需要的其余的信息
         void init();
+        // 重置与单个请求有关的状态（HTTP/2 的每个流都要重置一次）
+        void reset_request();
 
 
         // 解析 HTTP 请求
@@ -193,6 +516,56 @@ class http_conn
 	
 	// 填充 HTTP 应答
 	bool process_write(HTTP_CODE ret);
+	// 组装静态文件与错误状态的响应，HEAD 请求也照常组装响应体，由 process_write 去掉
+	bool add_static_response(HTTP_CODE ret);
+
+        // 发送输出队列队首的段（文件段或连续的内存段）并移除已发送的部分，返回值与 errno 的含义同 writev
+        ssize_t send_queue();
+
+        // HTTP/2：处理读入的帧、切换协议、在流上按 HTTP/1.1 的流程生成响应、发送会话中的帧
+        void process_h2();
+        bool upgrade_h2(HTTP_CODE ret);
+        void serve_h2(http2_stream* s,http2_request& req);
+        void respond_h2(http2_stream* s,HTTP_CODE ret);
+        long multipart_h2(http2_stream* s);
+        bool write_h2();
+        // 用户态 TLS 已经解密、之前读缓冲区放不下的数据不会再触发 EPOLLIN，读入空的读缓冲区，没有时返回 false
+        bool read_tls_pending();
+
+        // WebSocket：发送 101 后切换协议、处理读入的帧、发送会话中排队的帧
+        bool upgrade_ws();
+        void process_ws();
+        bool write_ws();
+
+        // 反向代理：收集转发的请求头、生成发往上游的请求、取得上游连接、出错时重试或回复 502 / 504、结束转发
+        // 解析并设置 Content-Length，格式错误或重复时返回 false
+        bool set_content_length( const char* value );
+        HTTP_CODE proxy_header( char* text );
+        bool proxy_request();
+        bool proxy_connect();
+        bool proxy_error( HTTP_CODE code );
+        bool proxy_finish();
+
+        // FastCGI：编码请求的记录、在主线程中推进请求、出错时回复 502 / 504、结束请求
+        bool fcgi_begin();
+        bool fcgi_pump();
+        bool fcgi_error( HTTP_CODE code );
+        bool fcgi_finish();
+        // 把请求体直接读入 buf，返回读入的字节数，暂时没有数据时返回 0，对端关闭或出错时返回 -1
+        ssize_t read_body( char* buf, size_t len );
+
+        // 路由：把请求交给匹配的处理器、发送处理器生成的响应、在主线程中等待异步处理器、超时时回复 504
+        HTTP_CODE do_route( route_handler* handler, route_request& req );
+        bool add_route_response();
+        bool route_pump();
+        bool route_error( HTTP_CODE code );
+
+        // 事件频道：SSE 的响应头、在主线程中加入频道与补发历史消息、把输出队列追加的消息发出去、回复长轮询
+        bool add_event_stream();
+        bool event_pump();
+        void event_queue( event_message** msgs, size_t count );
+        bool event_flush( bool rearm );
+        bool event_reply( event_message** msgs, size_t count );
 
         // 按照 /r/n 解析行
         LINE_STATUS parse_line();
@@ -203,6 +576,39 @@ class http_conn
 
         HTTP_CODE do_request();
 
+        // 内容包模式下的 do_request：索引查找后直接指向包内的内容
+        HTTP_CODE do_pack_request(content_pack *pack,const char *path,size_t path_len);
+
+        // 解析 Range / If-Range，返回 RANGE_NOT_SATISFIABLE 或 FILE_REQUEST
+        HTTP_CODE parse_range();
+        // 根据文件状态生成 ETag 与 Last-Modified
+        void make_validators();
+
+        // 计算下一段将要发送的文件内容 [off, off + len)，没有待发送的文件内容时返回 false
+        bool body_window(off_t &off,off_t &len);
+        // 下一段将要发送的文件内容是否已在页缓存中（mincore / preadv2 RWF_NOWAIT）
+        bool body_resident();
+        // 在 I/O 线程池中执行：读入下一段文件内容后重新注册 EPOLLOUT
+        void prefetch();
+        // 按发送位置向内核发出预读（WILLNEED）与丢弃（DONTNEED）提示
+        void advise_body();
+        // 从共享映射中取得 m_file_entry 的映射并记录在 m_mapping 中，失败时返回 NULL
+        char* map_file();
+        // 为 m_file_fd 路径上的大文件选择 MSG_ZEROCOPY / splice 发送方式
+        void select_transmit();
+        // 按 m_transmit 发送输出队列队首的文件段，返回值与 errno 的含义同 sendfile
+        ssize_t send_body(const output_queue::segment& s);
+        // 从错误队列中取出零拷贝完成通知，全部完成后解除保留的映射区
+        void reap_zerocopy();
+        // 在工作线程中推进 TLS 握手
+        void handshake();
+        // 用户态 TLS 的分散写：把第一个非空内存块交给 SSL_write，返回值与 errno 的含义同 writev
+        ssize_t tls_writev(const struct iovec* iov,int count);
+        // 按 Accept-Encoding 选择预压缩的 .br / .gz 文件替换 m_file_entry
+        void select_precompressed();
+        // 没有预压缩版本时判断是否需要即时压缩，需要时设置 m_compress
+        bool select_compression();
+
 };
 
 
@@ -0,0 +1,66 @@
+#include "http_date.h"
+
+char http_date::s_slots[SLOTS][LEN + 1] = { "Thu, 01 Jan 1970 00:00:00 GMT" };
+volatile int http_date::s_current = 0;
+volatile time_t http_date::s_time = 0;
+
+
+void http_date::update()
+{
+    time_t t = ::time(NULL);
+    if (t == s_time)
+    {
+        return;
+    }
+
+    int next = (s_current + 1) % SLOTS;
+    format(t,s_slots[next]);
+    // 槽位写完后再发布，读者不会看到写了一半的日期
+    __sync_synchronize();
+    s_time = t;
+    s_current = next;
+}
+
+
+// 不使用 strftime：它受 locale 影响，且每次都要解析格式串
+void http_date::format(time_t t,char *buf)
+{
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    struct tm tm;
+    gmtime_r(&t,&tm);
+
+    char *p = buf;
+    p[0] = days[tm.tm_wday * 3];
+    p[1] = days[tm.tm_wday * 3 + 1];
+    p[2] = days[tm.tm_wday * 3 + 2];
+    p[3] = ',';
+    p[4] = ' ';
+    p[5] = '0' + tm.tm_mday / 10;
+    p[6] = '0' + tm.tm_mday % 10;
+    p[7] = ' ';
+    p[8] = months[tm.tm_mon * 3];
+    p[9] = months[tm.tm_mon * 3 + 1];
+    p[10] = months[tm.tm_mon * 3 + 2];
+    p[11] = ' ';
+    int year = tm.tm_year + 1900;
+    p[12] = '0' + year / 1000 % 10;
+    p[13] = '0' + year / 100 % 10;
+    p[14] = '0' + year / 10 % 10;
+    p[15] = '0' + year % 10;
+    p[16] = ' ';
+    p[17] = '0' + tm.tm_hour / 10;
+    p[18] = '0' + tm.tm_hour % 10;
+    p[19] = ':';
+    p[20] = '0' + tm.tm_min / 10;
+    p[21] = '0' + tm.tm_min % 10;
+    p[22] = ':';
+    p[23] = '0' + tm.tm_sec / 10;
+    p[24] = '0' + tm.tm_sec % 10;
+    p[25] = ' ';
+    p[26] = 'G';
+    p[27] = 'M';
+    p[28] = 'T';
+    p[29] = '\0';
+}
@@ -0,0 +1,37 @@
+#ifndef HTTP_DATE_H
+#define HTTP_DATE_H
+
+#include <time.h>
+
+// 缓存的 HTTP 日期（RFC 7231 IMF-fixdate，如 Sun, 06 Nov 1994 08:49:37 GMT）
+// 主线程的定时器每秒调用一次 update() 重新生成，工作线程无锁读取：
+// 新的日期写入下一个槽位后才切换当前下标，读者拿到的槽位要过 SLOTS - 1 秒才会被再次改写
+class http_date
+{
+
+    public:
+
+        // 日期字符串的长度（不含结尾的 \0）
+        static const int LEN = 29;
+
+        // 时间进入新的一秒时重新生成，只在主线程中调用
+        static void update();
+
+        // 最近一次 update() 时的日期与时间
+        static const char *now() { return s_slots[s_current]; }
+        static time_t time() { return s_time; }
+
+        // 把 t 格式化为 HTTP 日期，buf 至少需要 LEN + 1 字节
+        static void format(time_t t,char *buf);
+
+    private:
+
+        static const int SLOTS = 4;
+
+        static char s_slots[SLOTS][LEN + 1];
+        static volatile int s_current;
+        static volatile time_t s_time;
+
+};
+
+#endif
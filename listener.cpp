@@ -0,0 +1,403 @@
+#include "listener.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+
+extern void addfd(int epollfd,int fd,bool one_shot);
+
+std::vector<listener *> listener::s_listeners;
+
+
+int format_address(const sock_address &addr,char *ip)
+{
+    if (addr.sa.sa_family == AF_INET6)
+    {
+        const in6_addr &a = addr.in6.sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&a))
+        {
+            // 双栈监听上的 IPv4 客户端
+            inet_ntop(AF_INET,a.s6_addr + 12,ip,ADDRESS_LEN);
+        }
+        else
+        {
+            inet_ntop(AF_INET6,&a,ip,ADDRESS_LEN);
+        }
+        return ntohs(addr.in6.sin6_port);
+    }
+    if (addr.sa.sa_family == AF_INET)
+    {
+        inet_ntop(AF_INET,&addr.in.sin_addr,ip,ADDRESS_LEN);
+        return ntohs(addr.in.sin_port);
+    }
+    strcpy(ip,"unix:");
+    return 0;
+}
+
+
+listener::listener() :
+    m_addr_len(0),m_any(false),m_tls(false),m_backlog(DEFAULT_BACKLOG),m_reuseport(true),m_v6only(false),
+    m_nodelay(false),m_deferred(false),m_fastopen(0),m_rcvbuf(0),m_sndbuf(0),m_mode(-1),m_fd(-1)
+{
+    memset(&m_addr,0,sizeof(m_addr));
+}
+
+
+// 解析 选项=数值，数值按 C 的写法（mode=0660 为八进制）
+static bool option_value(const std::string &opt,const char *name,int &value)
+{
+    size_t n = strlen(name);
+    if (opt.compare(0,n,name) != 0 || opt.size() <= n || opt[n] != '=')
+    {
+        return false;
+    }
+    char *end;
+    long v = strtol(opt.c_str() + n + 1,&end,0);
+    if (*end != '\0' || v < 0)
+    {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+
+bool listener::add(const char *spec,bool tls)
+{
+    std::string s(spec);
+    size_t comma = s.find(',');
+    std::string address = s.substr(0,comma);
+    if (address.empty())
+    {
+        return false;
+    }
+
+    listener *l = new listener;
+    l->m_name = address;
+    l->m_tls = tls;
+
+    // 选项
+    while (comma != std::string::npos)
+    {
+        size_t next = s.find(',',comma + 1);
+        std::string opt = s.substr(comma + 1,next == std::string::npos ? std::string::npos : next - comma - 1);
+        comma = next;
+
+        if (opt == "tls")
+        {
+            l->m_tls = true;
+        }
+        else if (opt == "ipv6only")
+        {
+            l->m_v6only = true;
+        }
+        else if (opt == "noreuseport")
+        {
+            l->m_reuseport = false;
+        }
+        else if (opt == "nodelay")
+        {
+            l->m_nodelay = true;
+        }
+        else if (opt == "deferred")
+        {
+            l->m_deferred = true;
+        }
+        else if (!option_value(opt,"backlog",l->m_backlog) && !option_value(opt,"fastopen",l->m_fastopen)
+                 && !option_value(opt,"rcvbuf",l->m_rcvbuf) && !option_value(opt,"sndbuf",l->m_sndbuf)
+                 && !option_value(opt,"mode",l->m_mode))
+        {
+            fprintf(stderr,"unknown listen option %s\n",opt.c_str());
+            delete l;
+            return false;
+        }
+    }
+
+    if (address.compare(0,5,"unix:") == 0)
+    {
+        std::string path = address.substr(5);
+        sockaddr_un *un = (sockaddr_un *)&l->m_addr;
+        if (path.empty() || path.size() >= sizeof(un->sun_path))
+        {
+            delete l;
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path,path.c_str(),path.size() + 1);
+        l->m_addr_len = sizeof(sockaddr_un);
+        s_listeners.push_back(l);
+        return true;
+    }
+
+    // 主机与端口：[IPv6]:端口、主机:端口，或者只有端口
+    std::string host;
+    std::string port = address;
+    if (address[0] == '[')
+    {
+        size_t close = address.find("]:");
+        if (close == std::string::npos)
+        {
+            delete l;
+            return false;
+        }
+        host = address.substr(1,close - 1);
+        port = address.substr(close + 2);
+    }
+    else
+    {
+        size_t colon = address.rfind(':');
+        if (colon != std::string::npos)
+        {
+            host = address.substr(0,colon);
+            port = address.substr(colon + 1);
+        }
+    }
+    if (port.empty() || port.find_first_not_of("0123456789") != std::string::npos)
+    {
+        delete l;
+        return false;
+    }
+
+    if (host.empty() || host == "*")
+    {
+        // 双栈：一个 IPv6 套接字同时接受 IPv4 连接
+        l->m_any = true;
+        sockaddr_in6 *in6 = (sockaddr_in6 *)&l->m_addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;
+        in6->sin6_port = htons(atoi(port.c_str()));
+        l->m_addr_len = sizeof(sockaddr_in6);
+        s_listeners.push_back(l);
+        return true;
+    }
+
+    // 只在启动时解析一次
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if (getaddrinfo(host.c_str(),port.c_str(),&hints,&res) != 0 || !res)
+    {
+        fprintf(stderr,"cannot resolve listen address %s\n",address.c_str());
+        delete l;
+        return false;
+    }
+    memcpy(&l->m_addr,res->ai_addr,res->ai_addrlen);
+    l->m_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    s_listeners.push_back(l);
+    return true;
+}
+
+
+bool listener::any_tls()
+{
+    for (size_t i = 0; i < s_listeners.size(); i++)
+    {
+        if (s_listeners[i]->m_tls)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool listener::set_options()
+{
+    int family = m_addr.ss_family;
+    int one = 1;
+
+    if (family == AF_UNIX)
+    {
+        return true;
+    }
+
+    // 多个进程可以绑定同一个端口，由内核分配连接
+    if (m_reuseport && setsockopt(m_fd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one)) < 0)
+    {
+        return false;
+    }
+    // 重启时不必等待 TIME_WAIT 的连接
+    setsockopt(m_fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+
+    if (family == AF_INET6)
+    {
+        int v6only = m_v6only ? 1 : 0;
+        if (setsockopt(m_fd,IPPROTO_IPV6,IPV6_V6ONLY,&v6only,sizeof(v6only)) < 0)
+        {
+            return false;
+        }
+    }
+    if (m_nodelay && setsockopt(m_fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one)) < 0)
+    {
+        return false;
+    }
+    // 请求数据到达后才唤醒 accept，只连接不发送的客户端不占用连接对象
+    if (m_deferred)
+    {
+        int seconds = 5;
+        if (setsockopt(m_fd,IPPROTO_TCP,TCP_DEFER_ACCEPT,&seconds,sizeof(seconds)) < 0)
+        {
+            return false;
+        }
+    }
+    if (m_fastopen > 0 && setsockopt(m_fd,IPPROTO_TCP,TCP_FASTOPEN,&m_fastopen,sizeof(m_fastopen)) < 0)
+    {
+        return false;
+    }
+    if (m_rcvbuf > 0 && setsockopt(m_fd,SOL_SOCKET,SO_RCVBUF,&m_rcvbuf,sizeof(m_rcvbuf)) < 0)
+    {
+        return false;
+    }
+    if (m_sndbuf > 0 && setsockopt(m_fd,SOL_SOCKET,SO_SNDBUF,&m_sndbuf,sizeof(m_sndbuf)) < 0)
+    {
+        return false;
+    }
+    return true;
+}
+
+
+bool listener::open()
+{
+    m_fd = socket(m_addr.ss_family,SOCK_STREAM | SOCK_CLOEXEC,0);
+    if (m_fd < 0 && m_any && (errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT))
+    {
+        // 系统没有 IPv6，只给出端口的监听改为 IPv4
+        sockaddr_in6 in6 = *(sockaddr_in6 *)&m_addr;
+        sockaddr_in *in = (sockaddr_in *)&m_addr;
+        memset(&m_addr,0,sizeof(m_addr));
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = INADDR_ANY;
+        in->sin_port = in6.sin6_port;
+        m_addr_len = sizeof(sockaddr_in);
+        m_fd = socket(AF_INET,SOCK_STREAM | SOCK_CLOEXEC,0);
+    }
+    if (m_fd < 0)
+    {
+        fprintf(stderr,"listen %s: socket: %s\n",m_name.c_str(),strerror(errno));
+        return false;
+    }
+
+    if (!set_options())
+    {
+        fprintf(stderr,"listen %s: setsockopt: %s\n",m_name.c_str(),strerror(errno));
+        return false;
+    }
+
+    if (m_addr.ss_family == AF_UNIX)
+    {
+        // 上次运行留下的套接字文件：没有进程在监听时删除，否则报告地址已被占用
+        const char *path = ((sockaddr_un *)&m_addr)->sun_path;
+        struct stat st;
+        if (lstat(path,&st) == 0 && S_ISSOCK(st.st_mode))
+        {
+            int probe = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+            bool alive = probe >= 0 && connect(probe,(struct sockaddr *)&m_addr,m_addr_len) == 0;
+            if (probe >= 0)
+            {
+                close(probe);
+            }
+            if (!alive)
+            {
+                unlink(path);
+            }
+        }
+    }
+
+    if (bind(m_fd,(struct sockaddr *)&m_addr,m_addr_len) < 0)
+    {
+        fprintf(stderr,"listen %s: bind: %s\n",m_name.c_str(),strerror(errno));
+        return false;
+    }
+    if (m_addr.ss_family == AF_UNIX && m_mode >= 0 && chmod(((sockaddr_un *)&m_addr)->sun_path,m_mode) < 0)
+    {
+        fprintf(stderr,"listen %s: chmod: %s\n",m_name.c_str(),strerror(errno));
+        return false;
+    }
+    if (::listen(m_fd,m_backlog) < 0)
+    {
+        fprintf(stderr,"listen %s: listen: %s\n",m_name.c_str(),strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+bool listener::open_all(int epollfd)
+{
+    for (size_t i = 0; i < s_listeners.size(); i++)
+    {
+        listener *l = s_listeners[i];
+        if (!l->open())
+        {
+            return false;
+        }
+        addfd(epollfd,l->m_fd,false);
+        printf("listening on %s%s\n",l->m_name.c_str(),l->m_tls ? " (tls)" : "");
+    }
+    return true;
+}
+
+
+listener *listener::find(int fd)
+{
+    for (size_t i = 0; i < s_listeners.size(); i++)
+    {
+        if (s_listeners[i]->m_fd == fd)
+        {
+            return s_listeners[i];
+        }
+    }
+    return NULL;
+}
+
+
+void listener::close_all()
+{
+    for (size_t i = 0; i < s_listeners.size(); i++)
+    {
+        listener *l = s_listeners[i];
+        if (l->m_fd != -1)
+        {
+            close(l->m_fd);
+            if (l->m_addr.ss_family == AF_UNIX)
+            {
+                unlink(((sockaddr_un *)&l->m_addr)->sun_path);
+            }
+        }
+        delete l;
+    }
+    s_listeners.clear();
+}
+
+
+int listener::accept(sock_address &peer)
+{
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int fd = ::accept(m_fd,(struct sockaddr *)&addr,&len);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    memset(&peer,0,sizeof(peer));
+    if (addr.ss_family == AF_INET || addr.ss_family == AF_INET6)
+    {
+        memcpy(&peer,&addr,addr.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6));
+    }
+    else
+    {
+        peer.sa.sa_family = AF_UNIX;
+    }
+    return fd;
+}
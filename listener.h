@@ -0,0 +1,86 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+// 客户端或本端的地址：IPv4、IPv6，Unix 域套接字只记录地址族
+// 比 sockaddr_storage 小得多，每个连接对象都带一份
+union sock_address
+{
+    sockaddr sa;
+    sockaddr_in in;
+    sockaddr_in6 in6;
+};
+
+// ip 至少需要的空间
+const size_t ADDRESS_LEN = 48;
+
+// 把地址格式化为 ip 字符串（IPv4 映射的 IPv6 地址按 IPv4 显示，Unix 域为 "unix:"），返回端口（Unix 域为 0）
+int format_address(const sock_address &addr,char *ip);
+
+// 一个监听套接字：TCP（IPv4、IPv6 或双栈）或 Unix 域，每个监听有自己的套接字选项与是否为 HTTPS
+// 所有监听都注册在主线程的 epoll 中，接受的连接与其他连接一样处理
+class listener
+{
+
+    public:
+
+        // 默认的 listen 队列长度
+        static const int DEFAULT_BACKLOG = 511;
+
+        // 在启动时添加监听，格式为 地址[,选项...]，格式错误或无法解析地址时返回 false
+        // 地址：端口（双栈，所有地址）、IPv4:端口、[IPv6]:端口、主机名:端口、unix:/path/to/socket
+        // 选项：tls、backlog=N、ipv6only、noreuseport、nodelay、deferred、fastopen=N、rcvbuf=N、sndbuf=N、mode=0660
+        static bool add(const char *spec,bool tls = false);
+        static bool empty() { return s_listeners.empty(); }
+        // 是否有 HTTPS 监听，需要加载证书
+        static bool any_tls();
+
+        // 创建、绑定所有监听套接字并加入 epoll，任何一个失败时输出原因并返回 false
+        static bool open_all(int epollfd);
+        // fd 属于监听套接字时返回它
+        static listener *find(int fd);
+        // 关闭所有监听套接字，删除 Unix 域套接字文件
+        static void close_all();
+
+        // 接受一个连接，peer 填入对端地址，没有连接时返回 -1
+        int accept(sock_address &peer);
+
+        int fd() const { return m_fd; }
+        bool tls() const { return m_tls; }
+        const std::string &name() const { return m_name; }
+
+    private:
+
+        listener();
+        bool open();
+        // 按选项设置监听套接字，接受的连接继承其中的 TCP_NODELAY 与缓冲区大小
+        bool set_options();
+
+        std::string m_name;
+        sockaddr_storage m_addr;
+        socklen_t m_addr_len;
+        // 只给出了端口：优先双栈，系统不支持 IPv6 时改用 IPv4
+        bool m_any;
+        bool m_tls;
+        int m_backlog;
+        bool m_reuseport;
+        bool m_v6only;
+        bool m_nodelay;
+        bool m_deferred;
+        int m_fastopen;
+        int m_rcvbuf;
+        int m_sndbuf;
+        // Unix 域套接字文件的权限，-1 表示按 umask
+        int m_mode;
+        int m_fd;
+
+        static std::vector<listener *> s_listeners;
+
+};
+
+#endif
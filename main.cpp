@@ -9,10 +9,20 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <signal.h>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "file_watcher.h"
+#include "warmup.h"
+#include "tls_context.h"
+#include "websocket.h"
+#include "upstream.h"
+#include "fastcgi.h"
+#include "router.h"
+#include "listener.h"
+#include "event_channel.h"
 
 #define MAX_FD          65535 // 最大文件描述符个数
 #define MAX_EVENT_NUM   10000 // 一次监听的最大事件数量
@@ -32,33 +42,369 @@ void addsig(int sig,void(handler)(int))
     sigaction(sig,&sa,NULL);
 }
 
+// 打印用法
+void usage(const char *prog)
+{
+    fprintf(stderr,"Usage.. ./%s [options] [port_num]\n",basename(prog));
+    fprintf(stderr,"  port_num    在所有地址上接受连接（IPv6 双栈，不支持 IPv6 时为 IPv4），与 -L port_num 相同\n");
+    fprintf(stderr,"  -s bytes    文件不小于 bytes 时使用 sendfile 发送，-1 表示始终使用 mmap（默认 %ld）\n",
+            http_conn::m_sendfile_threshold);
+    fprintf(stderr,"  -C entries  打开文件缓存的最大条目数，0 表示不缓存（默认 1024）\n");
+    fprintf(stderr,"  -T seconds  打开文件缓存条目重新校验的间隔（默认 5）\n");
+    fprintf(stderr,"  -H bytes    热点小文件响应缓存的字节预算，0 表示不缓存（默认 64M）\n");
+    fprintf(stderr,"  -O bytes    可放入响应缓存的最大文件（默认 64K）\n");
+    fprintf(stderr,"  -z          不发送预压缩的 .br / .gz 文件\n");
+    fprintf(stderr,"  -Z level    即时压缩的最高级别，负载高时自动降低，0 表示不压缩（默认 %d）\n",
+            http_conn::m_gzip_level);
+    fprintf(stderr,"  -G bytes    即时压缩结果缓存的字节预算（默认 32M）\n");
+    fprintf(stderr,"  -w          不用 inotify 监视网站根目录，缓存只按 -T 的间隔重新校验\n");
+    fprintf(stderr,"  -p file     从 pack 工具生成的内容包发送整个站点，收到 SIGHUP 时重新加载\n");
+    fprintf(stderr,"  -M file     启动时按清单预热文件（每行一个 URL 路径）\n");
+    fprintf(stderr,"  -S file     启动时按快照预热，退出时把热点文件写入快照\n");
+    fprintf(stderr,"  -B ms       预热的时间预算（默认 2000）\n");
+    fprintf(stderr,"  -I count    引用全部释放后保留的空闲文件映射数（默认 256）\n");
+    fprintf(stderr,"  -P bytes    不大于该大小的文件映射时预先建立页表（默认 %ld）\n",
+            http_conn::m_populate_max);
+    fprintf(stderr,"  -D bytes    不小于该大小的文件发送后从页缓存丢弃，0 表示不丢弃（默认 0）\n");
+    fprintf(stderr,"  -X bytes    不小于该大小的文件用 MSG_ZEROCOPY（不支持时用 splice）发送，0 表示不使用（默认 0）\n");
+    fprintf(stderr,"  -L spec     监听 地址[,选项...]，可以指定多次，地址为 端口、IPv4:端口、[IPv6]:端口、主机:端口\n");
+    fprintf(stderr,"              或 unix:/path/to/socket，选项为 tls、backlog=N、ipv6only、noreuseport、nodelay、\n");
+    fprintf(stderr,"              deferred、fastopen=N、rcvbuf=N、sndbuf=N、mode=0660（Unix 域套接字文件的权限）\n");
+    fprintf(stderr,"  -t port     同时在 port 上接受 HTTPS 连接，与 -L port,tls 相同，需要 -c 与 -k\n");
+    fprintf(stderr,"  -c file     HTTPS 证书链（PEM）\n");
+    fprintf(stderr,"  -k file     HTTPS 私钥（PEM）\n");
+    fprintf(stderr,"  -2          不接受 HTTP/2（h2c 连接前言、Upgrade: h2c 与 ALPN h2）\n");
+    fprintf(stderr,"  -W path     在 path 上提供回显消息的 WebSocket 端点，可以指定多次\n");
+    fprintf(stderr,"  -U route    反向代理 [lc:]前缀=主机:端口[,主机:端口...]，如 /api/=127.0.0.1:8080,127.0.0.1:8081，\n");
+    fprintf(stderr,"              默认轮询，lc: 表示最少连接数，可以指定多次\n");
+    fprintf(stderr,"  -F route    FastCGI [mpx:]前缀=套接字路径或主机:端口，如 /php/=/run/php-fpm.sock，\n");
+    fprintf(stderr,"              连接保持复用，mpx: 表示应用支持在一条连接上同时处理多个请求，可以指定多次\n");
+    fprintf(stderr,"  -V path     在 path 上提供事件频道：path 为 SSE 订阅，path/poll 为长轮询（?since=id），可以指定多次\n");
+    fprintf(stderr,"  -R prefix   在 prefix 下提供内置的 health 与 metrics 端点，如 /_server/\n");
+    fprintf(stderr,"  -E dir      自定义错误页所在的目录（400.html / 403.html / 404.html / 500.html）\n");
+    fprintf(stderr,"  -e rule     缓存策略 前缀=秒数，如 /static/=86400，0 表示每次重新校验，可以指定多次\n");
+    fprintf(stderr,"              文件名带内容指纹的资源（如 app.3f9a1c2e.js）总是缓存一年并标记 immutable\n");
+    fprintf(stderr,"  -A threads  读取冷文件的 I/O 线程数，0 表示不检查页缓存驻留（默认 4）\n");
+}
+
+// 收到 SIGTERM / SIGINT 时退出事件循环
+static volatile sig_atomic_t stop_server = 0;
+
+void on_sigterm(int sig)
+{
+    stop_server = 1;
+}
+
+// 收到 SIGHUP 时重新加载内容包
+static volatile sig_atomic_t reload_pack = 0;
+
+void on_sighup(int sig)
+{
+    reload_pack = 1;
+}
+
+// 收到 SIGUSR1 时输出缓存统计
+static volatile sig_atomic_t dump_stats = 0;
+
+void on_sigusr1(int sig)
+{
+    dump_stats = 1;
+}
+
+void print_stats()
+{
+    open_file_cache *fc = http_conn::m_file_cache;
+    response_cache *rc = http_conn::m_response_cache;
+    printf("open file cache: hits %lu misses %lu\n",fc->hits(),fc->misses());
+    mmap_cache *mc = http_conn::m_mmap_cache;
+    printf("mmap cache: hits %lu misses %lu idle %d\n",mc->hits(),mc->misses(),mc->idle());
+    printf("response cache: hits %lu misses %lu bytes %lu\n",rc->hits(),rc->misses(),(unsigned long)rc->bytes());
+    rc = http_conn::m_compressed_cache;
+    printf("compressed cache: hits %lu misses %lu bytes %lu\n",rc->hits(),rc->misses(),(unsigned long)rc->bytes());
+    if (http_conn::m_tls_context)
+    {
+        printf("tls: handshakes %lu resumed %lu\n",http_conn::m_tls_context->handshakes(),
+               http_conn::m_tls_context->resumed());
+    }
+    upstream_group::print_stats();
+    fcgi_backend::print_stats();
+    router::print_stats();
+    event_channel::print_stats();
+    fflush(stdout);
+}
+
 // 添加文件描述符到 epoll
 extern void addfd(int epollfd,int fd,bool one_shot);
 // 从 epoll 中删除文件描述符
 extern void removefd(int epollfd,int fd);
 // 修改文件描述符
 extern void modfd(int epollfd,int fd,int ev);
+// 网站根目录
+extern const char* doc_root;
 
 int main(int argc,char ** argv)
 {
 
-    if (argc <= 1)
+    // 解析选项
+    int opt;
+    int cache_entries = 1024;
+    int cache_ttl = 5;
+    long response_budget = 64 * 1024 * 1024;
+    long response_max_object = 64 * 1024;
+    long compressed_budget = 32 * 1024 * 1024;
+    bool watch = true;
+    const char *pack_path = NULL;
+    const char *manifest = NULL;
+    const char *snapshot = NULL;
+    int warm_budget = 2000;
+    int io_threads = 4;
+    int idle_mappings = 256;
+    const char *error_dir = NULL;
+    websocket_echo echo;
+    const char *builtin_prefix = NULL;
+    const char *tls_cert = NULL;
+    const char *tls_key = NULL;
+    while ((opt = getopt(argc,argv,"s:C:T:H:O:zZ:G:wp:M:S:B:A:P:D:X:t:c:k:I:E:e:2W:U:F:R:L:V:")) != -1)
     {
-        fprintf(stderr,"Usage.. ./%s port_num\n",basename(argv[0]));
+        switch (opt)
+        {
+            case 's':
+                http_conn::m_sendfile_threshold = atol(optarg);
+                break;
+            case 'C':
+                cache_entries = atoi(optarg);
+                break;
+            case 'T':
+                cache_ttl = atoi(optarg);
+                break;
+            case 'H':
+                response_budget = atol(optarg);
+                break;
+            case 'O':
+                response_max_object = atol(optarg);
+                break;
+            case 'z':
+                http_conn::m_precompressed = false;
+                break;
+            case 'Z':
+                http_conn::m_gzip_level = atoi(optarg);
+                break;
+            case 'G':
+                compressed_budget = atol(optarg);
+                break;
+            case 'w':
+                watch = false;
+                break;
+            case 'p':
+                pack_path = optarg;
+                break;
+            case 'M':
+                manifest = optarg;
+                break;
+            case 'S':
+                snapshot = optarg;
+                break;
+            case 'B':
+                warm_budget = atoi(optarg);
+                break;
+            case 'A':
+                io_threads = atoi(optarg);
+                break;
+            case 'P':
+                http_conn::m_populate_max = atol(optarg);
+                break;
+            case 'D':
+                http_conn::m_dropbehind_threshold = atol(optarg);
+                break;
+            case 'X':
+                http_conn::m_zerocopy_threshold = atol(optarg);
+                break;
+            case 't':
+                if (!listener::add(optarg,true))
+                {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'L':
+                if (!listener::add(optarg))
+                {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'I':
+                idle_mappings = atoi(optarg);
+                break;
+            case 'E':
+                error_dir = optarg;
+                break;
+            case 'e':
+                if (!http_conn::m_cache_policy.add_rule(optarg))
+                {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case '2':
+                http_conn::m_http2 = false;
+                break;
+            case 'W':
+                websocket_session::add_endpoint(optarg,&echo);
+                break;
+            case 'U':
+                if (!upstream_group::add_route(optarg))
+                {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'F':
+                if (!fcgi_backend::add_route(optarg))
+                {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'R':
+                builtin_prefix = optarg;
+                break;
+            case 'V':
+                if (!event_channel::add(optarg))
+                {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'c':
+                tls_cert = optarg;
+                break;
+            case 'k':
+                tls_key = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(-1);
+        }
+    }
+
+    // 位置参数的端口与 -L 一样作为一个监听
+    if (optind < argc && !listener::add(argv[optind]))
+    {
+        usage(argv[0]);
+        exit(-1);
+    }
+    if (listener::empty())
+    {
+        usage(argv[0]);
         exit(-1);
     }
 
-    // 获取端口号
-    int port = atoi(argv[1]);
+    // 内置端点与静态文件都经过路由，注册完后编译，预热之前就要可用
+    static route_static static_files;
+    static route_health health;
+    static route_metrics metrics;
+    if (builtin_prefix)
+    {
+        std::string prefix(builtin_prefix);
+        if (!router::add((prefix + "health").c_str(),&health) || !router::add((prefix + "metrics").c_str(),&metrics))
+        {
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+    router::add("/*",&static_files);
+    router::compile();
 
     // 对 SIGPIPE 信号处理
     addsig(SIGPIPE,SIG_IGN);
+    addsig(SIGUSR1,on_sigusr1);
+    addsig(SIGHUP,on_sighup);
+    addsig(SIGTERM,on_sigterm);
+    addsig(SIGINT,on_sigterm);
+
+    // HTTPS：证书加载失败时直接退出，不在缺少 HTTPS 的情况下运行
+    if (listener::any_tls())
+    {
+        if (!tls_cert || !tls_key)
+        {
+            usage(argv[0]);
+            exit(-1);
+        }
+        http_conn::m_tls_context = tls_context::create(tls_cert,tls_key,http_conn::m_http2);
+        if (!http_conn::m_tls_context)
+        {
+            exit(-1);
+        }
+    }
+
+    // 响应头中的 Date 在预热与接受连接之前先生成一次，之后由定时器每秒更新
+    http_date::update();
+
+    // 错误响应在启动时整体生成一次
+    if (!http_conn::build_error_responses(error_dir))
+    {
+        exit(-1);
+    }
+
+    // 内容包模式：启动时映射一次
+    if (pack_path)
+    {
+        content_pack *pack = content_pack::open(pack_path);
+        if (!pack)
+        {
+            exit(-1);
+        }
+        content_pack::install(pack);
+        http_conn::m_pack_mode = true;
+        printf("serving %u files from %s\n",pack->count(),pack_path);
+    }
+
+    // 创建打开文件缓存
+    http_conn::m_file_cache = new open_file_cache(cache_entries,cache_ttl);
+    // 创建共享文件映射
+    http_conn::m_mmap_cache = new mmap_cache(idle_mappings);
+    // 创建热点小文件响应缓存
+    http_conn::m_response_cache = new response_cache(response_budget,response_max_object);
+    // 创建即时压缩结果缓存
+    http_conn::m_compressed_cache = new response_cache(compressed_budget,http_conn::m_gzip_max_length);
+
+    // 监视网站根目录，文件变化时立即让缓存失效，此后缓存条目不再按 ttl 重新 stat
+    file_watcher *watcher = NULL;
+    if (watch)
+    {
+        watcher = new file_watcher(http_conn::invalidate,http_conn::on_watch_lost);
+        if (watcher->start(doc_root))
+        {
+            http_conn::m_file_cache->set_trusted(true);
+        }
+        else
+        {
+            fprintf(stderr,"cannot watch %s, caches fall back to ttl revalidation\n",doc_root);
+            delete watcher;
+            watcher = NULL;
+        }
+    }
+
+    // 在开始接受连接之前预热：先按清单，再按上次退出时保存的快照
+    if (manifest)
+    {
+        printf("warmed %d files from %s\n",warm_up(manifest,warm_budget),manifest);
+    }
+    if (snapshot)
+    {
+        printf("warmed %d files from %s\n",warm_up(snapshot,warm_budget),snapshot);
+    }
 
     // 创建线程池，初始化线程池
     threadpool<http_conn> *pool = NULL;
     try
     {
         pool = new threadpool<http_conn>;
+        if (io_threads > 0)
+        {
+            http_conn::m_io_pool = new threadpool<http_conn::prefetch_task>(io_threads);
+        }
     }
     catch(...)
     {
@@ -68,46 +414,68 @@ int main(int argc,char ** argv)
     //  创建一个数组用于保存所有的客户端信息  
     http_conn *users = new http_conn[MAX_FD];
 
-    // 创建监听套接字
-    int listenfd = socket(PF_INET,SOCK_STREAM,0);
-    if (listenfd < 0)
-    {
-	perror("socket()");
-	exit(-1);
-    }
-
-    // 设置端口复用
-    int reuse = 1;
-    setsockopt(listenfd,SOL_SOCKET,SO_REUSEPORT,&reuse,sizeof(reuse));
+    // 创建 epoll 对象、事件数组、添加
+    epoll_event events[MAX_EVENT_NUM];
 
-    // 绑定
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+    int epollfd = epoll_create(200);
 
+    // 创建所有监听套接字并加入 epoll 中，任何一个无法绑定都直接退出
+    if (!listener::open_all(epollfd))
+    {
+        exit(-1);
+    }
 
-    bind(listenfd,(struct sockaddr *)&address,sizeof(address));
-   // if ()
-   // {
-   //
-   // }
+    http_conn::m_epollfd = epollfd;
 
-    // 监听
-    listen(listenfd,5);
+    // 每秒触发一次的定时器，更新缓存的 Date
+    int timerfd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec tick = { { 1,0 },{ 1,0 } };
+    if (timerfd < 0 || timerfd_settime(timerfd,0,&tick,NULL) < 0)
+    {
+        perror("timerfd");
+        exit(-1);
+    }
+    addfd(epollfd,timerfd,false);
 
-    // 创建 epoll 对象、事件数组、添加
-    epoll_event events[MAX_EVENT_NUM];
+    // 其他线程向空闲的 WebSocket 连接发送数据时通过它唤醒主线程
+    int wakefd = websocket_session::init();
+    if (wakefd < 0)
+    {
+        perror("eventfd");
+        exit(-1);
+    }
+    addfd(epollfd,wakefd,false);
 
-    int epollfd = epoll_create(200);
+    // 异步处理器完成时通过它唤醒主线程
+    int routefd = router::init();
+    if (routefd < 0)
+    {
+        perror("eventfd");
+        exit(-1);
+    }
+    addfd(epollfd,routefd,false);
 
-    // 将监听的文件描述符加入 epoll 中
-    addfd(epollfd,listenfd,false);
+    // 事件频道发布消息时通过它唤醒主线程
+    int eventsfd = event_channel::init();
+    if (eventsfd < 0)
+    {
+        perror("eventfd");
+        exit(-1);
+    }
+    addfd(epollfd,eventsfd,false);
 
-    http_conn::m_epollfd = epollfd;
+    // 上游连接与客户端连接共用这个 epoll，启动时先检查一次各个上游
+    if (upstream_group::enabled())
+    {
+        upstream_group::start(epollfd);
+    }
+    if (fcgi_backend::enabled())
+    {
+        fcgi_backend::start(epollfd);
+    }
 
 
-    while (true)
+    while (!stop_server)
     {
 
         int num = epoll_wait(epollfd,events,MAX_EVENT_NUM - 1,-1);
@@ -118,21 +486,89 @@ int main(int argc,char ** argv)
             break;
         }
 
+        if (dump_stats)
+        {
+            dump_stats = 0;
+            print_stats();
+        }
+
+        if (reload_pack)
+        {
+            // 新包映射成功后才替换，正在发送旧包内容的连接继续持有旧包的引用
+            reload_pack = 0;
+            if (pack_path)
+            {
+                content_pack *pack = content_pack::open(pack_path);
+                if (pack)
+                {
+                    content_pack::install(pack);
+                    printf("reloaded %u files from %s\n",pack->count(),pack_path);
+                }
+            }
+        }
+
+        bool ws_tick = false;
+        bool ws_wake = false;
+
         // 循环遍历事件数组
         for (int i = 0; i < num; i++)
         {
             int sockfd = events[i].data.fd;
 
-            if (sockfd == listenfd)
+            if (sockfd == timerfd)
+            {
+                uint64_t expirations;
+                while (::read(timerfd,&expirations,sizeof(expirations)) > 0)
+                {
+                }
+                http_date::update();
+                ws_tick = true;
+            }
+            else if (sockfd == wakefd)
             {
-                // 有客户端连接进来
+                ws_wake = true;
+            }
+            else if (sockfd == routefd)
+            {
+                // 异步处理器完成，发送它们的响应
+                router::wake();
+            }
+            else if (sockfd == eventsfd)
+            {
+                // 事件频道有新消息，扇出给订阅者
+                event_channel::wake();
+            }
+            else if (upstream_conn *uc = upstream_group::find(sockfd))
+            {
+                // 上游连接：转发中的交给对应的客户端连接，其余是健康检查或空闲连接
+                http_conn *client = uc->client;
+                if (!client)
+                {
+                    upstream_group::on_event(uc,events[i].events);
+                }
+                else if (!client->proxy_pump())
+                {
+                    client->close_conn();
+                }
+            }
+            else if (fcgi_conn *fc = fcgi_backend::find(sockfd))
+            {
+                // FastCGI 连接：发送排队的记录，读取响应并推进相关的客户端连接
+                fc->on_event(events[i].events);
+            }
+            else if (listener *l = listener::find(sockfd))
+            {
+                // 有客户端连接进来（任意一个监听：TCP 或 Unix 域，明文或 HTTPS）
 
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd,(struct sockaddr*)&client_address,&client_addrlength);
+                sock_address client_address;
+                int connfd = l->accept(client_address);
+                if (connfd < 0)
+                {
+                    continue;
+                }
 
                 // 目前可接受的连接数已经满了
-                if (http_conn::m_user_count >= MAX_FD)
+                if (http_conn::m_user_count >= MAX_FD || connfd >= MAX_FD)
                 {
                     // 向客户端返回信息，表示服务器正忙
 
@@ -141,7 +577,17 @@ int main(int argc,char ** argv)
                 }
 
                 // 将新的客户的数据初始化，放入数组中
-                users[connfd].init(connfd,client_address);
+                users[connfd].init(connfd,client_address,l->tls());
+                if (l->tls() && !users[connfd].handshaking())
+                {
+                    // 无法创建 TLS 会话
+                    users[connfd].close_conn();
+                }
+            }
+            else if ((events[i].events & EPOLLERR) && !(events[i].events & (EPOLLRDHUP | EPOLLHUP))
+                     && users[sockfd].zerocopy_event())
+            {
+                // 只是 MSG_ZEROCOPY 的完成通知，已经回收
             }
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
@@ -149,11 +595,29 @@ int main(int argc,char ** argv)
                 users[sockfd].close_conn();
 
 
+            }
+            else if (users[sockfd].handshaking())
+            {
+                // TLS 握手需要的数据到达或可以继续发送，交给工作线程继续握手
+                pool->append(users + sockfd);
+            }
+            else if (users[sockfd].proxying())
+            {
+                // 代理转发只做 I/O，在主线程中进行
+                if (!users[sockfd].proxy_pump())
+                {
+                    users[sockfd].close_conn();
+                }
             }
             else if (events[i].events & EPOLLIN)
             {
                 // 有读的事件发生
-                if (users[sockfd].read())
+                // HTTP/2 连接同时可写时先发送已有的帧，对端不停发送请求时输出也能前进
+                if ((events[i].events & EPOLLOUT) && !users[sockfd].flush_h2())
+                {
+                    users[sockfd].close_conn();
+                }
+                else if (users[sockfd].read())
                 {
                     // 一次性将数据读完
                     // 数组首地址 users + 该fd的偏移 sockfd 定位到该对象在数组中的起始地址
@@ -175,15 +639,53 @@ int main(int argc,char ** argv)
                 }
             }
         }
-        
+
+        // 这一批事件处理完后再遍历 WebSocket 连接：发送 ping、为有新数据的空闲连接注册 EPOLLOUT
+        // 以及上游与 FastCGI 应用：健康检查、回收空闲连接、转发超时，还有等待太久的异步处理器与事件频道的心跳
+        if (ws_tick)
+        {
+            websocket_session::tick(http_date::time());
+            router::tick(http_date::time());
+            event_channel::tick(http_date::time());
+            if (upstream_group::enabled())
+            {
+                upstream_group::tick(http_date::time());
+            }
+            if (fcgi_backend::enabled())
+            {
+                fcgi_backend::tick(http_date::time());
+            }
+        }
+        if (ws_tick || ws_wake)
+        {
+            websocket_session::wake(epollfd);
+        }
 
     }
 
 
+    // 保存当前的热点文件，下次启动时预热
+    if (snapshot && !http_conn::m_pack_mode)
+    {
+        save_hot_snapshot(snapshot,doc_root,1000);
+    }
+
+    close(timerfd);
+    close(wakefd);
+    close(routefd);
+    close(eventsfd);
     close(epollfd);
-    close(listenfd);
+    listener::close_all();
     delete [] users;
     delete pool;
+    delete http_conn::m_io_pool;
+    delete watcher;
+    delete http_conn::m_compressed_cache;
+    delete http_conn::m_response_cache;
+    delete http_conn::m_file_cache;
+    delete http_conn::m_mmap_cache;
+    delete http_conn::m_tls_context;
+    content_pack::install(NULL);
 
     return 0;
 }
@@ -0,0 +1,96 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#include <cstddef>
+
+// 扩展名 -> MIME 类型的编译期常量表，服务器与 pack 工具共用
+struct mime_entry
+{
+    const char *ext;
+    const char *type;
+};
+
+constexpr mime_entry MIME_TYPES[] = {
+    { ".html", "text/html; charset=utf-8" },
+    { ".htm",  "text/html; charset=utf-8" },
+    { ".css",  "text/css; charset=utf-8" },
+    { ".js",   "text/javascript; charset=utf-8" },
+    { ".mjs",  "text/javascript; charset=utf-8" },
+    { ".json", "application/json" },
+    { ".map",  "application/json" },
+    { ".webmanifest", "application/manifest+json" },
+    { ".txt",  "text/plain; charset=utf-8" },
+    { ".md",   "text/markdown; charset=utf-8" },
+    { ".csv",  "text/csv; charset=utf-8" },
+    { ".xml",  "application/xml" },
+    { ".svg",  "image/svg+xml" },
+    { ".png",  "image/png" },
+    { ".jpg",  "image/jpeg" },
+    { ".jpeg", "image/jpeg" },
+    { ".gif",  "image/gif" },
+    { ".webp", "image/webp" },
+    { ".avif", "image/avif" },
+    { ".ico",  "image/x-icon" },
+    { ".woff", "font/woff" },
+    { ".woff2","font/woff2" },
+    { ".ttf",  "font/ttf" },
+    { ".otf",  "font/otf" },
+    { ".wasm", "application/wasm" },
+    { ".pdf",  "application/pdf" },
+    { ".zip",  "application/zip" },
+    { ".mp4",  "video/mp4" },
+    { ".webm", "video/webm" },
+    { ".mp3",  "audio/mpeg" },
+};
+
+constexpr const char *DEFAULT_MIME_TYPE = "application/octet-stream";
+
+// 不区分大小写比较（表中的扩展名都是小写）
+constexpr bool mime_ext_equal(const char *ext,const char *lower)
+{
+    for (; *ext && *lower; ext++, lower++)
+    {
+        char c = (*ext >= 'A' && *ext <= 'Z') ? *ext - 'A' + 'a' : *ext;
+        if (c != *lower)
+        {
+            return false;
+        }
+    }
+    return *ext == *lower;
+}
+
+// 根据扩展名返回 MIME 类型，未知类型返回 application/octet-stream
+constexpr const char *mime_type(const char *path)
+{
+    // 最后一个 / 之后的最后一个 .
+    const char *dot = nullptr;
+    for (const char *p = path; *p; p++)
+    {
+        if (*p == '.')
+        {
+            dot = p;
+        }
+        else if (*p == '/')
+        {
+            dot = nullptr;
+        }
+    }
+
+    if (dot)
+    {
+        for (const mime_entry &m : MIME_TYPES)
+        {
+            if (mime_ext_equal(dot,m.ext))
+            {
+                return m.type;
+            }
+        }
+    }
+
+    return DEFAULT_MIME_TYPE;
+}
+
+static_assert(mime_type("/static/app.3f9a1c2e.JS") == MIME_TYPES[3].type,"lookup must be usable at compile time");
+static_assert(mime_type("/a.d/README") == DEFAULT_MIME_TYPE,"extension must belong to the last path component");
+
+#endif
@@ -0,0 +1,209 @@
+#include "mmap_cache.h"
+#include <sys/mman.h>
+#include <new>
+
+
+mmap_cache::mmap_cache(int max_idle) :
+    m_hits(0),m_misses(0)
+{
+    m_shard_idle = 0;
+    if (max_idle > 0)
+    {
+        m_shard_idle = (max_idle + SHARDS - 1) / SHARDS;
+    }
+
+    for (int i = 0; i < SHARDS; i++)
+    {
+        m_shards[i].head = NULL;
+        m_shards[i].tail = NULL;
+        m_shards[i].idle = 0;
+    }
+}
+
+
+mmap_cache::~mmap_cache()
+{
+    // 退出时所有连接都已释放引用，表中只剩空闲映射
+    for (int i = 0; i < SHARDS; i++)
+    {
+        std::unordered_map<key,mapping *,key_hash>::iterator it = m_shards[i].map.begin();
+        for (; it != m_shards[i].map.end(); ++it)
+        {
+            munmap(it->second->addr,it->second->size);
+            delete it->second;
+        }
+    }
+}
+
+
+mmap_cache::key mmap_cache::key_of(const struct stat &st)
+{
+    key k;
+    k.dev = st.st_dev;
+    k.ino = st.st_ino;
+    k.mtime = st.st_mtim;
+    k.size = st.st_size;
+    return k;
+}
+
+
+mmap_cache::mapping *mmap_cache::acquire(int fd,const struct stat &st,bool populate)
+{
+    key k = key_of(st);
+    int index = key_hash()(k) % SHARDS;
+    shard &s = m_shards[index];
+
+    s.lock.lock();
+    std::unordered_map<key,mapping *,key_hash>::iterator it = s.map.find(k);
+    if (it != s.map.end())
+    {
+        mapping *m = it->second;
+        if (m->refs++ == 0)
+        {
+            idle_unlink(s,m);
+            s.idle--;
+        }
+        s.lock.unlock();
+        __sync_fetch_and_add(&m_hits,1);
+        return m;
+    }
+    s.lock.unlock();
+
+    __sync_fetch_and_add(&m_misses,1);
+
+    // 在锁外建立映射，MAP_POPULATE 可能需要读盘
+    int flags = MAP_SHARED;
+    if (populate)
+    {
+        flags |= MAP_POPULATE;
+    }
+    char *addr = (char *)mmap(0,st.st_size,PROT_READ,flags,fd,0);
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    s.lock.lock();
+    it = s.map.find(k);
+    if (it != s.map.end())
+    {
+        // 其他线程刚刚为同一个文件建立了映射，使用它的
+        mapping *m = it->second;
+        if (m->refs++ == 0)
+        {
+            idle_unlink(s,m);
+            s.idle--;
+        }
+        s.lock.unlock();
+        munmap(addr,st.st_size);
+        return m;
+    }
+
+    mapping *m = new (std::nothrow) mapping;
+    if (!m)
+    {
+        s.lock.unlock();
+        munmap(addr,st.st_size);
+        return NULL;
+    }
+    m->dev = k.dev;
+    m->ino = k.ino;
+    m->mtime = k.mtime;
+    m->size = k.size;
+    m->addr = addr;
+    m->refs = 1;
+    m->shard = index;
+    m->prev = NULL;
+    m->next = NULL;
+    s.map[k] = m;
+    s.lock.unlock();
+
+    return m;
+}
+
+
+void mmap_cache::release(mapping *m)
+{
+    shard &s = m_shards[m->shard];
+    mapping *victim = NULL;
+
+    s.lock.lock();
+    if (--m->refs == 0)
+    {
+        idle_push_front(s,m);
+        s.idle++;
+
+        // 空闲池已满，淘汰最久未使用的映射
+        if (s.idle > m_shard_idle)
+        {
+            victim = s.tail;
+            idle_unlink(s,victim);
+            s.idle--;
+            key k;
+            k.dev = victim->dev;
+            k.ino = victim->ino;
+            k.mtime = victim->mtime;
+            k.size = victim->size;
+            s.map.erase(k);
+        }
+    }
+    s.lock.unlock();
+
+    if (victim)
+    {
+        munmap(victim->addr,victim->size);
+        delete victim;
+    }
+}
+
+
+int mmap_cache::idle() const
+{
+    int n = 0;
+    for (int i = 0; i < SHARDS; i++)
+    {
+        n += m_shards[i].idle;
+    }
+    return n;
+}
+
+
+void mmap_cache::idle_unlink(shard &s,mapping *m)
+{
+    if (m->prev)
+    {
+        m->prev->next = m->next;
+    }
+    else
+    {
+        s.head = m->next;
+    }
+
+    if (m->next)
+    {
+        m->next->prev = m->prev;
+    }
+    else
+    {
+        s.tail = m->prev;
+    }
+
+    m->prev = NULL;
+    m->next = NULL;
+}
+
+
+void mmap_cache::idle_push_front(shard &s,mapping *m)
+{
+    m->prev = NULL;
+    m->next = s.head;
+    if (s.head)
+    {
+        s.head->prev = m;
+    }
+    s.head = m;
+    if (!s.tail)
+    {
+        s.tail = m;
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef MMAP_CACHE_H
+#define MMAP_CACHE_H
+
+#include <sys/stat.h>
+#include <unordered_map>
+#include "locker.h"
+
+// 共享的只读文件映射
+// 以 (设备, inode, 修改时间, 大小) 为键，同时请求同一个文件的连接共用一个映射，
+// 最后一个引用释放后映射进入空闲池，在池中按 LRU 淘汰时才 munmap，
+// 避免每个请求一次 mmap / munmap 带来的 mmap_sem 争用与 VMA 反复创建
+//
+// 文件被修改后修改时间或大小改变，新的请求得到新的映射，旧映射在最后一个引用释放后按 LRU 淘汰
+class mmap_cache
+{
+
+    public:
+
+        struct mapping
+        {
+            dev_t dev;
+            ino_t ino;
+            struct timespec mtime;
+            off_t size;
+
+            // 映射区起始地址
+            char *addr;
+
+            // 正在使用该映射的连接数，为 0 时位于空闲池中
+            int refs;
+            // 所属分片
+            int shard;
+
+            // 空闲池的 LRU 双向链表，表头为最近释放
+            mapping *prev;
+            mapping *next;
+        };
+
+        // 分片数量
+        static const int SHARDS = 16;
+
+        // max_idle 为空闲池中最多保留的映射数，0 表示引用全部释放后立即 munmap
+        explicit mmap_cache(int max_idle = 256);
+        ~mmap_cache();
+
+        // 取得 fd（状态为 st）的只读映射并增加引用计数，失败时返回 NULL
+        // populate 为 true 时新建的映射使用 MAP_POPULATE
+        mapping *acquire(int fd,const struct stat &st,bool populate);
+
+        // 释放 acquire 得到的引用
+        void release(mapping *m);
+
+        // 命中（复用已有映射）与未命中次数，以及当前的空闲映射数
+        unsigned long hits() const { return m_hits; }
+        unsigned long misses() const { return m_misses; }
+        int idle() const;
+
+    private:
+
+        struct key
+        {
+            dev_t dev;
+            ino_t ino;
+            struct timespec mtime;
+            off_t size;
+
+            bool operator==(const key &o) const
+            {
+                return dev == o.dev && ino == o.ino && size == o.size
+                    && mtime.tv_sec == o.mtime.tv_sec && mtime.tv_nsec == o.mtime.tv_nsec;
+            }
+        };
+
+        struct key_hash
+        {
+            size_t operator()(const key &k) const
+            {
+                size_t h = k.ino * 0x9e3779b97f4a7c15UL;
+                h ^= k.dev + (h << 6) + (h >> 2);
+                h ^= k.mtime.tv_sec + k.mtime.tv_nsec + (h << 6) + (h >> 2);
+                h ^= k.size + (h << 6) + (h >> 2);
+                return h;
+            }
+        };
+
+        struct shard
+        {
+            locker lock;
+            std::unordered_map<key,mapping *,key_hash> map;
+            mapping *head;
+            mapping *tail;
+            int idle;
+        };
+
+        static key key_of(const struct stat &st);
+
+        // 空闲池链表操作，调用时需持有分片锁
+        static void idle_unlink(shard &s,mapping *m);
+        static void idle_push_front(shard &s,mapping *m);
+
+    private:
+
+        shard m_shards[SHARDS];
+
+        // 每个分片的空闲映射上限
+        int m_shard_idle;
+
+        unsigned long m_hits;
+        unsigned long m_misses;
+
+};
+
+#endif
@@ -0,0 +1,310 @@
+#include "open_file_cache.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <new>
+
+
+open_file_cache::open_file_cache(int max_entries,int ttl) :
+    m_ttl(ttl),m_trusted(false),m_generation(0),m_hits(0),m_misses(0)
+{
+    // max_entries 为 0 时不缓存，每次 acquire 都重新打开文件
+    m_shard_capacity = 0;
+    if (max_entries > 0)
+    {
+        m_shard_capacity = (max_entries + SHARDS - 1) / SHARDS;
+    }
+
+    for (int i = 0; i < SHARDS; i++)
+    {
+        m_shards[i].head = NULL;
+        m_shards[i].tail = NULL;
+        m_shards[i].size = 0;
+    }
+}
+
+
+open_file_cache::~open_file_cache()
+{
+    for (int i = 0; i < SHARDS; i++)
+    {
+        entry *e = m_shards[i].head;
+        while (e)
+        {
+            entry *next = e->next;
+            release(e);
+            e = next;
+        }
+    }
+}
+
+
+open_file_cache::shard &open_file_cache::shard_of(const std::string &path)
+{
+    return m_shards[std::hash<std::string>()(path) % SHARDS];
+}
+
+
+open_file_cache::entry *open_file_cache::acquire(const char *path)
+{
+    std::string key(path);
+    shard &s = shard_of(key);
+    time_t now = time(NULL);
+
+    s.lock.lock();
+    std::unordered_map<std::string,entry *>::iterator it = s.map.find(key);
+    if (it != s.map.end())
+    {
+        entry *e = it->second;
+        __sync_add_and_fetch(&e->refs,1);
+        e->hits++;
+        lru_unlink(s,e);
+        lru_push_front(s,e);
+        bool fresh = (m_trusted || now - e->validated < m_ttl);
+        s.lock.unlock();
+
+        // 超过 ttl 的条目在锁外重新 stat，一致则继续使用
+        if (fresh || still_valid(e))
+        {
+            if (!fresh)
+            {
+                s.lock.lock();
+                e->validated = now;
+                s.lock.unlock();
+            }
+            __sync_fetch_and_add(&m_hits,1);
+            return e;
+        }
+
+        release(e);
+    }
+    else
+    {
+        s.lock.unlock();
+    }
+
+    __sync_fetch_and_add(&m_misses,1);
+
+    // 在锁外打开文件，避免慢速磁盘阻塞同一分片上的其他线程
+    unsigned long generation = __sync_fetch_and_add(&m_generation,0);
+    entry *e = load(path,now);
+    if (!e)
+    {
+        return NULL;
+    }
+
+    // 打开期间文件可能被修改且失效通知已经处理过，此时的结果不可信，只给调用者本次使用
+    if (m_shard_capacity == 0 || __sync_fetch_and_add(&m_generation,0) != generation)
+    {
+        // 不缓存：只有调用者持有引用
+        return e;
+    }
+
+    // 缓存持有一个引用，调用者持有一个引用
+    e->refs = 2;
+
+    s.lock.lock();
+    it = s.map.find(key);
+    if (it != s.map.end())
+    {
+        // 已过期的旧条目（或其他线程刚刚插入的条目）被新条目替换
+        entry *old = it->second;
+        lru_unlink(s,old);
+        s.size--;
+        release(old);
+    }
+    s.map[key] = e;
+    lru_push_front(s,e);
+    s.size++;
+
+    // 超出容量，淘汰最久未使用的条目，仍在使用中的 fd 等最后一个引用释放时才关闭
+    while (s.size > m_shard_capacity)
+    {
+        entry *victim = s.tail;
+        lru_unlink(s,victim);
+        s.map.erase(victim->path);
+        s.size--;
+        release(victim);
+    }
+    s.lock.unlock();
+
+    return e;
+}
+
+
+void open_file_cache::invalidate(const std::string &path)
+{
+    shard &s = shard_of(path);
+
+    __sync_fetch_and_add(&m_generation,1);
+
+    s.lock.lock();
+    std::unordered_map<std::string,entry *>::iterator it = s.map.find(path);
+    if (it != s.map.end())
+    {
+        entry *e = it->second;
+        lru_unlink(s,e);
+        s.map.erase(it);
+        s.size--;
+        release(e);
+    }
+    s.lock.unlock();
+}
+
+
+void open_file_cache::invalidate_prefix(const std::string &dir)
+{
+    __sync_fetch_and_add(&m_generation,1);
+
+    for (int i = 0; i < SHARDS; i++)
+    {
+        shard &s = m_shards[i];
+
+        s.lock.lock();
+        entry *e = s.head;
+        while (e)
+        {
+            entry *next = e->next;
+            const std::string &path = e->path;
+            if (path.compare(0,dir.size(),dir) == 0
+                && (path.size() == dir.size() || path[dir.size()] == '/'))
+            {
+                lru_unlink(s,e);
+                s.map.erase(path);
+                s.size--;
+                release(e);
+            }
+            e = next;
+        }
+        s.lock.unlock();
+    }
+}
+
+
+void open_file_cache::hot_paths(std::vector<std::pair<unsigned long,std::string> > &out)
+{
+    for (int i = 0; i < SHARDS; i++)
+    {
+        shard &s = m_shards[i];
+
+        s.lock.lock();
+        for (entry *e = s.head; e; e = e->next)
+        {
+            if (e->err == 0 && e->fd != -1)
+            {
+                out.push_back(std::make_pair(e->hits,e->path));
+            }
+        }
+        s.lock.unlock();
+    }
+}
+
+
+void open_file_cache::release(entry *e)
+{
+    if (__sync_sub_and_fetch(&e->refs,1) == 0)
+    {
+        if (e->fd != -1)
+        {
+            close(e->fd);
+        }
+        delete e;
+    }
+}
+
+
+open_file_cache::entry *open_file_cache::load(const char *path,time_t now)
+{
+    entry *e = new (std::nothrow) entry;
+    if (!e)
+    {
+        return NULL;
+    }
+
+    e->path = path;
+    e->fd = -1;
+    e->err = 0;
+    e->validated = now;
+    e->hits = 1;
+    e->refs = 1;
+    e->prev = NULL;
+    e->next = NULL;
+
+    if (stat(path,&e->st) < 0)
+    {
+        e->err = errno;
+        return e;
+    }
+
+    // 只为其他用户可读的普通文件保留 fd，目录与无权限的文件由调用者根据 st 判断
+    if (S_ISREG(e->st.st_mode) && (e->st.st_mode & S_IROTH))
+    {
+        e->fd = open(path,O_RDONLY | O_CLOEXEC);
+    }
+
+    return e;
+}
+
+
+bool open_file_cache::still_valid(const entry *e)
+{
+    struct stat st;
+    if (stat(e->path.c_str(),&st) < 0)
+    {
+        // 之前不存在，现在仍然不存在
+        return e->err != 0 && e->err == errno;
+    }
+
+    if (e->err != 0)
+    {
+        return false;
+    }
+
+    return st.st_dev == e->st.st_dev
+        && st.st_ino == e->st.st_ino
+        && st.st_size == e->st.st_size
+        && st.st_mode == e->st.st_mode
+        && st.st_mtim.tv_sec == e->st.st_mtim.tv_sec
+        && st.st_mtim.tv_nsec == e->st.st_mtim.tv_nsec;
+}
+
+
+void open_file_cache::lru_unlink(shard &s,entry *e)
+{
+    if (e->prev)
+    {
+        e->prev->next = e->next;
+    }
+    else
+    {
+        s.head = e->next;
+    }
+
+    if (e->next)
+    {
+        e->next->prev = e->prev;
+    }
+    else
+    {
+        s.tail = e->prev;
+    }
+
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+
+void open_file_cache::lru_push_front(shard &s,entry *e)
+{
+    e->prev = NULL;
+    e->next = s.head;
+    if (s.head)
+    {
+        s.head->prev = e;
+    }
+    s.head = e;
+    if (!s.tail)
+    {
+        s.tail = e;
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef OPEN_FILE_CACHE_H
+#define OPEN_FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include "locker.h"
+
+// 打开文件缓存（参考 nginx 的 open_file_cache）
+// 以文件的完整路径为键，缓存只读打开的 fd 与 stat 结果，
+// 同一个热点文件的重复请求不必再 stat / open / close
+//
+// 缓存按路径哈希分成若干分片，每个分片有自己的锁与 LRU 链表，
+// 不同线程访问不同分片时互不阻塞，不存在全局锁
+class open_file_cache
+{
+
+    public:
+
+        // 缓存中的一个文件
+        struct entry
+        {
+            // 文件路径（缓存的键）
+            std::string path;
+            // 只读打开的 fd，打开失败时为 -1
+            int fd;
+            // stat / open 失败时的 errno，0 表示成功
+            int err;
+            // 文件状态
+            struct stat st;
+            // 上次校验（stat）的时间
+            time_t validated;
+            // 被请求的次数，用于保存热点文件快照
+            unsigned long hits;
+
+            // 引用计数：缓存本身持有一个引用，每个正在使用它的连接各持有一个
+            int refs;
+
+            // 分片内的 LRU 双向链表，表头为最近使用
+            entry *prev;
+            entry *next;
+        };
+
+        // 分片数量
+        static const int SHARDS = 16;
+
+        // max_entries 为整个缓存的最大条目数，ttl 为条目重新校验的间隔（秒）
+        open_file_cache(int max_entries = 1024,int ttl = 5);
+        ~open_file_cache();
+
+        // 获取 path 对应的条目并增加引用计数，使用完后必须调用 release
+        // 条目的 err 不为 0 时表示文件不存在或无法打开（错误结果同样会被缓存 ttl 秒）
+        entry *acquire(const char *path);
+
+        // 释放 acquire 得到的引用，最后一个引用释放时关闭 fd
+        static void release(entry *e);
+
+        // 文件发生变化时移除对应条目，正在使用中的条目等最后一个引用释放时才关闭
+        void invalidate(const std::string &path);
+        // 移除 dir 本身及其下所有路径的条目
+        void invalidate_prefix(const std::string &dir);
+
+        // trusted 为 true 时条目永不过期，由 inotify 负责失效；为 false 时回到按 ttl 重新校验
+        void set_trusted(bool trusted) { m_trusted = trusted; }
+
+        // 取出缓存中存在的文件及其被请求的次数，用于保存热点文件快照
+        void hot_paths(std::vector<std::pair<unsigned long,std::string> > &out);
+
+        // 命中与未命中次数
+        unsigned long hits() const { return m_hits; }
+        unsigned long misses() const { return m_misses; }
+
+    private:
+
+        struct shard
+        {
+            locker lock;
+            std::unordered_map<std::string,entry *> map;
+            entry *head;
+            entry *tail;
+            int size;
+        };
+
+        // 打开并 stat 文件，生成一个新条目
+        static entry *load(const char *path,time_t now);
+
+        // 检查缓存的条目是否仍然与磁盘上的文件一致
+        static bool still_valid(const entry *e);
+
+        // LRU 链表操作，调用时需持有分片锁
+        static void lru_unlink(shard &s,entry *e);
+        static void lru_push_front(shard &s,entry *e);
+
+        shard &shard_of(const std::string &path);
+
+    private:
+
+        shard m_shards[SHARDS];
+
+        // 每个分片的最大条目数
+        int m_shard_capacity;
+
+        // 条目重新校验的间隔（秒）
+        int m_ttl;
+
+        // 是否由 inotify 负责失效（此时忽略 ttl）
+        volatile bool m_trusted;
+
+        // 每次失效加 1，打开文件期间发生过失效的条目不放入缓存，避免缓存旧的结果
+        unsigned long m_generation;
+
+        unsigned long m_hits;
+        unsigned long m_misses;
+
+};
+
+#endif
@@ -0,0 +1,148 @@
+#include "output_queue.h"
+
+
+output_queue::segment &output_queue::push_back(KIND kind,size_t len)
+{
+    m_segments.push_back(segment());
+    segment &s = m_segments.back();
+    s.kind = kind;
+    s.data = NULL;
+    s.fd = -1;
+    s.offset = 0;
+    s.len = len;
+    s.release = NULL;
+    s.owner = NULL;
+    m_bytes += len;
+    return s;
+}
+
+
+void output_queue::push(const char *data,size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    push_back(MEMORY,len).data = data;
+}
+
+
+void output_queue::push_copy(const char *data,size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    // deque 在两端增删时不移动已有元素，指向段内 buf 的指针保持有效
+    segment &s = push_back(MEMORY,len);
+    s.buf.assign(data,len);
+    s.data = s.buf.data();
+}
+
+
+void output_queue::push_shared(const char *data,size_t len,void (*release)(void *),void *owner)
+{
+    if (len == 0)
+    {
+        release(owner);
+        return;
+    }
+    segment &s = push_back(MEMORY,len);
+    s.data = data;
+    s.release = release;
+    s.owner = owner;
+}
+
+
+void output_queue::push_file(int fd,off_t offset,size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    segment &s = push_back(FILE,len);
+    s.fd = fd;
+    s.offset = offset;
+}
+
+
+int output_queue::gather(struct iovec *iov,int max) const
+{
+    int count = 0;
+    std::deque<segment>::const_iterator it = m_segments.begin();
+    for (; it != m_segments.end() && count < max && it->kind == MEMORY; ++it)
+    {
+        iov[count].iov_base = (void *)it->data;
+        iov[count].iov_len = it->len;
+        count++;
+    }
+    return count;
+}
+
+
+void output_queue::consume(size_t n)
+{
+    m_bytes -= n;
+    while (n > 0 && !m_segments.empty())
+    {
+        segment &s = m_segments.front();
+        if (n < s.len)
+        {
+            if (s.kind == MEMORY)
+            {
+                s.data += n;
+            }
+            else
+            {
+                s.offset += n;
+            }
+            s.len -= n;
+            return;
+        }
+        n -= s.len;
+        pop_front();
+    }
+}
+
+
+void output_queue::truncate(size_t n)
+{
+    while (n > 0 && !m_segments.empty())
+    {
+        segment &s = m_segments.back();
+        if (n < s.len)
+        {
+            s.len -= n;
+            m_bytes -= n;
+            return;
+        }
+        n -= s.len;
+        m_bytes -= s.len;
+        if (s.release)
+        {
+            s.release(s.owner);
+        }
+        m_segments.pop_back();
+    }
+}
+
+
+void output_queue::clear()
+{
+    while (!m_segments.empty())
+    {
+        pop_front();
+    }
+    m_bytes = 0;
+}
+
+
+void output_queue::pop_front()
+{
+    segment &s = m_segments.front();
+    if (s.release)
+    {
+        s.release(s.owner);
+    }
+    m_segments.pop_front();
+}
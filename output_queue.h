@@ -0,0 +1,94 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <deque>
+#include <string>
+
+// 连接的输出队列：一个响应由若干段按顺序组成，每一段是下面几种之一
+//   内存片段    由调用者保证在发送完之前有效（写缓冲区、响应缓存对象、共享映射区中的片段、错误页）
+//   自有缓冲区  入队时拷贝一份，由队列持有（如 multipart 的分段头）
+//   共享片段    带引用计数的内存，段发送完或被丢弃时调用 release 归还引用
+//   文件        fd + 偏移，由连接用 sendfile / MSG_ZEROCOPY / splice 发送
+// 队首连续的内存段一次 writev 最多合并 MAX_IOV 个，部分写入后按已发送的字节数逐段前进
+class output_queue
+{
+
+    public:
+
+        enum KIND
+        {
+            MEMORY = 0,
+            FILE
+        };
+
+        struct segment
+        {
+            KIND kind;
+
+            // 内存段：下一个待发送的字节
+            const char *data;
+            // 文件段：文件与下一个待发送的偏移
+            int fd;
+            off_t offset;
+            // 剩余的字节数
+            size_t len;
+
+            // 段发送完或被丢弃时调用，NULL 表示不需要
+            void (*release)(void *);
+            void *owner;
+
+            // 自有缓冲区的内容，data 指向其内部
+            std::string buf;
+        };
+
+        // 一次 writev 最多合并的内存段数
+        static const int MAX_IOV = IOV_MAX;
+
+        output_queue() : m_bytes(0) {}
+        ~output_queue() { clear(); }
+
+        // 追加内存片段，不拷贝
+        void push(const char *data,size_t len);
+        // 拷贝 data 后追加
+        void push_copy(const char *data,size_t len);
+        // 追加共享片段，调用者已为它取得一个引用，由队列在段结束时 release(owner)
+        void push_shared(const char *data,size_t len,void (*release)(void *),void *owner);
+        // 追加文件 [offset, offset + len)
+        void push_file(int fd,off_t offset,size_t len);
+
+        bool empty() const { return m_segments.empty(); }
+        // 队列中的段数与剩余的总字节数
+        size_t size() const { return m_segments.size(); }
+        size_t bytes() const { return m_bytes; }
+
+        segment &front() { return m_segments.front(); }
+        const segment &at(size_t i) const { return m_segments[i]; }
+
+        // 从队首开始把连续的内存段填入 iov，遇到文件段或已填满 max 个时停止，返回填入的个数
+        int gather(struct iovec *iov,int max) const;
+
+        // 从队首起已经发送了 n 字节：移除发送完的段，调整第一个未发送完的段
+        void consume(size_t n);
+
+        // 从队尾丢弃 n 字节（如 HEAD 响应去掉已经组装好的响应体）
+        void truncate(size_t n);
+
+        // 丢弃所有段
+        void clear();
+
+    private:
+
+        segment &push_back(KIND kind,size_t len);
+        void pop_front();
+
+    private:
+
+        std::deque<segment> m_segments;
+        size_t m_bytes;
+
+};
+
+#endif
@@ -0,0 +1,290 @@
+// 内容包生成工具
+// 用法：./pack doc_root output
+// 递归收集 doc_root 下其他用户可读的普通文件，生成一个可被服务器 -p 选项直接映射的内容包
+// 已有的 .gz / .br 文件作为对应文件的压缩版本，没有 .gz 的文本文件会自动压缩一份
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "content_pack.h"
+#include "gzip_filter.h"
+#include "mime_types.h"
+
+// 待打包的一个文件
+struct source
+{
+    std::string path;       // 以 / 开头的 URL 路径
+    std::string file;       // 磁盘上的路径
+    struct stat st;
+};
+
+static int out_fd = -1;
+static uint64_t out_pos = 0;
+
+static bool write_all(const char *data,size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(out_fd,data,len);
+        if (n < 0)
+        {
+            perror("write()");
+            return false;
+        }
+        data += n;
+        len -= n;
+        out_pos += n;
+    }
+    return true;
+}
+
+// 填充到页边界，保证每个内容都从页对齐的位置开始
+static bool pad_to_page()
+{
+    static const char zeros[PACK_ALIGN] = {0};
+    uint64_t rem = out_pos % PACK_ALIGN;
+    return rem == 0 || write_all(zeros,PACK_ALIGN - rem);
+}
+
+// 把一段内容写入包中，记录它的位置
+static bool write_variant(const char *data,size_t len,uint64_t &offset,uint64_t &size)
+{
+    if (!pad_to_page())
+    {
+        return false;
+    }
+    offset = out_pos;
+    size = len;
+    return write_all(data,len);
+}
+
+// 读入整个文件
+static bool read_file(const std::string &file,std::string &out)
+{
+    int fd = open(file.c_str(),O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    char buf[64 * 1024];
+    ssize_t n;
+    out.clear();
+    while ((n = read(fd,buf,sizeof(buf))) > 0)
+    {
+        out.append(buf,n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+static bool ends_with(const std::string &s,const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n,n,suffix) == 0;
+}
+
+static void collect(const std::string &root,const std::string &rel,std::vector<source> &files)
+{
+    std::string dir = root + rel;
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        perror(dir.c_str());
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name,".") == 0 || strcmp(de->d_name,"..") == 0)
+        {
+            continue;
+        }
+
+        source s;
+        s.path = rel + "/" + de->d_name;
+        s.file = root + s.path;
+        if (stat(s.file.c_str(),&s.st) < 0)
+        {
+            continue;
+        }
+
+        if (S_ISDIR(s.st.st_mode))
+        {
+            collect(root,s.path,files);
+        }
+        else if (S_ISREG(s.st.st_mode) && (s.st.st_mode & S_IROTH))
+        {
+            // 与服务器相同：只发布其他用户可读的文件
+            files.push_back(s);
+        }
+    }
+    closedir(d);
+}
+
+static bool by_path(const source &a,const source &b)
+{
+    return a.path < b.path;
+}
+
+int main(int argc,char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr,"Usage.. ./%s doc_root output\n",basename(argv[0]));
+        return 1;
+    }
+
+    std::string root = argv[1];
+    while (root.size() > 1 && root[root.size() - 1] == '/')
+    {
+        root.erase(root.size() - 1);
+    }
+
+    std::vector<source> all;
+    collect(root,"",all);
+
+    // .gz / .br 在原文件存在时只作为压缩版本
+    std::map<std::string,size_t> by_name;
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        by_name[all[i].path] = i;
+    }
+
+    std::vector<source> files;
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        const std::string &p = all[i].path;
+        if ((ends_with(p,".gz") || ends_with(p,".br")) && by_name.count(p.substr(0,p.size() - 3)))
+        {
+            continue;
+        }
+        files.push_back(all[i]);
+    }
+    std::sort(files.begin(),files.end(),by_path);
+
+    // 先写到临时文件，完成后 rename，服务器看到的永远是完整的包
+    std::string output = argv[2];
+    std::string tmp = output + ".tmp";
+    out_fd = open(tmp.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if (out_fd < 0)
+    {
+        perror(tmp.c_str());
+        return 1;
+    }
+
+    // 头部占第一页，最后再回填
+    pack_header header;
+    memset(&header,0,sizeof(header));
+    if (!write_all((const char *)&header,sizeof(header)))
+    {
+        return 1;
+    }
+
+    std::vector<pack_entry> index(files.size());
+    std::string strings;
+    std::string body;
+    std::string variant;
+    size_t gzipped = 0;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        const source &s = files[i];
+        pack_entry &e = index[i];
+        memset(&e,0,sizeof(e));
+
+        // 字符串以 \0 结尾，服务器可以直接当作 C 字符串使用
+        e.path_offset = strings.size();
+        e.path_len = s.path.size();
+        strings += s.path;
+        strings += '\0';
+
+        const char *mime = mime_type(s.path.c_str());
+        e.mime_offset = strings.size();
+        e.mime_len = strlen(mime);
+        strings += mime;
+        strings += '\0';
+
+        // 与服务器对文件生成的 ETag 相同："修改时间-文件大小"
+        e.mtime = s.st.st_mtime;
+        snprintf(e.etag,sizeof(e.etag),"\"%lx-%lx\"",(unsigned long)s.st.st_mtime,(unsigned long)s.st.st_size);
+
+        if (!read_file(s.file,body))
+        {
+            fprintf(stderr,"cannot read %s\n",s.file.c_str());
+            return 1;
+        }
+        if (!write_variant(body.data(),body.size(),
+                           e.variants[PACK_IDENTITY].offset,e.variants[PACK_IDENTITY].size))
+        {
+            return 1;
+        }
+
+        // 已有的 .gz 优先，否则对文本文件压缩一份，只有确实变小才保留
+        if (by_name.count(s.path + ".gz") && read_file(s.file + ".gz",variant))
+        {
+            write_variant(variant.data(),variant.size(),e.variants[PACK_GZIP].offset,e.variants[PACK_GZIP].size);
+        }
+        else if (gzip_compressible(s.path.c_str()) && body.size() >= 256)
+        {
+            gzip_stream gz;
+            variant.clear();
+            if (gz.init(9,gzip_stream::GZIP) && gz.write(body.data(),body.size(),variant,true)
+                && variant.size() < body.size())
+            {
+                write_variant(variant.data(),variant.size(),e.variants[PACK_GZIP].offset,e.variants[PACK_GZIP].size);
+                gzipped++;
+            }
+        }
+
+        if (by_name.count(s.path + ".br") && read_file(s.file + ".br",variant))
+        {
+            write_variant(variant.data(),variant.size(),e.variants[PACK_BR].offset,e.variants[PACK_BR].size);
+        }
+    }
+
+    // 字符串表与索引放在所有内容之后
+    pad_to_page();
+    header.strings_offset = out_pos;
+    header.strings_size = strings.size();
+    write_all(strings.data(),strings.size());
+
+    pad_to_page();
+    header.index_offset = out_pos;
+    if (!index.empty() && !write_all((const char *)&index[0],index.size() * sizeof(pack_entry)))
+    {
+        return 1;
+    }
+
+    memcpy(header.magic,PACK_MAGIC,8);
+    header.version = PACK_VERSION;
+    header.count = index.size();
+    header.file_size = out_pos;
+    if (pwrite(out_fd,&header,sizeof(header),0) != (ssize_t)sizeof(header) || fsync(out_fd) < 0)
+    {
+        perror("pwrite()");
+        return 1;
+    }
+    close(out_fd);
+
+    if (rename(tmp.c_str(),output.c_str()) < 0)
+    {
+        perror("rename()");
+        return 1;
+    }
+
+    printf("packed %lu files (%lu gzipped here) into %s, %llu bytes\n",
+           (unsigned long)files.size(),(unsigned long)gzipped,output.c_str(),(unsigned long long)out_pos);
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include "response_cache.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+
+response_cache::response_cache(size_t budget,size_t max_object) :
+    m_max_object(max_object),m_hits(0),m_misses(0)
+{
+    m_shard_budget = budget / SHARDS;
+
+    // 单个对象不能超过一个分片的预算
+    if (m_max_object > m_shard_budget)
+    {
+        m_max_object = m_shard_budget;
+    }
+
+    for (int i = 0; i < SHARDS; i++)
+    {
+        m_shards[i].hand = 0;
+        m_shards[i].bytes = 0;
+    }
+}
+
+
+response_cache::~response_cache()
+{
+    for (int i = 0; i < SHARDS; i++)
+    {
+        shard &s = m_shards[i];
+        for (size_t j = 0; j < s.ring.size(); j++)
+        {
+            if (s.ring[j])
+            {
+                release(s.ring[j]);
+            }
+        }
+    }
+}
+
+
+response_cache::shard &response_cache::shard_of(const std::string &key)
+{
+    return m_shards[std::hash<std::string>()(key) % SHARDS];
+}
+
+
+response_cache::object *response_cache::lookup(const std::string &key,const struct stat &st)
+{
+    shard &s = shard_of(key);
+
+    s.lock.lock();
+    std::unordered_map<std::string,object *>::iterator it = s.map.find(key);
+    if (it == s.map.end())
+    {
+        s.lock.unlock();
+        __sync_fetch_and_add(&m_misses,1);
+        return NULL;
+    }
+
+    object *o = it->second;
+    if (o->dev != st.st_dev || o->ino != st.st_ino || o->size != st.st_size
+        || o->mtime.tv_sec != st.st_mtim.tv_sec || o->mtime.tv_nsec != st.st_mtim.tv_nsec)
+    {
+        // 文件已经改变，丢弃旧的响应
+        remove(s,o);
+        s.lock.unlock();
+        __sync_fetch_and_add(&m_misses,1);
+        return NULL;
+    }
+
+    // 命中只设置访问位，不移动任何链表
+    o->referenced = true;
+    __sync_add_and_fetch(&o->refs,1);
+    s.lock.unlock();
+
+    __sync_fetch_and_add(&m_hits,1);
+    return o;
+}
+
+
+response_cache::object *response_cache::insert(const std::string &key,const struct stat &st,
+                                               const char *head,size_t head_len,const char *body,size_t body_len)
+{
+    size_t need = head_len + body_len;
+    if (body_len > m_max_object || need > m_shard_budget)
+    {
+        return NULL;
+    }
+
+    object *o = new (std::nothrow) object;
+    if (!o)
+    {
+        return NULL;
+    }
+
+    o->data = (char *)malloc(need);
+    if (!o->data)
+    {
+        delete o;
+        return NULL;
+    }
+
+    memcpy(o->data,head,head_len);
+    memcpy(o->data + head_len,body,body_len);
+    o->key = key;
+    o->dev = st.st_dev;
+    o->ino = st.st_ino;
+    o->size = st.st_size;
+    o->mtime = st.st_mtim;
+    o->head_len = head_len;
+    o->body_len = body_len;
+    o->referenced = false;
+    // 缓存持有一个引用，调用者持有一个引用
+    o->refs = 2;
+
+    shard &s = shard_of(key);
+
+    s.lock.lock();
+    std::unordered_map<std::string,object *>::iterator it = s.map.find(key);
+    if (it != s.map.end())
+    {
+        // 其他线程已经插入了同一个文件，以新生成的为准
+        remove(s,it->second);
+    }
+
+    evict(s,need);
+
+    if (s.free_slots.empty())
+    {
+        o->slot = s.ring.size();
+        s.ring.push_back(o);
+    }
+    else
+    {
+        o->slot = s.free_slots.back();
+        s.free_slots.pop_back();
+        s.ring[o->slot] = o;
+    }
+    s.map[key] = o;
+    s.bytes += need;
+    s.lock.unlock();
+
+    return o;
+}
+
+
+void response_cache::retain(object *o)
+{
+    __sync_add_and_fetch(&o->refs,1);
+}
+
+
+void response_cache::release(object *o)
+{
+    if (__sync_sub_and_fetch(&o->refs,1) == 0)
+    {
+        free(o->data);
+        delete o;
+    }
+}
+
+
+void response_cache::invalidate(const std::string &key)
+{
+    shard &s = shard_of(key);
+
+    s.lock.lock();
+    std::unordered_map<std::string,object *>::iterator it = s.map.find(key);
+    if (it != s.map.end())
+    {
+        remove(s,it->second);
+    }
+    s.lock.unlock();
+}
+
+
+void response_cache::invalidate_prefix(const std::string &dir)
+{
+    for (int i = 0; i < SHARDS; i++)
+    {
+        shard &s = m_shards[i];
+
+        s.lock.lock();
+        for (size_t j = 0; j < s.ring.size(); j++)
+        {
+            object *o = s.ring[j];
+            if (o && o->key.compare(0,dir.size(),dir) == 0
+                && (o->key.size() == dir.size() || o->key[dir.size()] == '/' || o->key[dir.size()] == '#'))
+            {
+                remove(s,o);
+            }
+        }
+        s.lock.unlock();
+    }
+}
+
+
+size_t response_cache::bytes() const
+{
+    size_t total = 0;
+    for (int i = 0; i < SHARDS; i++)
+    {
+        total += m_shards[i].bytes;
+    }
+    return total;
+}
+
+
+void response_cache::remove(shard &s,object *o)
+{
+    s.map.erase(o->key);
+    s.ring[o->slot] = NULL;
+    s.free_slots.push_back(o->slot);
+    s.bytes -= o->head_len + o->body_len;
+    release(o);
+}
+
+
+void response_cache::evict(shard &s,size_t need)
+{
+    // 指针最多转两圈：第一圈清除访问位，第二圈必然能找到可淘汰的对象
+    size_t steps = 2 * s.ring.size();
+    while (s.bytes + need > m_shard_budget && steps-- > 0)
+    {
+        if (s.hand >= s.ring.size())
+        {
+            s.hand = 0;
+        }
+
+        object *o = s.ring[s.hand];
+        if (o)
+        {
+            if (o->referenced)
+            {
+                o->referenced = false;
+            }
+            else
+            {
+                // 正在被连接发送的对象等最后一个引用释放时才真正回收内存
+                remove(s,o);
+            }
+        }
+        s.hand++;
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <sys/stat.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "locker.h"
+
+// 热点小文件的响应缓存
+// 缓存完整的响应：预先生成的状态行与响应头（不含 Connection 头与空行）以及文件内容，
+// 命中时一次 writev 直接从缓存内存发送，不再格式化响应头，也不再映射文件
+//
+// 按路径哈希分片，每个分片有自己的锁、字节预算与 CLOCK 淘汰指针
+class response_cache
+{
+
+    public:
+
+        // 缓存的一个响应
+        struct object
+        {
+            std::string key;
+
+            // 生成该响应时文件的身份，与打开文件缓存中的 stat 比较判断是否过期
+            dev_t dev;
+            ino_t ino;
+            off_t size;
+            struct timespec mtime;
+
+            // [响应头][文件内容] 连续存放
+            char *data;
+            size_t head_len;
+            size_t body_len;
+
+            // 引用计数：缓存本身持有一个，每个正在发送它的连接各持有一个
+            int refs;
+
+            // CLOCK 访问位
+            bool referenced;
+            // 在分片 CLOCK 环中的位置
+            size_t slot;
+
+            const char *head() const { return data; }
+            const char *body() const { return data + head_len; }
+        };
+
+        // 分片数量
+        static const int SHARDS = 16;
+
+        // budget 为所有分片合计的字节预算，max_object 为可缓存文件的最大字节数
+        response_cache(size_t budget = 64 * 1024 * 1024,size_t max_object = 64 * 1024);
+        ~response_cache();
+
+        // 文件大小是否适合缓存
+        bool cacheable(off_t size) const { return m_max_object > 0 && size >= 0 && (size_t)size <= m_max_object; }
+
+        // 查找 key 对应且与 st 一致的响应，命中时增加引用计数，使用完后调用 release
+        object *lookup(const std::string &key,const struct stat &st);
+
+        // 复制响应头与文件内容生成新对象并放入缓存，返回的对象已为调用者增加一次引用
+        // 超出预算或内存不足时返回 NULL
+        object *insert(const std::string &key,const struct stat &st,
+                       const char *head,size_t head_len,const char *body,size_t body_len);
+
+        // 为已持有的对象再增加一次引用（如输出队列中指向对象内存的段各持有一个）
+        static void retain(object *o);
+
+        // 释放 lookup / insert / retain 得到的引用
+        static void release(object *o);
+
+        // 移除键为 key 的对象
+        void invalidate(const std::string &key);
+        // 移除键以 dir 开头（dir 本身或其下的路径）的所有对象
+        void invalidate_prefix(const std::string &dir);
+
+        unsigned long hits() const { return m_hits; }
+        unsigned long misses() const { return m_misses; }
+        // 当前缓存的字节数
+        size_t bytes() const;
+
+    private:
+
+        struct shard
+        {
+            locker lock;
+            std::unordered_map<std::string,object *> map;
+            // CLOCK 环，空槽为 NULL
+            std::vector<object *> ring;
+            std::vector<size_t> free_slots;
+            size_t hand;
+            size_t bytes;
+        };
+
+        // 从分片中移除对象并释放缓存持有的引用，调用时需持有分片锁
+        static void remove(shard &s,object *o);
+
+        // 按 CLOCK 算法淘汰对象，直到分片能再容纳 need 字节，调用时需持有分片锁
+        void evict(shard &s,size_t need);
+
+        shard &shard_of(const std::string &key);
+
+    private:
+
+        shard m_shards[SHARDS];
+
+        // 每个分片的字节预算
+        size_t m_shard_budget;
+
+        // 可缓存文件的最大字节数
+        size_t m_max_object;
+
+        unsigned long m_hits;
+        unsigned long m_misses;
+
+};
+
+#endif
@@ -0,0 +1,645 @@
+#include "router.h"
+#include "http_conn.h"
+#include "event_channel.h"
+#include "header_templates.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+
+// 启动时注册的一条路由
+struct route_entry
+{
+    std::string pattern;
+    route_handler *handler;
+    // 模式中参数的名字，按出现顺序
+    std::vector<std::string> names;
+    std::vector<const char *> name_ptrs;
+    unsigned long hits;
+};
+
+// 构建阶段的树节点，compile() 之后释放
+struct build_node
+{
+    build_node() : param(NULL),route(-1),wildcard(-1) {}
+
+    // 从父节点到这里的静态边
+    std::string label;
+    std::vector<build_node *> children;
+    build_node *param;
+    // 在此结束的路由，以及从此开始匹配余下全部路径的路由
+    int route;
+    int wildcard;
+};
+
+// 编译后的节点：同一节点的静态子节点在数组中连续存放并按边的首字节排序，边的内容都在 s_labels 中
+struct trie_node
+{
+    unsigned int label_off;
+    unsigned int label_len;
+    unsigned int first_child;
+    unsigned int child_count;
+    int param;
+    int route;
+    int wildcard;
+};
+
+static std::vector<route_entry> s_routes;
+static build_node *s_root = NULL;
+static std::vector<trie_node> s_nodes;
+static std::string s_labels;
+
+// 等待完成的异步请求与已经完成、等待交回连接的异步请求
+static std::list<route_async *> s_pending;
+static std::vector<route_async *> s_ready;
+static locker s_lock;
+static int s_wakefd = -1;
+
+
+static void notify()
+{
+    uint64_t one = 1;
+    ssize_t ret = ::write(s_wakefd,&one,sizeof(one));
+    (void)ret;
+}
+
+
+bool route_request::param(const char *name,std::string &value) const
+{
+    for (int i = 0; i < param_count; i++)
+    {
+        if (strcmp(param_names[i],name) == 0)
+        {
+            value.assign(param_values[i],param_lens[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool route_request::get_or_head(route_response &resp) const
+{
+    if (head || strcmp(method,"GET") == 0)
+    {
+        return true;
+    }
+    resp.status = 405;
+    resp.header("Allow","GET, HEAD");
+    resp.body = "method not allowed\n";
+    return false;
+}
+
+
+route_async *route_request::defer()
+{
+    if (!async_allowed)
+    {
+        return NULL;
+    }
+    if (!async)
+    {
+        async = new route_async(conn);
+        s_lock.lock();
+        async->m_self = s_pending.insert(s_pending.end(),async);
+        s_lock.unlock();
+    }
+    return async;
+}
+
+
+ROUTE_RESULT route_request::park(event_channel *ch,bool stream_mode,unsigned long long since_id)
+{
+    channel = ch;
+    stream = stream_mode;
+    since = since_id;
+    return ROUTE_PARK;
+}
+
+
+const char *route_response::reason(int status)
+{
+    switch (status)
+    {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default:  return "Unknown";
+    }
+}
+
+
+void route_response::release(void *response)
+{
+    delete (route_response *)response;
+}
+
+
+route_async::route_async(http_conn *conn)
+    : m_conn(conn),m_finished(false),m_armed(false),m_cancelled(false),m_started(http_date::time())
+{
+}
+
+
+void route_async::finish()
+{
+    s_lock.lock();
+    if (m_cancelled)
+    {
+        // 连接已经放弃（cancel() 中已经移出等待列表），只剩处理器持有
+        s_lock.unlock();
+        delete this;
+        return;
+    }
+    m_finished = true;
+    bool wake = m_armed;
+    if (wake)
+    {
+        s_ready.push_back(this);
+    }
+    s_lock.unlock();
+
+    // 连接还没有开始等待时，由它在 take() 中直接取走结果
+    if (wake)
+    {
+        notify();
+    }
+}
+
+
+// 把 pattern 从 pos 开始的部分插入 node 之下
+static bool insert(build_node *node,const std::string &pattern,size_t pos,int route)
+{
+    while (pos < pattern.size())
+    {
+        char c = pattern[pos];
+        if (c == ':')
+        {
+            size_t end = pattern.find('/',pos);
+            if (end == std::string::npos)
+            {
+                end = pattern.size();
+            }
+            if (end == pos + 1)
+            {
+                return false;
+            }
+            if (!node->param)
+            {
+                node->param = new build_node;
+            }
+            node = node->param;
+            pos = end;
+            continue;
+        }
+        if (c == '*')
+        {
+            if (pattern.find('/',pos) != std::string::npos || node->wildcard != -1)
+            {
+                return false;
+            }
+            node->wildcard = route;
+            return true;
+        }
+
+        // 静态部分：到下一个参数或通配为止
+        size_t end = pattern.find_first_of(":*",pos);
+        if (end == std::string::npos)
+        {
+            end = pattern.size();
+        }
+        const char *text = pattern.data() + pos;
+        size_t len = end - pos;
+
+        build_node *child = NULL;
+        for (size_t i = 0; i < node->children.size(); i++)
+        {
+            if (node->children[i]->label[0] == c)
+            {
+                child = node->children[i];
+                break;
+            }
+        }
+        if (!child)
+        {
+            child = new build_node;
+            child->label.assign(text,len);
+            node->children.push_back(child);
+            node = child;
+            pos = end;
+            continue;
+        }
+
+        // 与已有的边比较公共前缀，不完全相同时把边拆成两段
+        size_t common = 0;
+        while (common < len && common < child->label.size() && child->label[common] == text[common])
+        {
+            common++;
+        }
+        if (common < child->label.size())
+        {
+            build_node *split = new build_node;
+            split->label = child->label.substr(common);
+            split->children.swap(child->children);
+            split->param = child->param;
+            split->route = child->route;
+            split->wildcard = child->wildcard;
+            child->label.resize(common);
+            child->children.push_back(split);
+            child->param = NULL;
+            child->route = -1;
+            child->wildcard = -1;
+        }
+        node = child;
+        pos += common;
+    }
+
+    if (node->route != -1)
+    {
+        return false;
+    }
+    node->route = route;
+    return true;
+}
+
+
+bool router::add(const char *pattern,route_handler *handler)
+{
+    if (!pattern || pattern[0] != '/' || !handler || !s_nodes.empty())
+    {
+        return false;
+    }
+
+    route_entry e;
+    e.pattern = pattern;
+    e.handler = handler;
+    e.hits = 0;
+    for (size_t i = 0; i < e.pattern.size(); i++)
+    {
+        char c = e.pattern[i];
+        if (c == ':' || c == '*')
+        {
+            size_t end = e.pattern.find('/',i);
+            if (end == std::string::npos)
+            {
+                end = e.pattern.size();
+            }
+            e.names.push_back(e.pattern.substr(i + 1,end - i - 1));
+            i = end;
+        }
+    }
+    if (e.names.size() > (size_t)route_request::MAX_PARAMS)
+    {
+        return false;
+    }
+
+    if (!s_root)
+    {
+        s_root = new build_node;
+    }
+    if (!insert(s_root,e.pattern,0,s_routes.size()))
+    {
+        return false;
+    }
+    s_routes.push_back(e);
+    return true;
+}
+
+
+static bool by_first_byte(const build_node *a,const build_node *b)
+{
+    return (unsigned char)a->label[0] < (unsigned char)b->label[0];
+}
+
+
+// 按层次顺序展开，使每个节点的静态子节点在数组中连续
+static void flatten(build_node *root)
+{
+    std::vector<build_node *> order;
+    order.push_back(root);
+    s_nodes.resize(1);
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        build_node *b = order[i];
+        trie_node &n = s_nodes[i];
+        n.label_off = s_labels.size();
+        n.label_len = b->label.size();
+        s_labels += b->label;
+        n.route = b->route;
+        n.wildcard = b->wildcard;
+
+        std::sort(b->children.begin(),b->children.end(),by_first_byte);
+        n.first_child = order.size();
+        n.child_count = b->children.size();
+        for (size_t j = 0; j < b->children.size(); j++)
+        {
+            order.push_back(b->children[j]);
+        }
+        n.param = -1;
+        if (b->param)
+        {
+            n.param = order.size();
+            order.push_back(b->param);
+        }
+        s_nodes.resize(order.size());
+    }
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        delete order[i];
+    }
+}
+
+
+void router::compile()
+{
+    for (size_t i = 0; i < s_routes.size(); i++)
+    {
+        route_entry &e = s_routes[i];
+        for (size_t j = 0; j < e.names.size(); j++)
+        {
+            e.name_ptrs.push_back(e.names[j].c_str());
+        }
+    }
+    if (s_root)
+    {
+        flatten(s_root);
+        s_root = NULL;
+    }
+}
+
+
+// 节点 n 的边已经匹配，继续匹配 [p, end)；静态的边优先，失败时回溯尝试参数与通配
+static int walk(unsigned int n,const char *p,const char *end,route_request &req)
+{
+    const trie_node &node = s_nodes[n];
+    if (p == end && node.route != -1)
+    {
+        return node.route;
+    }
+
+    if (p < end)
+    {
+        // 子节点按首字节排序，且首字节互不相同
+        unsigned int lo = node.first_child;
+        unsigned int hi = node.first_child + node.child_count;
+        while (lo < hi)
+        {
+            unsigned int mid = (lo + hi) / 2;
+            unsigned char c = s_labels[s_nodes[mid].label_off];
+            if (c < (unsigned char)*p)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        if (lo < node.first_child + node.child_count)
+        {
+            const trie_node &child = s_nodes[lo];
+            const char *label = s_labels.data() + child.label_off;
+            if (label[0] == *p && (size_t)(end - p) >= child.label_len && memcmp(label,p,child.label_len) == 0)
+            {
+                int route = walk(lo,p + child.label_len,end,req);
+                if (route != -1)
+                {
+                    return route;
+                }
+            }
+        }
+
+        if (node.param != -1 && *p != '/' && req.param_count < route_request::MAX_PARAMS)
+        {
+            const char *slash = (const char *)memchr(p,'/',end - p);
+            const char *q = slash ? slash : end;
+            int i = req.param_count++;
+            req.param_values[i] = p;
+            req.param_lens[i] = q - p;
+            int route = walk(node.param,q,end,req);
+            if (route != -1)
+            {
+                return route;
+            }
+            req.param_count--;
+        }
+    }
+
+    if (node.wildcard != -1 && req.param_count < route_request::MAX_PARAMS)
+    {
+        int i = req.param_count++;
+        req.param_values[i] = p;
+        req.param_lens[i] = end - p;
+        return node.wildcard;
+    }
+    return -1;
+}
+
+
+route_handler *router::match(const char *path,size_t len,route_request &req)
+{
+    req.param_count = 0;
+    req.pattern = NULL;
+    if (s_nodes.empty())
+    {
+        return NULL;
+    }
+
+    int route = walk(0,path,path + len,req);
+    if (route == -1)
+    {
+        req.param_count = 0;
+        return NULL;
+    }
+
+    route_entry &e = s_routes[route];
+    for (int i = 0; i < req.param_count; i++)
+    {
+        req.param_names[i] = e.name_ptrs[i];
+    }
+    req.pattern = e.pattern.c_str();
+    __sync_fetch_and_add(&e.hits,1);
+    return e.handler;
+}
+
+
+int router::init()
+{
+    s_wakefd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+    return s_wakefd;
+}
+
+
+void router::wake()
+{
+    uint64_t n;
+    while (::read(s_wakefd,&n,sizeof(n)) > 0)
+    {
+    }
+
+    std::vector<route_async *> ready;
+    s_lock.lock();
+    ready.swap(s_ready);
+    s_lock.unlock();
+
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        route_async *a = ready[i];
+        if (a->m_cancelled)
+        {
+            // 完成之后、交回之前连接就放弃了
+            delete a;
+            continue;
+        }
+        http_conn *conn = a->m_conn;
+        if (!conn->proxy_pump())
+        {
+            conn->close_conn();
+        }
+    }
+}
+
+
+void router::tick(time_t now)
+{
+    std::vector<http_conn *> expired;
+    s_lock.lock();
+    std::list<route_async *>::iterator it = s_pending.begin();
+    for (; it != s_pending.end(); ++it)
+    {
+        route_async *a = *it;
+        if (a->m_armed && !a->m_finished && !a->m_cancelled && now - a->m_started > TIMEOUT)
+        {
+            expired.push_back(a->m_conn);
+        }
+    }
+    s_lock.unlock();
+
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+        expired[i]->upstream_timeout();
+    }
+}
+
+
+bool router::take(route_async *a)
+{
+    s_lock.lock();
+    bool finished = a->m_finished;
+    if (finished)
+    {
+        // 之后由连接释放
+        s_pending.erase(a->m_self);
+    }
+    else
+    {
+        a->m_armed = true;
+    }
+    s_lock.unlock();
+    return finished;
+}
+
+
+void router::cancel(route_async *a)
+{
+    s_lock.lock();
+    s_pending.erase(a->m_self);
+    // 处理器还持有它（finish() 中释放），或者已经在 s_ready 中（wake() 中释放）
+    bool release = a->m_finished && !a->m_armed;
+    a->m_cancelled = true;
+    s_lock.unlock();
+
+    if (release)
+    {
+        delete a;
+    }
+}
+
+
+void router::print_stats()
+{
+    for (size_t i = 0; i < s_routes.size(); i++)
+    {
+        printf("route %s: requests %lu\n",s_routes[i].pattern.c_str(),s_routes[i].hits);
+    }
+}
+
+
+void router::metrics(std::string &out)
+{
+    char line[256];
+    for (size_t i = 0; i < s_routes.size(); i++)
+    {
+        snprintf(line,sizeof(line),"route_requests_total{route=\"%s\"} %lu\n",s_routes[i].pattern.c_str(),
+                 s_routes[i].hits);
+        out += line;
+    }
+}
+
+
+ROUTE_RESULT route_health::handle(route_request &req,route_response &resp)
+{
+    if (!req.get_or_head(resp))
+    {
+        return ROUTE_DONE;
+    }
+    resp.body = "ok\n";
+    return ROUTE_DONE;
+}
+
+
+ROUTE_RESULT route_metrics::handle(route_request &req,route_response &resp)
+{
+    if (!req.get_or_head(resp))
+    {
+        return ROUTE_DONE;
+    }
+    char line[256];
+    std::string &out = resp.body;
+    open_file_cache *fc = http_conn::m_file_cache;
+    response_cache *rc = http_conn::m_response_cache;
+    response_cache *cc = http_conn::m_compressed_cache;
+    mmap_cache *mc = http_conn::m_mmap_cache;
+
+    snprintf(line,sizeof(line),"connections %d\n",http_conn::m_user_count);
+    out += line;
+    snprintf(line,sizeof(line),"open_file_cache_hits_total %lu\nopen_file_cache_misses_total %lu\n",fc->hits(),fc->misses());
+    out += line;
+    snprintf(line,sizeof(line),"mmap_cache_hits_total %lu\nmmap_cache_misses_total %lu\n",mc->hits(),mc->misses());
+    out += line;
+    snprintf(line,sizeof(line),"response_cache_hits_total %lu\nresponse_cache_misses_total %lu\nresponse_cache_bytes %lu\n",
+             rc->hits(),rc->misses(),(unsigned long)rc->bytes());
+    out += line;
+    snprintf(line,sizeof(line),"compressed_cache_hits_total %lu\ncompressed_cache_misses_total %lu\ncompressed_cache_bytes %lu\n",
+             cc->hits(),cc->misses(),(unsigned long)cc->bytes());
+    out += line;
+    if (http_conn::m_tls_context)
+    {
+        snprintf(line,sizeof(line),"tls_handshakes_total %lu\ntls_resumed_total %lu\n",
+                 http_conn::m_tls_context->handshakes(),http_conn::m_tls_context->resumed());
+        out += line;
+    }
+    router::metrics(out);
+    event_channel::metrics(out);
+
+    resp.content_type = "text/plain; version=0.0.4";
+    resp.header("Cache-Control","no-cache");
+    return ROUTE_DONE;
+}
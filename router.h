@@ -0,0 +1,205 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <utility>
+
+class http_conn;
+class route_async;
+class event_channel;
+struct route_response;
+
+// 处理器的返回值
+enum ROUTE_RESULT
+{
+    ROUTE_DONE = 0,                         // 响应已经填好
+    ROUTE_ASYNC,                            // 调用了 defer()，之后由 finish() 完成
+    ROUTE_STATIC,                           // 交回给静态文件的流程（网站根目录或内容包）
+    ROUTE_PARK                              // 调用了 park()，连接停放在频道上等待消息
+};
+
+// 交给处理器的请求，所有字符串都指向连接的读缓冲区（或 HTTP/2 流的请求），只在 handle() 期间有效
+struct route_request
+{
+    // 一条路由最多的参数个数（:name 与 *name）
+    static const int MAX_PARAMS = 8;
+
+    const char *method;
+    // 不含查询串的路径
+    const char *path;
+    size_t path_len;
+    // ? 之后的查询串，没有时为 NULL
+    const char *query;
+    const char *host;
+    // Last-Event-ID 请求头（EventSource 断线重连时发送），没有时为 NULL
+    const char *last_event_id;
+    bool head;
+
+    // 匹配到的路由模式，以及按模式中出现顺序排列的参数名与值
+    const char *pattern;
+    int param_count;
+    const char *param_names[MAX_PARAMS];
+    const char *param_values[MAX_PARAMS];
+    size_t param_lens[MAX_PARAMS];
+
+    // 取名为 name 的参数，没有时返回 false
+    bool param(const char *name,std::string &value) const;
+
+    // 只读的端点用它检查方法：GET 与 HEAD 返回 true，其余方法在 resp 中填好 405（带 Allow 头）并返回 false
+    bool get_or_head(route_response &resp) const;
+
+    // 在 handle() 中调用，改为异步完成：处理器保存返回的对象，之后在任意线程中填好响应并调用 finish()
+    // HTTP/2 的流不支持异步完成，此时返回 NULL，处理器必须同步回复
+    route_async *defer();
+
+    // 在 handle() 中调用：把连接停放在频道上，stream 为 true 时作为 SSE 订阅者持续推送，否则为长轮询，
+    // 只等待 since 之后的下一批消息；since 为 event_channel::LATEST 时只等待新的消息。返回 ROUTE_PARK
+    // 与 defer() 一样不支持 HTTP/2 的流
+    ROUTE_RESULT park(event_channel *channel,bool stream,unsigned long long since);
+
+    // 以下由 http_conn 设置
+    bool async_allowed;
+    http_conn *conn;
+    route_async *async;
+    // park() 的参数
+    event_channel *channel;
+    bool stream;
+    unsigned long long since;
+};
+
+// 处理器生成的响应，http_conn 负责补上 Content-Length、Date、Connection 等头部
+struct route_response
+{
+    route_response() : status(200),content_type("text/plain; charset=utf-8") {}
+
+    void header(const char *name,const char *value) { headers.push_back(std::make_pair(std::string(name),std::string(value))); }
+
+    // 常见状态码的原因短语
+    static const char *reason(int status);
+    // 响应体交给输出队列后的 release 回调，释放整个响应
+    static void release(void *response);
+
+    int status;
+    // 指向字符串常量，NULL 时不发送 Content-Type
+    const char *content_type;
+    std::vector<std::pair<std::string,std::string> > headers;
+    std::string body;
+};
+
+// 路由的处理器，启动时用 router::add() 注册
+// handle() 在工作线程中调用，多个连接上的请求会并发调用同一个处理器
+class route_handler
+{
+
+    public:
+
+        virtual ~route_handler() {}
+
+        virtual ROUTE_RESULT handle(route_request &req,route_response &resp) = 0;
+
+};
+
+// 异步完成的请求：处理器持有它直到调用 finish()，连接持有它直到取走响应或放弃（关闭、超时）
+// 两边的状态由 router 的锁保护，最后放手的一方释放它
+class route_async
+{
+
+    public:
+
+        // 填好 response 后调用，可以在任意线程中调用一次，之后不能再访问这个对象
+        // 客户端已经关闭或超时时响应被丢弃
+        void finish();
+
+        route_response response;
+
+    private:
+
+        friend class router;
+        friend struct route_request;
+
+        explicit route_async(http_conn *conn);
+
+        http_conn *m_conn;
+        bool m_finished;
+        // 连接已经在等待（注册了 epoll），完成时要唤醒主线程
+        bool m_armed;
+        // 连接放弃了这个请求
+        bool m_cancelled;
+        time_t m_started;
+        // 在等待列表中的位置
+        std::list<route_async *>::iterator m_self;
+
+};
+
+// 启动时注册的路由编译成的基数树：
+// 静态部分按公共前缀压缩成边，:name 匹配一个非空的路径段，*name 匹配余下的全部路径（只能在最后）
+// 查找时先试静态的边，再试参数，最后是通配，按路径长度线性时间完成，不分配内存
+// 编译后只读，工作线程并发查找不需要加锁
+class router
+{
+
+    public:
+
+        // 异步处理器最长的完成时间（秒），超时回复 504
+        static const int TIMEOUT = 60;
+
+        // 在启动时注册 pattern，格式错误或重复时返回 false
+        static bool add(const char *pattern,route_handler *handler);
+        // 注册完成后编译成查找用的数组
+        static void compile();
+
+        // 查找路径 [path, path + len) 匹配的处理器并填好 req 的参数，没有匹配时返回 NULL
+        static route_handler *match(const char *path,size_t len,route_request &req);
+
+        // 创建唤醒主线程用的 eventfd，返回它以便加入 epoll，失败时返回 -1
+        static int init();
+        // 以下只在主线程中调用
+        // 把完成了的异步请求交回给各自的连接
+        static void wake();
+        // 每秒调用一次：让超时的异步请求回复 504
+        static void tick(time_t now);
+        // 连接来取异步请求的结果：已经完成时返回 true，否则标记为等待中返回 false
+        static bool take(route_async *a);
+        // 连接放弃 a（关闭或超时），之后不能再访问 a
+        static void cancel(route_async *a);
+
+        // 输出每条路由的请求数
+        static void print_stats();
+        // 以 Prometheus 文本格式追加每条路由的请求数
+        static void metrics(std::string &out);
+
+};
+
+// 内置处理器：静态文件（交回原来的流程）、健康检查与统计
+class route_static : public route_handler
+{
+
+    public:
+
+        ROUTE_RESULT handle(route_request &req,route_response &resp) { return ROUTE_STATIC; }
+
+};
+
+class route_health : public route_handler
+{
+
+    public:
+
+        ROUTE_RESULT handle(route_request &req,route_response &resp);
+
+};
+
+class route_metrics : public route_handler
+{
+
+    public:
+
+        ROUTE_RESULT handle(route_request &req,route_response &resp);
+
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "tls_context.h"
+#include <openssl/err.h>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+// 服务端会话缓存的大小与会话的有效期（秒）
+static const long SESSION_CACHE_SIZE = 20480;
+static const long SESSION_TIMEOUT = 300;
+
+// ALPN 协议列表（长度前缀），按服务端的优先顺序
+static const unsigned char ALPN_H2[] = "\x02h2\x08http/1.1";
+static const unsigned char ALPN_HTTP11[] = "\x08http/1.1";
+
+
+tls_context *tls_context::create(const char *cert,const char *key,bool http2)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+    {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx,cert) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx,key,SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx,TLS1_2_VERSION);
+
+    // kTLS 只支持 AES-GCM 与 ChaCha20-Poly1305，优先使用服务端的顺序保证协商到这些套件
+    SSL_CTX_set_options(ctx,SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_cipher_list(ctx,"ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_ciphersuites(ctx,"TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+
+    // 非阻塞 socket 上 SSL_write 可以只写出一部分，重试时内存块的起始位置会随已发送的字节移动
+    SSL_CTX_set_mode(ctx,SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                         | SSL_MODE_RELEASE_BUFFERS);
+
+    // 会话复用：TLS 1.2 的会话 ID 查服务端缓存，TLS 1.2 / 1.3 的会话票据由进程内随机生成的密钥加密
+    static const unsigned char sid_ctx[] = "WebServer";
+    SSL_CTX_set_session_id_context(ctx,sid_ctx,sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx,SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx,SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx,SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(ctx,2);
+
+    // 客户端没有提供 ALPN 时按 HTTP/1.1 处理
+    SSL_CTX_set_alpn_select_cb(ctx,select_alpn,(void *)(http2 ? ALPN_H2 : ALPN_HTTP11));
+
+    tls_context *tls = new (std::nothrow) tls_context;
+    if (!tls)
+    {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    tls->m_ctx = ctx;
+    return tls;
+}
+
+
+tls_context::~tls_context()
+{
+    SSL_CTX_free(m_ctx);
+}
+
+
+SSL *tls_context::new_session(int fd)
+{
+    SSL *ssl = SSL_new(m_ctx);
+    if (!ssl)
+    {
+        return NULL;
+    }
+
+    if (SSL_set_fd(ssl,fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+
+bool tls_context::ktls_send(SSL *ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+
+bool tls_context::ktls_recv(SSL *ssl)
+{
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+
+unsigned long tls_context::handshakes() const
+{
+    return SSL_CTX_sess_accept_good(m_ctx);
+}
+
+
+unsigned long tls_context::resumed() const
+{
+    return SSL_CTX_sess_hits(m_ctx);
+}
+
+
+int tls_context::select_alpn(SSL *ssl,const unsigned char **out,unsigned char *outlen,
+                             const unsigned char *in,unsigned int inlen,void *arg)
+{
+    const unsigned char *protos = (const unsigned char *)arg;
+    unsigned int len = (protos == ALPN_H2) ? sizeof(ALPN_H2) - 1 : sizeof(ALPN_HTTP11) - 1;
+    if (SSL_select_next_proto((unsigned char **)out,outlen,protos,len,in,inlen) != OPENSSL_NPN_NEGOTIATED)
+    {
+        // 没有共同的协议，不使用 ALPN 继续握手
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+
+bool tls_context::alpn_h2(SSL *ssl)
+{
+    const unsigned char *proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(ssl,&proto,&len);
+    return len == 2 && memcmp(proto,"h2",2) == 0;
+}
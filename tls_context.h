@@ -0,0 +1,48 @@
+#ifndef TLS_CONTEXT_H
+#define TLS_CONTEXT_H
+
+#include <openssl/ssl.h>
+
+// HTTPS 监听端口共用的 TLS 上下文
+// 握手完成后由 OpenSSL 把记录层交给内核（kTLS，TCP_ULP tls），
+// 之后 socket 上直接读写明文，sendfile / writev 的路径不需要任何改动；
+// 内核或密码套件不支持 kTLS 的方向由连接退回 SSL_read / SSL_write
+class tls_context
+{
+
+    public:
+
+        // 加载证书链与私钥，失败时返回 NULL
+        // http2 为 true 时 ALPN 优先选择 h2，否则只接受 http/1.1
+        static tls_context *create(const char *cert,const char *key,bool http2);
+
+        ~tls_context();
+
+        // 为新接受的连接创建服务端会话，失败时返回 NULL
+        SSL *new_session(int fd);
+
+        // 会话的发送 / 接收方向是否已经交给内核
+        static bool ktls_send(SSL *ssl);
+        static bool ktls_recv(SSL *ssl);
+
+        // 握手时 ALPN 是否选择了 h2
+        static bool alpn_h2(SSL *ssl);
+
+        // 握手总数与其中会话复用的次数
+        unsigned long handshakes() const;
+        unsigned long resumed() const;
+
+    private:
+
+        tls_context() : m_ctx(NULL) {}
+
+        static int select_alpn(SSL *ssl,const unsigned char **out,unsigned char *outlen,
+                               const unsigned char *in,unsigned int inlen,void *arg);
+
+    private:
+
+        SSL_CTX *m_ctx;
+
+};
+
+#endif
@@ -0,0 +1,687 @@
+#include "upstream.h"
+#include "http_conn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+
+extern void addfd(int epollfd,int fd,bool one_shot);
+extern void removefd(int epollfd,int fd);
+extern void modfd(int epollfd,int fd,int ev);
+
+std::vector<upstream_group *> upstream_group::s_routes;
+
+// 所有上游连接按 fd 索引，主线程据此把事件分派给上游连接
+static std::vector<upstream_conn *> s_conns;
+static int s_epollfd = -1;
+static time_t s_last_probe = 0;
+
+
+upstream::upstream(const sockaddr_in &addr,const std::string &name) :
+    active(0),requests(0),failures(0),bytes_sent(0),bytes_received(0),responses(0),latency_us(0),
+    m_addr(addr),m_name(name),m_down(false),m_fails(0),m_probe(NULL)
+{
+}
+
+
+void upstream::success()
+{
+    m_fails = 0;
+    set_down(false);
+}
+
+
+void upstream::failure()
+{
+    failures++;
+    if (++m_fails >= MAX_FAILS)
+    {
+        set_down(true);
+    }
+}
+
+
+void upstream::set_down(bool down)
+{
+    if (down != m_down)
+    {
+        printf("upstream %s is %s\n",m_name.c_str(),down ? "down" : "up");
+        m_down = down;
+    }
+}
+
+
+// [lc:]/api/=127.0.0.1:8080,127.0.0.1:8081
+bool upstream_group::add_route(const char *spec)
+{
+    BALANCE balance = ROUND_ROBIN;
+    if (strncmp(spec,"lc:",3) == 0)
+    {
+        balance = LEAST_CONN;
+        spec += 3;
+    }
+
+    const char *eq = strchr(spec,'=');
+    if (!eq || eq == spec || spec[0] != '/')
+    {
+        return false;
+    }
+
+    upstream_group *g = new upstream_group;
+    g->m_prefix.assign(spec,eq - spec);
+    g->m_balance = balance;
+    g->m_next = 0;
+
+    std::string list(eq + 1);
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t end = list.find(',',pos);
+        if (end == std::string::npos)
+        {
+            end = list.size();
+        }
+        std::string server = list.substr(pos,end - pos);
+        pos = end + 1;
+
+        size_t colon = server.rfind(':');
+        if (colon == std::string::npos || colon == 0)
+        {
+            delete g;
+            return false;
+        }
+        std::string host = server.substr(0,colon);
+        std::string port = server.substr(colon + 1);
+
+        // 只在启动时解析一次，之后不再查询 DNS
+        struct addrinfo hints;
+        struct addrinfo *res = NULL;
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(),port.c_str(),&hints,&res) != 0 || !res)
+        {
+            fprintf(stderr,"cannot resolve upstream %s\n",server.c_str());
+            delete g;
+            return false;
+        }
+        sockaddr_in addr;
+        memcpy(&addr,res->ai_addr,sizeof(addr));
+        freeaddrinfo(res);
+
+        g->m_servers.push_back(new upstream(addr,server));
+    }
+
+    s_routes.push_back(g);
+    return true;
+}
+
+
+upstream_group *upstream_group::match(const char *url)
+{
+    upstream_group *best = NULL;
+    for (size_t i = 0; i < s_routes.size(); i++)
+    {
+        const std::string &prefix = s_routes[i]->m_prefix;
+        if (strncmp(url,prefix.data(),prefix.size()) == 0 && (!best || prefix.size() > best->m_prefix.size()))
+        {
+            best = s_routes[i];
+        }
+    }
+    return best;
+}
+
+
+upstream *upstream_group::pick()
+{
+    size_t n = m_servers.size();
+    upstream *best = NULL;
+    size_t best_index = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t index = (m_next + i) % n;
+        upstream *u = m_servers[index];
+        if (!u->available())
+        {
+            continue;
+        }
+        if (m_balance == ROUND_ROBIN)
+        {
+            best = u;
+            best_index = index;
+            break;
+        }
+        // 连接数相同时从轮询位置开始取第一个，负载均匀时退化为轮询
+        if (!best || u->active < best->active)
+        {
+            best = u;
+            best_index = index;
+        }
+    }
+
+    if (!best && n > 0)
+    {
+        // 全部不可用时仍按轮询尝试，上游恢复后不必等到下一次健康检查
+        best_index = m_next % n;
+        best = m_servers[best_index];
+    }
+
+    if (best)
+    {
+        m_next = best_index + 1;
+    }
+    return best;
+}
+
+
+void upstream_group::start(int epollfd)
+{
+    s_epollfd = epollfd;
+    tick(time(NULL));
+}
+
+
+upstream_conn *upstream_group::find(int fd)
+{
+    if (fd < 0 || (size_t)fd >= s_conns.size())
+    {
+        return NULL;
+    }
+    return s_conns[fd];
+}
+
+
+upstream_conn *upstream_group::open(upstream *u)
+{
+    int fd = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (connect(fd,(struct sockaddr *)&u->m_addr,sizeof(u->m_addr)) < 0 && errno != EINPROGRESS)
+    {
+        ::close(fd);
+        return NULL;
+    }
+
+    // 请求头与响应头都是小块写，不等待前面数据的确认
+    int one = 1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+    upstream_conn *c = new upstream_conn;
+    c->fd = fd;
+    c->server = u;
+    c->client = NULL;
+    c->probe = false;
+    c->reused = false;
+    c->active = http_date::time();
+
+    if ((size_t)fd >= s_conns.size())
+    {
+        s_conns.resize(fd + 1,NULL);
+    }
+    s_conns[fd] = c;
+    addfd(s_epollfd,fd,true);
+    return c;
+}
+
+
+void upstream_group::close(upstream_conn *c)
+{
+    s_conns[c->fd] = NULL;
+    removefd(s_epollfd,c->fd);
+    delete c;
+}
+
+
+upstream_conn *upstream_group::acquire(upstream *u,http_conn *client)
+{
+    upstream_conn *c;
+    if (!u->m_idle.empty())
+    {
+        // 取最近放回的连接，它被上游关闭的可能最小
+        c = u->m_idle.back();
+        u->m_idle.pop_back();
+        c->reused = true;
+    }
+    else
+    {
+        c = open(u);
+        if (!c)
+        {
+            return NULL;
+        }
+    }
+
+    c->client = client;
+    c->active = http_date::time();
+    u->active++;
+    u->requests++;
+    return c;
+}
+
+
+void upstream_group::release(upstream_conn *c,bool reuse)
+{
+    upstream *u = c->server;
+    u->active--;
+    c->client = NULL;
+
+    if (reuse && u->m_idle.size() < upstream::MAX_IDLE)
+    {
+        // 空闲期间只关注上游关闭连接（或发来不该有的数据），届时直接关闭
+        c->active = http_date::time();
+        u->m_idle.push_back(c);
+        modfd(s_epollfd,c->fd,EPOLLIN);
+        return;
+    }
+    close(c);
+}
+
+
+void upstream_group::probe(upstream *u)
+{
+    upstream_conn *c = open(u);
+    if (!c)
+    {
+        u->failures++;
+        u->set_down(true);
+        return;
+    }
+    c->probe = true;
+    u->m_probe = c;
+    modfd(s_epollfd,c->fd,EPOLLOUT);
+}
+
+
+void upstream_group::on_event(upstream_conn *c,int events)
+{
+    upstream *u = c->server;
+
+    if (c->probe)
+    {
+        // 非阻塞连接完成：SO_ERROR 为 0 表示上游可以接受连接
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd,SOL_SOCKET,SO_ERROR,&err,&len) < 0)
+        {
+            err = errno;
+        }
+        if (err == 0 && !(events & (EPOLLERR | EPOLLHUP)))
+        {
+            u->success();
+        }
+        else
+        {
+            u->failures++;
+            u->set_down(true);
+        }
+        u->m_probe = NULL;
+        close(c);
+        return;
+    }
+
+    // 空闲连接上的事件只可能是上游关闭了连接
+    for (size_t i = 0; i < u->m_idle.size(); i++)
+    {
+        if (u->m_idle[i] == c)
+        {
+            u->m_idle.erase(u->m_idle.begin() + i);
+            break;
+        }
+    }
+    close(c);
+}
+
+
+void upstream_group::tick(time_t now)
+{
+    bool probing = (now - s_last_probe >= HEALTH_INTERVAL);
+    if (probing)
+    {
+        s_last_probe = now;
+    }
+
+    for (size_t r = 0; r < s_routes.size(); r++)
+    {
+        std::vector<upstream *> &servers = s_routes[r]->m_servers;
+        for (size_t i = 0; i < servers.size(); i++)
+        {
+            upstream *u = servers[i];
+
+            // 回收空闲过久的连接，最早放回的在前面
+            while (!u->m_idle.empty() && now - u->m_idle.front()->active >= IDLE_TIMEOUT)
+            {
+                close(u->m_idle.front());
+                u->m_idle.erase(u->m_idle.begin());
+            }
+
+            if (probing)
+            {
+                if (u->m_probe)
+                {
+                    // 上一次健康检查到现在还没有连上
+                    upstream_conn *c = u->m_probe;
+                    u->m_probe = NULL;
+                    close(c);
+                    u->failures++;
+                    u->set_down(true);
+                }
+                probe(u);
+            }
+        }
+    }
+
+    // 长时间没有进展的转发以 504 结束，处理时会释放上游连接，先收集再处理
+    std::vector<http_conn *> expired;
+    for (size_t fd = 0; fd < s_conns.size(); fd++)
+    {
+        upstream_conn *c = s_conns[fd];
+        if (c && c->client && now - c->active >= TIMEOUT)
+        {
+            expired.push_back(c->client);
+        }
+    }
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+        expired[i]->upstream_timeout();
+    }
+}
+
+
+void upstream_group::print_stats()
+{
+    for (size_t r = 0; r < s_routes.size(); r++)
+    {
+        upstream_group *g = s_routes[r];
+        printf("proxy %s (%s):\n",g->m_prefix.c_str(),g->m_balance == LEAST_CONN ? "least_conn" : "round_robin");
+        for (size_t i = 0; i < g->m_servers.size(); i++)
+        {
+            upstream *u = g->m_servers[i];
+            printf("  %s %s active %d idle %lu requests %lu failures %lu sent %lu received %lu latency %.2f ms\n",
+                   u->m_name.c_str(),u->m_down ? "down" : "up",u->active,(unsigned long)u->m_idle.size(),
+                   u->requests,u->failures,u->bytes_sent,u->bytes_received,
+                   u->responses ? u->latency_us / 1000.0 / u->responses : 0.0);
+        }
+    }
+}
+
+
+proxy_exchange::proxy_exchange(upstream_group *route) :
+    route(route),conn(NULL),state(PROXY_START),tries(0),sent(0),body_left(0),streamed(false),head_request(false),
+    buf(new char[BUFFER_SIZE]),buf_len(0),status(0),framing(BODY_NONE),remaining(0),chunk_state(0),reusable(true)
+{
+    clock_gettime(CLOCK_MONOTONIC,&started);
+}
+
+
+proxy_exchange::~proxy_exchange()
+{
+    delete [] buf;
+}
+
+
+// Connection 由本端按各自的连接重新生成
+bool proxy_exchange::hop_by_hop(const char *name,size_t len)
+{
+    static const char *names[] = { "Connection","Keep-Alive","Proxy-Connection","TE","Trailer","Upgrade" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strlen(names[i]) == len && strncasecmp(name,names[i],len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int proxy_exchange::parse_head(bool keep_alive)
+{
+    while (true)
+    {
+        char *end = (char *)memmem(buf,buf_len,"\r\n\r\n",4);
+        if (!end)
+        {
+            return buf_len >= BUFFER_SIZE ? -1 : 0;
+        }
+        size_t head_len = end + 4 - buf;
+
+        // HTTP/1.x 200 OK
+        if (buf_len < 12 || strncmp(buf,"HTTP/1.",7) != 0 || buf[8] != ' ')
+        {
+            return -1;
+        }
+        status = atoi(buf + 9);
+        bool http10 = (buf[7] == '0');
+        if (status < 100 || status > 999)
+        {
+            return -1;
+        }
+
+        if (status < 200)
+        {
+            // 100 Continue 等临时响应：请求体已经由本端读取，直接丢弃
+            memmove(buf,buf + head_len,buf_len - head_len);
+            buf_len -= head_len;
+            continue;
+        }
+
+        // 状态行统一改为 HTTP/1.1
+        char *line_end = (char *)memmem(buf,head_len,"\r\n",2);
+        head.assign("HTTP/1.1");
+        head.append(buf + 8,line_end + 2 - (buf + 8));
+
+        bool chunked = false;
+        bool has_length = false;
+        unsigned long long length = 0;
+        bool upstream_close = http10;
+
+        char *line = line_end + 2;
+        while (line < end + 2)
+        {
+            char *next = (char *)memmem(line,end + 2 - line,"\r\n",2);
+            char *colon = (char *)memchr(line,':',next - line);
+            if (!colon)
+            {
+                return -1;
+            }
+            size_t name_len = colon - line;
+            char *value = colon + 1;
+            while (value < next && (*value == ' ' || *value == '\t'))
+            {
+                value++;
+            }
+            std::string v(value,next - value);
+
+            if (name_len == 10 && strncasecmp(line,"Connection",10) == 0)
+            {
+                if (strcasestr(v.c_str(),"close"))
+                {
+                    upstream_close = true;
+                }
+                else if (strcasestr(v.c_str(),"keep-alive"))
+                {
+                    upstream_close = false;
+                }
+            }
+            else if (name_len == 17 && strncasecmp(line,"Transfer-Encoding",17) == 0)
+            {
+                chunked = strcasestr(v.c_str(),"chunked") != NULL;
+            }
+            else if (name_len == 14 && strncasecmp(line,"Content-Length",14) == 0)
+            {
+                has_length = true;
+                length = strtoull(v.c_str(),NULL,10);
+            }
+
+            if (!hop_by_hop(line,name_len))
+            {
+                head.append(line,next + 2 - line);
+            }
+            line = next + 2;
+        }
+
+        if (head_request || status == 204 || status == 304)
+        {
+            framing = BODY_NONE;
+        }
+        else if (chunked)
+        {
+            framing = BODY_CHUNKED;
+        }
+        else if (has_length)
+        {
+            framing = BODY_LENGTH;
+            remaining = length;
+        }
+        else
+        {
+            // 只能以关闭连接结束响应，客户端连接也随之关闭
+            framing = BODY_CLOSE;
+            keep_alive = false;
+        }
+        reusable = !upstream_close && framing != BODY_CLOSE;
+
+        head.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+        state = PROXY_BODY;
+        if (framing == BODY_NONE || (framing == BODY_LENGTH && remaining == 0))
+        {
+            state = PROXY_DONE;
+        }
+        return head_len;
+    }
+}
+
+
+// 分块编码的解析状态
+enum
+{
+    CHUNK_SIZE = 0,                         // 分块大小（十六进制）
+    CHUNK_EXTENSION,                        // 分块大小之后到行尾
+    CHUNK_DATA,                             // 分块数据
+    CHUNK_DATA_END,                         // 分块数据之后的 CRLF
+    CHUNK_TRAILER,                          // 末尾分块之后一行的开头
+    CHUNK_TRAILER_LINE                      // 尾部头部行
+};
+
+size_t proxy_exchange::body(const char *data,size_t len)
+{
+    if (state == PROXY_DONE)
+    {
+        // 响应结束之后还有数据，上游连接的状态不可信
+        reusable = false;
+        return 0;
+    }
+
+    if (framing == BODY_CLOSE)
+    {
+        return len;
+    }
+
+    if (framing == BODY_LENGTH)
+    {
+        size_t n = (remaining < len) ? remaining : len;
+        remaining -= n;
+        if (remaining == 0)
+        {
+            state = PROXY_DONE;
+        }
+        return n;
+    }
+
+    // 分块编码原样转发给客户端，这里只跟踪到最后一个分块与尾部结束的位置
+    size_t i = 0;
+    while (i < len && state != PROXY_DONE)
+    {
+        char c = data[i];
+        switch (chunk_state)
+        {
+            case CHUNK_SIZE:
+            {
+                int digit = -1;
+                if (c >= '0' && c <= '9')
+                {
+                    digit = c - '0';
+                }
+                else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                {
+                    digit = (c | 0x20) - 'a' + 10;
+                }
+
+                if (digit >= 0)
+                {
+                    if (remaining >> 60)
+                    {
+                        // 分块大小溢出，只能等上游关闭连接
+                        framing = BODY_CLOSE;
+                        reusable = false;
+                        return len;
+                    }
+                    remaining = remaining * 16 + digit;
+                }
+                else if (c == '\n')
+                {
+                    chunk_state = remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                else
+                {
+                    chunk_state = CHUNK_EXTENSION;
+                }
+                i++;
+                break;
+            }
+            case CHUNK_EXTENSION:
+                if (c == '\n')
+                {
+                    chunk_state = remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                i++;
+                break;
+            case CHUNK_DATA:
+            {
+                size_t n = (remaining < len - i) ? remaining : len - i;
+                remaining -= n;
+                i += n;
+                if (remaining == 0)
+                {
+                    chunk_state = CHUNK_DATA_END;
+                }
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (c == '\n')
+                {
+                    chunk_state = CHUNK_SIZE;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\n')
+                {
+                    state = PROXY_DONE;
+                }
+                else if (c != '\r')
+                {
+                    chunk_state = CHUNK_TRAILER_LINE;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n')
+                {
+                    chunk_state = CHUNK_TRAILER;
+                }
+                i++;
+                break;
+        }
+    }
+    return i;
+}
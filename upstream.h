@@ -0,0 +1,207 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stddef.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+class http_conn;
+class upstream;
+class upstream_group;
+
+// 到上游服务器的一条连接，与客户端连接一样注册在主线程的 epoll 中
+struct upstream_conn
+{
+    int fd;
+    upstream *server;
+    // 正在为其转发请求的客户端连接，空闲连接与健康检查连接为 NULL
+    http_conn *client;
+    // 健康检查的连接，连接建立后立即关闭
+    bool probe;
+    // 从空闲池中取出的连接，上游可能已经关闭了它，失败时可以换一条新连接重试
+    bool reused;
+    // 最近一次有进展（收发数据或放回连接池）的时间
+    time_t active;
+};
+
+// 一个上游服务器：保持连接的空闲连接池、健康状态与统计
+// 除了启动时的配置，所有操作都在主线程中进行，不需要加锁
+class upstream
+{
+
+    public:
+
+        // 连续失败多少次后标记为不可用，之后只由健康检查恢复
+        static const int MAX_FAILS = 3;
+        // 每个上游最多保留的空闲连接数
+        static const size_t MAX_IDLE = 32;
+
+        upstream(const sockaddr_in &addr,const std::string &name);
+
+        const std::string &name() const { return m_name; }
+        bool available() const { return !m_down; }
+
+        // 一次转发成功或失败（连接失败、上游提前关闭、超时）
+        void success();
+        void failure();
+
+        // 正在转发请求的连接数（最少连接数均衡的依据）
+        int active;
+        // 统计
+        unsigned long requests;
+        unsigned long failures;
+        unsigned long bytes_sent;
+        unsigned long bytes_received;
+        // 收到响应头的次数与从开始转发到收到响应头的总耗时（微秒）
+        unsigned long responses;
+        unsigned long latency_us;
+
+    private:
+
+        friend class upstream_group;
+
+        void set_down(bool down);
+
+        sockaddr_in m_addr;
+        std::string m_name;
+        bool m_down;
+        int m_fails;
+        std::vector<upstream_conn *> m_idle;
+        // 正在进行的健康检查，没有时为 NULL
+        upstream_conn *m_probe;
+
+};
+
+// 一条代理路由：URL 前缀匹配的请求在一组上游之间均衡
+class upstream_group
+{
+
+    public:
+
+        enum BALANCE
+        {
+            ROUND_ROBIN = 0,                // 轮询
+            LEAST_CONN                      // 最少连接数
+        };
+
+        // 健康检查的间隔（秒）
+        static const int HEALTH_INTERVAL = 5;
+        // 空闲连接保留的时间（秒）
+        static const int IDLE_TIMEOUT = 60;
+        // 连接、发送请求或等待响应没有任何进展的最长时间（秒）
+        static const int TIMEOUT = 60;
+
+        // 在启动时添加路由 [lc:]前缀=主机:端口[,主机:端口...]，格式错误或无法解析主机时返回 false
+        static bool add_route(const char *spec);
+        // 查找 URL 匹配的路由（最长前缀），没有时返回 NULL，可以在工作线程中调用
+        static upstream_group *match(const char *url);
+        static bool enabled() { return !s_routes.empty(); }
+
+        // 以下只在主线程中调用
+        // 记录 epoll，并立即对所有上游做一次健康检查
+        static void start(int epollfd);
+        // 每秒调用一次：健康检查、回收空闲连接、让长时间没有进展的转发超时
+        static void tick(time_t now);
+        // fd 属于上游连接时返回它
+        static upstream_conn *find(int fd);
+        // 空闲连接或健康检查连接上的事件
+        static void on_event(upstream_conn *c,int events);
+        // 取一条到 u 的连接：优先复用空闲连接，否则发起非阻塞连接；失败时返回 NULL
+        static upstream_conn *acquire(upstream *u,http_conn *client);
+        // 转发结束：reuse 为 true 时放回空闲池，否则关闭
+        static void release(upstream_conn *c,bool reuse);
+        // 输出每个上游的状态与统计
+        static void print_stats();
+
+        // 按均衡策略选择一个可用的上游，全部不可用时按轮询返回一个
+        upstream *pick();
+        size_t size() const { return m_servers.size(); }
+
+    private:
+
+        static void probe(upstream *u);
+        static upstream_conn *open(upstream *u);
+        static void close(upstream_conn *c);
+
+        std::string m_prefix;
+        BALANCE m_balance;
+        std::vector<upstream *> m_servers;
+        // 轮询的下一个位置
+        size_t m_next;
+
+        static std::vector<upstream_group *> s_routes;
+
+};
+
+// 一次代理转发的状态，由主线程驱动：
+// 请求头与请求体发往上游（请求体边从客户端读入边发送），上游的响应边读入边放入客户端的输出队列，
+// 输出队列发送完后才继续读取上游，任何时候最多缓存 BUFFER_SIZE 字节的响应
+struct proxy_exchange
+{
+    // 读取上游响应的缓冲区，响应头必须能完整放下
+    static const size_t BUFFER_SIZE = 64 * 1024;
+
+    enum STATE
+    {
+        PROXY_START = 0,                    // 选择上游并取得连接
+        PROXY_SEND,                         // 发送请求头与请求体
+        PROXY_HEAD,                         // 读取响应头
+        PROXY_BODY,                         // 转发响应体
+        PROXY_DONE                          // 响应已经全部放入输出队列
+    };
+
+    // 响应体的边界
+    enum FRAMING
+    {
+        BODY_NONE = 0,                      // 没有响应体（HEAD、1xx、204、304）
+        BODY_LENGTH,                        // Content-Length
+        BODY_CHUNKED,                       // Transfer-Encoding: chunked，原样转发并跟踪分块找到结尾
+        BODY_CLOSE                          // 直到上游关闭连接
+    };
+
+    explicit proxy_exchange(upstream_group *route);
+    ~proxy_exchange();
+
+    // 不在代理两端之间转发的逐跳头部
+    static bool hop_by_hop(const char *name,size_t len);
+
+    // 解析 buf 中的响应头并生成发给客户端的响应头 head（keep_alive 为客户端连接是否保持）
+    // 返回响应头的长度，不完整时返回 0，格式错误时返回 -1；1xx 的临时响应被跳过
+    int parse_head(bool keep_alive);
+
+    // len 字节的响应体到达，返回其中属于响应体的字节数，响应体结束时 state 变为 PROXY_DONE
+    size_t body(const char *data,size_t len);
+
+    upstream_group *route;
+    upstream_conn *conn;
+    STATE state;
+    // 已经尝试过的连接次数
+    size_t tries;
+
+    // 待发送给上游的请求数据及已发送的字节数
+    std::string request;
+    size_t sent;
+    // 还要从客户端读入并转发的请求体字节数
+    long body_left;
+    // 请求体已经开始从客户端流式读入，请求不能再完整重发
+    bool streamed;
+    bool head_request;
+
+    char *buf;
+    size_t buf_len;
+    std::string head;
+    int status;
+    FRAMING framing;
+    // BODY_LENGTH 剩余的字节数，或 BODY_CHUNKED 当前分块剩余的字节数
+    unsigned long long remaining;
+    // 分块的解析状态
+    int chunk_state;
+    // 上游连接在响应结束后能否放回连接池
+    bool reusable;
+    // 开始转发的时间，用于统计响应延迟
+    struct timespec started;
+};
+
+#endif
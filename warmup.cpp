@@ -0,0 +1,102 @@
+#include "warmup.h"
+#include "http_conn.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+
+
+// 单调时钟的毫秒数
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+int warm_up(const char *list,int budget_ms)
+{
+    FILE *fp = fopen(list,"r");
+    if (!fp)
+    {
+        // 第一次启动时还没有快照
+        return 0;
+    }
+
+    long deadline = now_ms() + budget_ms;
+    int warmed = 0;
+    int total = 0;
+    char line[http_conn::FILENAME_LEN];
+
+    while (fgets(line,sizeof(line),fp))
+    {
+        line[strcspn(line,"\r\n")] = '\0';
+        if (line[0] != '/')
+        {
+            // 空行、注释或不合法的路径
+            continue;
+        }
+
+        if (now_ms() >= deadline)
+        {
+            fprintf(stderr,"warm-up budget of %d ms exhausted after %d files\n",budget_ms,total);
+            break;
+        }
+
+        total++;
+        if (http_conn::warm(line))
+        {
+            warmed++;
+        }
+    }
+
+    fclose(fp);
+    return warmed;
+}
+
+
+static bool hotter(const std::pair<unsigned long,std::string> &a,const std::pair<unsigned long,std::string> &b)
+{
+    return a.first > b.first;
+}
+
+
+bool save_hot_snapshot(const char *path,const char *root,size_t max)
+{
+    std::vector<std::pair<unsigned long,std::string> > hot;
+    http_conn::m_file_cache->hot_paths(hot);
+    std::sort(hot.begin(),hot.end(),hotter);
+
+    // 先写临时文件再 rename，进程在写入途中被杀死也不会留下半个快照
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(),"w");
+    if (!fp)
+    {
+        perror(tmp.c_str());
+        return false;
+    }
+
+    size_t root_len = strlen(root);
+    size_t written = 0;
+    fprintf(fp,"# hot set, most requested first\n");
+    for (size_t i = 0; i < hot.size() && written < max; i++)
+    {
+        const std::string &p = hot[i].second;
+        if (p.compare(0,root_len,root) == 0 && p.size() > root_len && p[root_len] == '/')
+        {
+            fprintf(fp,"%s\n",p.c_str() + root_len);
+            written++;
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp.c_str(),path) < 0)
+    {
+        perror(path);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <cstddef>
+
+// 启动预热与热点文件快照
+// 重启后所有缓存都是冷的，在开始接受连接前按清单把最常访问的文件预先载入
+// 打开文件缓存、响应缓存与页缓存；进程退出时把当前的热点文件写成快照，供下次启动使用
+
+// 读取清单（每行一个 URL 路径，# 开头的行为注释）并依次预热，
+// 超过 budget_ms 毫秒后停止，返回成功预热的文件数
+int warm_up(const char *list,int budget_ms);
+
+// 把打开文件缓存中的文件按被请求次数从高到低写入快照，最多 max 个
+// 快照中的路径相对于 root，格式与清单相同
+bool save_hot_snapshot(const char *path,const char *root,size_t max);
+
+#endif
@@ -0,0 +1,631 @@
+#include "websocket.h"
+#include "http_date.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <vector>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern void modfd(int epollfd,int fd,int ev);
+
+// 启动时注册的端点
+static std::vector<std::pair<std::string,websocket_handler *> > s_endpoints;
+
+// 所有升级后的连接，供 ping、广播与唤醒遍历
+static std::list<websocket_session *> s_sessions;
+static locker s_sessions_lock;
+
+// 其他线程向空闲连接发送数据时通知主线程
+static int s_wakefd = -1;
+
+
+void websocket_echo::on_message(websocket_session *ws,bool text,const char *data,size_t len)
+{
+    ws->send(text,data,len);
+}
+
+
+void websocket_session::add_endpoint(const char *path,websocket_handler *handler)
+{
+    s_endpoints.push_back(std::make_pair(std::string(path),handler));
+}
+
+
+websocket_handler *websocket_session::endpoint(const char *path)
+{
+    for (size_t i = 0; i < s_endpoints.size(); i++)
+    {
+        if (s_endpoints[i].first == path)
+        {
+            return s_endpoints[i].second;
+        }
+    }
+    return NULL;
+}
+
+
+int websocket_session::init()
+{
+    s_wakefd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+    return s_wakefd;
+}
+
+
+void websocket_session::wake(int epollfd)
+{
+    uint64_t n;
+    while (::read(s_wakefd,&n,sizeof(n)) > 0)
+    {
+    }
+
+    s_sessions_lock.lock();
+    std::list<websocket_session *>::iterator it = s_sessions.begin();
+    for (; it != s_sessions.end(); ++it)
+    {
+        websocket_session *s = *it;
+        s->m_lock.lock();
+        if (s->m_parked && s->m_wake)
+        {
+            // 连接在 epoll 中等待（EPOLLONESHOT 尚未触发），没有其他线程在处理它，可以安全地修改事件
+            s->m_wake = false;
+            modfd(epollfd,s->m_sockfd,s->events());
+        }
+        s->m_lock.unlock();
+    }
+    s_sessions_lock.unlock();
+}
+
+
+void websocket_session::tick(time_t now)
+{
+    s_sessions_lock.lock();
+    std::list<websocket_session *>::iterator it = s_sessions.begin();
+    for (; it != s_sessions.end(); ++it)
+    {
+        websocket_session *s = *it;
+        s->m_lock.lock();
+        if (s->m_ping_time && now - s->m_ping_time >= PONG_TIMEOUT)
+        {
+            s->m_expired = true;
+            s->mark_wake();
+        }
+        else if (!s->m_ping_time && !s->m_close_sent && now - s->m_last_seen >= PING_INTERVAL)
+        {
+            s->append_frame(OP_PING,NULL,0);
+            s->m_ping_time = now;
+        }
+        s->m_lock.unlock();
+    }
+    s_sessions_lock.unlock();
+}
+
+
+void websocket_session::broadcast(websocket_handler *handler,bool text,const char *data,size_t len)
+{
+    s_sessions_lock.lock();
+    std::list<websocket_session *>::iterator it = s_sessions.begin();
+    for (; it != s_sessions.end(); ++it)
+    {
+        if ((*it)->m_handler == handler)
+        {
+            (*it)->send(text,data,len);
+        }
+    }
+    s_sessions_lock.unlock();
+}
+
+
+void websocket_session::accept_key(const char *key,char *out)
+{
+    static const char GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    std::string s(key);
+    s += GUID;
+
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *)s.data(),s.size(),digest);
+    EVP_EncodeBlock((unsigned char *)out,digest,SHA_DIGEST_LENGTH);
+}
+
+
+websocket_session::websocket_session(websocket_handler *handler,int sockfd) :
+    user(NULL),m_handler(handler),m_sockfd(sockfd),m_fragmented(false),m_fragment_text(false),m_stopped(false),
+    m_parked(false),m_wake(false),m_queued(0),m_close_sent(false),m_expired(false),m_last_seen(http_date::time()),m_ping_time(0)
+{
+    s_sessions_lock.lock();
+    m_self = s_sessions.insert(s_sessions.end(),this);
+    s_sessions_lock.unlock();
+}
+
+
+websocket_session::~websocket_session()
+{
+    // 移出列表后广播与唤醒都不会再访问它
+    s_sessions_lock.lock();
+    s_sessions.erase(m_self);
+    s_sessions_lock.unlock();
+}
+
+
+// 客户端发来的帧都经过掩码处理，按 4 字节的掩码循环异或
+// 按 16 字节（SSE2）或 8 字节一组处理，掩码先扩展成对应的宽度
+static void unmask(char *data,size_t len,const unsigned char *key)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    uint32_t key32;
+    memcpy(&key32,key,4);
+    __m128i key128 = _mm_set1_epi32(key32);
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i),_mm_xor_si128(v,key128));
+    }
+#endif
+
+    uint64_t key64;
+    memcpy(&key64,key,4);
+    memcpy((char *)&key64 + 4,key,4);
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v,data + i,8);
+        v ^= key64;
+        memcpy(data + i,&v,8);
+    }
+
+    // 每一组都是 4 的倍数，剩余部分从掩码的第 0 个字节继续
+    for (size_t j = 0; i < len; i++,j++)
+    {
+        data[i] ^= key[j & 3];
+    }
+}
+
+
+// RFC 3629：拒绝过长编码、代理区与超过 U+10FFFF 的码点
+static bool utf8_valid(const unsigned char *s,size_t len)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        unsigned char c = s[i];
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        size_t n;
+        unsigned int cp;
+        if ((c & 0xe0) == 0xc0)
+        {
+            n = 1;
+            cp = c & 0x1f;
+        }
+        else if ((c & 0xf0) == 0xe0)
+        {
+            n = 2;
+            cp = c & 0x0f;
+        }
+        else if ((c & 0xf8) == 0xf0)
+        {
+            n = 3;
+            cp = c & 0x07;
+        }
+        else
+        {
+            return false;
+        }
+
+        if (i + n >= len)
+        {
+            return false;
+        }
+        for (size_t k = 1; k <= n; k++)
+        {
+            if ((s[i + k] & 0xc0) != 0x80)
+            {
+                return false;
+            }
+            cp = (cp << 6) | (s[i + k] & 0x3f);
+        }
+
+        if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000)
+            || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+        {
+            return false;
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+
+void websocket_session::on_input(const char *data,size_t len)
+{
+    if (m_stopped)
+    {
+        return;
+    }
+
+    m_lock.lock();
+    m_last_seen = http_date::time();
+    m_lock.unlock();
+
+    m_input.append(data,len);
+
+    size_t pos = 0;
+    while (!m_stopped)
+    {
+        size_t avail = m_input.size() - pos;
+        if (avail < 2)
+        {
+            break;
+        }
+
+        const unsigned char *p = (const unsigned char *)m_input.data() + pos;
+        bool fin = (p[0] & 0x80) != 0;
+        int opcode = p[0] & 0x0f;
+        uint64_t length = p[1] & 0x7f;
+        size_t head = 2;
+
+        // 没有协商扩展，RSV 位必须为 0；客户端的帧必须带掩码
+        if ((p[0] & 0x70) || !(p[1] & 0x80))
+        {
+            fail(CLOSE_PROTOCOL_ERROR);
+            break;
+        }
+
+        if (length == 126)
+        {
+            if (avail < 4)
+            {
+                break;
+            }
+            length = (p[2] << 8) | p[3];
+            head = 4;
+        }
+        else if (length == 127)
+        {
+            if (avail < 10)
+            {
+                break;
+            }
+            length = 0;
+            for (int i = 2; i < 10; i++)
+            {
+                length = (length << 8) | p[i];
+            }
+            head = 10;
+        }
+
+        // 控制帧不能分片，载荷不超过 125 字节
+        if (opcode >= OP_CLOSE && (!fin || length > 125))
+        {
+            fail(CLOSE_PROTOCOL_ERROR);
+            break;
+        }
+        if (length > MAX_MESSAGE)
+        {
+            fail(CLOSE_TOO_BIG);
+            break;
+        }
+
+        if (avail < head + 4 + length)
+        {
+            // 帧还不完整
+            break;
+        }
+
+        char *payload = &m_input[pos + head + 4];
+        unmask(payload,length,p + head);
+        pos += head + 4 + length;
+        on_frame(fin,opcode,payload,length);
+    }
+
+    if (m_stopped)
+    {
+        m_input.clear();
+    }
+    else
+    {
+        m_input.erase(0,pos);
+    }
+}
+
+
+void websocket_session::on_frame(bool fin,int opcode,const char *payload,size_t len)
+{
+    switch (opcode)
+    {
+        case OP_CONTINUATION:
+            if (!m_fragmented)
+            {
+                fail(CLOSE_PROTOCOL_ERROR);
+                return;
+            }
+            if (m_message.size() + len > MAX_MESSAGE)
+            {
+                fail(CLOSE_TOO_BIG);
+                return;
+            }
+            m_message.append(payload,len);
+            if (fin)
+            {
+                m_fragmented = false;
+                deliver(m_fragment_text,m_message.data(),m_message.size());
+                m_message.clear();
+            }
+            break;
+        case OP_TEXT:
+        case OP_BINARY:
+            if (m_fragmented)
+            {
+                fail(CLOSE_PROTOCOL_ERROR);
+                return;
+            }
+            if (fin)
+            {
+                deliver(opcode == OP_TEXT,payload,len);
+            }
+            else
+            {
+                m_fragmented = true;
+                m_fragment_text = (opcode == OP_TEXT);
+                m_message.assign(payload,len);
+            }
+            break;
+        case OP_CLOSE:
+        {
+            // 回应对方的关闭码，之后由主线程在发送完后关闭连接
+            int code = CLOSE_NORMAL;
+            if (len == 1)
+            {
+                fail(CLOSE_PROTOCOL_ERROR);
+                return;
+            }
+            if (len >= 2)
+            {
+                code = ((unsigned char)payload[0] << 8) | (unsigned char)payload[1];
+                if (!utf8_valid((const unsigned char *)payload + 2,len - 2))
+                {
+                    fail(CLOSE_INVALID_DATA);
+                    return;
+                }
+            }
+            m_stopped = true;
+            close(code);
+            break;
+        }
+        case OP_PING:
+            m_lock.lock();
+            if (!m_close_sent)
+            {
+                append_frame(OP_PONG,payload,len);
+            }
+            m_lock.unlock();
+            break;
+        case OP_PONG:
+            m_lock.lock();
+            m_ping_time = 0;
+            m_lock.unlock();
+            break;
+        default:
+            fail(CLOSE_PROTOCOL_ERROR);
+            break;
+    }
+}
+
+
+void websocket_session::deliver(bool text,const char *data,size_t len)
+{
+    if (text && !utf8_valid((const unsigned char *)data,len))
+    {
+        fail(CLOSE_INVALID_DATA);
+        return;
+    }
+    m_handler->on_message(this,text,data,len);
+}
+
+
+void websocket_session::fail(int code)
+{
+    m_stopped = true;
+    close(code);
+}
+
+
+bool websocket_session::send(bool text,const char *data,size_t len)
+{
+    m_lock.lock();
+    if (m_close_sent || m_expired)
+    {
+        m_lock.unlock();
+        return false;
+    }
+    if (m_pending.size() + len > MAX_PENDING)
+    {
+        // 对方长时间不读取，继续缓存只会占用更多内存
+        m_expired = true;
+        bool wake = mark_wake();
+        m_lock.unlock();
+        if (wake)
+        {
+            notify();
+        }
+        return false;
+    }
+    bool wake = append_frame(text ? OP_TEXT : OP_BINARY,data,len);
+    m_lock.unlock();
+
+    if (wake)
+    {
+        notify();
+    }
+    return true;
+}
+
+
+void websocket_session::close(int code)
+{
+    m_lock.lock();
+    if (m_close_sent)
+    {
+        m_lock.unlock();
+        return;
+    }
+    // 1005 / 1006 / 1015 只用于本地报告，不能出现在关闭帧中
+    char payload[2];
+    size_t len = 0;
+    if (code != 1005 && code != 1006 && code != 1015)
+    {
+        payload[0] = code >> 8;
+        payload[1] = code;
+        len = 2;
+    }
+    bool wake = append_frame(OP_CLOSE,payload,len);
+    m_close_sent = true;
+    m_lock.unlock();
+
+    if (wake)
+    {
+        notify();
+    }
+}
+
+
+bool websocket_session::append_frame(int opcode,const char *data,size_t len)
+{
+    bool was_empty = m_pending.empty();
+
+    // 服务端发出的帧不带掩码
+    char head[10];
+    size_t n;
+    head[0] = (char)(0x80 | opcode);
+    if (len < 126)
+    {
+        head[1] = len;
+        n = 2;
+    }
+    else if (len <= 0xffff)
+    {
+        head[1] = 126;
+        head[2] = len >> 8;
+        head[3] = len;
+        n = 4;
+    }
+    else
+    {
+        head[1] = 127;
+        for (int i = 0; i < 8; i++)
+        {
+            head[2 + i] = (uint64_t)len >> (56 - 8 * i);
+        }
+        n = 10;
+    }
+    m_pending.append(head,n);
+    m_pending.append(data,len);
+
+    return was_empty && mark_wake();
+}
+
+
+bool websocket_session::mark_wake()
+{
+    if (!m_parked || m_wake)
+    {
+        return false;
+    }
+    m_wake = true;
+    return true;
+}
+
+
+void websocket_session::notify()
+{
+    uint64_t one = 1;
+    ssize_t ret = ::write(s_wakefd,&one,sizeof(one));
+    (void)ret;
+}
+
+
+void websocket_session::take(output_queue &out)
+{
+    m_lock.lock();
+    if (!m_pending.empty())
+    {
+        out.push_copy(m_pending.data(),m_pending.size());
+        m_pending.clear();
+    }
+    m_lock.unlock();
+}
+
+
+bool websocket_session::closing()
+{
+    m_lock.lock();
+    bool ret = m_close_sent;
+    m_lock.unlock();
+    return ret;
+}
+
+
+bool websocket_session::expired()
+{
+    m_lock.lock();
+    bool ret = m_expired;
+    m_lock.unlock();
+    return ret;
+}
+
+
+bool websocket_session::pending()
+{
+    m_lock.lock();
+    bool ret = !m_pending.empty();
+    m_lock.unlock();
+    return ret;
+}
+
+
+int websocket_session::events() const
+{
+    size_t unsent = m_queued + m_pending.size();
+    if (m_expired)
+    {
+        return EPOLLOUT;
+    }
+    if (unsent > HIGH_WATER)
+    {
+        // 背压：对方收走数据之前不读取新的帧
+        return EPOLLOUT;
+    }
+    return unsent > 0 ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+}
+
+
+void websocket_session::park(int epollfd,size_t queued)
+{
+    // 在持有锁时注册，与其他线程的 send() 不会错过彼此：
+    // 之前追加的数据由这里注册 EPOLLOUT，之后追加的数据看到 m_parked 后唤醒主线程
+    m_lock.lock();
+    m_queued = queued;
+    m_parked = true;
+    m_wake = false;
+    modfd(epollfd,m_sockfd,events());
+    m_lock.unlock();
+}
+
+
+void websocket_session::unpark()
+{
+    m_lock.lock();
+    m_parked = false;
+    m_lock.unlock();
+}
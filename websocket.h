@@ -0,0 +1,177 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <list>
+#include "locker.h"
+#include "output_queue.h"
+
+class websocket_session;
+
+// WebSocket 端点的处理器，启动时用 websocket_session::add_endpoint() 注册
+// on_open / on_message 在工作线程中调用，同一个连接上的回调不会并发；on_close 在关闭连接的线程中调用
+class websocket_handler
+{
+
+    public:
+
+        virtual ~websocket_handler() {}
+
+        virtual void on_open(websocket_session *ws) {}
+        // 一条完整的消息（分片已经合并，文本消息已经校验过 UTF-8）
+        virtual void on_message(websocket_session *ws,bool text,const char *data,size_t len) = 0;
+        virtual void on_close(websocket_session *ws) {}
+
+};
+
+// 回显收到的每一条消息，用于测试与探活
+class websocket_echo : public websocket_handler
+{
+
+    public:
+
+        void on_message(websocket_session *ws,bool text,const char *data,size_t len);
+
+};
+
+// 升级后的 WebSocket 连接（RFC 6455）
+// 连接仍由主线程的 epoll 驱动：主线程读入数据后交给工作线程解析帧、调用处理器，
+// 处理器（或任意其他线程）调用 send() 把编码好的帧追加到待发送缓冲区，由主线程放入输出队列发送；
+// 空闲的连接只注册在 epoll 中，不占用工作线程，其他线程发送时通过 eventfd 唤醒主线程为它注册 EPOLLOUT
+class websocket_session
+{
+
+    public:
+
+        // 单条消息（合并分片后）的最大长度，超过时以 1009 关闭
+        static const size_t MAX_MESSAGE = 1024 * 1024;
+        // 待发送的数据超过该值时不再读取新的帧，等对方把数据收走（背压）
+        static const size_t HIGH_WATER = 256 * 1024;
+        // 待发送的数据超过该值时认为对方已经无法跟上，关闭连接
+        static const size_t MAX_PENDING = 4 * 1024 * 1024;
+        // 连接空闲多久后发送 ping，以及等待 pong 的时间（秒）
+        static const int PING_INTERVAL = 30;
+        static const int PONG_TIMEOUT = 30;
+
+        // Sec-WebSocket-Accept 的长度
+        static const int ACCEPT_LEN = 28;
+
+        enum OPCODE
+        {
+            OP_CONTINUATION = 0x0,
+            OP_TEXT = 0x1,
+            OP_BINARY = 0x2,
+            OP_CLOSE = 0x8,
+            OP_PING = 0x9,
+            OP_PONG = 0xa
+        };
+
+        // 关闭码
+        enum CLOSE_CODE
+        {
+            CLOSE_NORMAL = 1000,
+            CLOSE_GOING_AWAY = 1001,
+            CLOSE_PROTOCOL_ERROR = 1002,
+            CLOSE_INVALID_DATA = 1007,
+            CLOSE_TOO_BIG = 1009
+        };
+
+        // 在启动时注册端点，之后只读
+        static void add_endpoint(const char *path,websocket_handler *handler);
+        // 查找路径对应的端点，没有时返回 NULL
+        static websocket_handler *endpoint(const char *path);
+
+        // 创建唤醒主线程用的 eventfd，返回它以便加入 epoll，失败时返回 -1
+        static int init();
+        // 在主线程中调用：为有了新数据或需要关闭的空闲连接注册 EPOLLOUT
+        static void wake(int epollfd);
+        // 在主线程中每秒调用一次：给空闲的连接发送 ping，关闭等不到 pong 的连接
+        static void tick(time_t now);
+        // 发给端点 handler 上的所有连接
+        static void broadcast(websocket_handler *handler,bool text,const char *data,size_t len);
+
+        // 由 Sec-WebSocket-Key 计算 Sec-WebSocket-Accept，out 至少 ACCEPT_LEN + 1 字节
+        static void accept_key(const char *key,char *out);
+
+        websocket_session(websocket_handler *handler,int sockfd);
+        ~websocket_session();
+
+        websocket_handler *handler() const { return m_handler; }
+
+        // 在工作线程中处理收到的字节
+        void on_input(const char *data,size_t len);
+
+        // 发送一条消息，可以在任意线程调用；连接正在关闭或对方跟不上时返回 false
+        bool send(bool text,const char *data,size_t len);
+        // 发送关闭帧，发送完后关闭连接，可以在任意线程调用
+        void close(int code);
+
+        // 主线程：把待发送的帧移入输出队列
+        void take(output_queue &out);
+        // 关闭帧已经排队，发送完后关闭连接
+        bool closing();
+        // ping 超时或发送缓冲区溢出，直接关闭连接
+        bool expired();
+        // 待发送缓冲区中是否还有数据
+        bool pending();
+
+        // 连接处理完当前事件，重新注册到 epoll 并标记为空闲，queued 为输出队列中尚未发送的字节数
+        void park(int epollfd,size_t queued);
+        // 主线程收到该连接的事件，不再是空闲的
+        void unpark();
+
+        // 处理器为连接保存的数据
+        void *user;
+
+    private:
+
+        void on_frame(bool fin,int opcode,const char *payload,size_t len);
+        void deliver(bool text,const char *data,size_t len);
+        // 协议错误：以 code 关闭，不再处理之后的帧
+        void fail(int code);
+        // 在持有 m_lock 时追加一个帧，返回是否需要唤醒主线程
+        bool append_frame(int opcode,const char *data,size_t len);
+        // 在持有 m_lock 时标记空闲的连接需要重新注册，返回是否需要唤醒主线程
+        bool mark_wake();
+        void notify();
+        // 在持有 m_lock 时计算空闲时注册的事件
+        int events() const;
+
+    private:
+
+        websocket_handler *m_handler;
+        int m_sockfd;
+
+        // 以下只在处理该连接的线程中访问
+        std::string m_input;
+        // 正在接收的分片消息
+        bool m_fragmented;
+        bool m_fragment_text;
+        std::string m_message;
+        // 已收到关闭帧或出现协议错误，不再解析之后的数据
+        bool m_stopped;
+
+        // 以下由 m_lock 保护
+        locker m_lock;
+        std::string m_pending;
+        bool m_parked;
+        // 空闲期间有了新的数据，等待主线程重新注册
+        bool m_wake;
+        // 空闲时输出队列中尚未发送的字节数
+        size_t m_queued;
+        bool m_close_sent;
+        // ping 超时或发送缓冲区溢出，直接关闭
+        bool m_expired;
+        time_t m_last_seen;
+        // 已发出、尚未收到 pong 的 ping 的发送时间，0 表示没有
+        time_t m_ping_time;
+
+        // 在所有连接列表中的位置
+        std::list<websocket_session *>::iterator m_self;
+
+};
+
+#endif